@@ -0,0 +1,49 @@
+/* Benchmark module.
+ * File: bench.h
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Definitions shared by the synthetic library generator and the load
+ * generator.
+ * */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+/* ********** Constant definitions ********** */
+
+/* Synthetic library defaults.
+ * Video directories are numbered from 'DEFAULT_FIRST_ID' onwards, as
+ * the server only accepts numeric directories.
+ * */
+#define DEFAULT_LIBRARY		"/tmp/ichoppedthatvideo-bench"
+#define DEFAULT_FIRST_ID	100
+#define DEFAULT_VIDEOS		20
+#define DEFAULT_QUALITIES	3
+#define DEFAULT_SECONDS		30
+
+/* Bytes per second of the lowest quality. Every other quality doubles
+ * the previous one, so the server sorts them in the same order.
+ * */
+#define DEFAULT_BASE_RATE	32768
+
+/* Highest quality count, one marker byte each. */
+#define MAX_QUALITIES		8
+
+/* Fake renditions hold a FLV header, and then every byte is the
+ * quality marker. Markers are not valid ASCII, so they cannot be
+ * mistaken for HTTP headers or chunk size lines, and the client may
+ * tell which quality is being received at any time.
+ * */
+#define FLV_HEADER		"FLV\x01\x05\x00\x00\x00\x09\x00\x00\x00\x00"
+#define FLV_HEADER_LEN		13
+#define QUALITY_MARKER		0x80
+
+#define RENDITION_NAME		"rendition%d.flv"
+#define INFO_FILE_NAME		"data.txt"
+
+/* Static files served for every video. */
+#define DATA_FILE_NAME		"data.xml"
+#define CROSSDOMAIN_FILE_NAME	"crossdomain.xml"
+
+#endif
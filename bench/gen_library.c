@@ -0,0 +1,334 @@
+/* Library generator.
+ * File: gen_library.c
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Build a synthetic video library to benchmark the server: every video
+ * has several fake renditions with an iframe per second, an info file
+ * written like chopper does, and the static files requested by players.
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <openssl/sha.h>
+
+#include "../server/common.h"
+#include "../chopper/file.h"
+#include "bench.h"
+
+/* ********** Constant definitions ********** */
+#define GEN_VERSION		"1.0"
+#define WRITE_BUF_SIZE		65536
+
+#define DATA_FILE_CONTENTS	"<data url=\"SERVER_URL\"/>\n"
+#define CROSSDOMAIN_CONTENTS	"<?xml version=\"1.0\"?>\n" \
+				"<cross-domain-policy>\n" \
+				"  <allow-access-from domain=\"*\"/>\n" \
+				"</cross-domain-policy>\n"
+
+/* ********** Private functions ********** */
+
+/* print_usage()
+ *
+ * Prints the available options on the command line.
+ * */
+void
+print_usage			(const char * app_name)
+{
+    printf("Usage: %s [OPTIONS]\n", app_name);
+    printf("Available options:\n"
+	   "\t-h, --help\t\t\t Display this usage information\n"
+	   "\t-v, --version\t\t\t Print the application version\n"
+	   "\t-p, --path 'path'\t\t Library path, created if needed [Default: %s]\n"
+	   "\t-f num, --first num\t\t First video id [Default: %d]\n"
+	   "\t-n num, --videos num\t\t Number of videos [Default: %d]\n"
+	   "\t-q num, --qualities num\t\t Renditions per video, up to %d [Default: %d]\n"
+	   "\t-s num, --seconds num\t\t Length of every video, in seconds [Default: %d]\n"
+	   "\t-r num, --rate num\t\t Bytes per second of the lowest quality [Default: %d]\n",
+	   DEFAULT_LIBRARY, DEFAULT_FIRST_ID, DEFAULT_VIDEOS, MAX_QUALITIES, DEFAULT_QUALITIES,
+	   DEFAULT_SECONDS, DEFAULT_BASE_RATE
+	);
+}
+
+/* write_text_file()
+ *
+ * */
+int
+write_text_file			(const char * dir, const char * name, const char * contents)
+{
+    char * filename;
+    FILE * file;
+
+    asprintf(&filename, "%s/%s", dir, name);
+
+    if ((file = fopen(filename, "w")) == NULL)
+    {
+	perror(filename);
+	free(filename);
+	return (FALSE);
+    }
+
+    fputs(contents, file);
+    fclose(file);
+    free(filename);
+    return (TRUE);
+}
+
+/* write_rendition()
+ *
+ * Write a fake rendition 'seconds' long at 'rate' bytes per second, and
+ * save an iframe offset at every second into 'iframe_offset'.
+ * */
+int
+write_rendition			(const char * dir, int quality, int seconds, int64_t rate, int64_t * iframe_offset)
+{
+    char * filename;
+    unsigned char * buf;
+    FILE * file;
+    int64_t size, written, len;
+    int i;
+
+    asprintf(&filename, "%s/" RENDITION_NAME, dir, quality);
+
+    if ((file = fopen(filename, "w")) == NULL)
+    {
+	perror(filename);
+	free(filename);
+	return (FALSE);
+    }
+
+    free(filename);
+    buf = malloc(WRITE_BUF_SIZE);
+    memset(buf, QUALITY_MARKER + quality, WRITE_BUF_SIZE);
+    fwrite(FLV_HEADER, 1, FLV_HEADER_LEN, file);
+
+    size = rate * seconds;
+
+    for (written = 0; written < size; written += len)
+    {
+	len = ((size - written) < WRITE_BUF_SIZE) ? (size - written) : WRITE_BUF_SIZE;
+	fwrite(buf, 1, len, file);
+    }
+
+    /* The first iframe starts right after the header. */
+    for (i = 0; i < seconds; i++)
+    {
+	iframe_offset[i] = (i == 0) ? 0 : (FLV_HEADER_LEN + (i * rate));
+    }
+
+    free(buf);
+    return ((fclose(file) == 0) ? TRUE : FALSE);
+}
+
+/* write_video()
+ *
+ * Write every rendition of a video, its info file and its static files.
+ * */
+int
+write_video			(const char * path, int id, int qualities, int seconds, int64_t base_rate)
+{
+    char * dir, * base, * rendition;
+    char sign[SIGN_LEN + 1];
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    int64_t * iframe_offset, * iframe_time;
+    DataRange header;
+    int i, base_len;
+
+    asprintf(&dir, "%s/%d", path, id);
+
+    if ((mkdir(dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0) && (errno != EEXIST))
+    {
+	perror(dir);
+	free(dir);
+	return (FALSE);
+    }
+
+    /* Unique digest, as chopper computes it. */
+    base_len = asprintf(&base, "%s%lu%lld", dir, (unsigned long)time(NULL), (long long)(base_rate * seconds));
+    SHA1((unsigned char *)base, base_len, digest);
+    free(base);
+
+    for (i = 0; i < SHA_DIGEST_LENGTH; i++)
+    {
+	sprintf(sign + i * 2, "%02x", digest[i]);
+    }
+
+    iframe_offset = malloc(seconds * sizeof(int64_t));
+    iframe_time = malloc(seconds * sizeof(int64_t));
+
+    /* One iframe per second, at the same time on every rendition. */
+    for (i = 0; i < seconds; i++)
+    {
+	iframe_time[i] = (int64_t)i * 1000;
+    }
+
+    /* Renditions hold no codec configuration, only the FLV header. */
+    header.offset = 0;
+    header.len = FLV_HEADER_LEN;
+
+    if (!save_common_info(dir, sign, qualities))
+    {
+	free(iframe_offset);
+	free(iframe_time);
+	free(dir);
+	return (FALSE);
+    }
+
+    /* Lower qualities first, as chopper sorts them. */
+    for (i = 0; i < qualities; i++)
+    {
+	asprintf(&rendition, RENDITION_NAME, i);
+
+	if (!write_rendition(dir, i, seconds, base_rate << i, iframe_offset) ||
+	    !save_stream_info(dir, rendition, iframe_offset, iframe_time, seconds, &header, NULL, 0, NULL))
+	{
+	    free(rendition);
+	    free(iframe_offset);
+	    free(iframe_time);
+	    free(dir);
+	    return (FALSE);
+	}
+
+	free(rendition);
+    }
+
+    free(iframe_offset);
+    free(iframe_time);
+
+    if (!write_text_file(dir, DATA_FILE_NAME, DATA_FILE_CONTENTS) ||
+	!write_text_file(dir, CROSSDOMAIN_FILE_NAME, CROSSDOMAIN_CONTENTS))
+    {
+	free(dir);
+	return (FALSE);
+    }
+
+    free(dir);
+    return (TRUE);
+}
+
+/* ********** Public functions ********** */
+
+int
+main			(int argc, char * argv[])
+{
+    char * path, full_path[PATH_MAX];
+    int first_id, videos, qualities, seconds, base_rate, i;
+
+    /* getopt_long() needed variables. */
+    int next_opt;				/* Next option in getopt_long() */
+    const char* short_opts = "hvp:f:n:q:s:r:";	/* Short options */
+    const char* app_name = argv[0];		/* Name of the app */
+
+    const struct option
+    long_opts[] =
+    {
+	{ "help",      0,  NULL, 'h'},
+	{ "version",   0,  NULL, 'v'},
+	{ "path",      1,  NULL, 'p'},
+	{ "first",     1,  NULL, 'f'},
+	{ "videos",    1,  NULL, 'n'},
+	{ "qualities", 1,  NULL, 'q'},
+	{ "seconds",   1,  NULL, 's'},
+	{ "rate",      1,  NULL, 'r'},
+	{ NULL,	       0,  NULL,  0}
+    };
+
+    path = DEFAULT_LIBRARY;
+    first_id = DEFAULT_FIRST_ID;
+    videos = DEFAULT_VIDEOS;
+    qualities = DEFAULT_QUALITIES;
+    seconds = DEFAULT_SECONDS;
+    base_rate = DEFAULT_BASE_RATE;
+
+    /* Explore the options array */
+    do
+    {
+	/* Call getopt_long. */
+	next_opt = getopt_long (argc, argv, short_opts, long_opts, NULL);
+
+	switch (next_opt)
+	{
+	    case 'h' :
+		print_usage(app_name);
+		exit(EXIT_SUCCESS);
+
+	    case 'v' :
+		printf("%s version: %s\n", app_name, GEN_VERSION);
+		exit(EXIT_SUCCESS);
+
+	    case 'p' :
+		path = optarg;
+		break;
+
+	    case 'f' :
+		first_id = atoi(optarg);
+		break;
+
+	    case 'n' :
+		videos = atoi(optarg);
+		break;
+
+	    case 'q' :
+		qualities = atoi(optarg);
+		break;
+
+	    case 's' :
+		seconds = atoi(optarg);
+		break;
+
+	    case 'r' :
+		base_rate = atoi(optarg);
+		break;
+
+	    case -1 : /* No more options. */
+		break;
+
+	    default:
+		exit(EXIT_FAILURE);
+	}
+    }
+    while (next_opt != -1);
+
+    if ((qualities < 1) || (qualities > MAX_QUALITIES) || (videos < 1) || (seconds < 1) || (base_rate < 1))
+    {
+	fprintf(stderr, "Invalid library size.\n");
+	return (EXIT_FAILURE);
+    }
+
+    /* The info file keeps the absolute path, as the server reads it. */
+    if (((mkdir(path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0) && (errno != EEXIST)) ||
+	(realpath(path, full_path) == NULL))
+    {
+	perror(path);
+	return (EXIT_FAILURE);
+    }
+
+    init_file(INFO_FILE_NAME);
+
+    for (i = 0; i < videos; i++)
+    {
+	if (!write_video(full_path, first_id + i, qualities, seconds, base_rate))
+	{
+	    fprintf(stderr, "Writing video %d failed\n", first_id + i);
+	    exit_file();
+	    return (EXIT_FAILURE);
+	}
+    }
+
+    exit_file();
+
+    printf("%d videos written to %s, ids %d to %d, %d qualities each.\n",
+	   videos, full_path, first_id, first_id + videos - 1, qualities);
+    return (EXIT_SUCCESS);
+}
@@ -0,0 +1,771 @@
+/* Load generator.
+ * File: load_client.c
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Open many concurrent connections against a server serving a library
+ * built by gen_library, mixing adaptive streams read at different rates,
+ * static file fetches, and renew messages, and report throughput, time
+ * to first byte, server CPU usage and stream quality switches.
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+
+/* ********** Constant definitions ********** */
+#define CLIENT_VERSION		"1.0"
+#define DEFAULT_HOST		"127.0.0.1"
+#define DEFAULT_PORT		80
+#define DEFAULT_CONNECTIONS	16
+#define DEFAULT_DURATION	30
+#define DEFAULT_SLOW_RATE	65536
+#define DEFAULT_STATIC_PCT	10
+#define DEFAULT_RENEW_TIME	0
+
+#define NANOSEC_IN_SEC		1000000000
+#define NANOSEC_IN_MSEC		1000000
+#define RECV_BUF_SIZE		16384
+#define RECV_TIMEOUT		1
+#define SLOW_RCVBUF		16384
+#define REQUEST_BUF_SIZE	256
+#define TTFB_INIT_LEN		1024
+
+/* Request types. */
+enum request_types {STREAM_REQUEST, STATIC_REQUEST, REQUEST_TYPES};
+
+static const
+char * request_type_names [] = {"stream", "static"};
+
+/* ********** Type definitions ********** */
+
+/* Results gathered by a single client thread. Each thread has its own,
+ * so nothing is shared until the run is over.
+ * */
+typedef
+struct _client_stats
+{
+    int64_t bytes;
+    int64_t quality_bytes[MAX_QUALITIES];
+    int requests[REQUEST_TYPES];
+    int errors[REQUEST_TYPES];
+    int renews;
+    int switches;
+
+    /* Time to first byte of every request, in nanoseconds. */
+    int64_t * ttfb[REQUEST_TYPES];
+    int ttfb_num[REQUEST_TYPES];
+    int ttfb_len[REQUEST_TYPES];
+}
+ClientStats;
+
+typedef
+struct _client
+{
+    pthread_t thread_id;
+    unsigned int seed;
+
+    /* Maximum bytes per second read, 0 for no limit. */
+    int64_t read_rate;
+
+    ClientStats stats;
+}
+Client;
+
+/* ********** Global variables ********** */
+struct sockaddr_in server_addr;
+int first_id          = DEFAULT_FIRST_ID;
+int videos            = DEFAULT_VIDEOS;
+int qualities         = DEFAULT_QUALITIES;
+int seconds           = DEFAULT_SECONDS;
+int static_pct        = DEFAULT_STATIC_PCT;
+int renew_time        = DEFAULT_RENEW_TIME;
+struct timespec deadline;
+
+/* ********** Private functions ********** */
+
+/* print_usage()
+ *
+ * Prints the available options on the command line.
+ * */
+void
+print_usage			(const char * app_name)
+{
+    printf("Usage: %s [OPTIONS]\n", app_name);
+    printf("Available options:\n"
+	   "\t-h, --help\t\t\t Display this usage information\n"
+	   "\t-v, --version\t\t\t Print the application version\n"
+	   "\t-H 'host', --host 'host'\t Server address [Default: %s]\n"
+	   "\t-P num, --port num\t\t Server port [Default: %d]\n"
+	   "\t-c num, --connections num\t Concurrent connections [Default: %d]\n"
+	   "\t-d num, --duration num\t\t Run for 'num' seconds [Default: %d]\n\n"
+	   "Library options, as given to gen_library\n"
+	   "\t-f num, --first num\t\t First video id [Default: %d]\n"
+	   "\t-n num, --videos num\t\t Number of videos [Default: %d]\n"
+	   "\t-q num, --qualities num\t\t Renditions per video [Default: %d]\n"
+	   "\t-s num, --seconds num\t\t Length of every video, in seconds [Default: %d]\n\n"
+	   "Client behaviour options\n"
+	   "\t-w num, --slow num\t\t Percentage of slow clients [Default: 0]\n"
+	   "\t-r num, --slow-rate num\t\t Bytes per second read by slow clients [Default: %d]\n"
+	   "\t-R num, --fast-rate num\t\t Bytes per second read by every other client, 0 for no limit [Default: 0]\n"
+	   "\t-x num, --static num\t\t Percentage of static file requests [Default: %d]\n"
+	   "\t-m num, --renew num\t\t Send a seek or quality renew message every 'num' seconds, 0 to disable [Default: %d]\n\n"
+	   "Server side options\n"
+	   "\t-i num, --pid num\t\t Server process id, to measure its CPU usage\n"
+	   "\t-M num, --metrics num\t\t Server metrics port, to read its quality switches\n",
+	   DEFAULT_HOST, DEFAULT_PORT, DEFAULT_CONNECTIONS, DEFAULT_DURATION, DEFAULT_FIRST_ID,
+	   DEFAULT_VIDEOS, DEFAULT_QUALITIES, DEFAULT_SECONDS, DEFAULT_SLOW_RATE, DEFAULT_STATIC_PCT,
+	   DEFAULT_RENEW_TIME
+	);
+}
+
+/* elapsed_ns()
+ *
+ * */
+int64_t
+elapsed_ns			(const struct timespec * start, const struct timespec * stop)
+{
+    return (((int64_t)(stop->tv_sec - start->tv_sec) * NANOSEC_IN_SEC) + (stop->tv_nsec - start->tv_nsec));
+}
+
+/* add_ttfb()
+ *
+ * */
+void
+add_ttfb			(ClientStats * stats, int type, int64_t value)
+{
+    if (stats->ttfb_num[type] == stats->ttfb_len[type])
+    {
+	stats->ttfb_len[type] = (stats->ttfb_len[type] > 0) ? (stats->ttfb_len[type] * 2) : TTFB_INIT_LEN;
+	stats->ttfb[type] = realloc(stats->ttfb[type], stats->ttfb_len[type] * sizeof(int64_t));
+    }
+
+    stats->ttfb[type][stats->ttfb_num[type]++] = value;
+}
+
+/* compare_int64()
+ *
+ * Function to be used along with qsort() to sort 'int64_t' arrays.
+ * */
+int
+compare_int64			(const void * fst, const void * snd)
+{
+    const int64_t * fst_num = (const int64_t *) fst;
+    const int64_t * snd_num = (const int64_t *) snd;
+
+    return ((*fst_num > *snd_num) - (*fst_num < *snd_num));
+}
+
+/* percentile()
+ *
+ * Returns the 'p' percentile of a sorted array, in milliseconds.
+ * */
+double
+percentile			(const int64_t * values, int num, double p)
+{
+    int pos;
+
+    if (num == 0)
+    {
+	return (0);
+    }
+
+    pos = (int)(p * num);
+    pos = (pos >= num) ? (num - 1) : pos;
+    return ((double)values[pos] / NANOSEC_IN_MSEC);
+}
+
+/* get_cpu_ticks()
+ *
+ * Returns user and system time used by process 'pid', in clock ticks,
+ * or -1 if it cannot be read.
+ * */
+int64_t
+get_cpu_ticks			(int pid)
+{
+    char * filename, * stat;
+    char buf[1024];
+    unsigned long long utime, stime;
+    FILE * file;
+    size_t len;
+
+    asprintf(&filename, "/proc/%d/stat", pid);
+    file = fopen(filename, "r");
+    free(filename);
+
+    if (file == NULL)
+    {
+	return (-1);
+    }
+
+    len = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    buf[len] = '\0';
+
+    /* The process name may have spaces: skip it before counting
+     * fields. User and system time are the 14th and 15th ones.
+     * */
+    if (((stat = strrchr(buf, ')')) == NULL) ||
+	(sscanf(stat + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2))
+    {
+	return (-1);
+    }
+
+    return ((int64_t)(utime + stime));
+}
+
+/* connect_server()
+ *
+ * */
+int
+connect_server			(int64_t read_rate)
+{
+    int sd;
+    const int rcvbuf = SLOW_RCVBUF;
+    struct timeval timeout;
+
+    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+	return (-1);
+    }
+
+    /* Slow readers should push back on the server as soon as possible,
+     * as real clients with a slow link do.
+     * */
+    if (read_rate > 0)
+    {
+	setsockopt(sd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(int));
+    }
+
+    /* Do not wait forever, so the deadline is always honoured. */
+    timeout.tv_sec = RECV_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval));
+
+    if (connect(sd, (struct sockaddr *)&server_addr, sizeof(struct sockaddr_in)) < 0)
+    {
+	close(sd);
+	return (-1);
+    }
+
+    return (sd);
+}
+
+/* get_metric()
+ *
+ * Read a counter from the server metrics port. Returns -1 if it cannot
+ * be read.
+ * */
+int64_t
+get_metric			(int port, const char * name)
+{
+    struct sockaddr_in addr;
+    char * buf, * found;
+    const char request [] = "GET /metrics HTTP/1.1\r\nConnection: close\r\n\r\n";
+    ssize_t len, total;
+    int64_t value;
+    int sd;
+
+    memset(&addr, 0, sizeof(struct sockaddr_in));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+	return (-1);
+    }
+
+    if ((connect(sd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) < 0) ||
+	(send(sd, request, sizeof(request) - 1, MSG_NOSIGNAL) < 0))
+    {
+	close(sd);
+	return (-1);
+    }
+
+    buf = malloc(RECV_BUF_SIZE * 4);
+    total = 0;
+
+    while ((total < (RECV_BUF_SIZE * 4) - 1) &&
+	   ((len = recv(sd, buf + total, (RECV_BUF_SIZE * 4) - 1 - total, 0)) > 0))
+    {
+	total += len;
+    }
+
+    close(sd);
+    buf[total] = '\0';
+    value = -1;
+
+    /* Skip "# HELP" and "# TYPE" lines. */
+    for (found = strstr(buf, name); found != NULL; found = strstr(found + 1, name))
+    {
+	if ((found > buf) && (found[-1] == '\n') && (found[strlen(name)] == ' '))
+	{
+	    value = strtoll(found + strlen(name) + 1, NULL, 10);
+	    break;
+	}
+    }
+
+    free(buf);
+    return (value);
+}
+
+/* run_request()
+ *
+ * Request a stream or a static file, and read the reply until the
+ * server closes the connection or the run is over.
+ * */
+void
+run_request			(Client * client, int type)
+{
+    char request[REQUEST_BUF_SIZE], renew[REQUEST_BUF_SIZE];
+    unsigned char buf[RECV_BUF_SIZE];
+    struct timespec start_time, now, last_renew;
+    int64_t received, spent, expected;
+    ssize_t len, i;
+    int sd, request_len, renew_len, quality, cur_quality;
+    ClientStats * stats;
+
+    stats = &client->stats;
+    stats->requests[type]++;
+
+    if (type == STREAM_REQUEST)
+    {
+	request_len = snprintf(request, REQUEST_BUF_SIZE, "GET /stream?video_id=%d HTTP/1.1\r\nConnection: close\r\n\r\n",
+			       first_id + (rand_r(&client->seed) % videos));
+    }
+    else
+    {
+	request_len = snprintf(request, REQUEST_BUF_SIZE, "GET /%s?video_id=%d HTTP/1.1\r\nConnection: close\r\n\r\n",
+			       (rand_r(&client->seed) % 2) ? DATA_FILE_NAME : CROSSDOMAIN_FILE_NAME,
+			       first_id + (rand_r(&client->seed) % videos));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    if (((sd = connect_server(client->read_rate)) < 0) ||
+	(send(sd, request, request_len, MSG_NOSIGNAL) < 0))
+    {
+	if (sd >= 0)
+	{
+	    close(sd);
+	}
+
+	stats->errors[type]++;
+	return;
+    }
+
+    received = 0;
+    cur_quality = -1;
+    last_renew = start_time;
+
+    while (1)
+    {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (elapsed_ns(&now, &deadline) <= 0)
+	{
+	    break;
+	}
+
+	if ((len = recv(sd, buf, RECV_BUF_SIZE, 0)) <= 0)
+	{
+	    /* Timeouts only check the deadline again. */
+	    if ((len < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+	    {
+		continue;
+	    }
+
+	    if ((len < 0) || (received == 0))
+	    {
+		stats->errors[type]++;
+	    }
+
+	    break;
+	}
+
+	if (received == 0)
+	{
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    add_ttfb(stats, type, elapsed_ns(&start_time, &now));
+	}
+
+	received += len;
+
+	/* Find out which quality is being received. */
+	if (type == STREAM_REQUEST)
+	{
+	    for (i = 0; i < len; i++)
+	    {
+		if ((buf[i] & ~(MAX_QUALITIES - 1)) == QUALITY_MARKER)
+		{
+		    quality = buf[i] - QUALITY_MARKER;
+		    stats->quality_bytes[quality]++;
+
+		    if (quality != cur_quality)
+		    {
+			stats->switches += (cur_quality >= 0);
+			cur_quality = quality;
+		    }
+		}
+	    }
+
+	    /* Seek or ask for another quality from time to time. */
+	    if ((renew_time > 0) && (elapsed_ns(&last_renew, &now) >= ((int64_t)renew_time * NANOSEC_IN_SEC)))
+	    {
+		if (rand_r(&client->seed) % 2)
+		{
+		    renew_len = snprintf(renew, REQUEST_BUF_SIZE, "quality=%d\n", rand_r(&client->seed) % qualities);
+		}
+		else
+		{
+		    renew_len = snprintf(renew, REQUEST_BUF_SIZE, "pos=%d\n", 1 + (rand_r(&client->seed) % seconds));
+		}
+
+		send(sd, renew, renew_len, MSG_NOSIGNAL);
+		stats->renews++;
+		last_renew = now;
+	    }
+	}
+
+	/* Slow clients sleep until they are back to their read rate. */
+	if (client->read_rate > 0)
+	{
+	    spent = elapsed_ns(&start_time, &now);
+	    expected = (received * NANOSEC_IN_SEC) / client->read_rate;
+
+	    if (expected > spent)
+	    {
+		now.tv_sec = (expected - spent) / NANOSEC_IN_SEC;
+		now.tv_nsec = (expected - spent) % NANOSEC_IN_SEC;
+		nanosleep(&now, NULL);
+	    }
+	}
+    }
+
+    stats->bytes += received;
+    close(sd);
+}
+
+/* client_main()
+ *
+ * Main client thread: send requests until the run is over.
+ * */
+void *
+client_main				(void * arg)
+{
+    Client * client;
+    struct timespec now;
+
+    client = (Client *)arg;
+
+    while (1)
+    {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	if (elapsed_ns(&now, &deadline) <= 0)
+	{
+	    break;
+	}
+
+	run_request(client, ((rand_r(&client->seed) % 100) < static_pct) ? STATIC_REQUEST : STREAM_REQUEST);
+    }
+
+    return (NULL);
+}
+
+/* print_report()
+ *
+ * Merge the results of every client and print them.
+ * */
+void
+print_report			(Client * clients, int num_clients, double duration, int64_t cpu_ticks, int64_t server_switches)
+{
+    ClientStats total;
+    double gbits;
+    int64_t quality_total;
+    int i, j, type;
+
+    memset(&total, 0, sizeof(ClientStats));
+
+    for (i = 0; i < num_clients; i++)
+    {
+	total.bytes += clients[i].stats.bytes;
+	total.renews += clients[i].stats.renews;
+	total.switches += clients[i].stats.switches;
+
+	for (j = 0; j < MAX_QUALITIES; j++)
+	{
+	    total.quality_bytes[j] += clients[i].stats.quality_bytes[j];
+	}
+
+	for (type = 0; type < REQUEST_TYPES; type++)
+	{
+	    total.requests[type] += clients[i].stats.requests[type];
+	    total.errors[type] += clients[i].stats.errors[type];
+
+	    for (j = 0; j < clients[i].stats.ttfb_num[type]; j++)
+	    {
+		add_ttfb(&total, type, clients[i].stats.ttfb[type][j]);
+	    }
+	}
+    }
+
+    gbits = ((double)total.bytes * 8) / NANOSEC_IN_SEC;
+
+    printf("Duration: %.2f s\n", duration);
+    printf("Received: %lld bytes; Throughput: %.2f Mbit/s\n",
+	   (long long)total.bytes, (gbits * 1000) / duration);
+
+    for (type = 0; type < REQUEST_TYPES; type++)
+    {
+	qsort(total.ttfb[type], total.ttfb_num[type], sizeof(int64_t), compare_int64);
+	printf("%s requests: %d; Errors: %d; Time to first byte (ms): p50 %.3f, p99 %.3f, p999 %.3f\n",
+	       request_type_names[type], total.requests[type], total.errors[type],
+	       percentile(total.ttfb[type], total.ttfb_num[type], 0.5),
+	       percentile(total.ttfb[type], total.ttfb_num[type], 0.99),
+	       percentile(total.ttfb[type], total.ttfb_num[type], 0.999));
+	free(total.ttfb[type]);
+    }
+
+    if ((cpu_ticks >= 0) && (gbits > 0))
+    {
+	printf("Server CPU: %.3f s; %.3f s per Gbit\n",
+	       (double)cpu_ticks / sysconf(_SC_CLK_TCK), ((double)cpu_ticks / sysconf(_SC_CLK_TCK)) / gbits);
+    }
+
+    printf("Quality switches: %d (%.2f per stream); Renew messages: %d\n", total.switches,
+	   (total.requests[STREAM_REQUEST] > 0) ? ((double)total.switches / total.requests[STREAM_REQUEST]) : 0,
+	   total.renews);
+
+    if (server_switches >= 0)
+    {
+	printf("Quality switches reported by the server: %lld\n", (long long)server_switches);
+    }
+
+    for (quality_total = 0, j = 0; j < qualities; j++)
+    {
+	quality_total += total.quality_bytes[j];
+    }
+
+    for (j = 0; (j < qualities) && (quality_total > 0); j++)
+    {
+	printf("Quality %d: %.1f%% of video bytes\n", j, ((double)total.quality_bytes[j] * 100) / quality_total);
+    }
+}
+
+/* ********** Public functions ********** */
+
+int
+main			(int argc, char * argv[])
+{
+    Client * clients;
+    struct hostent * host;
+    struct timespec start_time, stop_time;
+    char * host_name;
+    int64_t slow_rate, fast_rate, cpu_start, cpu_stop, switches_start, switches_stop;
+    int port, num_clients, duration, slow_pct, pid, metrics_port, i;
+
+    /* getopt_long() needed variables. */
+    int next_opt;				/* Next option in getopt_long() */
+    const char* short_opts = "hvH:P:c:d:f:n:q:s:w:r:R:x:m:i:M:";	/* Short options */
+    const char* app_name = argv[0];		/* Name of the app */
+
+    const struct option
+    long_opts[] =
+    {
+	{ "help",        0,  NULL, 'h'},
+	{ "version",     0,  NULL, 'v'},
+	{ "host",        1,  NULL, 'H'},
+	{ "port",        1,  NULL, 'P'},
+	{ "connections", 1,  NULL, 'c'},
+	{ "duration",    1,  NULL, 'd'},
+	{ "first",       1,  NULL, 'f'},
+	{ "videos",      1,  NULL, 'n'},
+	{ "qualities",   1,  NULL, 'q'},
+	{ "seconds",     1,  NULL, 's'},
+	{ "slow",        1,  NULL, 'w'},
+	{ "slow-rate",   1,  NULL, 'r'},
+	{ "fast-rate",   1,  NULL, 'R'},
+	{ "static",      1,  NULL, 'x'},
+	{ "renew",       1,  NULL, 'm'},
+	{ "pid",         1,  NULL, 'i'},
+	{ "metrics",     1,  NULL, 'M'},
+	{ NULL,	         0,  NULL,  0}
+    };
+
+    host_name = DEFAULT_HOST;
+    port = DEFAULT_PORT;
+    num_clients = DEFAULT_CONNECTIONS;
+    duration = DEFAULT_DURATION;
+    slow_pct = 0;
+    slow_rate = DEFAULT_SLOW_RATE;
+    fast_rate = 0;
+    pid = 0;
+    metrics_port = 0;
+
+    /* Explore the options array */
+    do
+    {
+	/* Call getopt_long. */
+	next_opt = getopt_long (argc, argv, short_opts, long_opts, NULL);
+
+	switch (next_opt)
+	{
+	    case 'h' :
+		print_usage(app_name);
+		exit(EXIT_SUCCESS);
+
+	    case 'v' :
+		printf("%s version: %s\n", app_name, CLIENT_VERSION);
+		exit(EXIT_SUCCESS);
+
+	    case 'H' :
+		host_name = optarg;
+		break;
+
+	    case 'P' :
+		port = atoi(optarg);
+		break;
+
+	    case 'c' :
+		num_clients = atoi(optarg);
+		break;
+
+	    case 'd' :
+		duration = atoi(optarg);
+		break;
+
+	    case 'f' :
+		first_id = atoi(optarg);
+		break;
+
+	    case 'n' :
+		videos = atoi(optarg);
+		break;
+
+	    case 'q' :
+		qualities = atoi(optarg);
+		break;
+
+	    case 's' :
+		seconds = atoi(optarg);
+		break;
+
+	    case 'w' :
+		slow_pct = atoi(optarg);
+		break;
+
+	    case 'r' :
+		slow_rate = atoll(optarg);
+		break;
+
+	    case 'R' :
+		fast_rate = atoll(optarg);
+		break;
+
+	    case 'x' :
+		static_pct = atoi(optarg);
+		break;
+
+	    case 'm' :
+		renew_time = atoi(optarg);
+		break;
+
+	    case 'i' :
+		pid = atoi(optarg);
+		break;
+
+	    case 'M' :
+		metrics_port = atoi(optarg);
+		break;
+
+	    case -1 : /* No more options. */
+		break;
+
+	    default:
+		exit(EXIT_FAILURE);
+	}
+    }
+    while (next_opt != -1);
+
+    if ((num_clients < 1) || (duration < 1) || (videos < 1) || (seconds < 1) ||
+	(qualities < 1) || (qualities > MAX_QUALITIES))
+    {
+	fprintf(stderr, "Invalid options.\n");
+	return (EXIT_FAILURE);
+    }
+
+    if ((host = gethostbyname(host_name)) == NULL)
+    {
+	fprintf(stderr, "Unknown host: %s\n", host_name);
+	return (EXIT_FAILURE);
+    }
+
+    memset(&server_addr, 0, sizeof(struct sockaddr_in));
+    server_addr.sin_family = AF_INET;
+    memcpy(&server_addr.sin_addr, host->h_addr_list[0], host->h_length);
+    server_addr.sin_port = htons(port);
+
+    clients = calloc(num_clients, sizeof(Client));
+
+    /* The first clients are the slow ones. */
+    for (i = 0; i < num_clients; i++)
+    {
+	clients[i].seed = (unsigned int)(time(NULL) ^ (i * 2654435761U));
+	clients[i].read_rate = ((i * 100) < (slow_pct * num_clients)) ? slow_rate : fast_rate;
+    }
+
+    cpu_start = (pid > 0) ? get_cpu_ticks(pid) : -1;
+    switches_start = (metrics_port > 0) ? get_metric(metrics_port, "ichoppedthatvideo_abr_switches_total") : -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    deadline = start_time;
+    deadline.tv_sec += duration;
+
+    for (i = 0; i < num_clients; i++)
+    {
+	if (pthread_create(&clients[i].thread_id, NULL, &client_main, &clients[i]) != 0)
+	{
+	    fprintf(stderr, "Cannot create client %d\n", i);
+	    return (EXIT_FAILURE);
+	}
+    }
+
+    for (i = 0; i < num_clients; i++)
+    {
+	pthread_join(clients[i].thread_id, NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &stop_time);
+    cpu_stop = (cpu_start >= 0) ? get_cpu_ticks(pid) : -1;
+    switches_stop = (switches_start >= 0) ? get_metric(metrics_port, "ichoppedthatvideo_abr_switches_total") : -1;
+
+    print_report(clients, num_clients, (double)elapsed_ns(&start_time, &stop_time) / NANOSEC_IN_SEC,
+		 ((cpu_start >= 0) && (cpu_stop >= 0)) ? (cpu_stop - cpu_start) : -1,
+		 ((switches_start >= 0) && (switches_stop >= 0)) ? (switches_stop - switches_start) : -1);
+
+    for (i = 0; i < num_clients; i++)
+    {
+	free(clients[i].stats.ttfb[STREAM_REQUEST]);
+	free(clients[i].stats.ttfb[STATIC_REQUEST]);
+    }
+
+    free(clients);
+    return (EXIT_SUCCESS);
+}
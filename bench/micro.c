@@ -0,0 +1,567 @@
+/* Micro-benchmarks.
+ * File: micro.c
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Run the server helpers found in every request over realistic inputs,
+ * and report time and allocations per call. Results may be written as
+ * JSON or CSV, so they can be tracked commit after commit.
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "../server/common.h"
+#include "../server/parser.h"
+#include "../server/request.h"
+#include "../server/reply.h"
+
+/* ********** Constant definitions ********** */
+#define MICRO_VERSION		"1.0"
+#define DEFAULT_MIN_TIME	200
+#define NANOSEC_IN_SEC		1000000000
+#define NANOSEC_IN_MSEC		1000000
+#define MAX_ITERATIONS		(1 << 30)
+
+/* Log line length and query parsing, as the request module uses them. */
+#define LOG_SIZE		250
+#define QUERY_DELIMITERS	"=&"
+#define QUERY_VALID_SET		"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ1234567890=&"
+
+/* A one hour video with an iframe per second, in three qualities. */
+#define INFO_STREAMS		3
+#define INFO_IFRAMES		3600
+#define INFO_STREAM_SIZE	16777216
+
+#define REPLY_CONTENT_LEN	1024
+#define SERVER_NAME		"media.example.com"
+
+/* Output formats. */
+enum output_formats {TEXT_OUTPUT, JSON_OUTPUT, CSV_OUTPUT};
+
+/* ********** Type definitions ********** */
+typedef
+struct _benchmark
+{
+    const char * name;
+    void (* run) (long iterations);
+}
+Benchmark;
+
+typedef
+struct _result
+{
+    long iterations;
+    double ns_per_op;
+    double allocs_per_op;
+    double bytes_per_op;
+}
+Result;
+
+/* ********** Global variables ********** */
+
+/* Requests captured from players and browsers. */
+const
+char * requests [] = {
+    "GET /stream?video_id=1234&sign=9f86d081884c7d659a2feaa0c55ad015a3bf4f1b&quality=1&pos=12 HTTP/1.1\r\n"
+    "Host: media.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (Windows NT 6.1; WOW64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/27.0.1453.110 Safari/537.36\r\n"
+    "Accept: */*\r\n"
+    "Referer: http://www.example.com/watch/1234\r\n"
+    "Accept-Encoding: gzip,deflate,sdch\r\n"
+    "Accept-Language: en-US,en;q=0.8\r\n"
+    "Connection: keep-alive\r\n\r\n",
+
+    "GET /data.xml?video_id=1234 HTTP/1.1\r\n"
+    "Host: media.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:21.0) Gecko/20100101 Firefox/21.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "If-None-Match: \"2a1f-19-51be2c80-gzip\"\r\n"
+    "Connection: keep-alive\r\n\r\n",
+
+    "GET /crossdomain.xml HTTP/1.1\r\n"
+    "Host: media.example.com\r\n"
+    "User-Agent: Shockwave Flash\r\n"
+    "Accept: */*\r\n\r\n",
+
+    "GET /stream?video_id=1234&sign=9f86d081884c7d659a2feaa0c55ad015a3bf4f1b&cache=3600 HTTP/1.1\r\n"
+    "Host: media.example.com\r\n"
+    "User-Agent: AppleCoreMedia/1.0.0.10B329 (iPad; U; CPU OS 6_1_3 like Mac OS X; en_us)\r\n"
+    "Range: bytes=1048576-\r\n"
+    "If-Range: \"9f86d081884c7d659a2feaa0c55ad015a3bf4f1b-1-0\"\r\n"
+    "Accept-Encoding: identity\r\n"
+    "Connection: keep-alive\r\n\r\n"
+};
+
+const
+int requests_len = 4;
+
+/* Query strings of the previous requests. */
+const
+char * queries [] = {
+    "video_id=1234&sign=9f86d081884c7d659a2feaa0c55ad015a3bf4f1b&quality=1&pos=12",
+    "video_id=1234",
+    "",
+    "video_id=1234&sign=9f86d081884c7d659a2feaa0c55ad015a3bf4f1b&cache=3600"
+};
+
+/* Request module tables. */
+extern const
+char * req_param_names [];
+
+/* Private to the stream module, it parses a stream of 'data.txt'. */
+char *
+parse_stream_info		(char * info, char ** name, ushort * iframe_num, int64_t * iframe_offset, char ** attrs);
+
+/* Allocations counted, only while 'counting' is set. */
+extern void * __libc_malloc (size_t size);
+extern void * __libc_calloc (size_t num, size_t size);
+extern void * __libc_realloc (void * ptr, size_t size);
+
+int counting        = 0;
+long alloc_count    = 0;
+long alloc_bytes    = 0;
+
+/* Shared by benchmarks. */
+Arena arena;
+char * info_file    = NULL;
+int64_t * info_offsets = NULL;
+char input_buf[REQUEST_MAX_SIZE];
+uint8_t reply_content[REPLY_CONTENT_LEN];
+const char data_xml [] = "<data url=\"SERVER_URL\"/>\n";
+
+/* ********** Private functions ********** */
+
+/* malloc(), calloc() and realloc()
+ *
+ * Count every allocation made by the code measured, including the ones
+ * made inside the C library, such as asprintf().
+ * */
+void *
+malloc				(size_t size)
+{
+    if (counting)
+    {
+	alloc_count++;
+	alloc_bytes += size;
+    }
+
+    return (__libc_malloc(size));
+}
+
+void *
+calloc				(size_t num, size_t size)
+{
+    if (counting)
+    {
+	alloc_count++;
+	alloc_bytes += num * size;
+    }
+
+    return (__libc_calloc(num, size));
+}
+
+void *
+realloc				(void * ptr, size_t size)
+{
+    if (counting)
+    {
+	alloc_count++;
+	alloc_bytes += size;
+    }
+
+    return (__libc_realloc(ptr, size));
+}
+
+/* print_usage()
+ *
+ * Prints the available options on the command line.
+ * */
+void
+print_usage			(const char * app_name)
+{
+    printf("Usage: %s [OPTIONS]\n", app_name);
+    printf("Available options:\n"
+	   "\t-h, --help\t\t\t Display this usage information\n"
+	   "\t-v, --version\t\t\t Print the application version\n"
+	   "\t-f 'format', --format 'format'\t Output format: 'text', 'json' or 'csv' [Default: text]\n"
+	   "\t-r 'name', --revision 'name'\t Revision measured, written along with the results\n"
+	   "\t-t num, --time num\t\t Run every benchmark for at least 'num' milliseconds [Default: %d]\n"
+	   "\t-b 'name', --bench 'name'\t Run only the benchmarks whose name contains 'name'\n",
+	   DEFAULT_MIN_TIME
+	);
+}
+
+/* Benchmarks.
+ *
+ * Each one runs its operation 'iterations' times, cycling through the
+ * corpus.
+ * */
+void
+bench_parse_key_value		(long iterations)
+{
+    char ** values;
+    long i;
+    int j;
+
+    for (i = 0; i < iterations; i++)
+    {
+	values = parse_key_value((char *)queries[i % requests_len], req_param_names, REQ_PARAM_NUM,
+				 QUERY_DELIMITERS, PARAM_MAX_LEN);
+
+	for (j = 0; j < REQ_PARAM_NUM; j++)
+	{
+	    free(values[j]);
+	}
+
+	free(values);
+    }
+}
+
+void
+bench_parse_query		(long iterations)
+{
+    char * values[REQ_PARAM_NUM];
+    Slice query;
+    long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+	/* Values are parsed in place, so the query is copied first. */
+	query.offset = 0;
+	query.len = strlen(queries[i % requests_len]);
+	memcpy(input_buf, queries[i % requests_len], query.len + 1);
+	parse_query(input_buf, query, req_param_names, REQ_PARAM_NUM, values, PARAM_MAX_LEN);
+    }
+}
+
+void
+bench_parse_http_request	(long iterations)
+{
+    HttpRequest req;
+    long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+	parse_http_request(requests[i % requests_len], strlen(requests[i % requests_len]), &req);
+    }
+}
+
+void
+bench_get_valid_substr_len	(long iterations)
+{
+    long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+	get_valid_substr_len(queries[i % requests_len], QUERY_VALID_SET);
+    }
+}
+
+void
+bench_wipe_special_chars	(long iterations)
+{
+    long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+	wipe_special_chars(&arena, (char *)requests[i % requests_len], LOG_SIZE);
+	reset_arena(&arena);
+    }
+}
+
+void
+bench_compose_reply		(long iterations)
+{
+    ReplyParams params = {NULL, HTTP_OK_CODE, XML_TYPE, CONN_KEEP, NULL, NO_CACHE, NO_EXPIRE, NULL};
+    unsigned int reply_size;
+    long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+	compose_reply(&arena, params, reply_content, REPLY_CONTENT_LEN, &reply_size);
+	reset_arena(&arena);
+    }
+}
+
+void
+bench_find_and_replace		(long iterations)
+{
+    char * src;
+    long i;
+
+    for (i = 0; i < iterations; i++)
+    {
+	src = strdup(data_xml);
+	find_and_replace(&src, "SERVER_URL", SERVER_NAME);
+	free(src);
+    }
+}
+
+/* Both passes of load_video() over the info file: count the iframes,
+ * and then read every stream.
+ * */
+void
+bench_load_video_info		(long iterations)
+{
+    char * cursor, * name;
+    ushort iframe_num;
+    int64_t * offset;
+    long i;
+    int j, total;
+
+    for (i = 0; i < iterations; i++)
+    {
+	cursor = strchr(strchr(info_file, '\n') + 1, '\n') + 1;
+	strtol(cursor, &cursor, 10);
+
+	for (j = 0, total = 0; j < INFO_STREAMS; j++)
+	{
+	    cursor = parse_stream_info(cursor, NULL, &iframe_num, NULL, NULL);
+	    total += iframe_num;
+	}
+
+	cursor = strchr(strchr(info_file, '\n') + 1, '\n') + 1;
+	strtol(cursor, &cursor, 10);
+
+	for (j = 0, offset = info_offsets; j < INFO_STREAMS; j++)
+	{
+	    cursor = parse_stream_info(cursor, &name, &iframe_num, offset, NULL);
+	    offset += iframe_num;
+	    free(name);
+	}
+    }
+}
+
+/* build_info_file()
+ *
+ * Compose a 'data.txt' file as chopper writes it.
+ * */
+void
+build_info_file			()
+{
+    char * stream;
+    int i, j;
+
+    asprintf(&info_file, "/home/www/htdocs/1234\n9f86d081884c7d659a2feaa0c55ad015a3bf4f1b\n%d\n", INFO_STREAMS);
+
+    for (i = 0; i < INFO_STREAMS; i++)
+    {
+	asprintf(&stream, "video_%d.flv\n%d\n", i, INFO_IFRAMES);
+	info_file = concat_and_free(info_file, stream);
+
+	for (j = 0; j < INFO_IFRAMES; j++)
+	{
+	    asprintf(&stream, "%lld ", (long long)j * ((INFO_STREAM_SIZE << i) / INFO_IFRAMES));
+	    info_file = concat_and_free(info_file, stream);
+	}
+
+	asprintf(&stream, "\n/header 0 13\n/config 13 52\n");
+	info_file = concat_and_free(info_file, stream);
+    }
+
+    info_offsets = malloc(INFO_STREAMS * INFO_IFRAMES * sizeof(int64_t));
+}
+
+/* run_benchmark()
+ *
+ * Run a benchmark doubling its iterations until it takes at least
+ * 'min_time' nanoseconds.
+ * */
+void
+run_benchmark			(const Benchmark * bench, int64_t min_time, Result * result)
+{
+    struct timespec start_time, stop_time;
+    int64_t spent;
+    long iterations;
+
+    /* Warm up caches and the arena. */
+    bench->run(1);
+
+    for (iterations = 1; ; iterations *= 2)
+    {
+	alloc_count = 0;
+	alloc_bytes = 0;
+	counting = 1;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	bench->run(iterations);
+	clock_gettime(CLOCK_MONOTONIC, &stop_time);
+	counting = 0;
+
+	spent = ((int64_t)(stop_time.tv_sec - start_time.tv_sec) * NANOSEC_IN_SEC) + (stop_time.tv_nsec - start_time.tv_nsec);
+
+	if ((spent >= min_time) || (iterations >= MAX_ITERATIONS))
+	{
+	    break;
+	}
+    }
+
+    result->iterations = iterations;
+    result->ns_per_op = (double)spent / iterations;
+    result->allocs_per_op = (double)alloc_count / iterations;
+    result->bytes_per_op = (double)alloc_bytes / iterations;
+}
+
+/* ********** Public functions ********** */
+
+int
+main			(int argc, char * argv[])
+{
+    Result result;
+    char * revision, * filter;
+    int format, min_time, i, first;
+
+    const Benchmark benchmarks [] = {
+	{"parse_key_value",	bench_parse_key_value},
+	{"parse_query",		bench_parse_query},
+	{"parse_http_request",	bench_parse_http_request},
+	{"get_valid_substr_len", bench_get_valid_substr_len},
+	{"wipe_special_chars",	bench_wipe_special_chars},
+	{"compose_reply",	bench_compose_reply},
+	{"find_and_replace",	bench_find_and_replace},
+	{"load_video_info",	bench_load_video_info},
+	{NULL,			NULL}
+    };
+
+    /* getopt_long() needed variables. */
+    int next_opt;				/* Next option in getopt_long() */
+    const char* short_opts = "hvf:r:t:b:";	/* Short options */
+    const char* app_name = argv[0];		/* Name of the app */
+
+    const struct option
+    long_opts[] =
+    {
+	{ "help",     0,  NULL, 'h'},
+	{ "version",  0,  NULL, 'v'},
+	{ "format",   1,  NULL, 'f'},
+	{ "revision", 1,  NULL, 'r'},
+	{ "time",     1,  NULL, 't'},
+	{ "bench",    1,  NULL, 'b'},
+	{ NULL,	      0,  NULL,  0}
+    };
+
+    format = TEXT_OUTPUT;
+    revision = "unknown";
+    filter = NULL;
+    min_time = DEFAULT_MIN_TIME;
+
+    /* Explore the options array */
+    do
+    {
+	/* Call getopt_long. */
+	next_opt = getopt_long (argc, argv, short_opts, long_opts, NULL);
+
+	switch (next_opt)
+	{
+	    case 'h' :
+		print_usage(app_name);
+		exit(EXIT_SUCCESS);
+
+	    case 'v' :
+		printf("%s version: %s\n", app_name, MICRO_VERSION);
+		exit(EXIT_SUCCESS);
+
+	    case 'f' :
+		if (strcmp(optarg, "json") == 0)
+		{
+		    format = JSON_OUTPUT;
+		}
+		else if (strcmp(optarg, "csv") == 0)
+		{
+		    format = CSV_OUTPUT;
+		}
+		break;
+
+	    case 'r' :
+		revision = optarg;
+		break;
+
+	    case 't' :
+		min_time = atoi(optarg);
+		break;
+
+	    case 'b' :
+		filter = optarg;
+		break;
+
+	    case -1 : /* No more options. */
+		break;
+
+	    default:
+		exit(EXIT_FAILURE);
+	}
+    }
+    while (next_opt != -1);
+
+    /* Only critical messages, written at once. */
+    init_log(CRITICAL, CONSOLE);
+
+    if (init_arena(&arena, ARENA_BLOCK_SIZE) != EXIT_SUCCESS)
+    {
+	fprintf(stderr, "Cannot allocate memory.\n");
+	return (EXIT_FAILURE);
+    }
+
+    memset(reply_content, 'x', REPLY_CONTENT_LEN);
+    build_info_file();
+
+    switch (format)
+    {
+	case (JSON_OUTPUT):
+	    printf("{\"revision\": \"%s\", \"benchmarks\": [", revision);
+	    break;
+	case (CSV_OUTPUT):
+	    printf("revision,name,iterations,ns_per_op,allocs_per_op,bytes_per_op\n");
+	    break;
+	default:
+	    printf("%-24s %12s %12s %12s %12s\n", "Benchmark", "Iterations", "ns/op", "allocs/op", "bytes/op");
+	    break;
+    }
+
+    for (i = 0, first = 1; benchmarks[i].name != NULL; i++)
+    {
+	if ((filter != NULL) && (strstr(benchmarks[i].name, filter) == NULL))
+	{
+	    continue;
+	}
+
+	run_benchmark(&benchmarks[i], (int64_t)min_time * NANOSEC_IN_MSEC, &result);
+
+	switch (format)
+	{
+	    case (JSON_OUTPUT):
+		printf("%s\n  {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.2f, \"allocs_per_op\": %.2f, \"bytes_per_op\": %.2f}",
+		       first ? "" : ",", benchmarks[i].name, result.iterations, result.ns_per_op,
+		       result.allocs_per_op, result.bytes_per_op);
+		break;
+	    case (CSV_OUTPUT):
+		printf("%s,%s,%ld,%.2f,%.2f,%.2f\n", revision, benchmarks[i].name, result.iterations,
+		       result.ns_per_op, result.allocs_per_op, result.bytes_per_op);
+		break;
+	    default:
+		printf("%-24s %12ld %12.2f %12.2f %12.2f\n", benchmarks[i].name, result.iterations,
+		       result.ns_per_op, result.allocs_per_op, result.bytes_per_op);
+		break;
+	}
+
+	first = 0;
+    }
+
+    if (format == JSON_OUTPUT)
+    {
+	printf("\n]}\n");
+    }
+
+    free_arena(&arena);
+    free(info_file);
+    free(info_offsets);
+    return (EXIT_SUCCESS);
+}
@@ -15,6 +15,7 @@
 #include "../server/common.h"
 #include "file.h"
 #include "video.h"
+#include "transcode.h"
 
 /* ********** Constant definitions ********** */
 
@@ -37,7 +38,14 @@ print_usage			(const char * app_name)
 	   "\t-h, --help\t\t\t Display this usage information\n"
 	   "\t-v, --version\t\t\t Print the application version\n"
 	   "\t-p, --path\t\t\t Specify the path to analyse\n"
-	   "\t-d, --dirs\t\t\t Watch for a specific set of directories in the path\n"
+	   "\t-d, --dirs\t\t\t Watch for a specific set of directories in the path\n\n"
+	   "Transcoding options\n"
+	   "\t-t, --transcode 'file'\t\t Encode a mezzanine file into a ladder of renditions in the path, and index them\n"
+	   "\t-l, --ladder 'ladder'\t\t Renditions, as comma separated 'height:kbps' pairs [Default: %s]\n"
+	   "\t-k num, --keyint num\t\t Seconds between keyframes, the same on every rendition [Default: %d]\n"
+	   "\t-j num, --jobs num\t\t Run up to 'num' encodes at once [Default: one for every processor]\n"
+	   "\t-e 'path', --encoder 'path'\t Encoder to run [Default: %s]\n",
+	   DEFAULT_LADDER, DEFAULT_KEYINT, DEFAULT_ENCODER
 	);
 }
 
@@ -60,11 +68,13 @@ main			(int argc, char * argv[])
 {
     int num_entries, i;
     char * path, * dirs, * dir, * filename;
+    char * mezzanine, * ladder, * encoder;
+    int keyint, jobs, res;
     struct dirent ** entries;
 	
     /* getopt_long() needed variables. */
     int next_opt;				/* Next option in getopt_long() */
-    const char* short_opts = "hvp:d:";	/* Short options */
+    const char* short_opts = "hvp:d:t:l:k:j:e:";	/* Short options */
     const char* app_name = argv[0];		/* Name of the app */
 	
     const struct option
@@ -74,11 +84,21 @@ main			(int argc, char * argv[])
 	{ "version", 0,  NULL, 'v'},
 	{ "path",    1,  NULL, 'p'},
 	{ "dirs",    1,  NULL, 'd'},
+	{ "transcode", 1, NULL, 't'},
+	{ "ladder",  1,  NULL, 'l'},
+	{ "keyint",  1,  NULL, 'k'},
+	{ "jobs",    1,  NULL, 'j'},
+	{ "encoder", 1,  NULL, 'e'},
 	{ NULL,	     0,  NULL,  0}
     };
 	
     path = NULL;
     dirs = NULL;
+    mezzanine = NULL;
+    ladder = DEFAULT_LADDER;
+    encoder = DEFAULT_ENCODER;
+    keyint = DEFAULT_KEYINT;
+    jobs = 0;
 	
     /* Explore the options array */
     do
@@ -104,6 +124,26 @@ main			(int argc, char * argv[])
 		asprintf(&dirs, "%s", optarg);
 		break;
 
+	    case 't' :
+		asprintf(&mezzanine, "%s", optarg);
+		break;
+
+	    case 'l' :
+		asprintf(&ladder, "%s", optarg);
+		break;
+
+	    case 'k' :
+		keyint = atoi(optarg);
+		break;
+
+	    case 'j' :
+		jobs = atoi(optarg);
+		break;
+
+	    case 'e' :
+		asprintf(&encoder, "%s", optarg);
+		break;
+
 	    case -1 : /* No more options. */
 		break;
 
@@ -120,6 +160,15 @@ main			(int argc, char * argv[])
     }
 	
     init_file(FILENAME);
+
+    /* The path is the video directory the renditions are saved to. */
+    if (mezzanine != NULL)
+    {
+	res = transcode_video(mezzanine, path, ladder, keyint, jobs, encoder);
+	exit_file();
+
+	return (res ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 	
     if (dirs == NULL)
     {
@@ -66,9 +66,15 @@ save_common_info	(char * path, char * sign, int num_streams)
 
 /* save_stream_info()
  * 
+ * Append a stream to the info file: its name, its iframe offsets, and
+ * then an attribute line for its 'header', for every range in 'config',
+ * if any, for its iframe times and for the 'hash' of its contents.
+ * Attribute lines start with '/', so they can never be mistaken for a
+ * file name.
  * */
 int
-save_stream_info	(char * path, char * filename, int64_t * iframe_offset, int iframe_num)
+save_stream_info	(char * path, char * filename, int64_t * iframe_offset, int64_t * iframe_time, int iframe_num,
+			 DataRange * header, DataRange * config, int config_num, char * hash)
 {
     int fd, i, buffer_len;
     char * buffer, * full_name;
@@ -101,6 +107,42 @@ save_stream_info	(char * path, char * filename, int64_t * iframe_offset, int ifr
     buffer_len = asprintf(&buffer, "\n");
     write(fd, buffer, buffer_len);
     free(buffer);
+
+    /* Write the header and codec configuration ranges. */
+    if ((header != NULL) && (header->len > 0))
+    {
+	buffer_len = asprintf(&buffer, "/header %lld %lld\n", (long long)header->offset, (long long)header->len);
+	write(fd, buffer, buffer_len);
+	free(buffer);
+    }
+
+    for (i = 0; i < config_num; i++)
+    {
+	buffer_len = asprintf(&buffer, "/config %lld %lld\n", (long long)config[i].offset, (long long)config[i].len);
+	write(fd, buffer, buffer_len);
+	free(buffer);
+    }
+
+    /* Write the iframe times, which the server switches streams by. */
+    if ((iframe_time != NULL) && (iframe_num > 0))
+    {
+	for (i = 0; i < iframe_num; i++)
+	{
+	    buffer_len = asprintf(&buffer, (i == 0) ? "/times %lld" : " %lld", (long long)iframe_time[i]);
+	    write(fd, buffer, buffer_len);
+	    free(buffer);
+	}
+
+	write(fd, "\n", 1);
+    }
+
+    /* Write the file hash, so videos sharing this file load it once. */
+    if ((hash != NULL) && (hash[0] != '\0'))
+    {
+	buffer_len = asprintf(&buffer, "/hash %s\n", hash);
+	write(fd, buffer, buffer_len);
+	free(buffer);
+    }
 	
     close(fd);
     return (TRUE);
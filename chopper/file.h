@@ -9,6 +9,22 @@
 #ifndef FILE_H
 #define FILE_H
 
+/* ********** Constant definitions ********** */
+
+/* Highest number of codec configuration ranges kept for every stream. */
+#define MAX_CONFIG_RANGES	4
+
+/* ********** Type definitions ********** */
+
+/* A byte range into a stream file. */
+typedef
+struct _data_range
+{
+    int64_t offset;
+    int64_t len;
+}
+DataRange;
+
 /* ********** Public functions ********** */
 int
 init_file				(char * filename);
@@ -17,7 +33,8 @@ int
 save_common_info		(char * path, char * sign, int num_streams);
 
 int
-save_stream_info		(char * path, char * filename, int64_t * iframe_offset, int iframe_num);
+save_stream_info		(char * path, char * filename, int64_t * iframe_offset, int64_t * iframe_time, int iframe_num,
+				 DataRange * header, DataRange * config, int config_num, char * hash);
 
 int
 exit_file				();
@@ -0,0 +1,468 @@
+/* MP4 module.
+ * File: mp4.c
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * MP4 sample tables.
+ * The server rewrites the 'moov' atom of progressive MP4 renditions to
+ * start them on any keyframe. The sample tables of every track are
+ * expanded here, once, into a list of samples saved next to the
+ * rendition, so the server only has to write them back.
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../server/common.h"
+#include "../server/mp4.h"
+#include "mp4.h"
+
+/* ********** Constant definitions ********** */
+#define ATOM_HEADER_LEN		8
+#define ATOM_LARGE_LEN		16
+
+#define ATOM_TYPE(a, b, c, d)	(((uint32_t)(a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+#define ATOM_FTYP		ATOM_TYPE('f', 't', 'y', 'p')
+#define ATOM_MOOV		ATOM_TYPE('m', 'o', 'o', 'v')
+#define ATOM_MDAT		ATOM_TYPE('m', 'd', 'a', 't')
+#define ATOM_MVEX		ATOM_TYPE('m', 'v', 'e', 'x')
+#define ATOM_TRAK		ATOM_TYPE('t', 'r', 'a', 'k')
+#define ATOM_MDIA		ATOM_TYPE('m', 'd', 'i', 'a')
+#define ATOM_MDHD		ATOM_TYPE('m', 'd', 'h', 'd')
+#define ATOM_HDLR		ATOM_TYPE('h', 'd', 'l', 'r')
+#define ATOM_MINF		ATOM_TYPE('m', 'i', 'n', 'f')
+#define ATOM_STBL		ATOM_TYPE('s', 't', 'b', 'l')
+#define ATOM_STTS		ATOM_TYPE('s', 't', 't', 's')
+#define ATOM_CTTS		ATOM_TYPE('c', 't', 't', 's')
+#define ATOM_STSS		ATOM_TYPE('s', 't', 's', 's')
+#define ATOM_STSC		ATOM_TYPE('s', 't', 's', 'c')
+#define ATOM_STSZ		ATOM_TYPE('s', 't', 's', 'z')
+#define ATOM_STCO		ATOM_TYPE('s', 't', 'c', 'o')
+#define ATOM_CO64		ATOM_TYPE('c', 'o', '6', '4')
+
+/* ********** Private functions ********** */
+
+/* get_be32()
+ *
+ * */
+static
+uint32_t
+get_be32			(const uint8_t * buf)
+{
+    return (((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3]);
+}
+
+/* get_be64()
+ *
+ * */
+static
+uint64_t
+get_be64			(const uint8_t * buf)
+{
+    return (((uint64_t)get_be32(buf) << 32) | get_be32(buf + 4));
+}
+
+/* find_atom()
+ *
+ * Find the first atom of type 'type' in 'len' bytes from 'buf'.
+ * Returns its contents, and their length in 'atom_len', or NULL if it
+ * is not found.
+ * */
+static
+uint8_t *
+find_atom			(uint8_t * buf, int64_t len, uint32_t type, int64_t * atom_len)
+{
+    int64_t size;
+    int header_len;
+
+    while (len >= ATOM_HEADER_LEN)
+    {
+	size = get_be32(buf);
+	header_len = ATOM_HEADER_LEN;
+
+	if ((size == 1) && (len >= ATOM_LARGE_LEN))
+	{
+	    size = get_be64(buf + 8);
+	    header_len = ATOM_LARGE_LEN;
+	}
+	else if (size == 0)
+	{
+	    size = len;
+	}
+
+	if ((size < header_len) || (size > len))
+	{
+	    return (NULL);
+	}
+
+	if (get_be32(buf + 4) == type)
+	{
+	    *atom_len = size - header_len;
+	    return (buf + header_len);
+	}
+
+	buf += size;
+	len -= size;
+    }
+
+    return (NULL);
+}
+
+/* find_table()
+ *
+ * Find a sample table in 'stbl', and check it holds 'entry_len' bytes
+ * for each of its entries, after 'skip' bytes.
+ * Returns its first entry, and the number of entries in 'entry_num',
+ * or NULL if it is not found or not well formed.
+ * */
+static
+uint8_t *
+find_table			(uint8_t * stbl, int64_t stbl_len, uint32_t type, int skip, int entry_len, uint32_t * entry_num)
+{
+    uint8_t * table;
+    int64_t table_len;
+
+    if (((table = find_atom(stbl, stbl_len, type, &table_len)) == NULL) ||
+	(table_len < (skip + 8)))
+    {
+	return (NULL);
+    }
+
+    *entry_num = get_be32(table + 4 + skip);
+
+    if ((entry_len > 0) && (*entry_num > ((table_len - skip - 8) / entry_len)))
+    {
+	return (NULL);
+    }
+
+    return (table + skip + 8);
+}
+
+/* load_track()
+ *
+ * Expand the sample tables of a track into 'header' and 'samples',
+ * which should be freed after use.
+ * Returns FALSE if they are not well formed.
+ * */
+static
+int
+load_track			(uint8_t * trak, int64_t trak_len, TrackHeader * header, Sample ** samples)
+{
+    uint8_t * mdia, * mdhd, * hdlr, * minf, * stbl;
+    uint8_t * stts, * ctts, * stss, * stsc, * stsz, * stco;
+    int64_t mdia_len, mdhd_len, hdlr_len, minf_len, stbl_len;
+    uint32_t stts_num, ctts_num, stss_num, stsc_num, stsz_num, stco_num;
+    uint32_t fixed_size, i, j, run, chunk, entry, chunk_samples;
+    int64_t offset;
+    int large_offsets;
+    Sample * res;
+
+    if (((mdia = find_atom(trak, trak_len, ATOM_MDIA, &mdia_len)) == NULL) ||
+	((mdhd = find_atom(mdia, mdia_len, ATOM_MDHD, &mdhd_len)) == NULL) || (mdhd_len < 24) ||
+	((hdlr = find_atom(mdia, mdia_len, ATOM_HDLR, &hdlr_len)) == NULL) || (hdlr_len < 12) ||
+	((minf = find_atom(mdia, mdia_len, ATOM_MINF, &minf_len)) == NULL) ||
+	((stbl = find_atom(minf, minf_len, ATOM_STBL, &stbl_len)) == NULL))
+    {
+	return (FALSE);
+    }
+
+    memset(header, 0, sizeof(TrackHeader));
+    header->handler = get_be32(hdlr + 8);
+    header->timescale = (mdhd[0] == 1) ? get_be32(mdhd + 20) : get_be32(mdhd + 12);
+
+    /* Sizes, and then the tables every sample needs. */
+    large_offsets = FALSE;
+
+    if (((stsz = find_table(stbl, stbl_len, ATOM_STSZ, 4, 0, &stsz_num)) == NULL) ||
+	((stts = find_table(stbl, stbl_len, ATOM_STTS, 0, 8, &stts_num)) == NULL) ||
+	((stsc = find_table(stbl, stbl_len, ATOM_STSC, 0, 12, &stsc_num)) == NULL) ||
+	(((stco = find_table(stbl, stbl_len, ATOM_STCO, 0, 4, &stco_num)) == NULL) &&
+	 ((large_offsets = TRUE), (stco = find_table(stbl, stbl_len, ATOM_CO64, 0, 8, &stco_num)) == NULL)))
+    {
+	return (FALSE);
+    }
+
+    fixed_size = get_be32(stsz - 8);
+
+    if ((fixed_size == 0) && (find_table(stbl, stbl_len, ATOM_STSZ, 4, 4, &stsz_num) == NULL))
+    {
+	return (FALSE);
+    }
+
+    ctts = find_table(stbl, stbl_len, ATOM_CTTS, 0, 8, &ctts_num);
+    stss = find_table(stbl, stbl_len, ATOM_STSS, 0, 4, &stss_num);
+
+    if ((res = calloc((stsz_num > 0) ? stsz_num : 1, sizeof(Sample))) == NULL)
+    {
+	return (FALSE);
+    }
+
+    header->sample_num = stsz_num;
+
+    /* Sizes, and sync samples. Without 'stss', every sample is. */
+    for (i = 0; i < stsz_num; i++)
+    {
+	res[i].size = (fixed_size != 0) ? fixed_size : get_be32(stsz + (i * 4));
+	res[i].flags = (stss == NULL) ? SAMPLE_SYNC : 0;
+    }
+
+    for (i = 0; (stss != NULL) && (i < stss_num); i++)
+    {
+	if (((j = get_be32(stss + (i * 4))) > 0) && (j <= stsz_num))
+	{
+	    res[j - 1].flags |= SAMPLE_SYNC;
+	}
+    }
+
+    /* Durations and composition offsets, as runs of samples. */
+    for (i = 0, j = 0; i < stts_num; i++)
+    {
+	for (run = get_be32(stts + (i * 8)); (run > 0) && (j < stsz_num); run--, j++)
+	{
+	    res[j].duration = get_be32(stts + (i * 8) + 4);
+	}
+    }
+
+    for (i = 0, j = 0; (ctts != NULL) && (i < ctts_num); i++)
+    {
+	for (run = get_be32(ctts + (i * 8)); (run > 0) && (j < stsz_num); run--, j++)
+	{
+	    res[j].cto = (int32_t)get_be32(ctts + (i * 8) + 4);
+	}
+    }
+
+    /* Offsets: samples in a chunk are stored one after the other. */
+    for (chunk = 0, entry = 0, j = 0; (chunk < stco_num) && (j < stsz_num); chunk++)
+    {
+	while (((entry + 1) < stsc_num) && (get_be32(stsc + ((entry + 1) * 12)) <= (chunk + 1)))
+	{
+	    entry++;
+	}
+
+	chunk_samples = (stsc_num > 0) ? get_be32(stsc + (entry * 12) + 4) : 0;
+	offset = large_offsets ? (int64_t)get_be64(stco + (chunk * 8)) : get_be32(stco + (chunk * 4));
+
+	for (; (chunk_samples > 0) && (j < stsz_num); chunk_samples--, j++)
+	{
+	    res[j].offset = offset;
+	    offset += res[j].size;
+	}
+    }
+
+    if (j < stsz_num)
+    {
+	free(res);
+	return (FALSE);
+    }
+
+    *samples = res;
+    return (TRUE);
+}
+
+/* ********** Public functions ********** */
+
+/* save_sample_table()
+ *
+ * Save the sample table of the MP4 file 'filename', with its extension
+ * replaced by SAMPLES_EXT, and replace 'iframe_offset' with the offsets
+ * of its video keyframes, and 'iframe_time' with their decoding times,
+ * in milliseconds. As with every other format, the first iframe is sent
+ * from the start of the file.
+ * Fragmented files, which need no rewriting, are skipped.
+ * Returns FALSE if the file has no sample table.
+ * */
+int
+save_sample_table		(char * filename, int64_t ** iframe_offset, int64_t ** iframe_time, int * iframe_num)
+{
+    FILE * file;
+    SampleFileHeader file_header;
+    TrackHeader headers[MAX_TRACKS];
+    Sample * samples[MAX_TRACKS];
+    uint8_t atom[ATOM_LARGE_LEN], * moov, * trak;
+    int64_t pos, size, moov_len, trak_len, decode_time;
+    int64_t * offsets, * times;
+    int header_len, track_num, video_track, i;
+    uint32_t type, j, sync_num;
+    char * name, * ext;
+
+    if ((file = fopen(filename, "r")) == NULL)
+    {
+	return (FALSE);
+    }
+
+    /* Locate the top level atoms. */
+    memset(&file_header, 0, sizeof(SampleFileHeader));
+    file_header.magic = SAMPLES_MAGIC;
+    moov = NULL;
+
+    for (pos = 0; (fseeko(file, pos, SEEK_SET) == 0) && (fread(atom, 1, ATOM_HEADER_LEN, file) == ATOM_HEADER_LEN); pos += size)
+    {
+	size = get_be32(atom);
+	type = get_be32(atom + 4);
+	header_len = ATOM_HEADER_LEN;
+
+	if (size == 1)
+	{
+	    if (fread(atom + ATOM_HEADER_LEN, 1, 8, file) != 8)
+	    {
+		break;
+	    }
+
+	    size = get_be64(atom + 8);
+	    header_len = ATOM_LARGE_LEN;
+	}
+	else if (size == 0)
+	{
+	    size = get_file_size(filename) - pos;
+	}
+
+	if (size < header_len)
+	{
+	    break;
+	}
+
+	switch (type)
+	{
+	    case (ATOM_FTYP):
+		file_header.ftyp_offset = pos;
+		file_header.ftyp_len = size;
+		break;
+	    case (ATOM_MOOV):
+		file_header.moov_offset = pos;
+		file_header.moov_len = size;
+		moov_len = size - header_len;
+
+		if ((moov = malloc(moov_len)) != NULL)
+		{
+		    if (fread(moov, 1, moov_len, file) != moov_len)
+		    {
+			free(moov);
+			moov = NULL;
+		    }
+		}
+
+		break;
+	    case (ATOM_MDAT):
+		file_header.mdat_offset = pos + header_len;
+		file_header.mdat_end = pos + size;
+		break;
+	}
+    }
+
+    fclose(file);
+
+    if ((moov == NULL) || (file_header.ftyp_len == 0) || (file_header.mdat_end == 0) ||
+	(find_atom(moov, moov_len, ATOM_MVEX, &size) != NULL))
+    {
+	free(moov);
+	return (FALSE);
+    }
+
+    /* Expand every track, in order. */
+    video_track = -1;
+    track_num = 0;
+
+    for (trak = moov, size = moov_len;
+	 (track_num < MAX_TRACKS) && ((trak = find_atom(trak, size, ATOM_TRAK, &trak_len)) != NULL);
+	 size = (moov + moov_len) - (trak + trak_len), trak += trak_len)
+    {
+	if (!load_track(trak, trak_len, &headers[track_num], &samples[track_num]))
+	{
+	    break;
+	}
+
+	if ((video_track < 0) && (headers[track_num].handler == HANDLER_VIDEO))
+	{
+	    video_track = track_num;
+	}
+
+	track_num++;
+    }
+
+    free(moov);
+    file_header.track_num = track_num;
+
+    if ((trak != NULL) || (video_track < 0))
+    {
+	for (i = 0; i < track_num; i++)
+	{
+	    free(samples[i]);
+	}
+
+	return (FALSE);
+    }
+
+    /* Save the sample table. */
+    ext = strrchr(filename, '.');
+    asprintf(&name, "%.*s%s", (int)(ext - filename), filename, SAMPLES_EXT);
+
+    if ((file = fopen(name, "w")) != NULL)
+    {
+	fwrite(&file_header, sizeof(SampleFileHeader), 1, file);
+
+	for (i = 0; i < track_num; i++)
+	{
+	    fwrite(&headers[i], sizeof(TrackHeader), 1, file);
+	    fwrite(samples[i], sizeof(Sample), headers[i].sample_num, file);
+	}
+
+	if (fclose(file) != 0)
+	{
+	    file = NULL;
+	}
+    }
+
+    if (file == NULL)
+    {
+	perror(name);
+    }
+
+    free(name);
+
+    /* Keyframe offsets, so the server may map iframes to samples. */
+    for (j = 0, sync_num = 0; j < headers[video_track].sample_num; j++)
+    {
+	sync_num += (samples[video_track][j].flags & SAMPLE_SYNC) ? 1 : 0;
+    }
+
+    offsets = NULL;
+    times = NULL;
+
+    if ((file != NULL) && (sync_num > 0) && (headers[video_track].timescale > 0) &&
+	((offsets = malloc(sync_num * sizeof(int64_t))) != NULL) &&
+	((times = malloc(sync_num * sizeof(int64_t))) != NULL))
+    {
+	for (j = 0, sync_num = 0, decode_time = 0; j < headers[video_track].sample_num; j++)
+	{
+	    if (samples[video_track][j].flags & SAMPLE_SYNC)
+	    {
+		offsets[sync_num] = (sync_num == 0) ? 0 : samples[video_track][j].offset;
+		times[sync_num] = (decode_time * 1000) / headers[video_track].timescale;
+		sync_num++;
+	    }
+
+	    decode_time += samples[video_track][j].duration;
+	}
+
+	free(*iframe_offset);
+	free(*iframe_time);
+	*iframe_offset = offsets;
+	*iframe_time = times;
+	*iframe_num = sync_num;
+    }
+    else
+    {
+	free(offsets);
+    }
+
+    for (i = 0; i < track_num; i++)
+    {
+	free(samples[i]);
+    }
+
+    return (file != NULL);
+}
@@ -0,0 +1,16 @@
+/* MP4 module.
+ * File: mp4.h
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * MP4 sample tables.
+ * */
+
+#ifndef CHOPPER_MP4_H
+#define CHOPPER_MP4_H
+
+/* ********** Public functions ********** */
+int
+save_sample_table		(char * filename, int64_t ** iframe_offset, int64_t ** iframe_time, int * iframe_num);
+
+#endif
@@ -0,0 +1,354 @@
+/* Transcode module.
+ * File: transcode.c
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Mezzanine files are encoded into a bitrate ladder: one FLV rendition
+ * for every rung, H.264 and AAC, with keyframes forced at the same
+ * times on all of them and no others, so the server switches between
+ * renditions on matching iframes. Encodes are run by an external
+ * encoder, several of them at once, and the video directory is indexed
+ * once all of them are done.
+ * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/sysinfo.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include "../server/common.h"
+#include "video.h"
+#include "transcode.h"
+
+/* ********** Constant definitions ********** */
+
+/* Highest number of rungs in a ladder. */
+#define MAX_RUNGS		8
+
+/* Renditions are named after their height, so no two rungs may have
+ * the same one.
+ * */
+#define RENDITION_NAME		"%dp.flv"
+
+/* Peak bitrate and buffer size, as a percentage of the bitrate of
+ * every rung.
+ * */
+#define MAXRATE_PERCENT		150
+#define BUFSIZE_PERCENT		200
+
+/* Every rendition carries the same audio. */
+#define AUDIO_CODEC		"aac"
+#define AUDIO_BITRATE		"128k"
+#define AUDIO_RATE		"44100"
+
+#define VIDEO_CODEC		"libx264"
+#define VIDEO_PRESET		"medium"
+
+/* Room for every encoder argument composed. */
+#define ARG_LEN			64
+
+/* ********** Type definitions ********** */
+
+/* A rung of the ladder, and the encoder process producing it, if it is
+ * running.
+ * */
+typedef
+struct _rung
+{
+    int height;
+    int bitrate;
+    char * filename;
+    pid_t pid;
+}
+Rung;
+
+/* ********** Private functions ********** */
+
+/* parse_ladder()
+ *
+ * Read a ladder, as comma separated "height:bitrate" pairs, skipping
+ * rungs taller than the mezzanine if its height is known. Every rung
+ * must have its own height.
+ * Returns the number of rungs found, or 0 if the ladder is not valid.
+ * */
+static
+int
+parse_ladder			(char * ladder, int source_height, Rung * rungs)
+{
+    char * copy, * rung, * saveptr;
+    int rung_num, height, bitrate, i;
+    Boolean valid;
+
+    if ((copy = strdup(ladder)) == NULL)
+    {
+	return (0);
+    }
+
+    rung_num = 0;
+    valid = TRUE;
+
+    for (rung = strtok_r(copy, ",", &saveptr); (rung != NULL) && valid; rung = strtok_r(NULL, ",", &saveptr))
+    {
+	if ((sscanf(rung, "%d:%d", &height, &bitrate) != 2) || (height <= 0) || (bitrate <= 0) ||
+	    (rung_num >= MAX_RUNGS))
+	{
+	    valid = FALSE;
+	    continue;
+	}
+
+	for (i = 0; (i < rung_num) && (rungs[i].height != height); i++);
+
+	if (i < rung_num)
+	{
+	    valid = FALSE;
+	}
+	else if ((source_height <= 0) || (height <= source_height))
+	{
+	    rungs[rung_num].height = height;
+	    rungs[rung_num].bitrate = bitrate;
+	    rungs[rung_num].filename = NULL;
+	    rungs[rung_num].pid = 0;
+	    rung_num++;
+	}
+    }
+
+    free(copy);
+    return (valid ? rung_num : 0);
+}
+
+/* get_source_height()
+ *
+ * Find the height of the video stream of a mezzanine file.
+ * Returns 0 if it is not known.
+ * */
+static
+int
+get_source_height		(char * input)
+{
+    AVFormatContext * format_ctx;
+    int i, height;
+
+    if ((av_open_input_file(&format_ctx, input, NULL, 0, NULL) != 0))
+    {
+	return (0);
+    }
+
+    height = 0;
+
+    if (av_find_stream_info(format_ctx) >= 0)
+    {
+	for (i = 0; (i < format_ctx->nb_streams) &&
+		 (format_ctx->streams[i]->codec->codec_type != CODEC_TYPE_VIDEO); i++);
+
+	if (i < format_ctx->nb_streams)
+	{
+	    height = format_ctx->streams[i]->codec->height;
+	}
+    }
+
+    av_close_input_file(format_ctx);
+    return (height);
+}
+
+/* start_encode()
+ *
+ * Start an encoder process for a rung. Keyframes are forced every
+ * 'keyint' seconds, and scene cuts do not add any other, so every
+ * rendition has the very same ones.
+ * Returns FALSE if the process cannot be started.
+ * */
+static
+Boolean
+start_encode			(char * encoder, char * input, Rung * rung, int keyint, int threads)
+{
+    char scale[ARG_LEN], bitrate[ARG_LEN], maxrate[ARG_LEN], bufsize[ARG_LEN], keyframes[ARG_LEN], thread_num[ARG_LEN];
+
+    char * argv[] = {encoder, "-nostdin", "-loglevel", "error", "-y", "-i", input,
+		     "-map", "0:v:0", "-map", "0:a:0?",
+		     "-c:v", VIDEO_CODEC, "-preset", VIDEO_PRESET, "-vf", scale,
+		     "-b:v", bitrate, "-maxrate", maxrate, "-bufsize", bufsize,
+		     "-force_key_frames", keyframes, "-sc_threshold", "0", "-threads", thread_num,
+		     "-c:a", AUDIO_CODEC, "-b:a", AUDIO_BITRATE, "-ar", AUDIO_RATE,
+		     "-f", "flv", rung->filename, NULL};
+
+    snprintf(scale, ARG_LEN, "scale=-2:%d", rung->height);
+    snprintf(bitrate, ARG_LEN, "%dk", rung->bitrate);
+    snprintf(maxrate, ARG_LEN, "%dk", (rung->bitrate * MAXRATE_PERCENT) / 100);
+    snprintf(bufsize, ARG_LEN, "%dk", (rung->bitrate * BUFSIZE_PERCENT) / 100);
+    snprintf(keyframes, ARG_LEN, "expr:gte(t,n_forced*%d)", keyint);
+    snprintf(thread_num, ARG_LEN, "%d", threads);
+
+    if ((rung->pid = fork()) < 0)
+    {
+	rung->pid = 0;
+	return (FALSE);
+    }
+
+    if (rung->pid == 0)
+    {
+	execvp(encoder, argv);
+	_exit(EXIT_FAILURE);
+    }
+
+    return (TRUE);
+}
+
+/* stop_encodes()
+ *
+ * Stop every encoder process still running among the first 'rung_num'
+ * rungs.
+ * */
+static
+void
+stop_encodes			(Rung * rungs, int rung_num)
+{
+    int i;
+
+    for (i = 0; i < rung_num; i++)
+    {
+	if (rungs[i].pid > 0)
+	{
+	    kill(rungs[i].pid, SIGTERM);
+	}
+    }
+}
+
+/* ********** Public functions ********** */
+
+/* transcode_video()
+ *
+ * Encode a mezzanine file, 'input', into the renditions of 'ladder'
+ * inside the video directory 'path', running up to 'jobs' encodes at
+ * once, or one for every processor if it is 0. Encoder threads are
+ * shared out among them.
+ * Once every rendition is encoded, the directory is indexed.
+ * */
+int
+transcode_video			(char * input, char * path, char * ladder, int keyint, int jobs, char * encoder)
+{
+    Rung rungs[MAX_RUNGS];
+    char input_dir[PATH_MAX], output_dir[PATH_MAX];
+    char * input_copy;
+    pid_t pid;
+    int rung_num, started, running, threads, status, i;
+    Boolean failed;
+
+    /* The mezzanine would be indexed along with its renditions. */
+    if (((input_copy = strdup(input)) == NULL) ||
+	(realpath(dirname(input_copy), input_dir) == NULL) || (realpath(path, output_dir) == NULL) ||
+	(strcmp(input_dir, output_dir) == 0))
+    {
+	fprintf(stderr, "The mezzanine file must exist, outside of %s\n", path);
+	free(input_copy);
+	return (FALSE);
+    }
+
+    free(input_copy);
+    av_register_all();
+
+    if ((keyint <= 0) || ((rung_num = parse_ladder(ladder, get_source_height(input), rungs)) == 0))
+    {
+	fprintf(stderr, "Invalid ladder: %s\n", ladder);
+	return (FALSE);
+    }
+
+    jobs = (jobs > 0) ? jobs : get_nprocs();
+    jobs = (jobs < rung_num) ? jobs : rung_num;
+    threads = (get_nprocs() / jobs > 0) ? (get_nprocs() / jobs) : 1;
+
+    printf("Transcoding %s into %d renditions, %d at once... ", input, rung_num, jobs);
+    fflush(stdout);
+
+    for (i = 0; i < rung_num; i++)
+    {
+	asprintf(&rungs[i].filename, "%s/" RENDITION_NAME, path, rungs[i].height);
+    }
+
+    /* Keep 'jobs' encodes running until every rung is started, and then
+     * wait for the rest.
+     * */
+    started = 0;
+    running = 0;
+    failed = FALSE;
+
+    while ((started < rung_num) || (running > 0))
+    {
+	if (!failed && (started < rung_num) && (running < jobs))
+	{
+	    if (start_encode(encoder, input, &rungs[started], keyint, threads))
+	    {
+		running++;
+		started++;
+	    }
+	    else
+	    {
+		fprintf(stderr, "Cannot start the encoder: %s\n", encoder);
+		failed = TRUE;
+
+		/* The ladder is useless without every rung. */
+		stop_encodes(rungs, started);
+	    }
+
+	    continue;
+	}
+
+	if (failed && (running == 0))
+	{
+	    break;
+	}
+
+	if ((pid = waitpid(-1, &status, 0)) < 0)
+	{
+	    break;
+	}
+
+	for (i = 0; (i < started) && (rungs[i].pid != pid); i++);
+
+	if (i < started)
+	{
+	    running--;
+	    rungs[i].pid = 0;
+
+	    if (!failed && (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)))
+	    {
+		fprintf(stderr, "\nCannot encode %s\n", rungs[i].filename);
+		failed = TRUE;
+		stop_encodes(rungs, started);
+	    }
+	}
+    }
+
+    /* Renditions of a failed ladder are not indexed, nor kept. Rungs never
+     * started may have files from an earlier run, left alone.
+     * */
+    for (i = 0; i < rung_num; i++)
+    {
+	if (failed && (i < started))
+	{
+	    unlink(rungs[i].filename);
+	}
+
+	free(rungs[i].filename);
+    }
+
+    if (failed)
+    {
+	return (FALSE);
+    }
+
+    printf("Done\n");
+    fflush(stdout);
+
+    return (load_videos(path));
+}
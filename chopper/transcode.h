@@ -0,0 +1,26 @@
+/* Transcode module.
+ * File: transcode.h
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Bitrate ladders encoded from a single mezzanine file.
+ * */
+
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+/* ********** Constant definitions ********** */
+
+/* Renditions encoded by default, as height and video bitrate (kbps)
+ * pairs, and seconds between keyframes. The server cuts segments at
+ * every keyframe, and expects one per second.
+ * */
+#define DEFAULT_LADDER		"1080:5000,720:2800,480:1400,360:800"
+#define DEFAULT_KEYINT		1
+#define DEFAULT_ENCODER		"ffmpeg"
+
+/* ********** Public functions ********** */
+int
+transcode_video			(char * input, char * path, char * ladder, int keyint, int jobs, char * encoder);
+
+#endif
@@ -16,9 +16,11 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <openssl/sha.h>
+#include <openssl/evp.h>
 
 #include "../server/common.h"
 #include "file.h"
+#include "mp4.h"
 #include "video.h"
 
 /* ********** Constant definitions ********** */
@@ -29,16 +31,61 @@
 #define OGV_EXT			".ogv"
 #define WEBM_EXT                ".webm"
 
+/* FLV layout.
+ * Files start with a header, and then every tag is followed by its
+ * size, in 4 bytes. Tags start with their type and body size, and the
+ * first two bytes of their body tell the codec and whether they hold
+ * its configuration.
+ * */
+#define FLV_SIGNATURE		"FLV"
+#define FLV_FILE_HEADER_LEN	9
+#define FLV_TAG_HEADER_LEN	11
+#define FLV_TAG_SIZE_LEN	4
+
+#define FLV_TAG_AUDIO		8
+#define FLV_TAG_VIDEO		9
+#define FLV_TAG_SCRIPT		18
+
+#define FLV_CODEC_AVC		7
+#define FLV_SOUND_AAC		10
+#define FLV_SEQUENCE_HEADER	0
+
+/* Tags read looking for the codec configuration. */
+#define FLV_SCAN_TAGS		64
+
+/* Keyframes of two renditions at most this many milliseconds apart are
+ * taken as the same one.
+ * */
+#define ALIGN_TOLERANCE		50
+
+/* Bytes read at once while hashing a file. */
+#define HASH_BUFFER_LEN		65536
+
 /* ********** Type definitions ********** */
 
 struct _stream
 {
 	char * filename;
 	int data_size;
+
+	/* SHA-1 of the file contents, in hex, or an empty string. Videos
+	 * listing the same file share it in the server memory.
+	 * */
+	char hash[SIGN_LEN + 1];
 	
-	/* Array with all the iframe offsets in the file. */
+	/* Array with all the iframe offsets in the file, and the time
+	 * they are decoded at, in milliseconds.
+	 * */
 	int64_t * iframe_offset;
+	int64_t * iframe_time;
 	int iframe_num;
+
+	/* File header and codec configuration, needed by players when
+	 * the stream is not sent from its first byte.
+	 * */
+	DataRange header;
+	DataRange config[MAX_CONFIG_RANGES];
+	int config_num;
 };
 
 typedef struct _stream Stream;
@@ -86,6 +133,162 @@ check_supported_ext			(const struct dirent * file)
     return (i < allowed_vlen);
 }
 
+/* get_file_hash()
+ * 
+ * Save the SHA-1 digest of the contents of 'filename', in hex, into
+ * 'hash', or an empty string if the file cannot be read.
+ * */
+void
+get_file_hash			(char * filename, char * hash)
+{
+    FILE * file;
+    EVP_MD_CTX * context;
+    unsigned char * buffer, digest[SHA_DIGEST_LENGTH];
+    size_t len;
+    int i;
+    Boolean valid;
+
+    hash[0] = '\0';
+
+    if ((file = fopen(filename, "r")) == NULL)
+    {
+	return;
+    }
+
+    if (((buffer = malloc(HASH_BUFFER_LEN)) == NULL) || ((context = EVP_MD_CTX_new()) == NULL))
+    {
+	free(buffer);
+	fclose(file);
+	return;
+    }
+
+    /* Rendition files may be large, so they are read in blocks. */
+    valid = (EVP_DigestInit_ex(context, EVP_sha1(), NULL) == 1);
+
+    while (valid && ((len = fread(buffer, 1, HASH_BUFFER_LEN, file)) > 0))
+    {
+	valid = (EVP_DigestUpdate(context, buffer, len) == 1);
+    }
+
+    if (valid && !ferror(file) && (EVP_DigestFinal_ex(context, digest, NULL) == 1))
+    {
+	for (i = 0; i < SHA_DIGEST_LENGTH; i++)
+	{
+	    sprintf(hash + i * 2, "%02x", digest[i]);
+	}
+    }
+
+    EVP_MD_CTX_free(context);
+    free(buffer);
+    fclose(file);
+}
+
+/* count_misaligned()
+ * 
+ * Count the iframes of 'stream' with no iframe of 'reference' at the
+ * same time. Both time arrays are sorted, so they are walked at once.
+ * */
+int
+count_misaligned		(Stream * stream, Stream * reference)
+{
+    int i, j, misaligned;
+
+    misaligned = 0;
+
+    for (i = 0, j = 0; i < stream->iframe_num; i++)
+    {
+	while ((j < reference->iframe_num) &&
+	       (reference->iframe_time[j] < stream->iframe_time[i] - ALIGN_TOLERANCE))
+	{
+	    j++;
+	}
+
+	if ((j >= reference->iframe_num) ||
+	    (reference->iframe_time[j] > stream->iframe_time[i] + ALIGN_TOLERANCE))
+	{
+	    misaligned++;
+	}
+    }
+
+    return (misaligned);
+}
+
+/* find_flv_headers()
+ * 
+ * Find the header of a FLV file, along with its metadata, and the tags
+ * holding the AVC and AAC configuration, which come before the first
+ * video frame.
+ * */
+void
+find_flv_headers		(char * filename, Stream * stream)
+{
+    FILE * file;
+    unsigned char tag[FLV_TAG_HEADER_LEN + 2];
+    int64_t pos, tag_len;
+    int type, i;
+    Boolean header_done;
+
+    stream->header.offset = 0;
+    stream->header.len = 0;
+    stream->config_num = 0;
+
+    if ((file = fopen(filename, "r")) == NULL)
+    {
+	return;
+    }
+
+    if ((fread(tag, 1, FLV_FILE_HEADER_LEN, file) != FLV_FILE_HEADER_LEN) ||
+	(memcmp(tag, FLV_SIGNATURE, strlen(FLV_SIGNATURE)) != 0))
+    {
+	fclose(file);
+	return;
+    }
+
+    pos = ((int64_t)tag[5] << 24) | (tag[6] << 16) | (tag[7] << 8) | tag[8];
+    pos += FLV_TAG_SIZE_LEN;
+    stream->header.len = pos;
+    header_done = FALSE;
+
+    for (i = 0; (i < FLV_SCAN_TAGS) && (fseeko(file, pos, SEEK_SET) == 0) &&
+	     (fread(tag, 1, sizeof(tag), file) == sizeof(tag)); i++)
+    {
+	type = tag[0] & 0x1f;
+	tag_len = FLV_TAG_HEADER_LEN + ((tag[1] << 16) | (tag[2] << 8) | tag[3]) + FLV_TAG_SIZE_LEN;
+
+	if (type == FLV_TAG_SCRIPT)
+	{
+	    /* Metadata goes along with the header. */
+	    if (!header_done)
+	    {
+		stream->header.len = pos + tag_len;
+	    }
+	}
+	else
+	{
+	    header_done = TRUE;
+
+	    if (((type == FLV_TAG_VIDEO) && ((tag[11] & 0x0f) == FLV_CODEC_AVC) && (tag[12] == FLV_SEQUENCE_HEADER)) ||
+		((type == FLV_TAG_AUDIO) && ((tag[11] >> 4) == FLV_SOUND_AAC) && (tag[12] == FLV_SEQUENCE_HEADER)))
+	    {
+		if (stream->config_num < MAX_CONFIG_RANGES)
+		{
+		    stream->config[stream->config_num].offset = pos;
+		    stream->config[stream->config_num].len = tag_len;
+		    stream->config_num++;
+		}
+	    }
+	    else if (type == FLV_TAG_VIDEO)
+	    {
+		break;
+	    }
+	}
+
+	pos += tag_len;
+    }
+
+    fclose(file);
+}
+
 /* load_stream()
  * 
  * Return a 'Stream' structure using avcodec tools.
@@ -95,7 +298,8 @@ load_stream			(char * filename)
 {
     int stream_index, full_frame;
     Stream * res;
-    int64_t prev_offset;
+    int64_t prev_offset, pkt_time;
+    AVRational time_base, msec_base = {1, 1000};
 	
     /* AVCodec related types. */
     AVFormatContext * format_ctx;
@@ -142,8 +346,11 @@ load_stream			(char * filename)
 	frame = avcodec_alloc_frame();
 	res = malloc(sizeof(Stream));
 	res->iframe_offset = malloc((format_ctx->duration / AV_TIME_BASE) * sizeof(int64_t) * 4);
+	res->iframe_time = malloc((format_ctx->duration / AV_TIME_BASE) * sizeof(int64_t) * 4);
 	res->iframe_num = 0;
 	prev_offset = 0;
+	pkt_time = 0;
+	time_base = format_ctx->streams[stream_index]->time_base;
 		
 	/* Read a raw packet from the container. */
 	while (av_read_frame(format_ctx, &pkt) == 0)
@@ -153,6 +360,11 @@ load_stream			(char * filename)
 	     * */
 	    if (pkt.stream_index == stream_index)
 	    {	
+		if (pkt.dts != AV_NOPTS_VALUE)
+		{
+		    pkt_time = av_rescale_q(pkt.dts, time_base, msec_base);
+		}
+
 		if (avcodec_decode_video(codec_ctx, frame, &full_frame, pkt.data, pkt.size) <= 0)
 		{
 		    avcodec_close(codec_ctx);
@@ -173,6 +385,7 @@ load_stream			(char * filename)
 		if (full_frame && (frame->pict_type == FF_I_TYPE))
 		{
 		    res->iframe_offset[res->iframe_num] = prev_offset;
+		    res->iframe_time[res->iframe_num] = pkt_time;
 		    res->iframe_num++;
 		}
 	    }
@@ -182,6 +395,28 @@ load_stream			(char * filename)
 
 	res->data_size = get_file_size(filename);
 	res->filename = get_last_substr(filename, '/');
+	get_file_hash(filename, res->hash);
+
+	/* Only FLV headers are spliced by the server. */
+	if (strstr(res->filename, FLV_EXT) != NULL)
+	{
+	    find_flv_headers(filename, res);
+	}
+	else
+	{
+	    res->header.len = 0;
+	    res->config_num = 0;
+	}
+
+	/* Progressive MP4 files are sent from a rewritten 'moov' atom, so
+	 * their keyframes are those of its sample table.
+	 * */
+	if (((strstr(res->filename, MP4_EXT) != NULL) || (strstr(res->filename, M4V_EXT) != NULL) ||
+	     (strstr(res->filename, MOV_EXT) != NULL)) &&
+	    !save_sample_table(filename, &res->iframe_offset, &res->iframe_time, &res->iframe_num))
+	{
+	    fprintf(stderr, "No MP4 sample table: %s\n", filename);
+	}
 		
 	/* Deallocate memory. */
 	avcodec_close(codec_ctx);
@@ -207,7 +442,7 @@ load_videos			(char * path)
 {
     Stream ** streams;
     struct dirent ** video_files;
-    int i, total_size, num_entries, base_len;
+    int i, total_size, num_entries, base_len, misaligned;
     char * filename, * base, * char_sign;
     unsigned char * uchar_sign;
     const time_t timer = time(NULL);
@@ -267,12 +502,28 @@ load_videos			(char * path)
 	qsort(streams, num_entries, sizeof(Stream *), compare_stream_size);
     }
 
+    /* Renditions are switched on keyframes shown at the same time, so
+     * those missing from any other rendition make players wait for the
+     * next one, or show some frames again.
+     * */
+    for (i = 1; i < num_entries; i++)
+    {
+	if ((misaligned = count_misaligned(streams[i], streams[0]) + count_misaligned(streams[0], streams[i])) > 0)
+	{
+	    fprintf(stderr, "\nKeyframes not aligned: %d between %s and %s\n", misaligned,
+		    streams[0]->filename, streams[i]->filename);
+	}
+    }
+
     /* Write results to a file, with this format:
      * - Number of files (streams).
      * - Information about that files:
      *   - File name.
      *   - Number of iframes.
      *   - Iframe offset array.
+     *   - Header and codec configuration ranges, if any.
+     *   - Iframe times.
+     *   - File hash.
      * */
     if (!save_common_info(path, char_sign, num_entries))
     {
@@ -283,7 +534,9 @@ load_videos			(char * path)
 	
     for (i = 0; i < num_entries; i++)
     {
-	if (!save_stream_info(path, streams[i]->filename, streams[i]->iframe_offset, streams[i]->iframe_num))
+	if (!save_stream_info(path, streams[i]->filename, streams[i]->iframe_offset, streams[i]->iframe_time,
+			      streams[i]->iframe_num, &streams[i]->header, streams[i]->config, streams[i]->config_num,
+			      streams[i]->hash))
 	{
 	    free(streams[i]);
 	    return (FALSE);
@@ -0,0 +1,159 @@
+/* Arena module.
+ * File: arena.c
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Bump allocator for request lifetime data.
+ * Every connection owns an arena, and anything allocated while a request
+ * is being served is taken from it. Nothing is freed on its own: the
+ * whole arena is reset at once when the request is done.
+ * Functions taking an arena also accept NULL, and then use malloc(), so
+ * the caller should free the memory returned.
+ * */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+
+#include "common.h"
+#include "arena.h"
+
+/* ********** Private functions ********** */
+
+/* new_block()
+ *
+ * */
+static
+ArenaBlock *
+new_block			(size_t size)
+{
+    ArenaBlock * block;
+
+    if ((block = malloc(sizeof(ArenaBlock) + size)) == NULL)
+    {
+	LOG(ERROR, EMSG_ARENAALLOC, NULL);
+	return (NULL);
+    }
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    return (block);
+}
+
+/* ********** Public functions ********** */
+
+/* init_arena()
+ *
+ * Initialize an arena, allocating its first block.
+ * */
+int
+init_arena			(Arena * arena, size_t block_size)
+{
+    arena->block_size = block_size;
+
+    if ((arena->first = arena->cur = new_block(block_size)) == NULL)
+    {
+	return (ECOD_ARENAALLOC);
+    }
+
+    return (EXIT_SUCCESS);
+}
+
+/* reset_arena()
+ *
+ * Release everything allocated from an arena, keeping its first block.
+ * */
+void
+reset_arena			(Arena * arena)
+{
+    ArenaBlock * block, * next;
+
+    for (block = arena->first->next; block != NULL; block = next)
+    {
+	next = block->next;
+	free(block);
+    }
+
+    arena->first->next = NULL;
+    arena->first->used = 0;
+    arena->cur = arena->first;
+}
+
+/* free_arena()
+ *
+ * */
+void
+free_arena			(Arena * arena)
+{
+    reset_arena(arena);
+    free(arena->first);
+    arena->first = arena->cur = NULL;
+}
+
+/* arena_alloc()
+ *
+ * Returns 'size' bytes of memory, aligned to ARENA_ALIGN bytes.
+ * */
+void *
+arena_alloc			(Arena * arena, size_t size)
+{
+    ArenaBlock * block;
+    size_t offset;
+
+    if (arena == NULL)
+    {
+	return (malloc(size));
+    }
+
+    offset = (arena->cur->used + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+
+    if ((offset + size) > arena->cur->size)
+    {
+	if ((block = new_block((size > arena->block_size) ? size : arena->block_size)) == NULL)
+	{
+	    return (NULL);
+	}
+
+	arena->cur->next = block;
+	arena->cur = block;
+	offset = 0;
+    }
+
+    arena->cur->used = offset + size;
+    return (arena->cur->data + offset);
+}
+
+/* arena_printf()
+ *
+ * Same as asprintf(), but the string is allocated from 'arena'. Its
+ * length is saved into 'len', if it is not NULL.
+ * */
+char *
+arena_printf			(Arena * arena, int * len, const char * format, ...)
+{
+    va_list args;
+    char * res;
+    int size;
+
+    va_start(args, format);
+    size = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if ((size < 0) || ((res = arena_alloc(arena, size + 1)) == NULL))
+    {
+	return (NULL);
+    }
+
+    va_start(args, format);
+    vsnprintf(res, size + 1, format, args);
+    va_end(args);
+
+    if (len != NULL)
+    {
+	*len = size;
+    }
+
+    return (res);
+}
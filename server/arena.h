@@ -0,0 +1,68 @@
+/* Arena module.
+ * File: arena.h
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Bump allocator for request lifetime data.
+ * */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdarg.h>
+
+/* ********** Constant definitions ********** */
+
+/* Default block size, in bytes. Bigger allocations get a block of
+ * their own.
+ * */
+#define ARENA_BLOCK_SIZE	16384
+
+/* Alignment of every allocation. */
+#define ARENA_ALIGN		16
+
+/* ********** Type definitions ********** */
+
+/* Memory blocks are chained, and only the first one is kept when the
+ * arena is reset. Allocations are aligned by their offset into 'data',
+ * so 'data' itself is aligned to ARENA_ALIGN bytes, as malloc() aligns
+ * the block.
+ * */
+typedef
+struct _arena_block
+{
+    struct _arena_block * next;
+    size_t size;
+    size_t used;
+    char data[] __attribute__ ((aligned(ARENA_ALIGN)));
+}
+ArenaBlock;
+
+typedef
+struct _arena
+{
+    ArenaBlock * first;
+    ArenaBlock * cur;
+    size_t block_size;
+}
+Arena;
+
+/* ********** Public functions ********** */
+int
+init_arena			(Arena * arena, size_t block_size);
+
+void
+reset_arena			(Arena * arena);
+
+void
+free_arena			(Arena * arena);
+
+void *
+arena_alloc			(Arena * arena, size_t size);
+
+char *
+arena_printf			(Arena * arena, int * len, const char * format, ...)
+    __attribute__ ((format (printf, 3, 4)));
+
+#endif
@@ -0,0 +1,1946 @@
+/* CMAF module.
+ * File: cmaf.c
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Renditions are also served as fragmented MP4 segments, one for every
+ * keyframe interval in their index, along with HLS and DASH manifests
+ * describing them, so standard players can play them and any cache on
+ * the way can keep them.
+ * Segments are remuxed from the rendition data, without re-encoding
+ * anything: MP4 renditions through the sample table saved by chopper,
+ * and FLV renditions through their tags, which must carry H.264 video
+ * and, optionally, AAC audio.
+ * Every object served never changes, so they are kept in a cache bounded
+ * in size, from which the least recently used ones are dropped.
+ * */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "mp4.h"
+#include "cmaf.h"
+
+/* ********** Constant definitions ********** */
+#define ATOM_HEADER_LEN		8
+#define ATOM_LARGE_LEN		16
+
+#define ATOM_TYPE(a, b, c, d)	(((uint32_t)(a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+#define ATOM_FTYP		ATOM_TYPE('f', 't', 'y', 'p')
+#define ATOM_MOOV		ATOM_TYPE('m', 'o', 'o', 'v')
+#define ATOM_MVHD		ATOM_TYPE('m', 'v', 'h', 'd')
+#define ATOM_TRAK		ATOM_TYPE('t', 'r', 'a', 'k')
+#define ATOM_TKHD		ATOM_TYPE('t', 'k', 'h', 'd')
+#define ATOM_MDIA		ATOM_TYPE('m', 'd', 'i', 'a')
+#define ATOM_MDHD		ATOM_TYPE('m', 'd', 'h', 'd')
+#define ATOM_HDLR		ATOM_TYPE('h', 'd', 'l', 'r')
+#define ATOM_MINF		ATOM_TYPE('m', 'i', 'n', 'f')
+#define ATOM_VMHD		ATOM_TYPE('v', 'm', 'h', 'd')
+#define ATOM_SMHD		ATOM_TYPE('s', 'm', 'h', 'd')
+#define ATOM_DINF		ATOM_TYPE('d', 'i', 'n', 'f')
+#define ATOM_DREF		ATOM_TYPE('d', 'r', 'e', 'f')
+#define ATOM_URL		ATOM_TYPE('u', 'r', 'l', ' ')
+#define ATOM_STBL		ATOM_TYPE('s', 't', 'b', 'l')
+#define ATOM_STSD		ATOM_TYPE('s', 't', 's', 'd')
+#define ATOM_STTS		ATOM_TYPE('s', 't', 't', 's')
+#define ATOM_STSC		ATOM_TYPE('s', 't', 's', 'c')
+#define ATOM_STSZ		ATOM_TYPE('s', 't', 's', 'z')
+#define ATOM_STCO		ATOM_TYPE('s', 't', 'c', 'o')
+#define ATOM_MVEX		ATOM_TYPE('m', 'v', 'e', 'x')
+#define ATOM_TREX		ATOM_TYPE('t', 'r', 'e', 'x')
+#define ATOM_MOOF		ATOM_TYPE('m', 'o', 'o', 'f')
+#define ATOM_MFHD		ATOM_TYPE('m', 'f', 'h', 'd')
+#define ATOM_TRAF		ATOM_TYPE('t', 'r', 'a', 'f')
+#define ATOM_TFHD		ATOM_TYPE('t', 'f', 'h', 'd')
+#define ATOM_TFDT		ATOM_TYPE('t', 'f', 'd', 't')
+#define ATOM_TRUN		ATOM_TYPE('t', 'r', 'u', 'n')
+#define ATOM_MDAT		ATOM_TYPE('m', 'd', 'a', 't')
+#define ATOM_AVC1		ATOM_TYPE('a', 'v', 'c', '1')
+#define ATOM_AVC3		ATOM_TYPE('a', 'v', 'c', '3')
+#define ATOM_AVCC		ATOM_TYPE('a', 'v', 'c', 'C')
+#define ATOM_MP4A		ATOM_TYPE('m', 'p', '4', 'a')
+#define ATOM_ESDS		ATOM_TYPE('e', 's', 'd', 's')
+
+#define BRAND_ISO6		ATOM_TYPE('i', 's', 'o', '6')
+#define BRAND_MP41		ATOM_TYPE('m', 'p', '4', '1')
+#define HANDLER_SOUND		ATOM_TYPE('s', 'o', 'u', 'n')
+
+/* Length of the fields before the child atoms of visual and audio
+ * sample entries.
+ * */
+#define VISUAL_ENTRY_LEN	78
+#define AUDIO_ENTRY_LEN		28
+
+/* Fragment flags.
+ *  - Fragments are relative to their 'moof' atom.
+ *  - Every sample has its own duration, size and flags, and composition
+ *    offset if any of them has one.
+ *  - Sync samples depend on no other one.
+ * */
+#define TFHD_BASE_IS_MOOF	0x020000
+#define TRUN_DATA_OFFSET	0x000001
+#define TRUN_SAMPLE_DURATION	0x000100
+#define TRUN_SAMPLE_SIZE	0x000200
+#define TRUN_SAMPLE_FLAGS	0x000400
+#define TRUN_SAMPLE_CTO		0x000800
+#define SYNC_SAMPLE_FLAGS	0x02000000
+#define NON_SYNC_SAMPLE_FLAGS	0x01010000
+
+/* Room for the atoms of a fragment: a fixed part, a part for every
+ * track, and the most every sample may take.
+ * */
+#define FRAGMENT_FIXED_LEN	64
+#define FRAGMENT_TRACK_LEN	80
+#define FRAGMENT_SAMPLE_LEN	16
+
+/* Room for the initialization segment of FLV renditions, not counting
+ * their codec configuration.
+ * */
+#define FLV_INIT_LEN		2048
+
+/* FLV tags. */
+#define FLV_SIGNATURE		"FLV"
+#define FLV_MIN_HEADER_LEN	9
+#define FLV_TAG_HEADER_LEN	11
+#define FLV_PREV_SIZE_LEN	4
+#define FLV_TAG_AUDIO		8
+#define FLV_TAG_VIDEO		9
+#define FLV_CODEC_AVC		7
+#define FLV_SOUND_AAC		10
+#define FLV_KEYFRAME		1
+#define FLV_TIMESCALE		1000
+
+/* AVC and AAC packets: their type, and the length of their header. */
+#define PACKET_CONFIG		0
+#define PACKET_DATA		1
+#define AVC_PACKET_LEN		5
+#define AAC_PACKET_LEN		2
+
+/* Samples in every AAC frame. */
+#define AAC_FRAME_LEN		1024
+
+/* Longest AAC configuration written in a single byte descriptor. */
+#define MAX_AAC_CONFIG_LEN	64
+
+/* Room for an H.264 sequence parameter set, without emulation
+ * prevention bytes.
+ * */
+#define MAX_SPS_LEN		512
+
+/* Object type and stream type of AAC audio, as written in 'esds'. */
+#define ESDS_AUDIO_AAC		0x40
+#define ESDS_AUDIO_STREAM	0x15
+
+/* Manifests. */
+#define CMAF_REQUEST		"cmaf"
+#define HLS_VERSION		7
+#define MIN_BUFFER_TIME		2
+#define TEXT_INIT_SIZE		4096
+#define SEGMENT_TYPE		"video/mp4"
+
+/* Segment cache. */
+#define CMAF_BUCKETS		1024
+#define MEGABYTE		1048576
+
+/* Sampling frequencies of AAC, by their index. */
+static const
+uint32_t aac_rates [] = {96000, 88200, 64000, 48000, 44100, 32000, 24000,
+			 22050, 16000, 12000, 11025, 8000, 7350};
+
+static const
+int aac_rates_vlen = 13;
+
+/* H.264 profiles with chroma format information in their sequence
+ * parameter sets.
+ * */
+static const
+int high_profiles [] = {100, 110, 122, 244, 44, 83, 86, 118, 128, 138, 139, 134, 135};
+
+static const
+int high_profiles_vlen = 13;
+
+/* ********** Type definitions ********** */
+
+/* Codec configuration found in FLV renditions. */
+typedef
+struct _flv_config
+{
+    const uint8_t * avc;
+    int64_t avc_len;
+    const uint8_t * aac;
+    int64_t aac_len;
+    uint32_t sample_rate;
+    int channels;
+}
+FlvConfig;
+
+/* Reader of bit fields. */
+typedef
+struct _bit_reader
+{
+    const uint8_t * buf;
+    int64_t len;
+    int64_t pos;
+}
+BitReader;
+
+/* Text being composed, and the room allocated for it. */
+typedef
+struct _text
+{
+    char * buf;
+    int64_t len;
+    int64_t size;
+}
+Text;
+
+/* ********** Global variables ********** */
+
+/* Segment cache: objects hashed by key, and a list from the most
+ * recently used one to the least. 'cache_used' is the size of every
+ * object cached, which may not go over 'cache_size'.
+ * */
+CmafObject * objects[CMAF_BUCKETS];
+CmafObject * newest_object = NULL;
+CmafObject * oldest_object = NULL;
+int64_t cache_used = 0;
+int64_t cache_size = 0;
+pthread_mutex_t cmaf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* ********** Private functions ********** */
+
+/* get_be16()
+ *
+ * */
+static
+uint32_t
+get_be16			(const uint8_t * buf)
+{
+    return ((buf[0] << 8) | buf[1]);
+}
+
+/* get_be24()
+ *
+ * */
+static
+uint32_t
+get_be24			(const uint8_t * buf)
+{
+    return ((buf[0] << 16) | (buf[1] << 8) | buf[2]);
+}
+
+/* get_be32()
+ *
+ * */
+static
+uint32_t
+get_be32			(const uint8_t * buf)
+{
+    return (((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3]);
+}
+
+/* put_byte()
+ *
+ * */
+static
+void
+put_byte			(AtomWriter * out, uint8_t value)
+{
+    out->buf[out->pos++] = value;
+}
+
+/* put_be16()
+ *
+ * */
+static
+void
+put_be16			(AtomWriter * out, uint16_t value)
+{
+    put_byte(out, value >> 8);
+    put_byte(out, value);
+}
+
+/* put_data()
+ *
+ * */
+static
+void
+put_data			(AtomWriter * out, const void * data, int64_t len)
+{
+    memcpy(out->buf + out->pos, data, len);
+    out->pos += len;
+}
+
+/* put_zeros()
+ *
+ * */
+static
+void
+put_zeros			(AtomWriter * out, int64_t len)
+{
+    memset(out->buf + out->pos, 0, len);
+    out->pos += len;
+}
+
+/* rescale()
+ *
+ * Convert 'value' from timescale 'from' to timescale 'to'.
+ * */
+static
+int64_t
+rescale				(int64_t value, uint32_t from, uint32_t to)
+{
+    return ((from == 0) ? 0 : (int64_t)(((long double)value * to) / from));
+}
+
+/* find_atom()
+ *
+ * Find the first atom of type 'type' among the 'len' bytes from 'buf'.
+ * Returns its contents, and their length in 'atom_len', or NULL if it
+ * is not found.
+ * */
+static
+const uint8_t *
+find_atom			(const uint8_t * buf, int64_t len, uint32_t type, int64_t * atom_len)
+{
+    uint32_t cur_type;
+    int64_t size;
+    int header_len;
+
+    while ((header_len = parse_atom(buf, len, &cur_type, &size)) != 0)
+    {
+	if (cur_type == type)
+	{
+	    *atom_len = size - header_len;
+	    return (buf + header_len);
+	}
+
+	buf += size;
+	len -= size;
+    }
+
+    return (NULL);
+}
+
+/* read_bits()
+ *
+ * Read 'num' bits, 32 at most. Bits past the end are read as zeros.
+ * */
+static
+uint32_t
+read_bits			(BitReader * reader, int num)
+{
+    uint32_t value;
+
+    for (value = 0; num > 0; num--, reader->pos++)
+    {
+	value <<= 1;
+
+	if ((reader->pos >> 3) < reader->len)
+	{
+	    value |= (reader->buf[reader->pos >> 3] >> (7 - (reader->pos & 7))) & 1;
+	}
+    }
+
+    return (value);
+}
+
+/* read_ue()
+ *
+ * Read an unsigned Exp-Golomb code.
+ * */
+static
+uint32_t
+read_ue				(BitReader * reader)
+{
+    int zeros;
+
+    for (zeros = 0; (zeros < 32) && (read_bits(reader, 1) == 0); zeros++);
+
+    return ((zeros >= 32) ? 0 : (((1U << zeros) - 1) + read_bits(reader, zeros)));
+}
+
+/* read_se()
+ *
+ * Read a signed Exp-Golomb code.
+ * */
+static
+int32_t
+read_se				(BitReader * reader)
+{
+    uint32_t value;
+
+    value = read_ue(reader);
+    return ((value & 1) ? (int32_t)((value + 1) / 2) : -(int32_t)(value / 2));
+}
+
+/* parse_sps()
+ *
+ * Find the picture size in the first sequence parameter set of an AVC
+ * decoder configuration record.
+ * Returns FALSE if there is none.
+ * */
+static
+Boolean
+parse_sps			(const uint8_t * avcc, int64_t avcc_len, int * width, int * height)
+{
+    BitReader reader;
+    uint8_t sps[MAX_SPS_LEN];
+    int64_t nal_len, i;
+    uint32_t profile, chroma_format, poc_type, frame_mbs_only, width_mbs, height_mbs;
+    uint32_t crop_left, crop_right, crop_top, crop_bottom, crop_x, crop_y, num, last_scale, next_scale;
+    int j, k, list_num;
+
+    if ((avcc_len < 8) || ((avcc[5] & 0x1f) == 0) ||
+	((nal_len = get_be16(avcc + 6)) < 4) || ((8 + nal_len) > avcc_len))
+    {
+	return (FALSE);
+    }
+
+    /* Drop emulation prevention bytes, and the NAL unit header. */
+    for (i = 1, reader.len = 0; (i < nal_len) && (reader.len < MAX_SPS_LEN); i++)
+    {
+	if ((i >= 3) && (avcc[8 + i] == 3) && (avcc[8 + i - 1] == 0) && (avcc[8 + i - 2] == 0))
+	{
+	    continue;
+	}
+
+	sps[reader.len++] = avcc[8 + i];
+    }
+
+    reader.buf = sps;
+    reader.pos = 0;
+
+    profile = read_bits(&reader, 8);
+    read_bits(&reader, 16);
+    read_ue(&reader);
+    chroma_format = 1;
+
+    for (j = 0; (j < high_profiles_vlen) && (high_profiles[j] != (int)profile); j++);
+
+    if (j < high_profiles_vlen)
+    {
+	if ((chroma_format = read_ue(&reader)) == 3)
+	{
+	    read_bits(&reader, 1);
+	}
+
+	read_ue(&reader);
+	read_ue(&reader);
+	read_bits(&reader, 1);
+
+	/* Scaling lists are skipped. */
+	if (read_bits(&reader, 1))
+	{
+	    list_num = (chroma_format == 3) ? 12 : 8;
+
+	    for (j = 0; j < list_num; j++)
+	    {
+		if (read_bits(&reader, 1))
+		{
+		    for (k = 0, last_scale = 8, next_scale = 8; k < ((j < 6) ? 16 : 64); k++)
+		    {
+			if (next_scale != 0)
+			{
+			    next_scale = (last_scale + read_se(&reader) + 256) % 256;
+			}
+
+			last_scale = (next_scale == 0) ? last_scale : next_scale;
+		    }
+		}
+	    }
+	}
+    }
+
+    read_ue(&reader);
+
+    if ((poc_type = read_ue(&reader)) == 0)
+    {
+	read_ue(&reader);
+    }
+    else if (poc_type == 1)
+    {
+	read_bits(&reader, 1);
+	read_se(&reader);
+	read_se(&reader);
+
+	for (num = read_ue(&reader); (num > 0) && ((reader.pos >> 3) < reader.len); num--)
+	{
+	    read_se(&reader);
+	}
+    }
+
+    read_ue(&reader);
+    read_bits(&reader, 1);
+    width_mbs = read_ue(&reader) + 1;
+    height_mbs = read_ue(&reader) + 1;
+
+    if (!(frame_mbs_only = read_bits(&reader, 1)))
+    {
+	read_bits(&reader, 1);
+    }
+
+    read_bits(&reader, 1);
+    crop_left = crop_right = crop_top = crop_bottom = 0;
+
+    if (read_bits(&reader, 1))
+    {
+	crop_left = read_ue(&reader);
+	crop_right = read_ue(&reader);
+	crop_top = read_ue(&reader);
+	crop_bottom = read_ue(&reader);
+    }
+
+    /* Cropping is counted in chroma samples. */
+    crop_x = ((chroma_format == 0) || (chroma_format == 3)) ? 1 : 2;
+    crop_y = ((chroma_format == 1) ? 2 : 1) * (2 - frame_mbs_only);
+
+    *width = (width_mbs * 16) - (crop_x * (crop_left + crop_right));
+    *height = ((2 - frame_mbs_only) * height_mbs * 16) - (crop_y * (crop_top + crop_bottom));
+
+    return ((*width > 0) && (*height > 0) && ((reader.pos >> 3) <= reader.len));
+}
+
+/* parse_aac_config()
+ *
+ * Find the sampling frequency and the channels of an AAC audio specific
+ * configuration.
+ * Returns FALSE if it is not valid.
+ * */
+static
+Boolean
+parse_aac_config		(FlvConfig * config)
+{
+    uint32_t rate_index;
+
+    if ((config->aac_len < 2) || (config->aac_len > MAX_AAC_CONFIG_LEN))
+    {
+	return (FALSE);
+    }
+
+    rate_index = ((config->aac[0] & 0x07) << 1) | (config->aac[1] >> 7);
+    config->channels = (config->aac[1] >> 3) & 0x0f;
+
+    if (rate_index < (uint32_t)aac_rates_vlen)
+    {
+	config->sample_rate = aac_rates[rate_index];
+    }
+    else if ((rate_index == 15) && (config->aac_len >= 5))
+    {
+	config->sample_rate = ((config->aac[1] & 0x7f) << 17) | (config->aac[2] << 9) | (config->aac[3] << 1) | (config->aac[4] >> 7);
+    }
+    else
+    {
+	return (FALSE);
+    }
+
+    return ((config->sample_rate > 0) && (config->channels > 0));
+}
+
+/* load_flv_tracks()
+ *
+ * Find the samples of an FLV rendition, 'data_size' bytes from 'data',
+ * and the configuration of its codecs. The file is read twice: first to
+ * count the samples, so they fit in a single allocation, and then to
+ * fill them.
+ * Video samples are decoded at the time of their tag, in milliseconds,
+ * and audio samples one frame after the other, since the time of the
+ * first one.
+ * Returns FALSE if it has no H.264 video, or any other codec.
+ * */
+static
+Boolean
+load_flv_tracks			(CmafIndex * index, const uint8_t * data, int64_t data_size, FlvConfig * config)
+{
+    CmafTrack * video, * audio;
+    const uint8_t * tag, * payload;
+    int64_t pos, payload_len, first_time[2], base_time;
+    uint32_t video_num, audio_num, time, prev_time;
+    int pass;
+    Boolean video_found, audio_found;
+
+    if ((data_size < FLV_MIN_HEADER_LEN) || (memcmp(data, FLV_SIGNATURE, strlen(FLV_SIGNATURE)) != 0))
+    {
+	return (FALSE);
+    }
+
+    memset(config, 0, sizeof(FlvConfig));
+    video = &index->tracks[0];
+    audio = &index->tracks[1];
+    prev_time = 0;
+
+    for (pass = 0; pass < 2; pass++)
+    {
+	video_num = 0;
+	audio_num = 0;
+	video_found = FALSE;
+	audio_found = FALSE;
+
+	for (pos = get_be32(data + 5) + FLV_PREV_SIZE_LEN; (pos + FLV_TAG_HEADER_LEN) <= data_size;
+	     pos += FLV_TAG_HEADER_LEN + payload_len + FLV_PREV_SIZE_LEN)
+	{
+	    tag = data + pos;
+	    payload = tag + FLV_TAG_HEADER_LEN;
+	    payload_len = get_be24(tag + 1);
+	    time = get_be24(tag + 4) | ((uint32_t)tag[7] << 24);
+
+	    if ((pos + FLV_TAG_HEADER_LEN + payload_len) > data_size)
+	    {
+		break;
+	    }
+
+	    if ((tag[0] == FLV_TAG_VIDEO) && (payload_len >= AVC_PACKET_LEN))
+	    {
+		if ((payload[0] & 0x0f) != FLV_CODEC_AVC)
+		{
+		    return (FALSE);
+		}
+
+		if ((payload[1] == PACKET_CONFIG) && (config->avc == NULL))
+		{
+		    config->avc = payload + AVC_PACKET_LEN;
+		    config->avc_len = payload_len - AVC_PACKET_LEN;
+		}
+		else if (payload[1] == PACKET_DATA)
+		{
+		    if (pass == 1)
+		    {
+			/* Each duration is known once the next sample is found. */
+			if (video_num > 0)
+			{
+			    video->samples[video_num - 1].duration = (time > prev_time) ? (time - prev_time) : 0;
+			}
+
+			video->samples[video_num].offset = pos + FLV_TAG_HEADER_LEN + AVC_PACKET_LEN;
+			video->samples[video_num].size = payload_len - AVC_PACKET_LEN;
+			video->samples[video_num].duration = (video_num > 0) ? video->samples[video_num - 1].duration : 0;
+			video->samples[video_num].cto = ((int32_t)(get_be24(payload + 2) << 8)) >> 8;
+			video->samples[video_num].flags = ((payload[0] >> 4) == FLV_KEYFRAME) ? SAMPLE_SYNC : 0;
+			prev_time = time;
+		    }
+
+		    if (!video_found)
+		    {
+			first_time[0] = time;
+			video_found = TRUE;
+		    }
+
+		    video_num++;
+		}
+	    }
+	    else if ((tag[0] == FLV_TAG_AUDIO) && (payload_len >= AAC_PACKET_LEN))
+	    {
+		if ((payload[0] >> 4) != FLV_SOUND_AAC)
+		{
+		    return (FALSE);
+		}
+
+		if ((payload[1] == PACKET_CONFIG) && (config->aac == NULL))
+		{
+		    config->aac = payload + AAC_PACKET_LEN;
+		    config->aac_len = payload_len - AAC_PACKET_LEN;
+		}
+		else if (payload[1] == PACKET_DATA)
+		{
+		    if (pass == 1)
+		    {
+			audio->samples[audio_num].offset = pos + FLV_TAG_HEADER_LEN + AAC_PACKET_LEN;
+			audio->samples[audio_num].size = payload_len - AAC_PACKET_LEN;
+			audio->samples[audio_num].duration = AAC_FRAME_LEN;
+			audio->samples[audio_num].cto = 0;
+			audio->samples[audio_num].flags = SAMPLE_SYNC;
+		    }
+
+		    if (!audio_found)
+		    {
+			first_time[1] = time;
+			audio_found = TRUE;
+		    }
+
+		    audio_num++;
+		}
+	    }
+	}
+
+	if (pass > 0)
+	{
+	    break;
+	}
+
+	/* Allocate every sample found. */
+	if ((video_num == 0) || (config->avc == NULL) ||
+	    ((audio_num > 0) && ((config->aac == NULL) || !parse_aac_config(config))) ||
+	    ((index->own_samples = malloc((video_num + audio_num) * sizeof(Sample))) == NULL))
+	{
+	    return (FALSE);
+	}
+
+	index->track_num = (audio_num > 0) ? 2 : 1;
+	index->video_track = 0;
+	index->size += (video_num + audio_num) * sizeof(Sample);
+
+	video->handler = HANDLER_VIDEO;
+	video->timescale = FLV_TIMESCALE;
+	video->samples = index->own_samples;
+	video->sample_num = video_num;
+
+	audio->handler = HANDLER_SOUND;
+	audio->timescale = config->sample_rate;
+	audio->samples = index->own_samples + video_num;
+	audio->sample_num = audio_num;
+	audio->duration = (int64_t)audio_num * AAC_FRAME_LEN;
+    }
+
+    for (video_num = 0; video_num < video->sample_num; video_num++)
+    {
+	video->duration += video->samples[video_num].duration;
+    }
+
+    /* Both tracks start at the time of their first tag. */
+    base_time = ((audio_num > 0) && (first_time[1] < first_time[0])) ? first_time[1] : first_time[0];
+    video->start_time = first_time[0] - base_time;
+    audio->start_time = (audio_num > 0) ? rescale(first_time[1] - base_time, FLV_TIMESCALE, audio->timescale) : 0;
+
+    return (TRUE);
+}
+
+/* write_ftyp()
+ *
+ * */
+static
+void
+write_ftyp			(AtomWriter * out)
+{
+    int64_t start;
+
+    start = begin_atom(out, ATOM_FTYP);
+    put_be32(out, BRAND_ISO6);
+    put_be32(out, 0);
+    put_be32(out, BRAND_ISO6);
+    put_be32(out, BRAND_MP41);
+    end_atom(out, start);
+}
+
+/* write_matrix()
+ *
+ * Write the identity transformation matrix of 'mvhd' and 'tkhd'.
+ * */
+static
+void
+write_matrix			(AtomWriter * out)
+{
+    put_be32(out, 0x00010000);
+    put_zeros(out, 12);
+    put_be32(out, 0x00010000);
+    put_zeros(out, 12);
+    put_be32(out, 0x40000000);
+}
+
+/* write_sample_entry()
+ *
+ * Write the description of the samples of an FLV track: an 'avc1' or
+ * an 'mp4a' atom, with the codec configuration found in the rendition.
+ * */
+static
+void
+write_sample_entry		(AtomWriter * out, CmafTrack * track, FlvConfig * config, int width, int height)
+{
+    int64_t entry_start, start, es_len, decoder_len;
+
+    entry_start = begin_atom(out, (track->handler == HANDLER_VIDEO) ? ATOM_AVC1 : ATOM_MP4A);
+    put_zeros(out, 6);
+    put_be16(out, 1);
+
+    if (track->handler == HANDLER_VIDEO)
+    {
+	put_zeros(out, 16);
+	put_be16(out, width);
+	put_be16(out, height);
+	put_be32(out, 0x00480000);
+	put_be32(out, 0x00480000);
+	put_be32(out, 0);
+	put_be16(out, 1);
+	put_zeros(out, 32);
+	put_be16(out, 0x0018);
+	put_be16(out, 0xffff);
+
+	start = begin_atom(out, ATOM_AVCC);
+	put_data(out, config->avc, config->avc_len);
+	end_atom(out, start);
+    }
+    else
+    {
+	put_zeros(out, 8);
+	put_be16(out, config->channels);
+	put_be16(out, 16);
+	put_be32(out, 0);
+	put_be32(out, (config->sample_rate <= 0xffff) ? (config->sample_rate << 16) : 0);
+
+	/* Elementary stream descriptor, with single byte lengths. */
+	decoder_len = 13 + 2 + config->aac_len;
+	es_len = 3 + 2 + decoder_len + 3;
+
+	start = begin_full_atom(out, ATOM_ESDS, 0);
+	put_byte(out, 0x03);
+	put_byte(out, es_len);
+	put_be16(out, track->track_id);
+	put_byte(out, 0);
+	put_byte(out, 0x04);
+	put_byte(out, decoder_len);
+	put_byte(out, ESDS_AUDIO_AAC);
+	put_byte(out, ESDS_AUDIO_STREAM);
+	put_zeros(out, 3 + 4 + 4);
+	put_byte(out, 0x05);
+	put_byte(out, config->aac_len);
+	put_data(out, config->aac, config->aac_len);
+	put_byte(out, 0x06);
+	put_byte(out, 1);
+	put_byte(out, 0x02);
+	end_atom(out, start);
+    }
+
+    end_atom(out, entry_start);
+}
+
+/* write_flv_init()
+ *
+ * Compose the initialization segment of an FLV rendition: 'ftyp', and
+ * a 'moov' atom with an empty sample table for every track.
+ * Returns FALSE if it cannot be composed.
+ * */
+static
+Boolean
+write_flv_init			(CmafIndex * index, FlvConfig * config)
+{
+    AtomWriter out;
+    CmafTrack * track;
+    int64_t moov, trak, mdia, minf, dinf, stbl, start;
+    int width, height, t;
+
+    if (!parse_sps(config->avc, config->avc_len, &width, &height) ||
+	((out.buf = malloc(FLV_INIT_LEN + config->avc_len + config->aac_len)) == NULL))
+    {
+	return (FALSE);
+    }
+
+    out.pos = 0;
+    write_ftyp(&out);
+    moov = begin_atom(&out, ATOM_MOOV);
+
+    start = begin_full_atom(&out, ATOM_MVHD, 0);
+    put_zeros(&out, 8);
+    put_be32(&out, FLV_TIMESCALE);
+    put_be32(&out, 0);
+    put_be32(&out, 0x00010000);
+    put_be16(&out, 0x0100);
+    put_zeros(&out, 10);
+    write_matrix(&out);
+    put_zeros(&out, 24);
+    put_be32(&out, index->track_num + 1);
+    end_atom(&out, start);
+
+    for (t = 0; t < index->track_num; t++)
+    {
+	track = &index->tracks[t];
+	track->track_id = t + 1;
+	trak = begin_atom(&out, ATOM_TRAK);
+
+	/* Enabled track, in the movie. */
+	start = begin_atom(&out, ATOM_TKHD);
+	put_be32(&out, 0x000003);
+	put_zeros(&out, 8);
+	put_be32(&out, track->track_id);
+	put_zeros(&out, 8 + 8 + 4);
+	put_be16(&out, (track->handler == HANDLER_VIDEO) ? 0 : 0x0100);
+	put_be16(&out, 0);
+	write_matrix(&out);
+	put_be32(&out, (track->handler == HANDLER_VIDEO) ? ((uint32_t)width << 16) : 0);
+	put_be32(&out, (track->handler == HANDLER_VIDEO) ? ((uint32_t)height << 16) : 0);
+	end_atom(&out, start);
+
+	mdia = begin_atom(&out, ATOM_MDIA);
+
+	/* Undetermined language. */
+	start = begin_full_atom(&out, ATOM_MDHD, 0);
+	put_zeros(&out, 8);
+	put_be32(&out, track->timescale);
+	put_be32(&out, 0);
+	put_be16(&out, 0x55c4);
+	put_be16(&out, 0);
+	end_atom(&out, start);
+
+	start = begin_full_atom(&out, ATOM_HDLR, 0);
+	put_be32(&out, 0);
+	put_be32(&out, track->handler);
+	put_zeros(&out, 12);
+	put_data(&out, (track->handler == HANDLER_VIDEO) ? "VideoHandler" : "SoundHandler", 13);
+	end_atom(&out, start);
+
+	minf = begin_atom(&out, ATOM_MINF);
+
+	if (track->handler == HANDLER_VIDEO)
+	{
+	    start = begin_atom(&out, ATOM_VMHD);
+	    put_be32(&out, 0x000001);
+	    put_zeros(&out, 8);
+	}
+	else
+	{
+	    start = begin_full_atom(&out, ATOM_SMHD, 0);
+	    put_be32(&out, 0);
+	}
+
+	end_atom(&out, start);
+
+	/* Samples are in this same file. */
+	dinf = begin_atom(&out, ATOM_DINF);
+	start = begin_full_atom(&out, ATOM_DREF, 0);
+	put_be32(&out, 1);
+	put_be32(&out, ATOM_HEADER_LEN + 4);
+	put_be32(&out, ATOM_URL);
+	put_be32(&out, 0x000001);
+	end_atom(&out, start);
+	end_atom(&out, dinf);
+
+	stbl = begin_atom(&out, ATOM_STBL);
+	start = begin_full_atom(&out, ATOM_STSD, 0);
+	put_be32(&out, 1);
+	write_sample_entry(&out, track, config, width, height);
+	end_atom(&out, start);
+
+	start = begin_full_atom(&out, ATOM_STTS, 0);
+	put_be32(&out, 0);
+	end_atom(&out, start);
+	start = begin_full_atom(&out, ATOM_STSC, 0);
+	put_be32(&out, 0);
+	end_atom(&out, start);
+	start = begin_full_atom(&out, ATOM_STSZ, 0);
+	put_zeros(&out, 8);
+	end_atom(&out, start);
+	start = begin_full_atom(&out, ATOM_STCO, 0);
+	put_be32(&out, 0);
+	end_atom(&out, start);
+
+	end_atom(&out, stbl);
+	end_atom(&out, minf);
+	end_atom(&out, mdia);
+	end_atom(&out, trak);
+    }
+
+    /* Every sample uses the first sample description. */
+    start = begin_atom(&out, ATOM_MVEX);
+
+    for (t = 0; t < index->track_num; t++)
+    {
+	trak = begin_full_atom(&out, ATOM_TREX, 0);
+	put_be32(&out, index->tracks[t].track_id);
+	put_be32(&out, 1);
+	put_zeros(&out, 12);
+	end_atom(&out, trak);
+    }
+
+    end_atom(&out, start);
+    end_atom(&out, moov);
+
+    index->init = out.buf;
+    index->init_len = out.pos;
+    return (TRUE);
+}
+
+/* write_mp4_tracks()
+ *
+ * Take the tracks of an MP4 rendition from its sample table, and compose
+ * its initialization segment: 'ftyp', and the 'moov' atom of the
+ * rendition without any sample.
+ * Returns FALSE if it cannot be composed.
+ * */
+static
+Boolean
+write_mp4_tracks		(CmafIndex * index, const uint8_t * data, Mp4Index * mp4)
+{
+    AtomWriter out;
+    CmafTrack * track;
+    int t;
+
+    index->track_num = mp4->header->track_num;
+    index->video_track = mp4->video_track;
+
+    for (t = 0; t < index->track_num; t++)
+    {
+	track = &index->tracks[t];
+	track->handler = mp4->tracks[t].header->handler;
+	track->timescale = mp4->tracks[t].header->timescale;
+	track->sample_num = mp4->tracks[t].header->sample_num;
+	track->samples = mp4->tracks[t].samples;
+	track->start_time = 0;
+	track->duration = mp4->tracks[t].duration;
+    }
+
+    if ((out.buf = malloc(FLV_INIT_LEN + get_mp4_init_bound(mp4))) == NULL)
+    {
+	return (FALSE);
+    }
+
+    out.pos = 0;
+    write_ftyp(&out);
+
+    if (!write_mp4_init(&out, mp4, data))
+    {
+	free(out.buf);
+	return (FALSE);
+    }
+
+    index->init = out.buf;
+    index->init_len = out.pos;
+    return (TRUE);
+}
+
+/* describe_track()
+ *
+ * Find the id of a track in its 'trak' atom, along with its codec as
+ * written in manifests, and its picture size if it is a video track.
+ * Returns FALSE if it is not well formed.
+ * */
+static
+Boolean
+describe_track			(CmafIndex * index, CmafTrack * track, const uint8_t * trak, int64_t trak_len, char * codec, int codec_len)
+{
+    const uint8_t * tkhd, * mdia, * minf, * stbl, * stsd, * child;
+    int64_t tkhd_len, mdia_len, minf_len, stbl_len, stsd_len, entry_len, child_len, i;
+    uint32_t type;
+    int header_len;
+
+    if (((tkhd = find_atom(trak, trak_len, ATOM_TKHD, &tkhd_len)) == NULL) || (tkhd_len < 24) ||
+	((mdia = find_atom(trak, trak_len, ATOM_MDIA, &mdia_len)) == NULL) ||
+	((minf = find_atom(mdia, mdia_len, ATOM_MINF, &minf_len)) == NULL) ||
+	((stbl = find_atom(minf, minf_len, ATOM_STBL, &stbl_len)) == NULL) ||
+	((stsd = find_atom(stbl, stbl_len, ATOM_STSD, &stsd_len)) == NULL) || (stsd_len < 8) ||
+	((header_len = parse_atom(stsd + 8, stsd_len - 8, &type, &entry_len)) == 0))
+    {
+	return (FALSE);
+    }
+
+    track->track_id = get_be32(tkhd + ((tkhd[0] == 1) ? 20 : 12));
+    stsd += 8;
+
+    /* Codecs, as in RFC 6381. */
+    if (((type == ATOM_AVC1) || (type == ATOM_AVC3)) && (entry_len >= (header_len + VISUAL_ENTRY_LEN)))
+    {
+	index->width = get_be16(stsd + header_len + 24);
+	index->height = get_be16(stsd + header_len + 26);
+
+	if (((child = find_atom(stsd + header_len + VISUAL_ENTRY_LEN, entry_len - header_len - VISUAL_ENTRY_LEN,
+				ATOM_AVCC, &child_len)) != NULL) && (child_len >= 4))
+	{
+	    snprintf(codec, codec_len, "%s.%02X%02X%02X", (type == ATOM_AVC1) ? "avc1" : "avc3", child[1], child[2], child[3]);
+	    return (TRUE);
+	}
+    }
+    else if ((type == ATOM_MP4A) && (entry_len >= (header_len + AUDIO_ENTRY_LEN)))
+    {
+	/* The audio object type is in the decoder specific info. */
+	if ((child = find_atom(stsd + header_len + AUDIO_ENTRY_LEN, entry_len - header_len - AUDIO_ENTRY_LEN,
+			       ATOM_ESDS, &child_len)) != NULL)
+	{
+	    for (i = 4; (i + 2) < child_len; i++)
+	    {
+		if ((child[i] == 0x05) && (child[i + 1] > 0) && (child[i + 1] < 0x80) && ((i + 2) < child_len))
+		{
+		    snprintf(codec, codec_len, "mp4a.40.%d", child[i + 2] >> 3);
+		    return (TRUE);
+		}
+	    }
+	}
+
+	snprintf(codec, codec_len, "mp4a.40.2");
+	return (TRUE);
+    }
+
+    snprintf(codec, codec_len, "%c%c%c%c", type >> 24, (type >> 16) & 0xff, (type >> 8) & 0xff, type & 0xff);
+    return (TRUE);
+}
+
+/* describe_tracks()
+ *
+ * Describe every track of a rendition, as found in the 'moov' atom of
+ * its initialization segment.
+ * Returns FALSE if it is not well formed.
+ * */
+static
+Boolean
+describe_tracks			(CmafIndex * index)
+{
+    const uint8_t * moov, * trak;
+    int64_t moov_len, trak_len, left;
+    char codec[CODECS_LEN];
+    int t, codecs_len;
+
+    if ((moov = find_atom(index->init, index->init_len, ATOM_MOOV, &moov_len)) == NULL)
+    {
+	return (FALSE);
+    }
+
+    codecs_len = 0;
+    index->codecs[0] = '\0';
+
+    for (t = 0, trak = moov, left = moov_len; t < index->track_num; t++)
+    {
+	if (((trak = find_atom(trak, left, ATOM_TRAK, &trak_len)) == NULL) ||
+	    !describe_track(index, &index->tracks[t], trak, trak_len, codec, CODECS_LEN))
+	{
+	    return (FALSE);
+	}
+
+	codecs_len += snprintf(index->codecs + codecs_len, (codecs_len < CODECS_LEN) ? (CODECS_LEN - codecs_len) : 0,
+			       "%s%s", (t > 0) ? "," : "", codec);
+	left = (moov + moov_len) - (trak + trak_len);
+	trak += trak_len;
+    }
+
+    return (codecs_len < CODECS_LEN);
+}
+
+/* get_segment_first()
+ *
+ * Number of the first sample of track 't' on segment 'segment'.
+ * */
+static
+uint32_t
+get_segment_first		(CmafIndex * index, int segment, int t)
+{
+    return (index->segments[(segment * index->track_num) + t]);
+}
+
+/* map_segments()
+ *
+ * Cut a rendition in segments, one for every keyframe interval of its
+ * index. Each one starts on the first video keyframe found at or after
+ * its iframe offset, and has the samples of every other track decoded
+ * until the next one starts. The first segment starts on the first
+ * sample of every track.
+ * Returns FALSE if it cannot be cut.
+ * */
+static
+Boolean
+map_segments			(CmafIndex * index, const int64_t * iframe_offset, int iframe_num)
+{
+    CmafTrack * video, * track;
+    int64_t time, bytes, duration, total_bytes;
+    uint32_t i, j, last;
+    int k, s, t;
+
+    video = &index->tracks[index->video_track];
+
+    if ((iframe_num <= 0) ||
+	((index->segments = malloc((iframe_num + 1) * index->track_num * sizeof(uint32_t))) == NULL) ||
+	((index->segment_time = malloc((iframe_num + 1) * sizeof(int64_t))) == NULL))
+    {
+	return (FALSE);
+    }
+
+    index->size += (iframe_num + 1) * ((index->track_num * sizeof(uint32_t)) + sizeof(int64_t));
+
+    /* Keyframes starting every segment. */
+    index->segment_time[0] = 0;
+    index->segments[index->video_track] = 0;
+    s = 1;
+
+    for (k = 1, j = 0, last = 0, time = video->start_time; k < iframe_num; k++)
+    {
+	for (; (j < video->sample_num) &&
+		 !((j > last) && (video->samples[j].flags & SAMPLE_SYNC) && (video->samples[j].offset >= iframe_offset[k]));
+	     time += video->samples[j].duration, j++);
+
+	if (j >= video->sample_num)
+	{
+	    break;
+	}
+
+	index->segments[(s * index->track_num) + index->video_track] = j;
+	index->segment_time[s] = time;
+	last = j;
+	s++;
+    }
+
+    index->segment_num = s;
+    index->segment_time[s] = video->start_time + video->duration;
+
+    /* Every other track follows the video. */
+    for (t = 0; t < index->track_num; t++)
+    {
+	track = &index->tracks[t];
+	index->segments[(s * index->track_num) + t] = track->sample_num;
+
+	if (t == index->video_track)
+	{
+	    continue;
+	}
+
+	index->segments[t] = 0;
+
+	for (k = 1, i = 0, time = track->start_time; k < s; k++)
+	{
+	    for (; (i < track->sample_num) && (rescale(time, track->timescale, video->timescale) < index->segment_time[k]);
+		 time += track->samples[i].duration, i++);
+
+	    index->segments[(k * index->track_num) + t] = i;
+	}
+    }
+
+    /* Peak and average bitrates. */
+    for (k = 0, total_bytes = 0; k < s; k++)
+    {
+	for (t = 0, bytes = 0; t < index->track_num; t++)
+	{
+	    for (i = get_segment_first(index, k, t); i < get_segment_first(index, k + 1, t); i++)
+	    {
+		bytes += index->tracks[t].samples[i].size;
+	    }
+	}
+
+	total_bytes += bytes;
+
+	if ((duration = index->segment_time[k + 1] - index->segment_time[k]) > 0)
+	{
+	    bytes = rescale(bytes * 8, duration, video->timescale);
+	    index->bandwidth = (bytes > index->bandwidth) ? bytes : index->bandwidth;
+	}
+    }
+
+    index->avg_bandwidth = (index->segment_time[s] > 0) ? rescale(total_bytes * 8, index->segment_time[s], video->timescale) : 0;
+    index->bandwidth = (index->bandwidth > index->avg_bandwidth) ? index->bandwidth : index->avg_bandwidth;
+
+    return (TRUE);
+}
+
+/* add_text()
+ *
+ * Add a formatted string to a text, enlarging it as needed.
+ * Returns FALSE if there is no memory for it.
+ * */
+static
+Boolean
+add_text			(Text * text, const char * format, ...)
+{
+    va_list args;
+    char * buf;
+    int len;
+
+    while (TRUE)
+    {
+	va_start(args, format);
+	len = vsnprintf(text->buf + text->len, text->size - text->len, format, args);
+	va_end(args);
+
+	if (len < 0)
+	{
+	    return (FALSE);
+	}
+
+	if ((text->len + len) < text->size)
+	{
+	    text->len += len;
+	    return (TRUE);
+	}
+
+	if ((buf = realloc(text->buf, (text->size * 2) + len)) == NULL)
+	{
+	    return (FALSE);
+	}
+
+	text->buf = buf;
+	text->size = (text->size * 2) + len;
+    }
+}
+
+/* init_text()
+ *
+ * */
+static
+Boolean
+init_text			(Text * text)
+{
+    text->len = 0;
+    text->size = TEXT_INIT_SIZE;
+
+    return ((text->buf = malloc(text->size)) != NULL);
+}
+
+/* end_text()
+ *
+ * Returns the text composed, with its length in 'len', or NULL if it
+ * could not be composed.
+ * */
+static
+char *
+end_text			(Text * text, Boolean failed, int64_t * len)
+{
+    if (failed)
+    {
+	free(text->buf);
+	return (NULL);
+    }
+
+    *len = text->len;
+    return (text->buf);
+}
+
+/* get_segment_seconds()
+ *
+ * */
+static
+double
+get_segment_seconds		(CmafIndex * index, int segment)
+{
+    return ((double)(index->segment_time[segment + 1] - index->segment_time[segment]) /
+	    index->tracks[index->video_track].timescale);
+}
+
+/* get_duration_seconds()
+ *
+ * Duration of a rendition.
+ * */
+static
+double
+get_duration_seconds		(CmafIndex * index)
+{
+    return ((double)index->segment_time[index->segment_num] / index->tracks[index->video_track].timescale);
+}
+
+/* get_bucket()
+ *
+ * Hash function for the segment cache.
+ * */
+static inline
+unsigned int
+get_bucket			(int video_id, int quality, int number)
+{
+    return ((((unsigned int)video_id * 2654435761U) + ((unsigned int)quality * 31) + number) % CMAF_BUCKETS);
+}
+
+/* find_object()
+ *
+ * Must be called with 'cmaf_lock' held.
+ * */
+static
+CmafObject *
+find_object			(int video_id, const char * sign, int quality, int number)
+{
+    CmafObject * object;
+
+    for (object = objects[get_bucket(video_id, quality, number)];
+	 (object != NULL) &&
+	     ((object->video_id != video_id) || (object->quality != quality) || (object->number != number) ||
+	      (strcmp(object->sign, sign) != 0));
+	 object = object->next);
+
+    return (object);
+}
+
+/* unlink_object()
+ *
+ * Remove an object from the list of recently used ones.
+ * Must be called with 'cmaf_lock' held.
+ * */
+static
+void
+unlink_object			(CmafObject * object)
+{
+    if (object->newer != NULL)
+    {
+	object->newer->older = object->older;
+    }
+    else
+    {
+	newest_object = object->older;
+    }
+
+    if (object->older != NULL)
+    {
+	object->older->newer = object->newer;
+    }
+    else
+    {
+	oldest_object = object->newer;
+    }
+
+    object->newer = object->older = NULL;
+}
+
+/* touch_object()
+ *
+ * Make an object the most recently used one.
+ * Must be called with 'cmaf_lock' held.
+ * */
+static
+void
+touch_object			(CmafObject * object)
+{
+    if (newest_object == object)
+    {
+	return;
+    }
+
+    if ((object->newer != NULL) || (object->older != NULL) || (oldest_object == object))
+    {
+	unlink_object(object);
+    }
+
+    object->older = newest_object;
+
+    if (newest_object != NULL)
+    {
+	newest_object->newer = object;
+    }
+
+    newest_object = object;
+
+    if (oldest_object == NULL)
+    {
+	oldest_object = object;
+    }
+}
+
+/* free_object()
+ *
+ * */
+static
+void
+free_object			(CmafObject * object)
+{
+    free(object->etag);
+    free(object->data);
+    free(object);
+}
+
+/* evict_objects()
+ *
+ * Drop the least recently used objects not in use until 'len' more
+ * bytes fit in the cache.
+ * Returns FALSE if they cannot fit.
+ * Must be called with 'cmaf_lock' held.
+ * */
+static
+Boolean
+evict_objects			(int64_t len)
+{
+    CmafObject * object, * older, ** prev;
+
+    for (object = oldest_object; (object != NULL) && ((cache_used + len) > cache_size); object = older)
+    {
+	older = object->newer;
+
+	if (object->refs > 0)
+	{
+	    continue;
+	}
+
+	for (prev = &objects[get_bucket(object->video_id, object->quality, object->number)];
+	     *prev != object;
+	     prev = &(*prev)->next);
+
+	*prev = object->next;
+	unlink_object(object);
+	cache_used -= object->len;
+	free_object(object);
+    }
+
+    return ((cache_used + len) <= cache_size);
+}
+
+/* ********** Public functions ********** */
+
+/* init_cmaf()
+ *
+ * Initialize the segment cache, 'cache_size' megabytes long. Nothing is
+ * cached if it is 0.
+ * */
+int
+init_cmaf			(int cache_size_mb)
+{
+    memset(objects, 0, sizeof(objects));
+    cache_size = (cache_size_mb > 0) ? ((int64_t)cache_size_mb * MEGABYTE) : 0;
+
+    return (EXIT_SUCCESS);
+}
+
+/* load_cmaf_index()
+ *
+ * Cut a rendition, 'data_size' bytes from 'data', in segments starting
+ * on the iframes of its index. MP4 renditions are read through their
+ * sample table, 'mp4', and FLV renditions if it is NULL.
+ * Returns NULL if it cannot be cut.
+ * */
+CmafIndex *
+load_cmaf_index			(const uint8_t * data, int64_t data_size, const int64_t * iframe_offset, int iframe_num,
+				 Mp4Index * mp4)
+{
+    CmafIndex * index;
+    FlvConfig config;
+    Boolean loaded;
+
+    if ((index = calloc(1, sizeof(CmafIndex))) == NULL)
+    {
+	return (NULL);
+    }
+
+    index->size = sizeof(CmafIndex);
+
+    if (mp4 != NULL)
+    {
+	loaded = write_mp4_tracks(index, data, mp4);
+    }
+    else
+    {
+	loaded = load_flv_tracks(index, data, data_size, &config) && write_flv_init(index, &config);
+    }
+
+    if (!loaded || !describe_tracks(index) || !map_segments(index, iframe_offset, iframe_num))
+    {
+	LOG_RATELIMITED(WARNING, EMSG_CMAFINDEX, NULL);
+	free_cmaf_index(index);
+	return (NULL);
+    }
+
+    index->size += index->init_len;
+    return (index);
+}
+
+/* free_cmaf_index()
+ *
+ * */
+void
+free_cmaf_index			(CmafIndex * index)
+{
+    free(index->segments);
+    free(index->segment_time);
+    free(index->init);
+    free(index->own_samples);
+    free(index);
+}
+
+/* build_cmaf_segment()
+ *
+ * Compose segment 'number' of a rendition, or its initialization
+ * segment if it is CMAF_INIT, from 'data', the rendition itself. Every
+ * track is a fragment of its own, and the samples of every track follow
+ * one another in 'mdat'.
+ * Returns the segment, which should be freed after use, and its length
+ * in 'len', or NULL if it does not exist.
+ * */
+uint8_t *
+build_cmaf_segment		(CmafIndex * index, const uint8_t * data, int number, int64_t * len)
+{
+    AtomWriter out;
+    CmafTrack * track;
+    Sample * sample;
+    int64_t bound, data_len, moof, traf, start, mdat, decode_time;
+    int64_t data_offset[MAX_TRACKS];
+    uint32_t first, last, i, run;
+    Boolean has_cto, negative_cto;
+    int t;
+
+    if (number == CMAF_INIT)
+    {
+	if ((out.buf = malloc(index->init_len)) != NULL)
+	{
+	    memcpy(out.buf, index->init, index->init_len);
+	    *len = index->init_len;
+	}
+
+	return (out.buf);
+    }
+
+    if ((number < 0) || (number >= index->segment_num))
+    {
+	return (NULL);
+    }
+
+    for (t = 0, bound = FRAGMENT_FIXED_LEN, data_len = 0; t < index->track_num; t++)
+    {
+	first = get_segment_first(index, number, t);
+	last = get_segment_first(index, number + 1, t);
+	bound += FRAGMENT_TRACK_LEN + ((int64_t)(last - first) * FRAGMENT_SAMPLE_LEN);
+
+	for (i = first; i < last; i++)
+	{
+	    data_len += index->tracks[t].samples[i].size;
+	}
+    }
+
+    if ((out.buf = malloc(bound + data_len)) == NULL)
+    {
+	return (NULL);
+    }
+
+    out.pos = 0;
+    moof = begin_atom(&out, ATOM_MOOF);
+
+    start = begin_full_atom(&out, ATOM_MFHD, 0);
+    put_be32(&out, number + 1);
+    end_atom(&out, start);
+
+    for (t = 0; t < index->track_num; t++)
+    {
+	track = &index->tracks[t];
+	first = get_segment_first(index, number, t);
+	last = get_segment_first(index, number + 1, t);
+	data_offset[t] = -1;
+
+	if (first >= last)
+	{
+	    continue;
+	}
+
+	for (i = 0, decode_time = track->start_time; i < first; i++)
+	{
+	    decode_time += track->samples[i].duration;
+	}
+
+	for (i = first, has_cto = FALSE, negative_cto = FALSE; i < last; i++)
+	{
+	    has_cto = has_cto || (track->samples[i].cto != 0);
+	    negative_cto = negative_cto || (track->samples[i].cto < 0);
+	}
+
+	traf = begin_atom(&out, ATOM_TRAF);
+
+	start = begin_atom(&out, ATOM_TFHD);
+	put_be32(&out, TFHD_BASE_IS_MOOF);
+	put_be32(&out, track->track_id);
+	end_atom(&out, start);
+
+	start = begin_full_atom(&out, ATOM_TFDT, 1);
+	put_be64(&out, decode_time);
+	end_atom(&out, start);
+
+	/* Signed composition offsets need a version 1 'trun'. */
+	start = begin_atom(&out, ATOM_TRUN);
+	put_be32(&out, ((negative_cto ? 1 : 0) << 24) | TRUN_DATA_OFFSET | TRUN_SAMPLE_DURATION | TRUN_SAMPLE_SIZE |
+		 TRUN_SAMPLE_FLAGS | (has_cto ? TRUN_SAMPLE_CTO : 0));
+	put_be32(&out, last - first);
+	data_offset[t] = out.pos;
+	put_be32(&out, 0);
+
+	for (i = first; i < last; i++)
+	{
+	    sample = &track->samples[i];
+	    put_be32(&out, sample->duration);
+	    put_be32(&out, sample->size);
+	    put_be32(&out, (sample->flags & SAMPLE_SYNC) ? SYNC_SAMPLE_FLAGS : NON_SYNC_SAMPLE_FLAGS);
+
+	    if (has_cto)
+	    {
+		put_be32(&out, (uint32_t)sample->cto);
+	    }
+	}
+
+	end_atom(&out, start);
+	end_atom(&out, traf);
+    }
+
+    end_atom(&out, moof);
+
+    /* Samples are copied in runs of contiguous ones. */
+    if ((data_len + ATOM_HEADER_LEN) > UINT32_MAX)
+    {
+	mdat = begin_atom(&out, ATOM_MDAT);
+	set_be32(&out, mdat, 1);
+	put_be64(&out, data_len + ATOM_LARGE_LEN);
+    }
+    else
+    {
+	mdat = begin_atom(&out, ATOM_MDAT);
+	set_be32(&out, mdat, data_len + ATOM_HEADER_LEN);
+    }
+
+    for (t = 0; t < index->track_num; t++)
+    {
+	if (data_offset[t] < 0)
+	{
+	    continue;
+	}
+
+	track = &index->tracks[t];
+	first = get_segment_first(index, number, t);
+	last = get_segment_first(index, number + 1, t);
+	set_be32(&out, data_offset[t], out.pos - moof);
+
+	for (i = first; i < last; i += run)
+	{
+	    for (start = track->samples[i].size, run = 1;
+		 ((i + run) < last) && (track->samples[i + run].offset == (track->samples[i].offset + start));
+		 start += track->samples[i + run].size, run++);
+
+	    put_data(&out, data + track->samples[i].offset, start);
+	}
+    }
+
+    *len = out.pos;
+    return (out.buf);
+}
+
+/* compose_hls_master()
+ *
+ * Compose the HLS master playlist of a video, with the renditions in
+ * 'indexes', one for every quality.
+ * URLs carry 'sign', if it is not NULL.
+ * Returns the playlist, which should be freed after use, and its length
+ * in 'len'.
+ * */
+char *
+compose_hls_master		(CmafIndex ** indexes, int index_num, int video_id, const char * sign, int64_t * len)
+{
+    Text text;
+    Boolean failed;
+    int i;
+
+    if (!init_text(&text))
+    {
+	return (NULL);
+    }
+
+    failed = !add_text(&text, "#EXTM3U\n#EXT-X-VERSION:%d\n#EXT-X-INDEPENDENT-SEGMENTS\n", HLS_VERSION);
+
+    for (i = 0; (i < index_num) && !failed; i++)
+    {
+	failed = !add_text(&text, "#EXT-X-STREAM-INF:BANDWIDTH=%lld,AVERAGE-BANDWIDTH=%lld,CODECS=\"%s\",RESOLUTION=%dx%d\n"
+			   "%s?video_id=%d%s%s&quality=%d&format=m3u8\n",
+			   (long long)indexes[i]->bandwidth, (long long)indexes[i]->avg_bandwidth, indexes[i]->codecs,
+			   indexes[i]->width, indexes[i]->height,
+			   CMAF_REQUEST, video_id, (sign != NULL) ? "&sign=" : "", (sign != NULL) ? sign : "", i);
+    }
+
+    return (end_text(&text, failed, len));
+}
+
+/* compose_hls_playlist()
+ *
+ * Compose the HLS media playlist of a rendition, 'quality' among the
+ * renditions of its video.
+ * Returns the playlist, which should be freed after use, and its length
+ * in 'len'.
+ * */
+char *
+compose_hls_playlist		(CmafIndex * index, int quality, int video_id, const char * sign, int64_t * len)
+{
+    Text text;
+    char * query;
+    double target, seconds;
+    Boolean failed;
+    int s;
+
+    if (asprintf(&query, "%s?video_id=%d%s%s&quality=%d", CMAF_REQUEST, video_id,
+		 (sign != NULL) ? "&sign=" : "", (sign != NULL) ? sign : "", quality) < 0)
+    {
+	return (NULL);
+    }
+
+    if (!init_text(&text))
+    {
+	free(query);
+	return (NULL);
+    }
+
+    for (s = 0, target = 0; s < index->segment_num; s++)
+    {
+	seconds = get_segment_seconds(index, s);
+	target = (seconds > target) ? seconds : target;
+    }
+
+    failed = !add_text(&text, "#EXTM3U\n#EXT-X-VERSION:%d\n#EXT-X-TARGETDURATION:%d\n#EXT-X-MEDIA-SEQUENCE:0\n"
+		       "#EXT-X-PLAYLIST-TYPE:VOD\n#EXT-X-INDEPENDENT-SEGMENTS\n#EXT-X-MAP:URI=\"%s&segment=init\"\n",
+		       HLS_VERSION, (int)(target + 0.999), query);
+
+    for (s = 0; (s < index->segment_num) && !failed; s++)
+    {
+	failed = !add_text(&text, "#EXTINF:%.3f,\n%s&segment=%d\n", get_segment_seconds(index, s), query, s);
+    }
+
+    failed = failed || !add_text(&text, "#EXT-X-ENDLIST\n");
+    free(query);
+
+    return (end_text(&text, failed, len));
+}
+
+/* compose_dash_manifest()
+ *
+ * Compose the DASH manifest of a video, with the renditions in
+ * 'indexes' as representations of a single adaptation set. Segment
+ * durations are listed in a timeline, as they follow the keyframes.
+ * Returns the manifest, which should be freed after use, and its length
+ * in 'len'.
+ * */
+char *
+compose_dash_manifest		(CmafIndex ** indexes, int index_num, int video_id, const char * sign, int64_t * len)
+{
+    Text text;
+    CmafIndex * index;
+    char * query;
+    double duration;
+    int64_t segment_len;
+    Boolean failed;
+    int i, s, repeat;
+
+    for (i = 0, duration = 0; i < index_num; i++)
+    {
+	duration = (get_duration_seconds(indexes[i]) > duration) ? get_duration_seconds(indexes[i]) : duration;
+    }
+
+    if (asprintf(&query, "%s?video_id=%d%s%s", CMAF_REQUEST, video_id,
+		 (sign != NULL) ? "&amp;sign=" : "", (sign != NULL) ? sign : "") < 0)
+    {
+	return (NULL);
+    }
+
+    if (!init_text(&text))
+    {
+	free(query);
+	return (NULL);
+    }
+
+    failed = !add_text(&text, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		       "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:isoff-live:2011\" "
+		       "type=\"static\" minBufferTime=\"PT%dS\" mediaPresentationDuration=\"PT%.3fS\">\n"
+		       "  <Period start=\"PT0S\">\n"
+		       "    <AdaptationSet mimeType=\"%s\" startWithSAP=\"1\">\n",
+		       MIN_BUFFER_TIME, duration, SEGMENT_TYPE);
+
+    for (i = 0; (i < index_num) && !failed; i++)
+    {
+	index = indexes[i];
+	failed = !add_text(&text, "      <Representation id=\"%d\" bandwidth=\"%lld\" codecs=\"%s\" width=\"%d\" height=\"%d\">\n"
+			   "        <SegmentTemplate timescale=\"%u\" startNumber=\"0\" "
+			   "initialization=\"%s&amp;quality=%d&amp;segment=init\" media=\"%s&amp;quality=%d&amp;segment=$Number$\">\n"
+			   "          <SegmentTimeline>\n",
+			   i, (long long)index->bandwidth, index->codecs, index->width, index->height,
+			   index->tracks[index->video_track].timescale, query, i, query, i);
+
+	/* Segments as long as the previous one are repeated. */
+	for (s = 0; (s < index->segment_num) && !failed; s += repeat + 1)
+	{
+	    segment_len = index->segment_time[s + 1] - index->segment_time[s];
+
+	    for (repeat = 0;
+		 ((s + repeat + 1) < index->segment_num) &&
+		     ((index->segment_time[s + repeat + 2] - index->segment_time[s + repeat + 1]) == segment_len);
+		 repeat++);
+
+	    failed = (s == 0) ?
+		!add_text(&text, "            <S t=\"0\" d=\"%lld\" r=\"%d\"/>\n", (long long)segment_len, repeat) :
+		!add_text(&text, "            <S d=\"%lld\" r=\"%d\"/>\n", (long long)segment_len, repeat);
+	}
+
+	failed = failed || !add_text(&text, "          </SegmentTimeline>\n        </SegmentTemplate>\n      </Representation>\n");
+    }
+
+    failed = failed || !add_text(&text, "    </AdaptationSet>\n  </Period>\n</MPD>\n");
+    free(query);
+
+    return (end_text(&text, failed, len));
+}
+
+/* find_cmaf_object()
+ *
+ * Search for an object in cache. If it is found, returns it with a new
+ * reference, that should be dropped with release_cmaf_object().
+ * This function is thread safe.
+ * */
+CmafObject *
+find_cmaf_object		(int video_id, const char * sign, int quality, int number)
+{
+    CmafObject * object;
+
+    pthread_mutex_lock(&cmaf_lock);
+
+    if ((object = find_object(video_id, sign, quality, number)) != NULL)
+    {
+	object->refs++;
+	touch_object(object);
+    }
+
+    pthread_mutex_unlock(&cmaf_lock);
+    return (object);
+}
+
+/* add_cmaf_object()
+ *
+ * Add an object to the cache, which takes 'data'. Less recently used
+ * objects are dropped to make room for it, and it is not cached at all
+ * if there is no room. If another thread added it meanwhile, that one
+ * is returned instead.
+ * Returns the object, with a reference that should be dropped with
+ * release_cmaf_object(), or NULL if there is no memory for it.
+ * This function is thread safe.
+ * */
+CmafObject *
+add_cmaf_object			(int video_id, const char * sign, int quality, int number, uint8_t * data, int64_t len,
+				 const char * etag)
+{
+    CmafObject * object, * found;
+    unsigned int bucket;
+
+    if (((object = calloc(1, sizeof(CmafObject))) == NULL) ||
+	((object->etag = strdup(etag)) == NULL))
+    {
+	free(object);
+	free(data);
+	return (NULL);
+    }
+
+    object->video_id = video_id;
+    object->quality = quality;
+    object->number = number;
+    strncpy(object->sign, sign, SIGN_LEN);
+    object->data = data;
+    object->len = len;
+    object->refs = 1;
+
+    pthread_mutex_lock(&cmaf_lock);
+
+    if ((found = find_object(video_id, object->sign, quality, number)) != NULL)
+    {
+	found->refs++;
+	touch_object(found);
+	pthread_mutex_unlock(&cmaf_lock);
+	free_object(object);
+	return (found);
+    }
+
+    if ((object->cached = evict_objects(len)))
+    {
+	bucket = get_bucket(video_id, quality, number);
+	object->next = objects[bucket];
+	objects[bucket] = object;
+	touch_object(object);
+	cache_used += len;
+    }
+
+    pthread_mutex_unlock(&cmaf_lock);
+    return (object);
+}
+
+/* release_cmaf_object()
+ *
+ * Drop a reference to an object, and free it if it is not cached and
+ * not used anymore.
+ * */
+void
+release_cmaf_object		(CmafObject * object)
+{
+    Boolean unused;
+
+    pthread_mutex_lock(&cmaf_lock);
+    unused = ((--object->refs == 0) && !object->cached);
+    pthread_mutex_unlock(&cmaf_lock);
+
+    if (unused)
+    {
+	free_object(object);
+    }
+}
@@ -0,0 +1,148 @@
+/* CMAF module.
+ * File: cmaf.h
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Fragmented MP4 segments, and the HLS and DASH manifests describing
+ * them.
+ * */
+
+#ifndef CMAF_H
+#define CMAF_H
+
+#include <stdint.h>
+
+/* ********** Constant definitions ********** */
+
+/* Default size of the segment cache, in megabytes. */
+#define DEFAULT_SEGMENT_CACHE	64
+
+/* Objects of a video other than media segments, which are numbered
+ * from 0.
+ * */
+#define CMAF_INIT		-1
+#define CMAF_HLS_PLAYLIST	-2
+#define CMAF_HLS_MASTER		-3
+#define CMAF_DASH_MANIFEST	-4
+
+/* Room for the codecs of a rendition, as written in manifests. */
+#define CODECS_LEN		64
+
+/* ********** Type definitions ********** */
+
+/* A track of a rendition. Its samples point into the rendition data,
+ * and 'start_time' is the time its first sample is decoded at.
+ * */
+typedef
+struct _cmaf_track
+{
+    uint32_t handler;
+    uint32_t timescale;
+    uint32_t track_id;
+    uint32_t sample_num;
+    Sample * samples;
+    int64_t start_time;
+    int64_t duration;
+}
+CmafTrack;
+
+/* A rendition cut in segments, one for every keyframe interval in its
+ * index.
+ *  - 'segments' has the first sample of every track on every segment,
+ *    'track_num' entries each, followed by the number of samples of
+ *    every track.
+ *  - 'segment_time' has the time every segment starts at, followed by
+ *    the end of the rendition, in the timescale of its video track.
+ *  - 'init' is its initialization segment.
+ *  - 'bandwidth' is the peak bitrate of its segments, and
+ *    'avg_bandwidth' its average bitrate.
+ *  - 'own_samples' are the samples found in FLV renditions, which have
+ *    no sample table.
+ *  - 'size' is the memory it takes.
+ * */
+typedef
+struct _cmaf_index
+{
+    CmafTrack tracks[MAX_TRACKS];
+    int track_num;
+    int video_track;
+
+    int segment_num;
+    uint32_t * segments;
+    int64_t * segment_time;
+
+    uint8_t * init;
+    int64_t init_len;
+
+    char codecs[CODECS_LEN];
+    int width;
+    int height;
+    int64_t bandwidth;
+    int64_t avg_bandwidth;
+
+    Sample * own_samples;
+    int64_t size;
+}
+CmafIndex;
+
+/* An object served: a manifest, or a segment of a rendition, along
+ * with the entity tag it is sent with. Objects are reference counted,
+ * as they may be dropped from cache while being sent.
+ * */
+typedef
+struct _cmaf_object
+{
+    int video_id;
+    int quality;
+    int number;
+    char sign[SIGN_LEN + 1];
+
+    char * etag;
+    uint8_t * data;
+    int64_t len;
+
+    int refs;
+    Boolean cached;
+    struct _cmaf_object * next;
+    struct _cmaf_object * newer;
+    struct _cmaf_object * older;
+}
+CmafObject;
+
+/* ********** Public functions ********** */
+int
+init_cmaf			(int cache_size);
+
+/* Renditions. */
+CmafIndex *
+load_cmaf_index			(const uint8_t * data, int64_t data_size, const int64_t * iframe_offset, int iframe_num,
+				 Mp4Index * mp4);
+
+void
+free_cmaf_index			(CmafIndex * index);
+
+uint8_t *
+build_cmaf_segment		(CmafIndex * index, const uint8_t * data, int number, int64_t * len);
+
+/* Manifests. */
+char *
+compose_hls_master		(CmafIndex ** indexes, int index_num, int video_id, const char * sign, int64_t * len);
+
+char *
+compose_hls_playlist		(CmafIndex * index, int quality, int video_id, const char * sign, int64_t * len);
+
+char *
+compose_dash_manifest		(CmafIndex ** indexes, int index_num, int video_id, const char * sign, int64_t * len);
+
+/* Segment cache. */
+CmafObject *
+find_cmaf_object		(int video_id, const char * sign, int quality, int number);
+
+CmafObject *
+add_cmaf_object			(int video_id, const char * sign, int quality, int number, uint8_t * data, int64_t len,
+				 const char * etag);
+
+void
+release_cmaf_object		(CmafObject * object);
+
+#endif
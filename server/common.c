@@ -59,7 +59,7 @@ get_file_size			(char * filename)
 	
 	if (stat(filename, &properties) != 0)
 	{
-		log_message(WARNING, EMSG_STATFILE, NULL);
+		LOG(WARNING, EMSG_STATFILE, NULL);
 		return 0;
 	}
 	
@@ -85,14 +85,14 @@ get_file_contents		(char * filename)
 		 * failing one or two times is acceptable, as when only one file
 		 * is really needed but many are readed.
 		 * */
-		log_message(WARNING, EMSG_OPENFILE, NULL);
+		LOG(WARNING, EMSG_OPENFILE, NULL);
 		return (NULL);
 	}
 	
 	if (stat(filename, &properties) != 0)
 	{
 		close(fd);
-		log_message(WARNING, EMSG_STATFILE, NULL);
+		LOG(WARNING, EMSG_STATFILE, NULL);
 		return (NULL);
 	}
 	
@@ -105,7 +105,7 @@ get_file_contents		(char * filename)
 	{
 		free(contents);
 		close(fd);
-		log_message(WARNING, EMSG_READFILE, NULL);
+		LOG(WARNING, EMSG_READFILE, NULL);
 		return (NULL);
 	}
 
@@ -219,28 +219,26 @@ get_last_substr			(const char * str, char delim)
  * characters from 'valid_set', not counting the last '\0'.
  * This behaviour is pretty similar to strspn, but the latter seems broken
  * with some chars like '/'.
- * 
- * TODO: Optimize.
+ * A 256 entries table is filled once per call, so every character in
+ * 'str' is checked with a single lookup.
  * */
 size_t
 get_valid_substr_len		(const char * str, char * valid_set)
 {
-	int i, str_len, valid_set_len;
-	size_t res;
-	
-	str_len = strlen(str);
-	valid_set_len = strlen(valid_set);
-	res = 0;
-	
-	for (i = 0; (i < str_len) && (res == i); i++)
-	{
-		if (strchr(valid_set, str[i]))
-		{
-			res++;
-		}
-	}
+    unsigned char valid_table[256];
+    const unsigned char * cur;
 
-	return (res);
+    memset(valid_table, 0, sizeof(valid_table));
+
+    for (cur = (const unsigned char *)valid_set; *cur != '\0'; cur++)
+    {
+	valid_table[*cur] = 1;
+    }
+
+    /* '\0' is never valid, so the loop stops at the end of 'str'. */
+    for (cur = (const unsigned char *)str; valid_table[*cur]; cur++);
+
+    return (cur - (const unsigned char *)str);
 }
 
 /* concat_and_free()
@@ -416,85 +414,54 @@ parse_key_value		(char * str, const char ** keys, int len, char * delimiters, in
  * 
  * Formats a string 'str' to print it on screen, truncating it if it is
  * necessary.
- * Result must be freed when it is no longer used.
+ * Result is allocated from 'arena', or must be freed when it is no longer
+ * used if 'arena' is NULL.
  * */
 char *
-wipe_special_chars		(char * str, int len)
+wipe_special_chars		(Arena * arena, char * str, int len)
 {
-	int str_len, head_len, tail_len;
-	char * head, * tail, * offset, * res, * special_str;
-	char special_char;
+	char * res, * cur, * special;
+	int str_len;
 	
-	/* Chars to format. */
+	/* Chars to format, and their printable form. */
 	const char * special_chars = "\b\t\n\v\f\r\e";
+	const char * printable_chars = "btnvfre";
 
 	/* Don't allow lengths over 'len'. */
-	if ((len > 0) && (strlen(str) > len))
+	str_len = strlen(str);
+
+	if ((len > 0) && (str_len > len))
 	{
-		res = malloc((len + 5) * sizeof(char));
-		snprintf(res, len, "%s", str);
-		sprintf(res + len - 1, "[...]");
-		str_len = strlen(res);
+		str_len = len - 1;
 	}
-	else
+
+	/* Every char might be escaped, and a '[...]' mark might be added. */
+	if ((res = arena_alloc(arena, (2 * str_len) + 6)) == NULL)
 	{
-		str_len = asprintf(&res, "%s", str);
+		return (NULL);
 	}
 
-	while ((offset = strpbrk(res, special_chars)) != NULL)
+	for (cur = res; str_len > 0; str++, str_len--)
 	{
-		special_char = offset[0];
-		special_str = NULL;
-		
-		switch (special_char)
-		{		
-			case ('\b'):
-				asprintf(&special_str, "\\b");
-				break;
-				
-			case ('\t'):
-				asprintf(&special_str, "\\t");
-				break;
-				
-			case ('\n'):
-				asprintf(&special_str, "\\n");
-				break;
-				
-			case ('\v'):
-				asprintf(&special_str, "\\v");
-				break;
-				
-			case ('\f'):
-				asprintf(&special_str, "\\f");
-				break;
-				
-			case ('\r'):
-				asprintf(&special_str, "\\r");
-				break;
-				
-			case ('\e'):
-				asprintf(&special_str, "\\e");
-				break;
+		if ((*str != '\0') && ((special = strchr(special_chars, *str)) != NULL))
+		{
+			*cur++ = '\\';
+			*cur++ = printable_chars[special - special_chars];
 		}
-		
-		if (special_str != NULL)
+		else
 		{
-			head_len = offset - res + 1;
-			head = malloc(head_len * sizeof(char));
-			snprintf(head, head_len, "%s", res);
-			
-			tail_len = str_len - head_len + 1;
-			tail = malloc(tail_len * sizeof(char));
-			snprintf(tail, tail_len, "%s", res + head_len);
-			
-			free(res);
-			str_len = asprintf(&res, "%s%s%s", head, special_str, tail);
-
-			free(head);
-			free(tail);
-			free(special_str);
+			*cur++ = *str;
 		}
 	}
+
+	if ((len > 0) && (*str != '\0'))
+	{
+		strcpy(cur, "[...]");
+	}
+	else
+	{
+		*cur = '\0';
+	}
 	
 	return (res);
 }
@@ -582,19 +549,15 @@ const char *
 get_server_name			()
 {
 	char * hostname;
-	char * default_hostname;
-	
-	asprintf(&default_hostname, "localhost");
 	
-	if ((hostname = malloc(30 * sizeof(char))) == NULL)
+	if (((hostname = malloc(30 * sizeof(char))) != NULL) &&
+		(gethostname(hostname, 30) == 0))
 	{
-		return (default_hostname);
+		return (hostname);
 	}
 	
-	if (gethostname(hostname, 30) != 0)
-	{
-		return (default_hostname);
-	}
+	free(hostname);
+	asprintf(&hostname, "localhost");
 	
 	return (hostname);
 }
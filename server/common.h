@@ -27,6 +27,9 @@ typedef short			Boolean;
 
 #include "msg.h"
 #include "logging.h"
+#include "arena.h"
+#include "timer.h"
+#include "control.h"
 
 /* ********** Public functions ********** */
 
@@ -69,7 +72,7 @@ char **
 parse_key_value			(char * str, const char ** keys, int len, char * delimiters, int max_len);
 
 char *
-wipe_special_chars		(char * str, int len);
+wipe_special_chars		(Arena * arena, char * str, int len);
 
 /* Atomic functions. */
 inline
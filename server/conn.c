@@ -14,9 +14,10 @@
 #include <unistd.h>
 #include <mysql.h>
 
-#include "request.h"
 #include "common.h"
+#include "request.h"
 #include "conn.h"
+#include "metrics.h"
 
 /* ********** Constant definitions ********** */
 #define QUEUE_PER_CHILD		3
@@ -37,6 +38,12 @@ pthread_mutex_t conn_lock 	= PTHREAD_MUTEX_INITIALIZER;
 int 		server_sd	= 0;
 struct linger   close_timeout   = {0, 0};
 
+/* Persistent connections: maximum idle time (in seconds) between two
+ * requests, and maximum number of requests per connection.
+ * */
+int		keepalive_timeout = DEFAULT_KEEPALIVE_TO;
+int		max_requests	= DEFAULT_MAX_REQUESTS;
+
 /* 'alive_flag' contains a flag to notify each thread if it should
  * stop the main process.
  * */
@@ -77,6 +84,7 @@ child_main				(void * arg)
     int pos;
     socklen_t client_len;
     struct sockaddr_in client_addr;
+    ClientConn conn;
     char * add_info;
 	
     pos = (int)arg;
@@ -84,10 +92,31 @@ child_main				(void * arg)
 	
     /* Initialize MySQL threaded interaction. */
     mysql_thread_init();
+
+    /* Every connection managed by this child reuses the same buffer
+     * and arena.
+     * */
+    if (init_input_buffer(&conn.input) != EXIT_SUCCESS)
+    {
+	LOG(ERROR, EMSG_CREATECHILD, NULL);
+	mysql_thread_end();
+	return (NULL);
+    }
+
+    if (init_arena(&conn.arena, ARENA_BLOCK_SIZE) != EXIT_SUCCESS)
+    {
+	LOG(ERROR, EMSG_CREATECHILD, NULL);
+	free_input_buffer(&conn.input);
+	mysql_thread_end();
+	return (NULL);
+    }
 	
-    asprintf(&add_info, "Thread ID: %d\n", pos);
-    log_message(MESSAGE, IMSG_THREADINIT, add_info);
-    free(add_info);
+    if (LOG_ENABLED(MESSAGE))
+    {
+	asprintf(&add_info, "Thread ID: %d\n", pos);
+	log_message(MESSAGE, IMSG_THREADINIT, add_info);
+	free(add_info);
+    }
 	
     while (alive_flag > 0)
     {
@@ -95,14 +124,32 @@ child_main				(void * arg)
 	client_sd = accept(server_sd, (struct sockaddr *) &client_addr, &client_len);
 	pthread_mutex_unlock(&conn_lock);
 		
+	metrics_add(M_CONNECTIONS, 1);
+	metrics_start_first_byte();
+
 	/* Abort connection without waiting to send remaining data. */
 	setsockopt(client_sd, SOL_SOCKET, SO_LINGER, &close_timeout, sizeof(struct linger));
 	children[pos].conn_count++;
+
+	conn.sd = client_sd;
+	conn.ip_num = client_addr.sin_addr.s_addr;
+	conn.input.len = 0;
+	conn.input.request_len = 0;
+	conn.requests = 0;
+	conn.max_requests = (keepalive_timeout > 0) ? max_requests : 1;
+	conn.idle_timeout = keepalive_timeout;
+	start_timer(&conn.timer, client_sd);
 		
-	/* Process request */
-	manage_request(client_sd);
+	/* Process requests until the connection is closed, either by
+	 * the client or because it has been idle for too long.
+	 * */
+	while ((manage_request(&conn) == EXIT_SUCCESS) && conn.keep_alive && (alive_flag > 0));
+	stop_timer(&conn.timer);
 	close(client_sd);
     }
+
+    free_input_buffer(&conn.input);
+    free_arena(&conn.arena);
 	
     /* End MySQL threaded interaction . */
     mysql_thread_end();
@@ -145,7 +192,7 @@ get_child_pos			()
 	
     if (i >= child_num)
     {
-	log_message(WARNING, EMSG_CHILDNOTFOUND, NULL);
+	LOG(WARNING, EMSG_CHILDNOTFOUND, NULL);
 	return (ECOD_CHILDNOTFOUND);
     }
     return (i);
@@ -177,7 +224,7 @@ get_conn_served			()
  * threads.
  * */
 int
-init_conn		(int port, int num_children, int closed_timeout)
+init_conn		(int port, int num_children, int closed_timeout, int keepalive_to, int max_req)
 {
     int i;
     const int reuse = 1;
@@ -186,7 +233,7 @@ init_conn		(int port, int num_children, int closed_timeout)
 	
     if ((children = malloc(num_children * sizeof(Child))) == NULL)
     {
-	log_message(CRITICAL, EMSG_CHILDALLOC, NULL);
+	LOG(CRITICAL, EMSG_CHILDALLOC, NULL);
 	return (ECOD_CHILDALLOC);
     }
 	
@@ -195,14 +242,14 @@ init_conn		(int port, int num_children, int closed_timeout)
     /* Create the server socket. */
     if ((server_sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
     {
-	log_message(CRITICAL, EMSG_SOCKET, NULL);
+	LOG(CRITICAL, EMSG_SOCKET, NULL);
 	return(ECOD_SOCKET);
     }
 
     /* Set this to avoid TIME_WAIT problems reusing the socket. */
     if (setsockopt(server_sd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) < 0)
     {
-	log_message(WARNING, EMSG_REUSEADDR, NULL);
+	LOG(WARNING, EMSG_REUSEADDR, NULL);
     }
 
     /* Sets the connection information and bind it. */
@@ -214,7 +261,7 @@ init_conn		(int port, int num_children, int closed_timeout)
     if (bind(server_sd, (struct sockaddr *) &server_address, sizeof(struct sockaddr_in)) < 0)
     {
 	close(server_sd);
-	log_message(CRITICAL, EMSG_BIND, NULL);
+	LOG(CRITICAL, EMSG_BIND, NULL);
 	return (ECOD_BIND);
     }
 
@@ -224,13 +271,16 @@ init_conn		(int port, int num_children, int closed_timeout)
     if (listen(server_sd, num_children * QUEUE_PER_CHILD) < 0)
     {
 	close(server_sd);
-	log_message(CRITICAL, EMSG_LISTEN, NULL);
+	LOG(CRITICAL, EMSG_LISTEN, NULL);
 	return (ECOD_LISTEN);
     }
 	
-    asprintf(&add_info, "Listening port: %d; Active threads: %d\n", port, num_children);
-    log_message(MESSAGE, IMSG_CONNINIT, add_info);
-    free(add_info);
+    if (LOG_ENABLED(MESSAGE))
+    {
+	asprintf(&add_info, "Listening port: %d; Active threads: %d\n", port, num_children);
+	log_message(MESSAGE, IMSG_CONNINIT, add_info);
+	free(add_info);
+    }
 
     /* Set linger timeout. */
     if (closed_timeout > 0)
@@ -243,6 +293,10 @@ init_conn		(int port, int num_children, int closed_timeout)
 	close_timeout.l_onoff = 0;
     }
 
+    /* Persistent connections are disabled with a zero timeout. */
+    keepalive_timeout = (keepalive_to > 0) ? keepalive_to : 0;
+    max_requests = (max_req > 0) ? max_req : 1;
+
     for (i = 0; i < num_children; i++)
     {
 	children[i].conn_count = 0;
@@ -252,7 +306,7 @@ init_conn		(int port, int num_children, int closed_timeout)
 	    /* This error should be managed more precisely.
 	     * Maybe it might go on with at least 1 thread.
 	     * */
-	    log_message(ERROR, EMSG_CREATECHILD, NULL);
+	    LOG(ERROR, EMSG_CREATECHILD, NULL);
 	    return (ECOD_CREATECHILD);
 	}
 	else
@@ -13,6 +13,8 @@
 #define DEFAULT_PORT	        80
 #define DEFAULT_NUM_CHILDREN    192
 #define DEFAULT_CLOSED_TO       0
+#define DEFAULT_KEEPALIVE_TO    5
+#define DEFAULT_MAX_REQUESTS    100
 
 /* ********** Public functions ********** */
 int
@@ -25,6 +27,6 @@ long long *
 get_conn_served			();
 
 int
-init_conn			(int port, int num_children, int closed_timeout);
+init_conn			(int port, int num_children, int closed_timeout, int keepalive_to, int max_req);
 
 #endif
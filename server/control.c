@@ -0,0 +1,223 @@
+/* Control module.
+ * File: control.c
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Control messages sent by clients while a stream is being sent.
+ * A single thread waits on every stream socket with epoll, and flags
+ * the streams with data to read, so streams never poll their sockets:
+ * they only check their flag between chunks.
+ * Sockets are registered as one shot, and registered again once read,
+ * so the thread only wakes up when a client sends something.
+ * */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "common.h"
+#include "control.h"
+
+/* ********** Constant definitions ********** */
+
+/* Events handled on each epoll_wait() call. */
+#define CONTROL_EVENTS		64
+
+#define CONTROL_FLAGS		(EPOLLIN | EPOLLRDHUP | EPOLLONESHOT)
+
+/* ********** Global variables ********** */
+int control_fd = -1;
+pthread_t control_thread;
+
+/* ********** Private functions ********** */
+
+/* arm_control()
+ *
+ * Wait for the next data on a control channel.
+ * */
+static
+int
+arm_control			(Control * control, int op)
+{
+    struct epoll_event event;
+
+    event.events = CONTROL_FLAGS;
+    event.data.ptr = control;
+
+    return (epoll_ctl(control_fd, op, control->sd, &event));
+}
+
+/* wait_control()
+ *
+ * Main function of the control thread.
+ * Control structures live as long as the thread serving them, so a
+ * flag set after a stream has ended only costs its next stream a
+ * useless read.
+ * */
+static
+void *
+wait_control			(void * arg)
+{
+    struct epoll_event events[CONTROL_EVENTS];
+    int num_events, i;
+
+    while (TRUE)
+    {
+	if ((num_events = epoll_wait(control_fd, events, CONTROL_EVENTS, -1)) < 0)
+	{
+	    continue;
+	}
+
+	for (i = 0; i < num_events; i++)
+	{
+	    ((Control *)events[i].data.ptr)->ready = TRUE;
+	}
+    }
+
+    return (NULL);
+}
+
+/* ********** Public functions ********** */
+
+/* init_control()
+ *
+ * Start the control thread.
+ * */
+int
+init_control			()
+{
+    if (((control_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) ||
+	(pthread_create(&control_thread, NULL, &wait_control, NULL) != 0))
+    {
+	LOG(CRITICAL, EMSG_CONTROLTHREAD, NULL);
+	return (ECOD_CONTROLTHREAD);
+    }
+
+    pthread_detach(control_thread);
+    return (EXIT_SUCCESS);
+}
+
+/* watch_control()
+ *
+ * Start reading control messages from socket 'sd', after the 'len'
+ * bytes in 'data' already read from it. Those are skipped if they do
+ * not fit in the buffer, as any message too long.
+ * */
+void
+watch_control			(Control * control, int sd, const char * data, size_t len)
+{
+    control->sd = sd;
+    control->ready = FALSE;
+    control->discarding = FALSE;
+    control->len = len;
+    control->consumed = 0;
+
+    /* Too much to keep: skip it, up to the end of the last message. */
+    if (len > CONTROL_MSG_LEN)
+    {
+	LOG_RATELIMITED(WARNING, EMSG_CONTROLTOOLONG, NULL);
+	control->discarding = (data[len - 1] != '\n');
+	control->len = 0;
+    }
+
+    memcpy(control->buf, data, control->len);
+    control->watched = (arm_control(control, EPOLL_CTL_ADD) == 0);
+}
+
+/* unwatch_control()
+ *
+ * Stop reading control messages. Must be called before the socket is
+ * closed.
+ * */
+void
+unwatch_control			(Control * control)
+{
+    if (control->watched)
+    {
+	epoll_ctl(control_fd, EPOLL_CTL_DEL, control->sd, NULL);
+	control->watched = FALSE;
+    }
+}
+
+/* read_control()
+ *
+ * Return the next whole control message received, without its line
+ * ending, or NULL if there is none. The socket is only read if the
+ * control thread has found data on it.
+ * Messages are valid until the next call.
+ * */
+char *
+read_control			(Control * control)
+{
+    char * end;
+    ssize_t bytes_read;
+
+    while (TRUE)
+    {
+	/* Remove the message returned last time. */
+	if (control->consumed > 0)
+	{
+	    control->len -= control->consumed;
+	    memmove(control->buf, control->buf + control->consumed, control->len);
+	    control->consumed = 0;
+	}
+
+	if ((end = memchr(control->buf, '\n', control->len)) != NULL)
+	{
+	    control->consumed = end + 1 - control->buf;
+
+	    if (control->discarding)
+	    {
+		control->discarding = FALSE;
+		continue;
+	    }
+
+	    if ((end > control->buf) && (*(end - 1) == '\r'))
+	    {
+		end--;
+	    }
+
+	    *end = '\0';
+	    return (control->buf);
+	}
+
+	/* No line ending fits in the buffer: skip until the next one. */
+	if (control->len >= CONTROL_MSG_LEN)
+	{
+	    LOG_RATELIMITED(WARNING, EMSG_CONTROLTOOLONG, NULL);
+	    control->discarding = TRUE;
+	    control->len = 0;
+	}
+
+	if (!control->ready)
+	{
+	    return (NULL);
+	}
+
+	control->ready = FALSE;
+
+	if ((bytes_read = recv(control->sd, control->buf + control->len, CONTROL_MSG_LEN - control->len, MSG_DONTWAIT)) > 0)
+	{
+	    control->len += bytes_read;
+	}
+	else if ((bytes_read == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+	{
+	    /* Nothing else will be sent by this client. */
+	    unwatch_control(control);
+	    return (NULL);
+	}
+
+	/* Sockets are level triggered, so any data left wakes the
+	 * thread up again at once.
+	 * */
+	if (control->watched && (arm_control(control, EPOLL_CTL_MOD) != 0))
+	{
+	    unwatch_control(control);
+	}
+    }
+}
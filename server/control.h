@@ -0,0 +1,60 @@
+/* Control module.
+ * File: control.h
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Control messages sent by clients while a stream is being sent.
+ * */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stddef.h>
+
+/* ********** Constant definitions ********** */
+
+/* Longest control message, without its line ending. Longer ones are
+ * discarded.
+ * */
+#define CONTROL_MSG_LEN		256
+
+/* ********** Type definitions ********** */
+
+/* Control channel of a stream.
+ * Clients send control messages on the stream connection, each one a
+ * query string ended by a new line ("quality=1&pos=20\n"). Messages
+ * may arrive split or together in any way, so they are kept in 'buf'
+ * until their line ends.
+ *  - 'ready' is set by the control thread once there is data to read,
+ *    so nothing is read from the socket until then.
+ *  - 'consumed' is the length of the last message returned, removed
+ *    from 'buf' on the next call.
+ *  - 'discarding' is set while skipping a message too long.
+ * */
+typedef
+struct _control
+{
+    int sd;
+    volatile int ready;
+    int watched;
+    int discarding;
+    size_t len;
+    size_t consumed;
+    char buf[CONTROL_MSG_LEN + 1];
+}
+Control;
+
+/* ********** Public functions ********** */
+int
+init_control			();
+
+void
+watch_control			(Control * control, int sd, const char * data, size_t len);
+
+void
+unwatch_control			(Control * control);
+
+char *
+read_control			(Control * control);
+
+#endif
@@ -4,17 +4,37 @@
  * License: GPLv3
  * 
  * Non video files related module.
+ * Every file is loaded once and kept in memory along with its reply
+ * header, so it can be sent with a single call. Cached files are dropped
+ * as soon as they change on disk.
+ * Text files are also kept compressed, and the best encoding accepted by
+ * each client is sent. Clients holding an up to date copy of a file just
+ * get a "304 Not Modified" reply.
  * */
 
 #define _GNU_SOURCE
 #define _BSD_SOURCE
 
 #include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <zlib.h>
+
+#ifdef BROTLI_SUPPORT
+#include <brotli/encode.h>
+#endif
 
-#include "request.h"
 #include "common.h"
+#include "request.h"
 #include "stream.h"
 #include "reply.h"
 
@@ -61,160 +81,974 @@ char * default_paths [] = {DEFAULT_CROSSDOMAIN_PATH, DEFAULT_DATA_PATH,
 const
 char * http_types [] = {XML_TYPE, XML_TYPE, SWF_TYPE, SWF_TYPE, PLAIN_TYPE, HTML_TYPE};
 
+/* Files worth compressing. SWF files are usually compressed already. */
+const
+Boolean compressible [] = {TRUE, TRUE, FALSE, FALSE, TRUE, TRUE};
+
 const int files_supported_num = 6;
 
+/* File cache.
+ * 'DEFAULT_ID' is the id of generic files, and 'ANY_ID' and 'ANY_CODE'
+ * select every entry when removing files from cache.
+ * */
+#define CACHE_BUCKETS			1024
+#define DEFAULT_ID			-1
+#define ANY_ID				INT_MIN
+#define ANY_CODE			-1
+
+/* Room for a video id, written as a decimal number. */
+#define ID_LEN				16
+
+/* Events that make a cached file invalid. Directories are watched
+ * instead of files, so files replaced with rename() are also noticed.
+ * */
+#define WATCH_EVENTS			(IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | \
+					 IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF)
+#define WATCH_BUF_LEN			4096
+
+/* Connection types, in the same order as the cached headers. */
+#define CONN_TYPES			2
+
+/* Reply types, in the same order as the cached headers. */
+#define REPLY_OK			0
+#define REPLY_NOT_MODIFIED		1
+#define REPLY_TYPES			2
+
+const
+char * reply_codes [] = {HTTP_OK_CODE, HTTP_NOT_MODIFIED_CODE};
+
+const
+char * conn_types [] = {CONN_CLOSE, CONN_KEEP};
+
+/* Content encodings, from the least to the most preferred one. Every
+ * variant of a compressible file also carries a 'Vary' header.
+ * */
+#define ENCODING_IDENTITY		0
+#define ENCODING_GZIP			1
+#define ENCODING_BROTLI			2
+#define ENCODINGS			3
+
+#define VARY_HEADER			"Vary: Accept-Encoding\r\n"
+#define GZIP_WINDOW_BITS		(15 + 16)
+#define GZIP_MEM_LEVEL			9
+
+const
+char * encoding_names [] = {"identity", "gzip", "br"};
+
+/* Suffixes added to the entity tag of compressed variants. */
+const
+char * etag_suffixes [] = {"", "-gz", "-br"};
+
+const
+char * encoding_headers [] = {VARY_HEADER,
+			      "Content-Encoding: gzip\r\n" VARY_HEADER,
+			      "Content-Encoding: br\r\n" VARY_HEADER};
+
+/* ********** Type definitions ********** */
+
+/* A file, with a given content encoding.
+ * Each variant keeps a complete reply header for every reply and
+ * connection type. The date is the only field that changes between
+ * replies, so it is sent apart: 'date_pos' is its offset into the
+ * headers, and 'tail' points to the rest of the header after it.
+ * 'extra_headers' has the encoding and validator headers.
+ * Variants that were not built have no data.
+ * */
+typedef
+struct _file_variant
+{
+    uint8_t * data;
+    int64_t data_size;
+
+    char * etag;
+    char * extra_headers;
+
+    char * header[REPLY_TYPES][CONN_TYPES];
+    unsigned int date_pos[REPLY_TYPES];
+    char * tail[REPLY_TYPES][CONN_TYPES];
+    unsigned int tail_len[REPLY_TYPES][CONN_TYPES];
+}
+FileVariant;
+
+/* A cached file, with every variant built for it.
+ * Entries are reference counted, as they may be dropped from cache
+ * while being sent.
+ * Files not found are cached as well, with no variant and 'missing'
+ * set, until they are created.
+ * */
+typedef
+struct _file_entry
+{
+    int id;
+    int code;
+    time_t mtime;
+    Boolean missing;
+
+    FileVariant variants[ENCODINGS];
+
+    int refs;
+    struct _file_entry * next;
+}
+FileEntry;
 
+/* Watched directories, and the id of the files inside them. */
+typedef
+struct _watched_dir
+{
+    int wd;
+    int id;
+}
+WatchedDir;
 
 /* ********** Global variables ********** */
 char * ad_path = NULL;
+const char * server_name = NULL;
 
+/* File cache, and the lock protecting both the cache and the list of
+ * watched directories.
+ * 'cache_gen' changes every time a file is removed, so files read
+ * before a change are never cached.
+ * */
+FileEntry * cache [CACHE_BUCKETS];
+unsigned int cache_gen = 0;
+pthread_rwlock_t cache_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* inotify related variables. */
+int inotify_fd = -1;
+WatchedDir * watched = NULL;
+int watched_num = 0;
 
 /* ********** Private functions ********** */
 
-/* check_supported_file()
+/* get_file_code()
+ * 
+ * Returns the code of a supported file, or -1 if 'filename' is not
+ * supported.
+ * */
+int
+get_file_code			(const char * filename)
+{
+    int i;
+
+    for (i = 0; (i < files_supported_num) && (strcmp(files_supported[i], filename) != 0); i++);
+
+    return ((i < files_supported_num) ? i : -1);
+}
+
+/* get_bucket()
+ * 
+ * Hash function for the file cache.
+ * */
+static inline
+unsigned int
+get_bucket			(int id, int code)
+{
+    return ((((unsigned int)id * 2654435761U) + code) % CACHE_BUCKETS);
+}
+
+/* free_entry()
+ * 
+ * */
+void
+free_entry			(FileEntry * entry)
+{
+    int i, j, k;
+
+    for (i = 0; i < ENCODINGS; i++)
+    {
+	if (entry->variants[i].data != NULL)
+	{
+	    for (j = 0; j < REPLY_TYPES; j++)
+	    {
+		for (k = 0; k < CONN_TYPES; k++)
+		{
+		    free(entry->variants[i].header[j][k]);
+		}
+	    }
+
+	    free(entry->variants[i].etag);
+	    free(entry->variants[i].extra_headers);
+	    free(entry->variants[i].data);
+	}
+    }
+
+    free(entry);
+}
+
+/* release_entry()
+ * 
+ * Drop a reference to a cached file, and free it if it is not used
+ * anymore.
+ * */
+void
+release_entry			(FileEntry * entry)
+{
+    if (__sync_sub_and_fetch(&entry->refs, 1) == 0)
+    {
+	free_entry(entry);
+    }
+}
+
+/* find_entry()
+ * 
+ * Search for a file in cache. If it is found, returns it with a new
+ * reference, that should be dropped with release_entry().
+ * This function is thread safe.
+ * */
+FileEntry *
+find_entry			(int id, int code)
+{
+    FileEntry * entry;
+
+    pthread_rwlock_rdlock(&cache_lock);
+
+    for (entry = cache[get_bucket(id, code)];
+	 (entry != NULL) && ((entry->id != id) || (entry->code != code));
+	 entry = entry->next);
+
+    if (entry != NULL)
+    {
+	__sync_add_and_fetch(&entry->refs, 1);
+    }
+
+    pthread_rwlock_unlock(&cache_lock);
+    return (entry);
+}
+
+/* remove_entries()
  * 
- * Checks if the directory, the file 'filename' and its type are supported.
- * Returns the type in 'reply.h' fashion, that must be freed after use.
+ * Remove files from cache. Both 'id' and 'code' may be 'ANY_ID' and
+ * 'ANY_CODE' to remove several files at once.
+ * This function is thread safe.
  * */
-char *
-check_supported_file		(char * filename)
+void
+remove_entries			(int id, int code)
 {
-    char * res;
+    FileEntry ** prev, * entry, * removed;
     int i;
-    const int vlen = 5;
 
-    /* Find out if it is a valid file name. */
-    for (i = 0; (i < vlen) && (strcmp(files_supported[i], filename) != 0); i++);
-    if (i >= vlen)
+    removed = NULL;
+    pthread_rwlock_wrlock(&cache_lock);
+    cache_gen++;
+
+    for (i = 0; i < CACHE_BUCKETS; i++)
+    {
+	prev = &cache[i];
+
+	while ((entry = *prev) != NULL)
+	{
+	    if (((id == ANY_ID) || (entry->id == id)) &&
+		((code == ANY_CODE) || (entry->code == code)))
+	    {
+		*prev = entry->next;
+		entry->next = removed;
+		removed = entry;
+	    }
+	    else
+	    {
+		prev = &entry->next;
+	    }
+	}
+    }
+
+    pthread_rwlock_unlock(&cache_lock);
+
+    /* Files being sent are freed later, by their senders. */
+    while ((entry = removed) != NULL)
+    {
+	removed = entry->next;
+	release_entry(entry);
+    }
+}
+
+/* watch_dir()
+ * 
+ * Watch the directory where files with the same 'id' are stored.
+ * This function is thread safe.
+ * */
+int
+watch_dir			(int id, char * dir)
+{
+    int i, wd;
+
+    if ((inotify_fd < 0) ||
+	((wd = inotify_add_watch(inotify_fd, dir, WATCH_EVENTS)) < 0))
+    {
+	LOG(WARNING, EMSG_FILEWATCH, dir);
+	return (ECOD_FILEWATCH);
+    }
+
+    pthread_rwlock_wrlock(&cache_lock);
+
+    for (i = 0; (i < watched_num) && (watched[i].wd != wd); i++);
+
+    if (i >= watched_num)
+    {
+	watched = realloc(watched, (watched_num + 1) * sizeof(WatchedDir));
+	watched[watched_num].wd = wd;
+	watched[watched_num].id = id;
+	watched_num++;
+    }
+
+    pthread_rwlock_unlock(&cache_lock);
+    return (EXIT_SUCCESS);
+}
+
+/* watch_files()
+ * 
+ * Thread that removes files from cache when they change.
+ * */
+void *
+watch_files			(void * arg)
+{
+    char buf [WATCH_BUF_LEN] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event * event;
+    char * cur;
+    ssize_t len;
+    int i, id, code;
+
+    while (TRUE)
+    {
+	if ((len = read(inotify_fd, buf, WATCH_BUF_LEN)) <= 0)
+	{
+	    if ((len < 0) && (errno == EINTR))
+	    {
+		continue;
+	    }
+
+	    LOG(ERROR, EMSG_FILEWATCH, NULL);
+	    break;
+	}
+
+	for (cur = buf; cur < (buf + len); cur += sizeof(struct inotify_event) + event->len)
+	{
+	    event = (const struct inotify_event *)cur;
+
+	    /* Some events were lost, so nothing in cache can be trusted. */
+	    if (event->mask & IN_Q_OVERFLOW)
+	    {
+		remove_entries(ANY_ID, ANY_CODE);
+		continue;
+	    }
+
+	    pthread_rwlock_rdlock(&cache_lock);
+	    for (i = 0; (i < watched_num) && (watched[i].wd != event->wd); i++);
+	    id = (i < watched_num) ? watched[i].id : ANY_ID;
+	    pthread_rwlock_unlock(&cache_lock);
+
+	    if (id == ANY_ID)
+	    {
+		continue;
+	    }
+
+	    if (event->mask & (IN_IGNORED | IN_DELETE_SELF))
+	    {
+		/* The directory is gone. */
+		remove_entries(id, ANY_CODE);
+
+		if (event->mask & IN_IGNORED)
+		{
+		    pthread_rwlock_wrlock(&cache_lock);
+		    for (i = 0; (i < watched_num) && (watched[i].wd != event->wd); i++);
+		    if (i < watched_num)
+		    {
+			watched[i] = watched[--watched_num];
+		    }
+		    pthread_rwlock_unlock(&cache_lock);
+		}
+	    }
+	    else if ((event->len > 0) && ((code = get_file_code(event->name)) >= 0))
+	    {
+		LOG(MESSAGE, IMSG_FILECHANGED, (char *)event->name);
+		remove_entries(id, code);
+	    }
+	}
+    }
+
+    return (NULL);
+}
+
+/* get_encodings()
+ * 
+ * Returns the encodings accepted in an 'Accept-Encoding' header, as a
+ * bit mask indexed by encoding code. Encodings with a zero quality value
+ * are not accepted, and '*' stands for every encoding not listed.
+ * */
+int
+get_encodings			(const char * value)
+{
+    const char * cur, * token;
+    size_t token_len;
+    int i, accepted, listed, any;
+    double quality;
+
+    accepted = 1 << ENCODING_IDENTITY;
+    listed = 0;
+    any = -1;
+    cur = value;
+
+    while (*cur != '\0')
+    {
+	/* Read the next token. */
+	for (; (*cur == ' ') || (*cur == '\t') || (*cur == ','); cur++);
+	for (token = cur; (*cur != '\0') && (*cur != ',') && (*cur != ';') && (*cur != ' ') && (*cur != '\t'); cur++);
+	token_len = cur - token;
+
+	/* And its quality value, if any. */
+	quality = 1;
+	for (; (*cur == ' ') || (*cur == '\t'); cur++);
+
+	if (*cur == ';')
+	{
+	    for (cur++; (*cur == ' ') || (*cur == '\t'); cur++);
+
+	    if (((*cur == 'q') || (*cur == 'Q')) && (cur[1] == '='))
+	    {
+		quality = strtod(cur + 2, NULL);
+	    }
+	}
+
+	for (; (*cur != '\0') && (*cur != ','); cur++);
+
+	if ((token_len == 1) && (*token == '*'))
+	{
+	    any = (quality > 0);
+	    continue;
+	}
+
+	for (i = 0; (i < ENCODINGS) &&
+		 !((strlen(encoding_names[i]) == token_len) && (strncasecmp(encoding_names[i], token, token_len) == 0)); i++);
+
+	if (i < ENCODINGS)
+	{
+	    listed |= 1 << i;
+	    accepted = (quality > 0) ? (accepted | (1 << i)) : (accepted & ~(1 << i));
+	}
+    }
+
+    if (any > 0)
+    {
+	accepted |= ~listed & ((1 << ENCODINGS) - 1);
+    }
+
+    return (accepted);
+}
+
+/* gzip_data()
+ * 
+ * Compress 'data' in gzip format. Returns the compressed data, that
+ * should be freed after use, or NULL if it cannot be compressed.
+ * */
+uint8_t *
+gzip_data			(const uint8_t * data, int64_t data_size, int64_t * res_size)
+{
+    z_stream stream;
+    uint8_t * res;
+
+    memset(&stream, 0, sizeof(z_stream));
+
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, GZIP_WINDOW_BITS,
+		     GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
     {
 	return (NULL);
     }
-	
-    /* Get the file type. */
-    if (asprintf(&res, "%s", http_types[i]) <= 0)
+
+    *res_size = deflateBound(&stream, data_size);
+    res = malloc(*res_size);
+
+    stream.next_in = (uint8_t *)data;
+    stream.avail_in = data_size;
+    stream.next_out = res;
+    stream.avail_out = *res_size;
+
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
     {
+	deflateEnd(&stream);
+	free(res);
 	return (NULL);
     }
-	
+
+    *res_size = stream.total_out;
+    deflateEnd(&stream);
+
+    return (res);
+}
+
+#ifdef BROTLI_SUPPORT
+/* brotli_data()
+ * 
+ * Compress 'data' in brotli format. Returns the compressed data, that
+ * should be freed after use, or NULL if it cannot be compressed.
+ * */
+uint8_t *
+brotli_data			(const uint8_t * data, int64_t data_size, int64_t * res_size)
+{
+    uint8_t * res;
+    size_t size;
+
+    size = BrotliEncoderMaxCompressedSize(data_size);
+    res = malloc(size);
+
+    if ((size == 0) ||
+	!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+			       data_size, data, &size, res))
+    {
+	free(res);
+	return (NULL);
+    }
+
+    *res_size = size;
     return (res);
 }
+#endif
+
+/* build_variant()
+ * 
+ * Compose the reply headers of a file variant, once its data is set.
+ * Its entity tag is made from 'etag_base', that identifies the file on
+ * disk, and its encoding.
+ * */
+void
+build_variant			(FileVariant * variant, int code, int encoding, const char * etag_base, time_t mtime)
+{
+    ReplyParams reply;
+    char last_modified [DATE_LEN];
+    unsigned int header_size;
+    int i, j;
+
+    format_date(mtime, last_modified);
+    asprintf(&variant->etag, "\"%s%s\"", etag_base, etag_suffixes[encoding]);
+    asprintf(&variant->extra_headers, "%sETag: %s\r\nLast-Modified: %s\r\n",
+	     compressible[code] ? encoding_headers[encoding] : "", variant->etag, last_modified);
+
+    reply.http_command = NULL;
+    reply.content_type = (char *)http_types[code];
+    reply.transfer_encoding = NULL;
+    reply.cache_control = NO_CACHE;
+    reply.expiration = NO_EXPIRE;
+    reply.extra_headers = variant->extra_headers;
+
+    /* Every header of the same reply type has the date at the same
+     * offset.
+     * */
+    for (i = 0; i < REPLY_TYPES; i++)
+    {
+	reply.http_code = (char *)reply_codes[i];
+
+	for (j = 0; j < CONN_TYPES; j++)
+	{
+	    reply.connection = (char *)conn_types[j];
+	    variant->header[i][j] = compose_header(NULL, reply, variant->data_size, &header_size);
+	    split_header_date(variant->header[i][j], header_size, &variant->date_pos[i],
+			      &variant->tail[i][j], &variant->tail_len[i][j]);
+	}
+    }
+}
+
+/* cache_entry()
+ * 
+ * Save a file just loaded from 'path' into cache, unless another thread
+ * did it before, or the files of its directory changed since 'gen'.
+ * Returns the file, with a new reference for the caller, and frees
+ * 'path'.
+ * This function is thread safe.
+ * */
+static
+FileEntry *
+cache_entry			(FileEntry * entry, unsigned int gen, Boolean watching, char * path)
+{
+    FileEntry * found;
+    int id, code;
+
+    id = entry->id;
+    code = entry->code;
+
+    if (watching)
+    {
+	pthread_rwlock_wrlock(&cache_lock);
+
+	for (found = cache[get_bucket(id, code)];
+	     (found != NULL) && ((found->id != id) || (found->code != code));
+	     found = found->next);
+
+	if (found != NULL)
+	{
+	    __sync_add_and_fetch(&found->refs, 1);
+	    pthread_rwlock_unlock(&cache_lock);
+	    free_entry(entry);
+	    free(path);
+	    return (found);
+	}
+
+	if (gen == cache_gen)
+	{
+	    entry->refs++;
+	    entry->next = cache[get_bucket(id, code)];
+	    cache[get_bucket(id, code)] = entry;
+
+	    if (!entry->missing)
+	    {
+		LOG(MESSAGE, IMSG_FILECACHED, path);
+	    }
+	}
+
+	pthread_rwlock_unlock(&cache_lock);
+    }
+
+    free(path);
+    return (entry);
+}
+
+/* load_entry()
+ * 
+ * Read a file from disk and compose its reply headers. The file is
+ * saved into cache, unless it changes while it is being loaded, and so
+ * are files not found, so later requests for them are not looked up
+ * again.
+ * Returns the file with a new reference, that should be dropped with
+ * release_entry(), or NULL if it cannot be loaded.
+ * This function is thread safe.
+ * */
+FileEntry *
+load_entry			(int id, int code)
+{
+    FileEntry * entry;
+    FileVariant * identity;
+    struct stat properties;
+    char * dir, * path, * etag_base;
+    unsigned int gen;
+    Boolean watching;
+    int i;
+
+    /* Build the file path. */
+    if (id == DEFAULT_ID)
+    {
+	asprintf(&dir, "%s", DEFAULT_PATH);
+	asprintf(&path, "%s", default_paths[code]);
+    }
+    else if ((asprintf(&dir, "%s/%d", ad_path, id) <= 0) ||
+	     (asprintf(&path, "%s/%s", dir, files_supported[code]) <= 0))
+    {
+	LOG(ERROR, EMSG_BUILDPATH, (char *)files_supported[code]);
+	return (NULL);
+    }
+
+    /* Watch the directory before reading, so no change is missed. */
+    pthread_rwlock_rdlock(&cache_lock);
+    gen = cache_gen;
+    pthread_rwlock_unlock(&cache_lock);
+
+    watching = (watch_dir(id, dir) == EXIT_SUCCESS);
+    free(dir);
+
+    if ((entry = calloc(1, sizeof(FileEntry))) == NULL)
+    {
+	free(path);
+	return (NULL);
+    }
+
+    entry->id = id;
+    entry->code = code;
+    entry->refs = 1;
+
+    /* Check if file exists, and get its identity. */
+    if (stat(path, &properties) != 0)
+    {
+	LOG_RATELIMITED(ERROR, EMSG_FILEPATH, path);
+	entry->missing = TRUE;
+	return (cache_entry(entry, gen, watching, path));
+    }
+
+    identity = &entry->variants[ENCODING_IDENTITY];
+
+    if ((identity->data = get_file_contents(path)) == NULL)
+    {
+	free(path);
+	free(entry);
+	return (NULL);
+    }
+
+    entry->mtime = properties.st_mtime;
+    identity->data_size = get_file_size(path);
+
+    /* 'data.xml' is a special case: it has a line that should be changed
+     * before composing the reply.
+     * */
+    if (code == DATA_FILE_CODE)
+    {
+	find_and_replace((char**)&identity->data, "SERVER_URL", server_name);
+	identity->data_size = strlen((char *)identity->data);
+    }
+
+    /* Compress text files. Compressed variants are only kept if they are
+     * smaller than the original file.
+     * */
+    if (compressible[code])
+    {
+	entry->variants[ENCODING_GZIP].data = gzip_data(identity->data, identity->data_size,
+							&entry->variants[ENCODING_GZIP].data_size);
+#ifdef BROTLI_SUPPORT
+	entry->variants[ENCODING_BROTLI].data = brotli_data(identity->data, identity->data_size,
+							    &entry->variants[ENCODING_BROTLI].data_size);
+#endif
+    }
+
+    asprintf(&etag_base, "%lx-%llx-%lx", (unsigned long)properties.st_ino,
+	     (unsigned long long)properties.st_size, (unsigned long)properties.st_mtime);
+
+    for (i = 0; i < ENCODINGS; i++)
+    {
+	if ((i != ENCODING_IDENTITY) && (entry->variants[i].data != NULL) &&
+	    (entry->variants[i].data_size >= identity->data_size))
+	{
+	    free(entry->variants[i].data);
+	    entry->variants[i].data = NULL;
+	}
+
+	if (entry->variants[i].data != NULL)
+	{
+	    build_variant(&entry->variants[i], code, i, etag_base, entry->mtime);
+	}
+    }
+
+    free(etag_base);
+
+    return (cache_entry(entry, gen, watching, path));
+}
+
+/* send_iovec()
+ * 
+ * Send every buffer in 'iov', going on after partial writes.
+ * Returns the amount of data written, or -1 on error.
+ * */
+ssize_t
+send_iovec			(int client_sd, struct iovec * iov, int iov_num)
+{
+    struct msghdr msg;
+    ssize_t total_sent, sent;
+
+    memset(&msg, 0, sizeof(struct msghdr));
+    total_sent = 0;
+
+    while (iov_num > 0)
+    {
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iov_num;
+
+	if ((sent = sendmsg(client_sd, &msg, MSG_NOSIGNAL)) < 0)
+	{
+	    if (errno == EINTR)
+	    {
+		continue;
+	    }
+
+	    return (-1);
+	}
+
+	total_sent += sent;
+
+	/* Replies are only cut off once they stop moving. */
+	timer_progress();
+
+	/* Skip every buffer already sent. */
+	while ((iov_num > 0) && ((size_t)sent >= iov->iov_len))
+	{
+	    sent -= iov->iov_len;
+	    iov++;
+	    iov_num--;
+	}
+
+	if (iov_num > 0)
+	{
+	    iov->iov_base = (char *)iov->iov_base + sent;
+	    iov->iov_len -= sent;
+	}
+    }
+
+    return (total_sent);
+}
 
 /* ********** Public functions ********** */
 
 /* init_file()
  * 
- * Initialize some global variables needed to use per ad files.
+ * Initialize some global variables needed to use per ad files, start
+ * watching file changes and load generic files into cache.
  * */
 int
 init_file					(char * path)
 {
+    pthread_t watch_thread;
+    FileEntry * entry;
+    int i;
+
     if (!check_file_exists(path) ||
 	(asprintf(&ad_path, "%s", path) <= 0))
     {
-	log_message(CRITICAL, EMSG_ADPATH, NULL);
+	LOG(CRITICAL, EMSG_ADPATH, NULL);
 	return (ECOD_ADPATH);
     }
+
+    server_name = get_server_name();
+
+    /* Without inotify, files are read from disk on every request. */
+    if (((inotify_fd = inotify_init()) < 0) ||
+	(pthread_create(&watch_thread, NULL, &watch_files, NULL) != 0))
+    {
+	LOG(WARNING, EMSG_FILEWATCH, NULL);
+
+	if (inotify_fd >= 0)
+	{
+	    close(inotify_fd);
+	    inotify_fd = -1;
+	}
+    }
+    else
+    {
+	pthread_detach(watch_thread);
+    }
+
+    for (i = 0; i < files_supported_num; i++)
+    {
+	if ((entry = load_entry(DEFAULT_ID, i)) != NULL)
+	{
+	    release_entry(entry);
+	}
+    }
 	
     return (EXIT_SUCCESS);
 }
 
-/* get_file_by_id()
+/* send_file_by_id()
  * 
- * Returns contents file (as char *) using some URL parameters.
- * The returned value should be freed after its use with free().
- * If there is no ad with the id provided, return the default one.
+ * Send a file using some URL parameters. Any temporary data is allocated
+ * from 'arena'.
+ * 'connection' is the value of the 'Connection' reply header, and
+ * 'headers' has the request headers that may change the reply.
+ * Returns the amount of data written, ECOD_FILESEND if the file could not
+ * be sent, or any other error code if it was not found.
  * */
-char *
-get_file_by_id			(char * filename, char ** params)
+int
+send_file_by_id			(Arena * arena, int client_sd, char * filename, char ** params, char * connection, RequestHeaders * headers)
 {
-    char * res, * path;
-    uint8_t * contents;
+    FileEntry * entry;
+    FileVariant * variant;
     ReplyParams reply;
-    int i;
+    struct iovec iov[4];
+    char * header, * date;
+    char id_str[ID_LEN];
+    unsigned int header_size, date_len;
+    int id, code, conn_type, iov_num, encodings, encoding, reply_type;
+    ssize_t bytes_sent;
 	
-    /* Initialize constant reply parameters. */
-    reply.http_command = NULL;
-    reply.http_code = HTTP_OK_CODE;
-    reply.connection = CONN_CLOSE;
-    reply.transfer_encoding = NULL;
-    reply.expiration = NO_EXPIRE;
-
     /* Check if file type and name are supported. */
-    if ((reply.content_type = check_supported_file(filename)) == NULL)
+    if ((code = get_file_code(filename)) < 0)
     {
-	log_message(ERROR, EMSG_FILEUNKNOWN, filename);
-	return (NULL);
+	LOG_RATELIMITED(ERROR, EMSG_FILEUNKNOWN, filename);
+	return (ECOD_FILEUNKNOWN);
     }
-	
-    if (params[ichoppedthatvideoD_PARAM_CODE] != NULL)
+
+    /* Generic files, such as crossdomain.xml or robots.txt, have no id.
+     * Files are cached and loaded by the number, so ids written any
+     * other way than it (such as "007") are not found.
+     * */
+    id = DEFAULT_ID;
+
+    if (params[VIDEOID_PARAM_CODE] != NULL)
     {
-	/* Manage requests with arguments. */ 
-	if (check_supported_dir(ad_path, params[ichoppedthatvideoD_PARAM_CODE]) == 0)
-	{
-	    log_message(ERROR, EMSG_ADIDUNK, params[ichoppedthatvideoD_PARAM_CODE]);
-	    return (NULL);
-	}
-		
-	/* Build the file path. */
-	if (asprintf(&path, "%s/%s/%s", ad_path, params[ichoppedthatvideoD_PARAM_CODE], filename) <= 0)
+	id = atoi(params[VIDEOID_PARAM_CODE]);
+	snprintf(id_str, ID_LEN, "%d", id);
+
+	if (strcmp(id_str, params[VIDEOID_PARAM_CODE]) != 0)
 	{
-	    log_message(ERROR, EMSG_BUILDPATH, filename);
-	    return (NULL);
+	    LOG_RATELIMITED(ERROR, EMSG_ADIDUNK, params[VIDEOID_PARAM_CODE]);
+	    return (ECOD_ADIDUNK);
 	}
     }
-    else
-    {
-	/* Manage generic files, such as crossdomain.xml or robots.txt. */
-	for (i = 0; (i < files_supported_num) && (strcmp(filename, files_supported[i])); i++);
 
-	if (i < files_supported_num)
+    if ((entry = find_entry(id, code)) == NULL)
+    {
+	if ((id != DEFAULT_ID) &&
+	    (check_supported_dir(ad_path, id_str) == 0))
 	{
-	    asprintf(&path, "%s", default_paths[i]);
+	    LOG_RATELIMITED(ERROR, EMSG_ADIDUNK, params[VIDEOID_PARAM_CODE]);
+	    return (ECOD_ADIDUNK);
 	}
-	else
+
+	if ((entry = load_entry(id, code)) == NULL)
 	{
-	    log_message(ERROR, EMSG_FILEUNKNOWN, filename);
-	    return (NULL);
+	    return (ECOD_FILEPATH);
 	}
     }
-	
-    /* Check if file exists. */
-    if (!check_file_exists(path))
+
+    if (entry->missing)
     {
-	log_message(ERROR, EMSG_FILEPATH, path);
-	free(path);
-	return (NULL);
+	release_entry(entry);
+	return (ECOD_FILEPATH);
     }
 
-    contents = get_file_contents(path);
-	
-    /* Cache control. */
-    if (params[CACHE_PARAM_CODE] != NULL)
+    for (conn_type = 0; (conn_type < (CONN_TYPES - 1)) && (strcmp(connection, conn_types[conn_type]) != 0); conn_type++);
+
+    /* Select the preferred encoding among the ones accepted. */
+    encodings = (headers->accept_encoding != NULL) ? get_encodings(headers->accept_encoding) : (1 << ENCODING_IDENTITY);
+
+    for (encoding = ENCODINGS - 1;
+	 (encoding > ENCODING_IDENTITY) && !((encodings & (1 << encoding)) && (entry->variants[encoding].data != NULL));
+	 encoding--);
+
+    variant = &entry->variants[encoding];
+
+    /* The client may have this very variant already. */
+    reply_type = is_not_modified(headers, variant->etag, entry->mtime) ? REPLY_NOT_MODIFIED : REPLY_OK;
+
+    if (params[CACHE_PARAM_CODE] == NULL)
     {
-	asprintf(&reply.cache_control, "%s%s", MAX_AGE, params[CACHE_PARAM_CODE]);
+	/* Cached header, with the current date in the middle. */
+	date = get_date(&date_len);
+	iov[0].iov_base = variant->header[reply_type][conn_type];
+	iov[0].iov_len = variant->date_pos[reply_type];
+	iov[1].iov_base = date;
+	iov[1].iov_len = date_len;
+	iov[2].iov_base = variant->tail[reply_type][conn_type];
+	iov[2].iov_len = variant->tail_len[reply_type][conn_type];
+	iov_num = 3;
     }
     else
     {
-	reply.cache_control = NO_CACHE;
+	/* Cache control changes with every request. */
+	reply.http_command = NULL;
+	reply.http_code = (char *)reply_codes[reply_type];
+	reply.content_type = (char *)http_types[code];
+	reply.connection = connection;
+	reply.transfer_encoding = NULL;
+	reply.expiration = NO_EXPIRE;
+	reply.extra_headers = variant->extra_headers;
+	reply.cache_control = arena_printf(arena, NULL, "%s%s", MAX_AGE, params[CACHE_PARAM_CODE]);
+
+	header = compose_header(arena, reply, variant->data_size, &header_size);
+
+	iov[0].iov_base = header;
+	iov[0].iov_len = header_size;
+	iov_num = 1;
     }
 
-    /* 'data.xml' is a special case: it has a line that should be changed
-     * before composing the reply.
-     * */
-    if (strstr(path, DATA_FILE_NAME))
+    /* "304 Not Modified" replies have no body. */
+    if (reply_type == REPLY_OK)
     {
-	find_and_replace((char**)&contents, "SERVER_URL", get_server_name());
+	iov[iov_num].iov_base = variant->data;
+	iov[iov_num].iov_len = variant->data_size;
+	iov_num++;
     }
-	
-    res = compose_reply(reply, contents, strlen((char*)contents), NULL);
-    free(contents);
-    free(path);
-    free(reply.content_type);
-	
-    if (params[CACHE_PARAM_CODE] != NULL)
+
+    bytes_sent = send_iovec(client_sd, iov, iov_num);
+
+    release_entry(entry);
+
+    if (bytes_sent < 0)
     {
-	free(reply.cache_control);
+	LOG_RATELIMITED(MESSAGE, EMSG_FILESEND, filename);
+	return (ECOD_FILESEND);
     }
 
-    return (res);
+    return (bytes_sent);
 }
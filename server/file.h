@@ -9,11 +9,16 @@
 #ifndef FILE_H
 #define FILE_H
 
+#include <sys/uio.h>
+
 /* ********** Public functions ********** */
 int
 init_file				(char * path);
 
-char *
-get_file_by_id			(char * filename, char ** params);
+int
+send_file_by_id			(Arena * arena, int client_sd, char * filename, char ** params, char * connection, RequestHeaders * headers);
+
+ssize_t
+send_iovec			(int client_sd, struct iovec * iov, int iov_num);
 
 #endif
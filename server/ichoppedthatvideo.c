@@ -23,8 +23,13 @@
 #include "signal.h"
 #include "common.h"
 #include "conn.h"
+#include "request.h"
 #include "stream.h"
+#include "mp4.h"
+#include "cmaf.h"
+#include "session.h"
 #include "file.h"
+#include "metrics.h"
 
 #include "logging.h"
 
@@ -50,8 +55,16 @@ print_usage			(const char * app_name)
 	   "System specific options\n"
 	   "\t-P num, --port num\t\t Use the port 'port' to receive data [Default: %d]\n"
 	   "\t-c num, --children num\t\t Create 'num' children processes [Default: %d]\n"
-	   "\t-t num, --timeout num\t\t Set a timeout of 'num' seconds for each connection [Default: %d, mininum value: %d]\n"
-	   "\t-C num, --closed-timeout num\t\t Set a timeout of 'num' seconds for closed connections [Default: off]\n\n"
+	   "\t-t num, --timeout num\t\t Close streams not sending anything for 'num' seconds [Default: %d, mininum value: %d]\n"
+	   "\t-C num, --closed-timeout num\t\t Set a timeout of 'num' seconds for closed connections [Default: off]\n"
+	   "\t-k num, --keepalive num\t\t Keep idle connections open for 'num' seconds, 0 to disable [Default: %d]\n"
+	   "\t-K num, --max-requests num\t Serve up to 'num' requests per connection [Default: %d]\n"
+	   "\t-M num, --metrics num\t\t Serve metrics on port 'num', only to local clients, 0 to disable [Default: %d]\n"
+	   "\t-e num, --pace num\t\t Send adaptive streams at 'num' percent of their bitrate, at least %d, 0 to disable [Default: %d]\n"
+	   "\t-b num, --pace-burst num\t Send the first 'num' seconds of video without pacing [Default: %d]\n"
+	   "\t-m num, --segment-cache num\t Keep up to 'num' megabytes of CMAF segments in memory, 0 to disable [Default: %d]\n"
+	   "\t-w 'file', --warmup 'file'\t Load the most requested videos listed in 'file' on startup, and keep the list there [Default: off]\n"
+	   "\t-W num, --warmup-top num\t Load up to 'num' videos on startup [Default: %d]\n\n"
 	   "Debug specific options\n"
 	   "\t-o 'output', --output 'output'\t Set the default log output: 'syslog', 'console' or 'both' [Default: %s]\n"
 	   "\t-l num, --log-level num\t\t Define the minimum logging level, from more (1) to less (4) verbosity [Default: %d (Log only critical messages)]\n"
@@ -62,7 +75,8 @@ print_usage			(const char * app_name)
 	   "\t-R num, --request num\t\t Define maximum number of requests per second allowed [Default: %d]\n"
 	   "\t-T num, --time num\t\t Define maximum time (in seconds) an IP can be blacklisted [Default: %d]\n"
 	   "\t-B num, --blacklist num\t\t Set blacklist length to 'num' [Default: %d]\n",
-	   DEFAULT_PATH, DEFAULT_PORT, DEFAULT_NUM_CHILDREN, DEFAULT_TIMEOUT, MIN_TIMEOUT, DEFAULT_OUTPUT, DEFAULT_LOG_LEVEL, 
+	   DEFAULT_PATH, DEFAULT_PORT, DEFAULT_NUM_CHILDREN, DEFAULT_TIMEOUT, MIN_TIMEOUT,
+	   DEFAULT_KEEPALIVE_TO, DEFAULT_MAX_REQUESTS, DEFAULT_METRICS_PORT, MIN_PACE, DEFAULT_PACE, DEFAULT_PACE_BURST, DEFAULT_SEGMENT_CACHE, DEFAULT_WARMUP_TOP, DEFAULT_OUTPUT, DEFAULT_LOG_LEVEL, 
 	   DEFAULT_REQ_LIMIT, DEFAULT_TIME_LIMIT, DEFAULT_BLCK_LEN
 	);
 }
@@ -156,7 +170,7 @@ dump_core			(int size)
     }
     else
     {
-	log_message(WARNING, EMSG_SULIMIT, NULL);
+	LOG(WARNING, EMSG_SULIMIT, NULL);
     }
 }
 
@@ -174,7 +188,7 @@ main				(int argc, char* argv[])
 
     /* getopt_long() variables. */
     int next_opt;				                  /* Next option in getopt_long() */
-    const char * short_opts = "hvDp:asP:c:t:C:o:l:d:SR:T:B:";     /* Short options */
+    const char * short_opts = "hvDp:asP:c:t:C:k:K:M:e:b:m:w:W:o:l:d:SR:T:B:";   /* Short options */
     const char * app_name = argv[0];		                  /* Name of the app */
     int daemonize = 0;                                            /* Put the server on background. Default: Off. */
     char * path = DEFAULT_PATH;				          /* Path. Default: "/home/www/htdocs/" */
@@ -184,6 +198,14 @@ main				(int argc, char* argv[])
     int num_children = DEFAULT_NUM_CHILDREN;		          /* Number of child processes. Default: 192 */
     int timeout = DEFAULT_TIMEOUT;                                /* Data transfer timeout, in seconds. Default: 10 */
     int closed_timeout = DEFAULT_CLOSED_TO;                       /* Closed connection timeout, in seconds. Default: 0 (not active). */
+    int keepalive_timeout = DEFAULT_KEEPALIVE_TO;                 /* Idle persistent connection timeout, in seconds. Default: 5. */
+    int max_requests = DEFAULT_MAX_REQUESTS;                      /* Maximum requests per connection. Default: 100. */
+    int metrics_port = DEFAULT_METRICS_PORT;                      /* Metrics admin port. Default: 0 (disabled). */
+    int pace = DEFAULT_PACE;                                      /* Pacing, as a percentage of the bitrate. Default: 0 (disabled). */
+    int pace_burst = DEFAULT_PACE_BURST;                          /* Seconds of video sent before pacing. Default: 10. */
+    int segment_cache = DEFAULT_SEGMENT_CACHE;                    /* CMAF segment cache, in megabytes. Default: 64. */
+    char * warmup_list = NULL;                                    /* Video popularity list. Default: none (no warm-up). */
+    int warmup_top = DEFAULT_WARMUP_TOP;                          /* Videos loaded on startup. Default: 100. */
     char * output = DEFAULT_OUTPUT;                               /* Logging output. Default: syslog. */
     int log_level = DEFAULT_LOG_LEVEL;			          /* Log level. Default: 4 (log only critical messages) */
     int core_size = 0;				                  /* Maximum file size on core dump, in bytes. */
@@ -205,6 +227,14 @@ main				(int argc, char* argv[])
 	{ "children",  1,  NULL,   'c'},
 	{ "timeout",   1,  NULL,   't'},
 	{ "closed-timeout", 1, NULL, 'C'},
+	{ "keepalive", 1,  NULL,   'k'},
+	{ "max-requests", 1, NULL, 'K'},
+	{ "metrics",   1,  NULL,   'M'},
+	{ "pace",      1,  NULL,   'e'},
+	{ "pace-burst", 1, NULL,   'b'},
+	{ "segment-cache", 1, NULL, 'm'},
+	{ "warmup",    1,  NULL,   'w'},
+	{ "warmup-top", 1, NULL,   'W'},
 	{ "output",    1,  NULL,   'o'},
 	{ "log-level", 1,  NULL,   'l'},
 	{ "dump-core", 1,  NULL,   'd'},
@@ -264,6 +294,38 @@ main				(int argc, char* argv[])
 		closed_timeout = atoi(optarg);
 		break;
 
+	    case 'k':
+		keepalive_timeout = atoi(optarg);
+		break;
+
+	    case 'K':
+		max_requests = atoi(optarg);
+		break;
+
+	    case 'M':
+		metrics_port = atoi(optarg);
+		break;
+
+	    case 'e':
+		pace = atoi(optarg);
+		break;
+
+	    case 'b':
+		pace_burst = atoi(optarg);
+		break;
+
+	    case 'm':
+		segment_cache = atoi(optarg);
+		break;
+
+	    case 'w':
+		asprintf(&warmup_list, "%s", optarg);
+		break;
+
+	    case 'W':
+		warmup_top = atoi(optarg);
+		break;
+
 	    case 'o':
 		asprintf(&output, "%s", optarg);
 		break;                    
@@ -344,6 +406,14 @@ main				(int argc, char* argv[])
 	printf("Server configuration summary:\n");
     }
 
+    /* No more processes are forked, so messages can be written by a
+     * separate thread from now on.
+     * */
+    if ((res = start_log()) != EXIT_SUCCESS)
+    {
+	return (res);
+    }
+
     /* Manage signals. */
     signal(SIGSEGV, default_handler);		/* SEGV, like a segmentation fault. */
     signal(SIGINT, default_handler);		/* INT, like Ctrl + C .*/
@@ -369,7 +439,13 @@ main				(int argc, char* argv[])
     }
 
     /* Initialize video management. */
-    if ((res = init_videos(path, signed_auth, timeout)) != EXIT_SUCCESS)
+    if ((res = init_videos(path, signed_auth, timeout, pace, pace_burst)) != EXIT_SUCCESS)
+    {
+	return (res);
+    }
+
+    /* Initialize the CMAF segment cache. */
+    if ((res = init_cmaf(segment_cache)) != EXIT_SUCCESS)
     {
 	return (res);
     }
@@ -405,8 +481,47 @@ main				(int argc, char* argv[])
                "\n\t\t-> Backlist length: %d\n", req_limit, time_limit, blck_len);
     }
 	
+    /* Initialize metrics before any thread records them. */
+    if (metrics_port > 0)
+    {
+	if ((res = init_metrics(metrics_port)) != EXIT_SUCCESS)
+	{
+	    return (res);
+	}
+	printf("\t-> Metrics served on local port %d.\n", metrics_port);
+    }
+	
+    /* Initialize connection timers. */
+    if ((res = init_timers()) != EXIT_SUCCESS)
+    {
+	return (res);
+    }
+
+    /* Initialize stream sessions. */
+    if ((res = init_sessions()) != EXIT_SUCCESS)
+    {
+	return (res);
+    }
+
+    /* Initialize the control channel of streams. */
+    if ((res = init_control()) != EXIT_SUCCESS)
+    {
+	return (res);
+    }
+
+    /* Load the most requested videos before taking any request. */
+    if (warmup_list != NULL)
+    {
+	if ((res = init_warmup(warmup_list, warmup_top)) != EXIT_SUCCESS)
+	{
+	    return (res);
+	}
+	printf("\t-> Warmed up to %d of the most requested videos in '%s'.\n", warmup_top, warmup_list);
+	free(warmup_list);
+    }
+
     /* Initialize children. */
-    if ((res = init_conn(port, num_children, closed_timeout)) != EXIT_SUCCESS)
+    if ((res = init_conn(port, num_children, closed_timeout, keepalive_timeout, max_requests)) != EXIT_SUCCESS)
     {
 	return(res);
     }
@@ -3,7 +3,9 @@
  * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
  * License: GPLv3
  * 
- * Manage logs and messages
+ * Manage logs and messages.
+ * Once started, threads queue their messages into rings of their own,
+ * and a separate thread writes them, so logging never blocks.
  * */
 
 #define _GNU_SOURCE
@@ -15,6 +17,7 @@
 #include <time.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "logging.h"
@@ -24,11 +27,289 @@
 #define SYSLOG_CODE   2
 #define BOTH_CODE     4
 
+/* Records per thread ring, must be a power of 2. */
+#define LOG_RING_SIZE		256
+
+/* Bytes of data kept from each message, including the trailing '\0'. */
+#define LOG_DATA_LEN		232
+
+/* Time the drain thread sleeps when there is nothing to write, in
+ * nanoseconds.
+ * */
+#define LOG_DRAIN_INTERVAL	10000000
+
+/* ********** Type definitions ********** */
+
+/* Messages are always constants from 'msg.h', so only their address is
+ * saved; data is copied, and truncated if it does not fit.
+ * */
+typedef
+struct _log_record
+{
+    int level;
+    int err_num;
+    const char * msg;
+    Boolean has_data;
+    char data[LOG_DATA_LEN];
+}
+LogRecord;
+
+/* Single producer, single consumer ring.
+ * Each thread writes into its own ring, and only the drain thread reads
+ * from it. When a thread ends its ring is released, and may be taken by
+ * any thread started later. Rings are never freed.
+ * */
+typedef
+struct _log_ring
+{
+    volatile unsigned int head;
+    volatile unsigned int tail;
+    volatile unsigned int dropped;
+    unsigned int reported;
+    int in_use;
+    struct _log_ring * next;
+    LogRecord records[LOG_RING_SIZE];
+}
+LogRing;
 
 /* ********** Global variables ********** */
 int min_level  = 0;
 int output_dev = 0;
 
+/* Rings of every thread, and the one owned by the current thread. */
+LogRing * log_rings = NULL;
+__thread LogRing * own_ring = NULL;
+pthread_key_t ring_key;
+
+/* Messages lost because a ring could not be allocated. */
+unsigned int lost_records = 0;
+unsigned int lost_reported = 0;
+
+/* Drain thread. Messages are written at once until it is started. */
+pthread_t drain_thread;
+pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+volatile Boolean async_log = FALSE;
+
+/* ********** Private functions ********** */
+
+/* write_message()
+ * 
+ * Format a message and write it to the output devices.
+ * Only called by a single thread at once, so strerror() is safe here.
+ * */
+static
+void
+write_message		(int level, const char * msg, const char * data, int err_num)
+{
+    char * full_msg;
+    int priority;
+
+    if (data != NULL)
+    {
+	if (level > MESSAGE)
+	{
+	    asprintf(&full_msg, "[MSG] %s    [DATA] %s    [SYSMSG] %s", msg, data, strerror(err_num));
+	}
+	else
+	{
+	    asprintf(&full_msg, "[MSG] %s    [DATA] %s", msg, data);
+	}
+    }
+    else
+    {
+	if (level > MESSAGE)
+	{
+	    asprintf(&full_msg, "[MSG] %s    [SYSMSG] %s", msg, strerror(err_num));
+	}
+	else
+	{
+	    asprintf(&full_msg, "[MSG] %s", msg);
+	}
+    }
+
+    /* Log to console. */
+    if ((output_dev == BOTH_CODE) || (output_dev == CONSOLE_CODE))
+    {
+	fprintf(stderr, "ichoppedthatvideo: %s", full_msg);
+    }
+
+    /* Log to syslog. */
+    if ((output_dev == BOTH_CODE) || (output_dev == SYSLOG_CODE))
+    {
+	priority = LOG_USER;
+
+	switch(level)
+	{
+	    case (CRITICAL):
+		priority = priority | LOG_CRIT;
+		break;
+	    case (ERROR):
+		priority = priority | LOG_ERR;
+		break;	
+	    case (WARNING):
+		priority = priority | LOG_WARNING;
+		break;
+	    case (MESSAGE):
+		priority = priority | LOG_NOTICE;
+		break;
+	    default:
+		priority = priority | LOG_INFO;
+	}
+
+	syslog(priority, "%s", full_msg);
+    }
+
+    free(full_msg);
+}
+
+/* release_ring()
+ * 
+ * Called when a thread ends, so its ring may be reused. Records still
+ * there are written by the drain thread anyway.
+ * */
+static
+void
+release_ring		(void * ring)
+{
+    __sync_synchronize();
+    ((LogRing *)ring)->in_use = 0;
+}
+
+/* get_ring()
+ * 
+ * Returns the ring of the current thread, taking a released one or
+ * allocating a new one the first time the thread logs something.
+ * */
+static
+LogRing *
+get_ring		()
+{
+    LogRing * ring;
+
+    if (own_ring != NULL)
+    {
+	return (own_ring);
+    }
+
+    for (ring = log_rings; (ring != NULL) && !__sync_bool_compare_and_swap(&ring->in_use, 0, 1); ring = ring->next);
+
+    if (ring == NULL)
+    {
+	if ((ring = calloc(1, sizeof(LogRing))) == NULL)
+	{
+	    return (NULL);
+	}
+
+	ring->in_use = 1;
+
+	do
+	{
+	    ring->next = log_rings;
+	}
+	while (!__sync_bool_compare_and_swap(&log_rings, ring->next, ring));
+    }
+
+    pthread_setspecific(ring_key, ring);
+    own_ring = ring;
+
+    return (ring);
+}
+
+/* report_drops()
+ * 
+ * Log the number of messages dropped since the last report.
+ * */
+static
+void
+report_drops		(unsigned int dropped, unsigned int * reported)
+{
+    char count[16];
+
+    if (dropped != *reported)
+    {
+	snprintf(count, sizeof(count), "%u", dropped - *reported);
+	write_message(MESSAGE, IMSG_LOGDROPPED, count, 0);
+	*reported = dropped;
+    }
+}
+
+/* drain_rings()
+ * 
+ * Write every record pending, and report messages dropped since the
+ * last call. If 'wait' is not set, nothing is written while records
+ * are being written by anybody else.
+ * Returns the number of records written.
+ * */
+static
+int
+drain_rings		(Boolean wait)
+{
+    LogRing * ring;
+    LogRecord * record;
+    unsigned int head, tail;
+    int written;
+
+    written = 0;
+
+    if (wait)
+    {
+	pthread_mutex_lock(&drain_lock);
+    }
+    else if (pthread_mutex_trylock(&drain_lock) != 0)
+    {
+	return (written);
+    }
+
+    for (ring = log_rings; ring != NULL; ring = ring->next)
+    {
+	head = ring->head;
+	__sync_synchronize();
+
+	for (tail = ring->tail; tail != head; tail++)
+	{
+	    record = &ring->records[tail & (LOG_RING_SIZE - 1)];
+	    write_message(record->level, record->msg, record->has_data ? record->data : NULL, record->err_num);
+	    written++;
+	}
+
+	__sync_synchronize();
+	ring->tail = tail;
+
+	report_drops(ring->dropped, &ring->reported);
+    }
+
+    report_drops(lost_records, &lost_reported);
+
+    pthread_mutex_unlock(&drain_lock);
+
+    return (written);
+}
+
+/* drain_log()
+ * 
+ * Drain thread main function. Sleeps for a while when every ring is
+ * empty.
+ * */
+static
+void *
+drain_log		(void * arg)
+{
+    struct timespec interval;
+
+    interval.tv_sec = 0;
+    interval.tv_nsec = LOG_DRAIN_INTERVAL;
+
+    while (TRUE)
+    {
+	if (drain_rings(TRUE) == 0)
+	{
+	    nanosleep(&interval, NULL);
+	}
+    }
+
+    return (NULL);
+}
+
 /* ********** Public functions ********** */
 
 /* init_log()
@@ -62,76 +343,150 @@ init_log		(int level, char * output)
     return (EXIT_SUCCESS);
 }
 
+/* start_log()
+ * 
+ * Start writing messages from a separate thread. Until then, they are
+ * written at once by the thread logging them.
+ * Must be called once no more processes will be forked.
+ * */
+int
+start_log		()
+{
+    if ((pthread_key_create(&ring_key, release_ring) != 0) ||
+	(pthread_create(&drain_thread, NULL, &drain_log, NULL) != 0))
+    {
+	log_message(CRITICAL, EMSG_LOGTHREAD, NULL);
+	return (ECOD_LOGTHREAD);
+    }
+
+    pthread_detach(drain_thread);
+    async_log = TRUE;
+
+    /* Do not lose messages written just before exiting. */
+    atexit(flush_log);
+
+    return (EXIT_SUCCESS);
+}
+
+/* flush_log()
+ * 
+ * Write every message pending right now, without waiting for the drain
+ * thread.
+ * */
+void
+flush_log		()
+{
+    if (async_log)
+    {
+	drain_rings(TRUE);
+    }
+}
+
+/* try_flush_log()
+ * 
+ * Same as flush_log(), but gives up if messages are being written, or
+ * if called from the drain thread, so it does not wait forever when
+ * called from a signal handler.
+ * */
+void
+try_flush_log		()
+{
+    if (async_log && !pthread_equal(pthread_self(), drain_thread))
+    {
+	drain_rings(FALSE);
+    }
+}
+
+/* log_allowed()
+ * 
+ * Check if a rate limited call site may log another message during the
+ * current second. The number of messages suppressed in the previous
+ * window is logged when a new one starts.
+ * */
+Boolean
+log_allowed		(LogLimit * limit, int level)
+{
+    const time_t now = time(NULL);
+    time_t second;
+    unsigned int suppressed;
+    char count[16];
+
+    second = limit->second;
+
+    if ((second != now) && __sync_bool_compare_and_swap(&limit->second, second, now))
+    {
+	limit->count = 0;
+
+	if ((suppressed = __sync_lock_test_and_set(&limit->suppressed, 0)) > 0)
+	{
+	    snprintf(count, sizeof(count), "%u", suppressed);
+	    log_message(level, IMSG_LOGSUPPRESSED, count);
+	}
+    }
+
+    if (__sync_add_and_fetch(&limit->count, 1) <= LOG_RATE_LIMIT)
+    {
+	return (TRUE);
+    }
+
+    __sync_fetch_and_add(&limit->suppressed, 1);
+    return (FALSE);
+}
+
 /* log_message()
  * 
+ * Queue a message into the ring of the calling thread. This never
+ * blocks: if the ring is full, the message is dropped and counted.
  * */
 void
 log_message		(int level, char * msg, char * data)
 {
-    char * full_msg;
+    LogRing * ring;
+    LogRecord * record;
+    unsigned int head;
     int err_num = errno;
-    int priority;
 
     /* Priority mask check.
      * If the minimum verbose level is above the level specified, nothing occurs.
      * */
-    if (level >= min_level)
+    if (level < min_level)
     {
-	if (data != NULL)
-	{
-	    if (level > MESSAGE)
-	    {
-		asprintf(&full_msg, "[MSG] %s    [DATA] %s    [SYSMSG] %s", msg, data, strerror(err_num));
-	    }
-	    else
-	    {
-		asprintf(&full_msg, "[MSG] %s    [DATA] %s", msg, data);
-	    }
-	}
-	else
-	{
-	    if (level > MESSAGE)
-	    {
-		asprintf(&full_msg, "[MSG] %s    [SYSMSG] %s", msg, strerror(err_num));
-	    }
-	    else
-	    {
-		asprintf(&full_msg, "[MSG] %s", msg);
-	    }
-	}
+	return;
+    }
 
-	/* Log to console. */
-	if ((output_dev == BOTH_CODE) || (output_dev == CONSOLE_CODE))
-	{
-	    fprintf(stderr, "ichoppedthatvideo: %s", full_msg);
-	}
+    if (!async_log)
+    {
+	write_message(level, msg, data, err_num);
+	return;
+    }
 
-	/* Log to syslog. */
-	if ((output_dev == BOTH_CODE) || (output_dev == SYSLOG_CODE))
-	{
-	    priority = LOG_USER;
-
-	    switch(level)
-	    {
-		case (CRITICAL):
-		    priority = priority | LOG_CRIT;
-		    break;
-		case (ERROR):
-		    priority = priority | LOG_ERR;
-		    break;	
-		case (WARNING):
-		    priority = priority | LOG_WARNING;
-		    break;
-		case (MESSAGE):
-		    priority = priority | LOG_NOTICE;
-		    break;
-		default:
-		    priority = priority | LOG_INFO;
-	    }
-
-	    syslog(priority, "%s", full_msg);
-	}
+    if ((ring = get_ring()) == NULL)
+    {
+	__sync_fetch_and_add(&lost_records, 1);
+	return;
+    }
+
+    head = ring->head;
 
-	free(full_msg);
+    if ((head - ring->tail) >= LOG_RING_SIZE)
+    {
+	ring->dropped++;
+	return;
     }
+
+    record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    record->level = level;
+    record->err_num = err_num;
+    record->msg = msg;
+    record->has_data = (data != NULL);
+
+    if (data != NULL)
+    {
+	strncpy(record->data, data, LOG_DATA_LEN - 1);
+	record->data[LOG_DATA_LEN - 1] = '\0';
+    }
+
+    /* The record must be complete before the drain thread sees it. */
+    __sync_synchronize();
+    ring->head = head + 1;
 }
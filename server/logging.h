@@ -9,6 +9,8 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
+#include <time.h>
+
 /* ********** Constant definitions ********** */
 
 #define DEFAULT_LOG_LEVEL  CRITICAL
@@ -20,15 +22,85 @@
 #define WARNING	           2
 #define MESSAGE	           1
 
+/* Messages below this level are removed at compile time, so their
+ * arguments are never evaluated. Production builds should raise it.
+ * */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL      MESSAGE
+#endif
+
+/* Messages per second allowed from each rate limited call site. */
+#define LOG_RATE_LIMIT     10
+
 /* Logging devices. */
 #define CONSOLE            "console"
 #define SYSLOG             "syslog"
 #define BOTH               "both"
 
+/* ********** Type definitions ********** */
+
+/* Every rate limited call site has its own counters. */
+typedef
+struct _log_limit
+{
+    volatile time_t second;
+    volatile unsigned int count;
+    volatile unsigned int suppressed;
+}
+LogLimit;
+
+/* ********** Global variables ********** */
+extern int min_level;
+
+/* ********** Macros ********** */
+
+/* Use these instead of calling log_message() directly: the level is
+ * checked before any argument is evaluated.
+ * */
+#define LOG_ENABLED(level)	(((level) >= LOG_MIN_LEVEL) && ((level) >= min_level))
+
+#define LOG(level, msg, data)						\
+    do									\
+    {									\
+	if (LOG_ENABLED(level))						\
+	{								\
+	    log_message((level), (msg), (data));			\
+	}								\
+    }									\
+    while (0)
+
+/* Same as LOG(), but no more than LOG_RATE_LIMIT messages per second
+ * are written from each call site. Use it for messages any client may
+ * trigger at will.
+ * */
+#define LOG_RATELIMITED(level, msg, data)				\
+    do									\
+    {									\
+	static LogLimit log_limit;					\
+									\
+	if (LOG_ENABLED(level) && log_allowed(&log_limit, (level)))	\
+	{								\
+	    log_message((level), (msg), (data));			\
+	}								\
+    }									\
+    while (0)
+
 /* ********** Public functions ********** */
 int
 init_log	(int level, char * output);
 
+int
+start_log	();
+
+void
+flush_log	();
+
+void
+try_flush_log	();
+
+Boolean
+log_allowed	(LogLimit * limit, int level);
+
 void
 log_message	(int level, char * msg, char * data);
 
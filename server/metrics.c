@@ -0,0 +1,556 @@
+/* Metrics module.
+ * File: metrics.c
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Runtime counters and latency histograms.
+ * Every thread updates a slot of its own without locks, and slots are
+ * only added up when the metrics are requested, on a separate admin
+ * port, in Prometheus text format.
+ * Histograms are log-linear, as in HDR histograms: each power of 2 is
+ * split in 'HIST_SUB_BUCKETS' buckets, so quantiles have a relative
+ * error below 1/HIST_SUB_BUCKETS at any scale.
+ * */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "conn.h"
+#include "request.h"
+#include "reply.h"
+#include "metrics.h"
+
+/* ********** Constant definitions ********** */
+#define METRICS_PREFIX		"ichoppedthatvideo_"
+#define METRICS_TYPE		"text/plain; version=0.0.4"
+
+/* Room for the whole reply body. */
+#define METRICS_BUF_LEN		32768
+
+/* Histogram buckets: values up to 2^HIST_MAX_BIT nanoseconds (~18
+ * minutes) are recorded exactly; bigger ones go to the last bucket.
+ * */
+#define HIST_SUB_BITS		4
+#define HIST_SUB_BUCKETS	(1 << HIST_SUB_BITS)
+#define HIST_MAX_BIT		40
+#define HIST_BUCKETS		((HIST_MAX_BIT - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+#define NANOSEC_IN_SEC		1000000000
+
+/* ********** Type definitions ********** */
+typedef
+struct _histogram
+{
+    int64_t count;
+    int64_t sum;
+    int64_t buckets[HIST_BUCKETS];
+}
+Histogram;
+
+/* Only the owner thread writes into a slot. When a thread ends its slot
+ * is released, and taken by the next thread started, so values are
+ * never lost.
+ * */
+typedef
+struct _metrics_slot
+{
+    int64_t counters[M_COUNTERS];
+    int64_t bytes[METRICS_QUALITIES];
+    Histogram histograms[M_HISTOGRAMS];
+
+    /* Connection accepted, but nothing sent yet. */
+    struct timespec first_byte_start;
+    Boolean first_byte_pending;
+
+    int in_use;
+    struct _metrics_slot * next;
+}
+MetricsSlot;
+
+/* ********** Global variables ********** */
+const
+char * counter_names [] = {"connections_total", "requests_total", "video_cache_hits_total",
+			   "video_cache_misses_total", "abr_switches_total", "send_stalls_total",
+			   "timeouts_total", "security_rejects_total", "segment_cache_hits_total",
+			   "segment_cache_misses_total", "shared_streams_total", "stats_queue_depth"};
+
+const
+char * counter_types [] = {"counter", "counter", "counter", "counter", "counter", "counter",
+			   "counter", "counter", "counter", "counter", "counter", "gauge"};
+
+const
+char * counter_help [] = {"Connections accepted.", "Requests read.", "Videos found in memory.",
+			  "Videos loaded from disk.", "Stream quality changes while streaming.",
+			  "Calls to send() blocked for too long.", "Connections closed by a timer.",
+			  "Requests rejected by the security module.",
+			  "CMAF segments and manifests found in cache.",
+			  "CMAF segments and manifests built.",
+			  "Stream files found in memory, loaded for another video.",
+			  "Threads waiting for or using the statistics database."};
+
+const
+char * histogram_names [] = {"first_byte_seconds", "parse_seconds", "video_load_seconds"};
+
+const
+char * histogram_help [] = {"Time from accepting a connection to sending the first byte.",
+			    "Time spent parsing a request.", "Time spent loading a video from disk."};
+
+const
+double quantiles [] = {0.5, 0.9, 0.99, 0.999};
+
+const
+int quantiles_vlen = 4;
+
+Boolean metrics_enabled = FALSE;
+
+/* Slots of every thread, and the one owned by the current thread. */
+MetricsSlot * metrics_slots = NULL;
+__thread MetricsSlot * own_slot = NULL;
+pthread_key_t slot_key;
+
+/* Admin socket and thread. */
+int metrics_sd = -1;
+pthread_t metrics_thread;
+
+/* ********** Private functions ********** */
+
+/* release_slot()
+ *
+ * Called when a thread ends, so its slot may be reused.
+ * */
+static
+void
+release_slot			(void * slot)
+{
+    __sync_synchronize();
+    ((MetricsSlot *)slot)->in_use = 0;
+}
+
+/* get_slot()
+ *
+ * Returns the slot of the current thread, taking a released one or
+ * allocating a new one the first time the thread needs it.
+ * */
+static
+MetricsSlot *
+get_slot			()
+{
+    MetricsSlot * slot;
+
+    if (own_slot != NULL)
+    {
+	return (own_slot);
+    }
+
+    for (slot = metrics_slots; (slot != NULL) && !__sync_bool_compare_and_swap(&slot->in_use, 0, 1); slot = slot->next);
+
+    if (slot == NULL)
+    {
+	if ((slot = calloc(1, sizeof(MetricsSlot))) == NULL)
+	{
+	    return (NULL);
+	}
+
+	slot->in_use = 1;
+
+	do
+	{
+	    slot->next = metrics_slots;
+	}
+	while (!__sync_bool_compare_and_swap(&metrics_slots, slot->next, slot));
+    }
+
+    pthread_setspecific(slot_key, slot);
+    own_slot = slot;
+
+    return (slot);
+}
+
+/* get_bucket()
+ *
+ * Returns the histogram bucket for 'value'.
+ * */
+static
+int
+get_bucket			(int64_t value)
+{
+    int bit;
+
+    if (value < HIST_SUB_BUCKETS)
+    {
+	return ((value < 0) ? 0 : value);
+    }
+
+    if ((bit = 63 - __builtin_clzll(value)) >= HIST_MAX_BIT)
+    {
+	return (HIST_BUCKETS - 1);
+    }
+
+    return (((bit - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS) + ((value >> (bit - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1)));
+}
+
+/* get_bucket_limit()
+ *
+ * Returns the highest value recorded into a bucket.
+ * */
+static
+int64_t
+get_bucket_limit		(int bucket)
+{
+    int bit;
+
+    if (bucket < HIST_SUB_BUCKETS)
+    {
+	return (bucket);
+    }
+
+    bit = (bucket / HIST_SUB_BUCKETS) + HIST_SUB_BITS - 1;
+
+    return ((((int64_t)HIST_SUB_BUCKETS + (bucket % HIST_SUB_BUCKETS) + 1) << (bit - HIST_SUB_BITS)) - 1);
+}
+
+/* append()
+ *
+ * Append formatted text to a reply body 'METRICS_BUF_LEN' bytes long.
+ * */
+static
+void
+append				(char * buf, int * len, const char * format, ...)
+{
+    va_list args;
+
+    if (*len < (METRICS_BUF_LEN - 1))
+    {
+	va_start(args, format);
+	*len += vsnprintf(buf + *len, METRICS_BUF_LEN - *len, format, args);
+	va_end(args);
+
+	if (*len > (METRICS_BUF_LEN - 1))
+	{
+	    *len = METRICS_BUF_LEN - 1;
+	}
+    }
+}
+
+/* format_metrics()
+ *
+ * Add up every slot and write the result into 'buf'.
+ * Returns the text length.
+ * */
+static
+int
+format_metrics			(MetricsSlot * total, char * buf)
+{
+    MetricsSlot * slot;
+    long long * conn_served;
+    int64_t seen, rank;
+    int i, j, k, len;
+
+    memset(total, 0, sizeof(MetricsSlot));
+
+    /* Values are read while they are being written, which is fine for
+     * monitoring.
+     * */
+    for (slot = metrics_slots; slot != NULL; slot = slot->next)
+    {
+	for (i = 0; i < M_COUNTERS; i++)
+	{
+	    total->counters[i] += slot->counters[i];
+	}
+
+	for (i = 0; i < METRICS_QUALITIES; i++)
+	{
+	    total->bytes[i] += slot->bytes[i];
+	}
+
+	for (i = 0; i < M_HISTOGRAMS; i++)
+	{
+	    total->histograms[i].count += slot->histograms[i].count;
+	    total->histograms[i].sum += slot->histograms[i].sum;
+
+	    for (j = 0; j < HIST_BUCKETS; j++)
+	    {
+		total->histograms[i].buckets[j] += slot->histograms[i].buckets[j];
+	    }
+	}
+    }
+
+    len = 0;
+
+    for (i = 0; i < M_COUNTERS; i++)
+    {
+	append(buf, &len, "# HELP %s%s %s\n# TYPE %s%s %s\n%s%s %lld\n",
+	       METRICS_PREFIX, counter_names[i], counter_help[i],
+	       METRICS_PREFIX, counter_names[i], counter_types[i],
+	       METRICS_PREFIX, counter_names[i], (long long)total->counters[i]);
+    }
+
+    append(buf, &len, "# HELP %ssent_bytes_total Bytes of video sent, by quality level.\n"
+	   "# TYPE %ssent_bytes_total counter\n", METRICS_PREFIX, METRICS_PREFIX);
+
+    for (i = 0; i < METRICS_QUALITIES; i++)
+    {
+	append(buf, &len, "%ssent_bytes_total{quality=\"%d\"} %lld\n", METRICS_PREFIX, i, (long long)total->bytes[i]);
+    }
+
+    /* Connections served by each child thread. */
+    if ((conn_served = get_conn_served()) != NULL)
+    {
+	append(buf, &len, "# HELP %schild_connections_total Connections served by each thread.\n"
+	       "# TYPE %schild_connections_total counter\n", METRICS_PREFIX, METRICS_PREFIX);
+
+	for (i = 0; i < get_child_num(); i++)
+	{
+	    append(buf, &len, "%schild_connections_total{child=\"%d\"} %lld\n", METRICS_PREFIX, i, conn_served[i]);
+	}
+
+	free(conn_served);
+    }
+
+    /* Histograms are shown as summaries, with some quantiles. */
+    for (i = 0; i < M_HISTOGRAMS; i++)
+    {
+	append(buf, &len, "# HELP %s%s %s\n# TYPE %s%s summary\n",
+	       METRICS_PREFIX, histogram_names[i], histogram_help[i], METRICS_PREFIX, histogram_names[i]);
+
+	for (j = 0, k = 0, seen = 0; j < quantiles_vlen; j++)
+	{
+	    rank = (int64_t)(quantiles[j] * total->histograms[i].count);
+
+	    for (; (k < (HIST_BUCKETS - 1)) && ((seen + total->histograms[i].buckets[k]) <= rank); k++)
+	    {
+		seen += total->histograms[i].buckets[k];
+	    }
+
+	    append(buf, &len, "%s%s{quantile=\"%g\"} %.9f\n", METRICS_PREFIX, histogram_names[i], quantiles[j],
+		   (total->histograms[i].count > 0) ? ((double)get_bucket_limit(k) / NANOSEC_IN_SEC) : 0.0);
+	}
+
+	append(buf, &len, "%s%s_sum %.9f\n%s%s_count %lld\n",
+	       METRICS_PREFIX, histogram_names[i], (double)total->histograms[i].sum / NANOSEC_IN_SEC,
+	       METRICS_PREFIX, histogram_names[i], (long long)total->histograms[i].count);
+    }
+
+    return (len);
+}
+
+/* serve_metrics()
+ *
+ * Admin thread main function. Replies every request with the metrics,
+ * and closes the connection.
+ * */
+static
+void *
+serve_metrics			(void * arg)
+{
+    Arena arena;
+    ReplyParams params;
+    MetricsSlot * total;
+    struct timeval timeout;
+    char request[1024];
+    char * header, * body;
+    unsigned int header_size;
+    int client_sd, body_len;
+
+    if (init_arena(&arena, ARENA_BLOCK_SIZE) != EXIT_SUCCESS)
+    {
+	return (NULL);
+    }
+
+    params.http_command = NULL;
+    params.http_code = HTTP_OK_CODE;
+    params.content_type = METRICS_TYPE;
+    params.connection = CONN_CLOSE;
+    params.transfer_encoding = NULL;
+    params.cache_control = NO_CACHE;
+    params.expiration = NO_EXPIRE;
+    params.extra_headers = NULL;
+
+    timeout.tv_sec = 1;
+    timeout.tv_usec = 0;
+
+    while (TRUE)
+    {
+	if ((client_sd = accept(metrics_sd, NULL, NULL)) < 0)
+	{
+	    continue;
+	}
+
+	/* Read the request, whatever it is, before replying. */
+	setsockopt(client_sd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval));
+	recv(client_sd, request, sizeof(request), 0);
+
+	if (((total = arena_alloc(&arena, sizeof(MetricsSlot))) != NULL) &&
+	    ((body = arena_alloc(&arena, METRICS_BUF_LEN)) != NULL))
+	{
+	    body_len = format_metrics(total, body);
+
+	    if ((header = compose_header(&arena, params, body_len, &header_size)) != NULL)
+	    {
+		send(client_sd, header, header_size, MSG_NOSIGNAL | MSG_MORE);
+		send(client_sd, body, body_len, MSG_NOSIGNAL);
+	    }
+	}
+
+	close(client_sd);
+	reset_arena(&arena);
+    }
+
+    return (NULL);
+}
+
+/* ********** Public functions ********** */
+
+/* init_metrics()
+ *
+ * Open the admin port, only for local connections, and start serving
+ * metrics. Nothing is recorded if 'port' is 0.
+ * */
+int
+init_metrics			(int port)
+{
+    struct sockaddr_in address;
+    const int reuse = 1;
+
+    if (port <= 0)
+    {
+	return (EXIT_SUCCESS);
+    }
+
+    if (pthread_key_create(&slot_key, release_slot) != 0)
+    {
+	LOG(CRITICAL, EMSG_METRICSTHREAD, NULL);
+	return (ECOD_METRICSTHREAD);
+    }
+
+    memset(&address, 0, sizeof(struct sockaddr_in));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    if (((metrics_sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) ||
+	(setsockopt(metrics_sd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(int)) < 0) ||
+	(bind(metrics_sd, (struct sockaddr *)&address, sizeof(struct sockaddr_in)) < 0) ||
+	(listen(metrics_sd, SOMAXCONN) < 0))
+    {
+	LOG(CRITICAL, EMSG_METRICSPORT, NULL);
+	return (ECOD_METRICSPORT);
+    }
+
+    metrics_enabled = TRUE;
+
+    if (pthread_create(&metrics_thread, NULL, &serve_metrics, NULL) != 0)
+    {
+	metrics_enabled = FALSE;
+	LOG(CRITICAL, EMSG_METRICSTHREAD, NULL);
+	return (ECOD_METRICSTHREAD);
+    }
+
+    pthread_detach(metrics_thread);
+    LOG(MESSAGE, IMSG_METRICSENABLED, NULL);
+
+    return (EXIT_SUCCESS);
+}
+
+/* metrics_add()
+ *
+ * Add 'value' to a counter. Gauges may also be decreased.
+ * */
+void
+metrics_add			(int counter, int64_t value)
+{
+    MetricsSlot * slot;
+
+    if (metrics_enabled && ((slot = get_slot()) != NULL))
+    {
+	slot->counters[counter] += value;
+    }
+}
+
+/* metrics_bytes()
+ *
+ * Count video bytes sent with a given quality level.
+ * */
+void
+metrics_bytes			(int quality, int64_t bytes)
+{
+    MetricsSlot * slot;
+
+    if (metrics_enabled && (bytes > 0) && ((slot = get_slot()) != NULL))
+    {
+	slot->bytes[(quality < METRICS_QUALITIES) ? quality : (METRICS_QUALITIES - 1)] += bytes;
+    }
+}
+
+/* metrics_record()
+ *
+ * Record a value, in nanoseconds, into a histogram.
+ * */
+void
+metrics_record			(int histogram, int64_t value)
+{
+    MetricsSlot * slot;
+
+    if (metrics_enabled && ((slot = get_slot()) != NULL))
+    {
+	slot->histograms[histogram].buckets[get_bucket(value)]++;
+	slot->histograms[histogram].sum += value;
+	slot->histograms[histogram].count++;
+    }
+}
+
+/* metrics_elapsed()
+ *
+ * Returns the nanoseconds elapsed since 'start', taken from the
+ * monotonic clock.
+ * */
+int64_t
+metrics_elapsed			(const struct timespec * start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (((int64_t)(now.tv_sec - start->tv_sec) * NANOSEC_IN_SEC) + (now.tv_nsec - start->tv_nsec));
+}
+
+/* metrics_start_first_byte()
+ *
+ * A connection has just been accepted by the current thread.
+ * */
+void
+metrics_start_first_byte	()
+{
+    MetricsSlot * slot;
+
+    if (metrics_enabled && ((slot = get_slot()) != NULL))
+    {
+	clock_gettime(CLOCK_MONOTONIC, &slot->first_byte_start);
+	slot->first_byte_pending = TRUE;
+    }
+}
+
+/* metrics_first_byte()
+ *
+ * Some data has been sent by the current thread. Only the first call
+ * after accepting a connection is recorded.
+ * */
+void
+metrics_first_byte		()
+{
+    MetricsSlot * slot;
+
+    if (metrics_enabled && ((slot = own_slot) != NULL) && slot->first_byte_pending)
+    {
+	slot->first_byte_pending = FALSE;
+	metrics_record(H_FIRST_BYTE, metrics_elapsed(&slot->first_byte_start));
+    }
+}
@@ -0,0 +1,58 @@
+/* Metrics module.
+ * File: metrics.h
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Runtime counters and latency histograms, served in Prometheus text
+ * format on an admin port.
+ * */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <time.h>
+
+/* ********** Constant definitions ********** */
+
+/* Admin port, 0 to disable metrics. */
+#define DEFAULT_METRICS_PORT	0
+
+/* Bytes sent are counted for each quality level up to this one; higher
+ * levels are added to the last one.
+ * */
+#define METRICS_QUALITIES	8
+
+/* Counters.
+ * 'M_STATS_QUEUE' is a gauge: threads waiting for, or using, the
+ * statistics database connection.
+ * */
+enum metric_counters {M_CONNECTIONS, M_REQUESTS, M_VIDEO_HITS, M_VIDEO_MISSES, M_ABR_SWITCHES,
+		      M_SEND_STALLS, M_TIMEOUTS, M_SECURITY_REJECTS, M_SEGMENT_HITS, M_SEGMENT_MISSES,
+		      M_SHARED_STREAMS, M_STATS_QUEUE, M_COUNTERS};
+
+/* Latency histograms, in nanoseconds. */
+enum metric_histograms {H_FIRST_BYTE, H_PARSE, H_VIDEO_LOAD, M_HISTOGRAMS};
+
+/* ********** Public functions ********** */
+int
+init_metrics			(int port);
+
+void
+metrics_add			(int counter, int64_t value);
+
+void
+metrics_bytes			(int quality, int64_t bytes);
+
+void
+metrics_record			(int histogram, int64_t value);
+
+int64_t
+metrics_elapsed			(const struct timespec * start);
+
+void
+metrics_start_first_byte	();
+
+void
+metrics_first_byte		();
+
+#endif
@@ -0,0 +1,1106 @@
+/* MP4 module.
+ * File: mp4.c
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Progressive MP4 files can only be played from their first byte, as
+ * their 'moov' atom describes where every sample is. To start them on
+ * any keyframe, chopper saves the sample table of every rendition, and
+ * a new 'moov' atom is composed here for the samples from that keyframe
+ * onwards, with their offsets moved to the tail of 'mdat' sent after it.
+ * Rewritten atoms are cached for every rendition, as players seeking
+ * around a video keep asking for the same keyframes.
+ * */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "mp4.h"
+
+/* ********** Constant definitions ********** */
+#define ATOM_HEADER_LEN		8
+#define ATOM_LARGE_LEN		16
+
+/* Room for every table composed for a track, along with its 'stbl'
+ * atom: a fixed part, and the most every sample may take.
+ * */
+#define TABLES_FIXED_LEN	128
+#define TABLES_SAMPLE_LEN	44
+
+/* Length of a 'trex' atom. */
+#define TREX_LEN		32
+
+#define ATOM_TYPE(a, b, c, d)	(((uint32_t)(a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+#define ATOM_MOOV		ATOM_TYPE('m', 'o', 'o', 'v')
+#define ATOM_MVHD		ATOM_TYPE('m', 'v', 'h', 'd')
+#define ATOM_TRAK		ATOM_TYPE('t', 'r', 'a', 'k')
+#define ATOM_TKHD		ATOM_TYPE('t', 'k', 'h', 'd')
+#define ATOM_EDTS		ATOM_TYPE('e', 'd', 't', 's')
+#define ATOM_MDIA		ATOM_TYPE('m', 'd', 'i', 'a')
+#define ATOM_MDHD		ATOM_TYPE('m', 'd', 'h', 'd')
+#define ATOM_MINF		ATOM_TYPE('m', 'i', 'n', 'f')
+#define ATOM_STBL		ATOM_TYPE('s', 't', 'b', 'l')
+#define ATOM_STSD		ATOM_TYPE('s', 't', 's', 'd')
+#define ATOM_STTS		ATOM_TYPE('s', 't', 't', 's')
+#define ATOM_CTTS		ATOM_TYPE('c', 't', 't', 's')
+#define ATOM_STSS		ATOM_TYPE('s', 't', 's', 's')
+#define ATOM_STSC		ATOM_TYPE('s', 't', 's', 'c')
+#define ATOM_STSZ		ATOM_TYPE('s', 't', 's', 'z')
+#define ATOM_STCO		ATOM_TYPE('s', 't', 'c', 'o')
+#define ATOM_CO64		ATOM_TYPE('c', 'o', '6', '4')
+#define ATOM_MDAT		ATOM_TYPE('m', 'd', 'a', 't')
+#define ATOM_MVEX		ATOM_TYPE('m', 'v', 'e', 'x')
+#define ATOM_TREX		ATOM_TYPE('t', 'r', 'e', 'x')
+
+/* ********** Type definitions ********** */
+
+/* State of a 'moov' atom being rewritten.
+ *  - 'first' is the first sample kept in every track, and 'start_time'
+ *    its decoding time.
+ *  - 'movie_timescale' is the one of 'mvhd', used by 'mvhd' and 'tkhd'.
+ *  - 'track_id' is the id of every track, as found in 'tkhd'.
+ *  - 'chunk_table' and 'chunk_num' locate the chunk offsets written,
+ *    relative to 'cut' until the length of the whole header is known.
+ * */
+typedef
+struct _rewrite
+{
+    Mp4Index * index;
+    AtomWriter out;
+
+    int track;
+    uint32_t first[MAX_TRACKS];
+    int64_t start_time[MAX_TRACKS];
+    uint32_t movie_timescale;
+    uint32_t track_id[MAX_TRACKS];
+    int64_t cut;
+    Boolean large_offsets;
+
+    int64_t chunk_table[MAX_TRACKS];
+    uint32_t chunk_num[MAX_TRACKS];
+}
+Rewrite;
+
+/* ********** Global variables ********** */
+pthread_mutex_t mp4_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* ********** Private functions ********** */
+
+/* get_be32()
+ *
+ * */
+static
+uint32_t
+get_be32			(const uint8_t * buf)
+{
+    return (((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3]);
+}
+
+/* get_be64()
+ *
+ * */
+static
+uint64_t
+get_be64			(const uint8_t * buf)
+{
+    return (((uint64_t)get_be32(buf) << 32) | get_be32(buf + 4));
+}
+
+/* rescale()
+ *
+ * Convert 'value' from timescale 'from' to timescale 'to'.
+ * */
+static
+int64_t
+rescale				(int64_t value, uint32_t from, uint32_t to)
+{
+    return ((from == 0) ? 0 : (int64_t)(((long double)value * to) / from));
+}
+
+/* get_track_duration()
+ *
+ * Duration of the samples kept in a track, in its timescale.
+ * */
+static
+int64_t
+get_track_duration		(Rewrite * rw, int track)
+{
+    return (rw->index->tracks[track].duration - rw->start_time[track]);
+}
+
+
+/* patch_duration()
+ *
+ * Write a new duration into the copy of a 'mvhd', 'tkhd' or 'mdhd' atom
+ * at 'start', 'offset' bytes after its version on version 0 atoms, or
+ * 'large_offset' bytes on version 1 atoms.
+ * */
+static
+void
+patch_duration			(Rewrite * rw, int64_t start, int header_len, int64_t size,
+				 int offset, int large_offset, int64_t duration)
+{
+    if (rw->out.buf[start + header_len] == 1)
+    {
+	if (size >= (header_len + large_offset + 8))
+	{
+	    set_be64(&rw->out, start + header_len + large_offset, duration);
+	}
+    }
+    else if (size >= (header_len + offset + 4))
+    {
+	set_be32(&rw->out, start + header_len + offset, (duration > UINT32_MAX) ? UINT32_MAX : duration);
+    }
+}
+
+/* get_chunk_samples()
+ *
+ * Number of samples in the chunk starting on sample 'first': samples
+ * stored one right after the other.
+ * */
+static
+uint32_t
+get_chunk_samples		(const Sample * samples, uint32_t first, uint32_t last)
+{
+    uint32_t i;
+
+    for (i = first + 1; (i < last) && (samples[i].offset == (samples[i - 1].offset + samples[i - 1].size)); i++);
+
+    return (i - first);
+}
+
+/* write_tables()
+ *
+ * Compose the sample tables of the current track for the samples kept:
+ * 'stts', 'ctts' and 'stss' if needed, 'stsc', 'stsz' and the chunk
+ * offsets.
+ * */
+static
+void
+write_tables			(Rewrite * rw)
+{
+    Sample * samples;
+    int64_t start, count_pos;
+    uint32_t first, last, i, count, run, chunk, chunk_samples, prev_samples;
+    Boolean has_cto, negative_cto, all_sync, same_size;
+
+    samples = rw->index->tracks[rw->track].samples;
+    first = rw->first[rw->track];
+    last = rw->index->tracks[rw->track].header->sample_num;
+
+    has_cto = FALSE;
+    negative_cto = FALSE;
+    all_sync = TRUE;
+    same_size = (first < last);
+
+    for (i = first; i < last; i++)
+    {
+	has_cto = has_cto || (samples[i].cto != 0);
+	negative_cto = negative_cto || (samples[i].cto < 0);
+	all_sync = all_sync && (samples[i].flags & SAMPLE_SYNC);
+	same_size = same_size && (samples[i].size == samples[first].size);
+    }
+
+    /* Decoding times. */
+    start = begin_full_atom(&rw->out, ATOM_STTS, 0);
+    count_pos = rw->out.pos;
+    put_be32(&rw->out, 0);
+
+    for (i = first, count = 0; i < last; i += run, count++)
+    {
+	for (run = 1; ((i + run) < last) && (samples[i + run].duration == samples[i].duration); run++);
+	put_be32(&rw->out, run);
+	put_be32(&rw->out, samples[i].duration);
+    }
+
+    set_be32(&rw->out, count_pos, count);
+    end_atom(&rw->out, start);
+
+    /* Composition offsets. */
+    if (has_cto)
+    {
+	start = begin_full_atom(&rw->out, ATOM_CTTS, negative_cto ? 1 : 0);
+	count_pos = rw->out.pos;
+	put_be32(&rw->out, 0);
+
+	for (i = first, count = 0; i < last; i += run, count++)
+	{
+	    for (run = 1; ((i + run) < last) && (samples[i + run].cto == samples[i].cto); run++);
+	    put_be32(&rw->out, run);
+	    put_be32(&rw->out, (uint32_t)samples[i].cto);
+	}
+
+	set_be32(&rw->out, count_pos, count);
+	end_atom(&rw->out, start);
+    }
+
+    /* Sync samples, numbered from 1. */
+    if (!all_sync)
+    {
+	start = begin_full_atom(&rw->out, ATOM_STSS, 0);
+	count_pos = rw->out.pos;
+	put_be32(&rw->out, 0);
+
+	for (i = first, count = 0; i < last; i++)
+	{
+	    if (samples[i].flags & SAMPLE_SYNC)
+	    {
+		put_be32(&rw->out, i - first + 1);
+		count++;
+	    }
+	}
+
+	set_be32(&rw->out, count_pos, count);
+	end_atom(&rw->out, start);
+    }
+
+    /* Samples per chunk, only where it changes. */
+    start = begin_full_atom(&rw->out, ATOM_STSC, 0);
+    count_pos = rw->out.pos;
+    put_be32(&rw->out, 0);
+
+    for (i = first, count = 0, chunk = 0, prev_samples = 0; i < last; i += chunk_samples)
+    {
+	chunk_samples = get_chunk_samples(samples, i, last);
+	chunk++;
+
+	if (chunk_samples != prev_samples)
+	{
+	    put_be32(&rw->out, chunk);
+	    put_be32(&rw->out, chunk_samples);
+	    put_be32(&rw->out, 1);
+	    prev_samples = chunk_samples;
+	    count++;
+	}
+    }
+
+    set_be32(&rw->out, count_pos, count);
+    end_atom(&rw->out, start);
+
+    /* Sample sizes. */
+    start = begin_full_atom(&rw->out, ATOM_STSZ, 0);
+    put_be32(&rw->out, same_size ? samples[first].size : 0);
+    put_be32(&rw->out, last - first);
+
+    for (i = first; (i < last) && !same_size; i++)
+    {
+	put_be32(&rw->out, samples[i].size);
+    }
+
+    end_atom(&rw->out, start);
+
+    /* Chunk offsets, relative to the cut until the header is done. */
+    start = begin_full_atom(&rw->out, rw->large_offsets ? ATOM_CO64 : ATOM_STCO, 0);
+    put_be32(&rw->out, chunk);
+    rw->chunk_table[rw->track] = rw->out.pos;
+    rw->chunk_num[rw->track] = chunk;
+
+    for (i = first; i < last; i += get_chunk_samples(samples, i, last))
+    {
+	if (rw->large_offsets)
+	{
+	    put_be64(&rw->out, samples[i].offset - rw->cut);
+	}
+	else
+	{
+	    put_be32(&rw->out, samples[i].offset - rw->cut);
+	}
+    }
+
+    end_atom(&rw->out, start);
+}
+
+/* write_atoms()
+ *
+ * Copy the atoms found in 'len' bytes from 'buf', children of an atom
+ * of type 'parent', composing again every one which depends on the
+ * samples kept. Edit lists are dropped, as they refer to the original
+ * timeline.
+ * Returns FALSE if they are not well formed.
+ * */
+static
+Boolean
+write_atoms			(Rewrite * rw, const uint8_t * buf, int64_t len, uint32_t parent)
+{
+    Mp4Track * cur_track;
+    uint32_t type;
+    int64_t size, start, duration, max_duration;
+    int header_len, i;
+
+    while (len > 0)
+    {
+	if ((header_len = parse_atom(buf, len, &type, &size)) == 0)
+	{
+	    return (FALSE);
+	}
+
+	/* Sample tables are composed again, and edit lists dropped. */
+	if (((parent == ATOM_STBL) && (type != ATOM_STSD)) ||
+	    ((parent == ATOM_TRAK) && (type == ATOM_EDTS)))
+	{
+	    buf += size;
+	    len -= size;
+	    continue;
+	}
+
+	switch (type)
+	{
+	    case (ATOM_TRAK):
+		if (++rw->track >= (int)rw->index->header->track_num)
+		{
+		    return (FALSE);
+		}
+
+		/* Fall through. */
+	    case (ATOM_MDIA):
+	    case (ATOM_MINF):
+	    case (ATOM_STBL):
+		start = begin_atom(&rw->out, type);
+
+		if (!write_atoms(rw, buf + header_len, size - header_len, type))
+		{
+		    return (FALSE);
+		}
+
+		if (type == ATOM_STBL)
+		{
+		    if (rw->track < 0)
+		    {
+			return (FALSE);
+		    }
+
+		    write_tables(rw);
+		}
+
+		end_atom(&rw->out, start);
+		break;
+	    default:
+		start = rw->out.pos;
+		memcpy(rw->out.buf + rw->out.pos, buf, size);
+		rw->out.pos += size;
+
+		if (type == ATOM_MVHD)
+		{
+		    for (i = 0, max_duration = 0; i < (int)rw->index->header->track_num; i++)
+		    {
+			cur_track = &rw->index->tracks[i];
+			duration = rescale(get_track_duration(rw, i), cur_track->header->timescale, rw->movie_timescale);
+			max_duration = (duration > max_duration) ? duration : max_duration;
+		    }
+
+		    patch_duration(rw, start, header_len, size, 16, 24, max_duration);
+		}
+		else if ((type == ATOM_TKHD) && (rw->track >= 0))
+		{
+		    cur_track = &rw->index->tracks[rw->track];
+		    patch_duration(rw, start, header_len, size, 20, 28,
+				   rescale(get_track_duration(rw, rw->track), cur_track->header->timescale, rw->movie_timescale));
+
+		    if (size >= (header_len + 24))
+		    {
+			rw->track_id[rw->track] = get_be32(rw->out.buf + start + header_len + ((rw->out.buf[start + header_len] == 1) ? 20 : 12));
+		    }
+		}
+		else if ((type == ATOM_MDHD) && (rw->track >= 0))
+		{
+		    patch_duration(rw, start, header_len, size, 16, 24, get_track_duration(rw, rw->track));
+		}
+
+		break;
+	}
+
+	buf += size;
+	len -= size;
+    }
+
+    return (TRUE);
+}
+
+/* get_movie_timescale()
+ *
+ * Find the timescale of the 'mvhd' atom among the children of 'moov'.
+ * Returns 0 if there is none.
+ * */
+static
+uint32_t
+get_movie_timescale		(const uint8_t * buf, int64_t len)
+{
+    uint32_t type;
+    int64_t size;
+    int header_len;
+
+    while ((header_len = parse_atom(buf, len, &type, &size)) != 0)
+    {
+	if (type == ATOM_MVHD)
+	{
+	    if (buf[header_len] == 1)
+	    {
+		return ((size >= (header_len + 24)) ? get_be32(buf + header_len + 20) : 0);
+	    }
+
+	    return ((size >= (header_len + 16)) ? get_be32(buf + header_len + 12) : 0);
+	}
+
+	buf += size;
+	len -= size;
+    }
+
+    return (0);
+}
+
+/* write_moov()
+ *
+ * Compose a new 'moov' atom for the samples kept, from the one of the
+ * rendition in 'data'. Fragmented renditions keep no samples at all,
+ * and declare their tracks in a 'mvex' atom instead.
+ * Returns FALSE if it is not well formed.
+ * */
+static
+Boolean
+write_moov			(Rewrite * rw, const uint8_t * data, Boolean fragmented)
+{
+    const uint8_t * moov;
+    uint32_t type;
+    int64_t size, moov_start, mvex_start, trex_start;
+    int header_len, t;
+
+    moov = data + rw->index->header->moov_offset;
+
+    if (((header_len = parse_atom(moov, rw->index->header->moov_len, &type, &size)) == 0) ||
+	((rw->movie_timescale = get_movie_timescale(moov + header_len, size - header_len)) == 0))
+    {
+	return (FALSE);
+    }
+
+    moov_start = begin_atom(&rw->out, ATOM_MOOV);
+
+    if (!write_atoms(rw, moov + header_len, size - header_len, ATOM_MOOV) ||
+	(rw->track != ((int)rw->index->header->track_num - 1)))
+    {
+	return (FALSE);
+    }
+
+    /* Every sample uses the first sample description. */
+    if (fragmented)
+    {
+	mvex_start = begin_atom(&rw->out, ATOM_MVEX);
+
+	for (t = 0; t < (int)rw->index->header->track_num; t++)
+	{
+	    trex_start = begin_full_atom(&rw->out, ATOM_TREX, 0);
+	    put_be32(&rw->out, rw->track_id[t]);
+	    put_be32(&rw->out, 1);
+	    put_be32(&rw->out, 0);
+	    put_be32(&rw->out, 0);
+	    put_be32(&rw->out, 0);
+	    end_atom(&rw->out, trex_start);
+	}
+
+	end_atom(&rw->out, mvex_start);
+    }
+
+    end_atom(&rw->out, moov_start);
+    return (TRUE);
+}
+
+/* build_header()
+ *
+ * Compose the header of a rendition starting on keyframe 'iframe':
+ * 'ftyp', a 'moov' atom for the samples from then on, and the header
+ * of an 'mdat' atom holding them. Every track starts on its first
+ * sample decoded at the time of the keyframe, or later.
+ * 'data' holds the rendition.
+ * Returns NULL if it cannot be composed.
+ * */
+static
+Mp4Header *
+build_header			(Mp4Index * index, const uint8_t * data, int iframe)
+{
+    Rewrite rw;
+    Mp4Header * header;
+    Mp4Track * cur_track, * video;
+    SampleFileHeader * file;
+    int64_t bound, time, header_len, offset;
+    uint32_t i, j, sync;
+    int t;
+
+    memset(&rw, 0, sizeof(Rewrite));
+    rw.index = index;
+    rw.track = -1;
+    file = index->header;
+    video = &index->tracks[index->video_track];
+
+    /* Find the keyframe, and the time it is decoded at. */
+    for (i = 0, time = 0, sync = 0; i < video->header->sample_num; time += video->samples[i].duration, i++)
+    {
+	if ((video->samples[i].flags & SAMPLE_SYNC) && (sync++ == (uint32_t)iframe))
+	{
+	    break;
+	}
+    }
+
+    if (i >= video->header->sample_num)
+    {
+	return (NULL);
+    }
+
+    /* Find where every track starts, and the first byte sent. */
+    rw.cut = file->mdat_end;
+    bound = file->ftyp_len + file->moov_len + ATOM_LARGE_LEN;
+
+    for (t = 0; t < (int)file->track_num; t++)
+    {
+	cur_track = &index->tracks[t];
+
+	if (t == index->video_track)
+	{
+	    j = i;
+	    rw.start_time[t] = time;
+	}
+	else
+	{
+	    for (j = 0, rw.start_time[t] = 0;
+		 (j < cur_track->header->sample_num) &&
+		     (rescale(rw.start_time[t], cur_track->header->timescale, video->header->timescale) < time);
+		 rw.start_time[t] += cur_track->samples[j].duration, j++);
+	}
+
+	rw.first[t] = j;
+
+	if ((j < cur_track->header->sample_num) && (cur_track->samples[j].offset < rw.cut))
+	{
+	    rw.cut = cur_track->samples[j].offset;
+	}
+
+	bound += TABLES_FIXED_LEN + ((int64_t)cur_track->header->sample_num * TABLES_SAMPLE_LEN);
+    }
+
+    if ((header = malloc(sizeof(Mp4Header))) == NULL)
+    {
+	return (NULL);
+    }
+
+    if ((rw.out.buf = malloc(bound)) == NULL)
+    {
+	free(header);
+	return (NULL);
+    }
+
+    rw.large_offsets = ((bound + file->mdat_end - rw.cut) > UINT32_MAX);
+
+    /* 'ftyp' is sent as it is, and 'moov' composed again. */
+    memcpy(rw.out.buf, data + file->ftyp_offset, file->ftyp_len);
+    rw.out.pos = file->ftyp_len;
+
+    if (!write_moov(&rw, data, FALSE))
+    {
+	free(rw.out.buf);
+	free(header);
+	return (NULL);
+    }
+
+    /* The tail of 'mdat' follows. */
+    header->tail_offset = rw.cut;
+    header->tail_len = file->mdat_end - rw.cut;
+
+    if ((header->tail_len + ATOM_HEADER_LEN) > UINT32_MAX)
+    {
+	put_be32(&rw.out, 1);
+	put_be32(&rw.out, ATOM_MDAT);
+	put_be64(&rw.out, header->tail_len + ATOM_LARGE_LEN);
+    }
+    else
+    {
+	put_be32(&rw.out, header->tail_len + ATOM_HEADER_LEN);
+	put_be32(&rw.out, ATOM_MDAT);
+    }
+
+    /* Now the chunk offsets can be moved after the header. */
+    header_len = rw.out.pos;
+
+    for (t = 0; t < (int)file->track_num; t++)
+    {
+	for (j = 0; j < rw.chunk_num[t]; j++)
+	{
+	    if (rw.large_offsets)
+	    {
+		offset = rw.chunk_table[t] + (j * 8);
+		set_be64(&rw.out, offset, get_be64(rw.out.buf + offset) + header_len);
+	    }
+	    else
+	    {
+		offset = rw.chunk_table[t] + (j * 4);
+		set_be32(&rw.out, offset, get_be32(rw.out.buf + offset) + header_len);
+	    }
+	}
+    }
+
+    header->iframe = iframe;
+    header->data = rw.out.buf;
+    header->len = header_len;
+    return (header);
+}
+
+/* free_header()
+ *
+ * */
+static
+void
+free_header			(Mp4Header * header)
+{
+    free(header->data);
+    free(header);
+}
+
+/* find_header()
+ *
+ * Find the header cached for keyframe 'iframe', if any.
+ * Must be called with 'mp4_lock' held.
+ * */
+static
+Mp4Header *
+find_header			(Mp4Index * index, int iframe)
+{
+    int i;
+
+    for (i = 0; i < MOOV_CACHE_SLOTS; i++)
+    {
+	if ((index->cache[i] != NULL) && (index->cache[i]->iframe == iframe))
+	{
+	    return (index->cache[i]);
+	}
+    }
+
+    return (NULL);
+}
+
+/* get_free_slot()
+ *
+ * Find room for a new header in the cache: an empty slot, or else the
+ * slot of the least recently used header not in use.
+ * Returns -1 if every header is in use.
+ * Must be called with 'mp4_lock' held.
+ * */
+static
+int
+get_free_slot			(Mp4Index * index)
+{
+    int i, slot;
+
+    for (i = 0, slot = -1; i < MOOV_CACHE_SLOTS; i++)
+    {
+	if (index->cache[i] == NULL)
+	{
+	    return (i);
+	}
+
+	if ((index->cache[i]->refs == 0) &&
+	    ((slot < 0) || (index->cache[i]->last_used < index->cache[slot]->last_used)))
+	{
+	    slot = i;
+	}
+    }
+
+    return (slot);
+}
+
+/* ********** Public functions ********** */
+
+/* put_be32()
+ *
+ * */
+void
+put_be32			(AtomWriter * out, uint32_t value)
+{
+    out->buf[out->pos++] = value >> 24;
+    out->buf[out->pos++] = value >> 16;
+    out->buf[out->pos++] = value >> 8;
+    out->buf[out->pos++] = value;
+}
+
+/* put_be64()
+ *
+ * */
+void
+put_be64			(AtomWriter * out, uint64_t value)
+{
+    put_be32(out, value >> 32);
+    put_be32(out, value);
+}
+
+/* set_be32()
+ *
+ * Write a value at 'pos', without moving the write position.
+ * */
+void
+set_be32			(AtomWriter * out, int64_t pos, uint32_t value)
+{
+    int64_t saved_pos;
+
+    saved_pos = out->pos;
+    out->pos = pos;
+    put_be32(out, value);
+    out->pos = saved_pos;
+}
+
+/* set_be64()
+ *
+ * */
+void
+set_be64			(AtomWriter * out, int64_t pos, uint64_t value)
+{
+    int64_t saved_pos;
+
+    saved_pos = out->pos;
+    out->pos = pos;
+    put_be64(out, value);
+    out->pos = saved_pos;
+}
+
+/* begin_atom()
+ *
+ * Start an atom, whose size is written by end_atom().
+ * Returns the position of the atom.
+ * */
+int64_t
+begin_atom			(AtomWriter * out, uint32_t type)
+{
+    int64_t start;
+
+    start = out->pos;
+    put_be32(out, 0);
+    put_be32(out, type);
+
+    return (start);
+}
+
+/* begin_full_atom()
+ *
+ * */
+int64_t
+begin_full_atom			(AtomWriter * out, uint32_t type, uint8_t version)
+{
+    int64_t start;
+
+    start = begin_atom(out, type);
+    put_be32(out, (uint32_t)version << 24);
+
+    return (start);
+}
+
+/* end_atom()
+ *
+ * */
+void
+end_atom			(AtomWriter * out, int64_t start)
+{
+    set_be32(out, start, out->pos - start);
+}
+
+/* parse_atom()
+ *
+ * Read the header of the atom at 'buf', 'len' bytes at most.
+ * Returns the length of its header, with its type and whole size in
+ * 'type' and 'size', or 0 if it is not well formed.
+ * */
+int
+parse_atom			(const uint8_t * buf, int64_t len, uint32_t * type, int64_t * size)
+{
+    int header_len;
+
+    if (len < ATOM_HEADER_LEN)
+    {
+	return (0);
+    }
+
+    header_len = ATOM_HEADER_LEN;
+    *size = get_be32(buf);
+    *type = get_be32(buf + 4);
+
+    if (*size == 1)
+    {
+	if (len < ATOM_LARGE_LEN)
+	{
+	    return (0);
+	}
+
+	*size = get_be64(buf + 8);
+	header_len = ATOM_LARGE_LEN;
+    }
+    else if (*size == 0)
+    {
+	*size = len;
+    }
+
+    return (((*size >= header_len) && (*size <= len)) ? header_len : 0);
+}
+
+/* load_mp4_index()
+ *
+ * Load the sample table of the rendition 'filename', 'data_size' bytes
+ * long, and check that it fits in the rendition.
+ * Returns NULL if there is none, or it is not valid.
+ * */
+Mp4Index *
+load_mp4_index			(const char * filename, int64_t data_size)
+{
+    Mp4Index * index;
+    Mp4Track * cur_track;
+    SampleFileHeader * file;
+    char * name, * ext, * slash, * cursor;
+    int64_t size, left;
+    uint32_t i;
+    int t;
+
+    /* The extension of the rendition is replaced. */
+    ext = strrchr(filename, '.');
+    slash = strrchr(filename, '/');
+
+    if ((ext == NULL) || ((slash != NULL) && (ext < slash)))
+    {
+	return (NULL);
+    }
+
+    asprintf(&name, "%.*s%s", (int)(ext - filename), filename, SAMPLES_EXT);
+
+    if (!check_file_exists(name) || ((index = calloc(1, sizeof(Mp4Index))) == NULL))
+    {
+	free(name);
+	return (NULL);
+    }
+
+    if ((index->file_data = (char *)get_file_contents(name)) == NULL)
+    {
+	free(index);
+	free(name);
+	return (NULL);
+    }
+
+    size = get_file_size(name);
+    index->size = size;
+    index->header = file = (SampleFileHeader *)index->file_data;
+    index->video_track = -1;
+
+    if ((size < (int64_t)sizeof(SampleFileHeader)) || (file->magic != SAMPLES_MAGIC) ||
+	(file->track_num == 0) || (file->track_num > MAX_TRACKS) ||
+	(file->ftyp_offset < 0) || (file->ftyp_len <= 0) || ((file->ftyp_offset + file->ftyp_len) > data_size) ||
+	(file->moov_offset < 0) || (file->moov_len <= 0) || ((file->moov_offset + file->moov_len) > data_size) ||
+	(file->mdat_offset < 0) || (file->mdat_offset > file->mdat_end) || (file->mdat_end > data_size))
+    {
+	LOG(WARNING, EMSG_MP4INDEX, name);
+	free_mp4_index(index);
+	free(name);
+	return (NULL);
+    }
+
+    cursor = index->file_data + sizeof(SampleFileHeader);
+    left = size - sizeof(SampleFileHeader);
+
+    for (t = 0; t < (int)file->track_num; t++)
+    {
+	cur_track = &index->tracks[t];
+
+	if (left < (int64_t)sizeof(TrackHeader))
+	{
+	    break;
+	}
+
+	cur_track->header = (TrackHeader *)cursor;
+	cursor += sizeof(TrackHeader);
+	left -= sizeof(TrackHeader);
+
+	if ((cur_track->header->timescale == 0) ||
+	    (cur_track->header->sample_num > (left / sizeof(Sample))))
+	{
+	    break;
+	}
+
+	cur_track->samples = (Sample *)cursor;
+	cursor += cur_track->header->sample_num * sizeof(Sample);
+	left -= cur_track->header->sample_num * sizeof(Sample);
+
+	/* Every sample must be inside 'mdat'. */
+	for (i = 0; i < cur_track->header->sample_num; i++)
+	{
+	    if ((cur_track->samples[i].offset < file->mdat_offset) ||
+		((cur_track->samples[i].offset + cur_track->samples[i].size) > file->mdat_end))
+	    {
+		break;
+	    }
+
+	    cur_track->duration += cur_track->samples[i].duration;
+	}
+
+	if (i < cur_track->header->sample_num)
+	{
+	    break;
+	}
+
+	if ((index->video_track < 0) && (cur_track->header->handler == HANDLER_VIDEO))
+	{
+	    index->video_track = t;
+	}
+    }
+
+    if ((t < (int)file->track_num) || (index->video_track < 0))
+    {
+	LOG(WARNING, EMSG_MP4INDEX, name);
+	free_mp4_index(index);
+	free(name);
+	return (NULL);
+    }
+
+    free(name);
+    return (index);
+}
+
+/* free_mp4_index()
+ *
+ * Free a sample table and every header cached for it, which must not
+ * be in use.
+ * */
+void
+free_mp4_index			(Mp4Index * index)
+{
+    int i;
+
+    for (i = 0; i < MOOV_CACHE_SLOTS; i++)
+    {
+	if (index->cache[i] != NULL)
+	{
+	    free_header(index->cache[i]);
+	}
+    }
+
+    free(index->file_data);
+    free(index);
+}
+
+/* get_mp4_init_bound()
+ *
+ * Room needed to compose the 'moov' atom of a fragmented rendition with
+ * write_mp4_init().
+ * */
+int64_t
+get_mp4_init_bound		(Mp4Index * index)
+{
+    return (index->header->moov_len + ATOM_HEADER_LEN +
+	    ((int64_t)index->header->track_num * (TABLES_FIXED_LEN + TREX_LEN)));
+}
+
+/* write_mp4_init()
+ *
+ * Compose into 'out' the 'moov' atom of a fragmented rendition with the
+ * same tracks as 'data', the rendition loaded with 'index'. Its samples
+ * are left to the fragments.
+ * Returns FALSE if it cannot be composed.
+ * */
+Boolean
+write_mp4_init			(AtomWriter * out, Mp4Index * index, const uint8_t * data)
+{
+    Rewrite rw;
+    int t;
+
+    memset(&rw, 0, sizeof(Rewrite));
+    rw.index = index;
+    rw.track = -1;
+    rw.out = *out;
+
+    for (t = 0; t < (int)index->header->track_num; t++)
+    {
+	rw.first[t] = index->tracks[t].header->sample_num;
+	rw.start_time[t] = index->tracks[t].duration;
+    }
+
+    if (!write_moov(&rw, data, TRUE))
+    {
+	return (FALSE);
+    }
+
+    out->pos = rw.out.pos;
+    return (TRUE);
+}
+
+/* get_mp4_header()
+ *
+ * Return the header of a rendition starting on keyframe 'iframe', from
+ * the cache or composed from 'data', the rendition itself. It must be
+ * released with release_mp4_header() once sent.
+ * Headers are composed without holding the lock, so two streams may
+ * compose the same one; only the first one is kept. If every header
+ * cached is in use, the new one is freed once released.
+ * Returns NULL if it cannot be composed.
+ * This function is thread safe.
+ * */
+Mp4Header *
+get_mp4_header			(Mp4Index * index, const uint8_t * data, int iframe)
+{
+    Mp4Header * header, * built;
+    int slot;
+
+    built = NULL;
+    pthread_mutex_lock(&mp4_lock);
+
+    if ((header = find_header(index, iframe)) == NULL)
+    {
+	pthread_mutex_unlock(&mp4_lock);
+
+	if ((built = build_header(index, data, iframe)) == NULL)
+	{
+	    LOG_RATELIMITED(WARNING, EMSG_MP4REWRITE, NULL);
+	    return (NULL);
+	}
+
+	LOG(MESSAGE, IMSG_MP4REWRITTEN, NULL);
+	pthread_mutex_lock(&mp4_lock);
+
+	/* Another stream may have composed it meanwhile. */
+	if ((header = find_header(index, iframe)) == NULL)
+	{
+	    header = built;
+	    built = NULL;
+	    header->refs = 0;
+
+	    if ((header->cached = ((slot = get_free_slot(index)) >= 0)))
+	    {
+		if (index->cache[slot] != NULL)
+		{
+		    free_header(index->cache[slot]);
+		}
+
+		index->cache[slot] = header;
+	    }
+	}
+    }
+
+    header->refs++;
+    header->last_used = ++index->clock;
+    pthread_mutex_unlock(&mp4_lock);
+
+    if (built != NULL)
+    {
+	free_header(built);
+    }
+
+    return (header);
+}
+
+/* release_mp4_header()
+ *
+ * */
+void
+release_mp4_header		(Mp4Index * index, Mp4Header * header)
+{
+    pthread_mutex_lock(&mp4_lock);
+
+    if ((--header->refs == 0) && !header->cached)
+    {
+	free_header(header);
+    }
+
+    pthread_mutex_unlock(&mp4_lock);
+}
@@ -0,0 +1,191 @@
+/* MP4 module.
+ * File: mp4.h
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * MP4 sample tables, and 'moov' atoms rewritten to start a stream on
+ * any keyframe.
+ * */
+
+#ifndef MP4_H
+#define MP4_H
+
+#include <stdint.h>
+
+/* ********** Constant definitions ********** */
+
+/* Sample tables are written by chopper next to every progressive MP4
+ * rendition, with the extension of the rendition replaced by this one.
+ * */
+#define SAMPLES_EXT		".samples"
+#define SAMPLES_MAGIC		0x31504d53
+
+/* Highest number of tracks in a rendition. */
+#define MAX_TRACKS		8
+
+/* Sample flags. */
+#define SAMPLE_SYNC		0x01
+
+/* Track handlers. */
+#define HANDLER_VIDEO		0x76696465
+
+/* Rewritten headers kept for every rendition. */
+#define MOOV_CACHE_SLOTS	8
+
+/* ********** Type definitions ********** */
+
+/* Sample table file layout, in the byte order of the machine that wrote
+ * it: a 'SampleFileHeader', and then a 'TrackHeader' followed by its
+ * samples for every track, in the same order as the 'trak' atoms in
+ * 'moov'.
+ *  - Offsets are absolute file offsets, and 'mdat_end' is the end of
+ *    the 'mdat' payload.
+ *  - Sample durations and composition offsets ('cto') are in the
+ *    timescale of their track.
+ * */
+typedef
+struct _sample_file_header
+{
+    uint32_t magic;
+    uint32_t track_num;
+    int64_t ftyp_offset;
+    int64_t ftyp_len;
+    int64_t moov_offset;
+    int64_t moov_len;
+    int64_t mdat_offset;
+    int64_t mdat_end;
+}
+SampleFileHeader;
+
+typedef
+struct _track_header
+{
+    uint32_t handler;
+    uint32_t timescale;
+    uint32_t sample_num;
+    uint32_t reserved;
+}
+TrackHeader;
+
+typedef
+struct _sample
+{
+    int64_t offset;
+    uint32_t size;
+    uint32_t duration;
+    int32_t cto;
+    uint32_t flags;
+}
+Sample;
+
+/* A track of a loaded sample table. Its samples point into the file
+ * data, and 'duration' adds up every sample duration.
+ * */
+typedef
+struct _mp4_track
+{
+    TrackHeader * header;
+    Sample * samples;
+    int64_t duration;
+}
+Mp4Track;
+
+/* Everything sent before the tail of 'mdat' when a rendition starts on
+ * keyframe 'iframe': its 'ftyp' atom, the rewritten 'moov' atom and a
+ * new 'mdat' header, in 'data'. The rest of the reply is sent straight
+ * from the rendition, 'tail_len' bytes from 'tail_offset'.
+ * Headers are shared by every stream starting on the same keyframe,
+ * and freed once unused if they do not fit in the cache.
+ * */
+typedef
+struct _mp4_header
+{
+    int iframe;
+    int refs;
+    Boolean cached;
+    unsigned int last_used;
+
+    uint8_t * data;
+    int64_t len;
+    int64_t tail_offset;
+    int64_t tail_len;
+}
+Mp4Header;
+
+/* Sample table of a rendition, along with its rewritten headers.
+ * 'size' is the memory it takes, and 'video_track' the index of its
+ * video track.
+ * */
+typedef
+struct _mp4_index
+{
+    char * file_data;
+    int64_t size;
+
+    SampleFileHeader * header;
+    Mp4Track tracks[MAX_TRACKS];
+    int video_track;
+
+    Mp4Header * cache[MOOV_CACHE_SLOTS];
+    unsigned int clock;
+}
+Mp4Index;
+
+/* Buffer atoms are composed into, big enough to hold all of them, and
+ * the position of the next byte written.
+ * */
+typedef
+struct _atom_writer
+{
+    uint8_t * buf;
+    int64_t pos;
+}
+AtomWriter;
+
+/* ********** Public functions ********** */
+
+/* Atom composition. */
+void
+put_be32			(AtomWriter * out, uint32_t value);
+
+void
+put_be64			(AtomWriter * out, uint64_t value);
+
+void
+set_be32			(AtomWriter * out, int64_t pos, uint32_t value);
+
+void
+set_be64			(AtomWriter * out, int64_t pos, uint64_t value);
+
+int64_t
+begin_atom			(AtomWriter * out, uint32_t type);
+
+int64_t
+begin_full_atom			(AtomWriter * out, uint32_t type, uint8_t version);
+
+void
+end_atom			(AtomWriter * out, int64_t start);
+
+int
+parse_atom			(const uint8_t * buf, int64_t len, uint32_t * type, int64_t * size);
+
+/* Sample tables. */
+Mp4Index *
+load_mp4_index			(const char * filename, int64_t data_size);
+
+void
+free_mp4_index			(Mp4Index * index);
+
+Mp4Header *
+get_mp4_header			(Mp4Index * index, const uint8_t * data, int iframe);
+
+void
+release_mp4_header		(Mp4Index * index, Mp4Header * header);
+
+int64_t
+get_mp4_init_bound		(Mp4Index * index);
+
+Boolean
+write_mp4_init			(AtomWriter * out, Mp4Index * index, const uint8_t * data);
+
+#endif
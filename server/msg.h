@@ -46,6 +46,13 @@
 #define ECOD_BUILDPATH		-33
 #define EMSG_FILEPATH		"Error finding file"
 #define ECOD_FILEPATH		-34
+#define EMSG_FILEWATCH		"Cannot watch file changes"
+#define ECOD_FILEWATCH		-35
+#define EMSG_FILESEND		"Error sending file"
+#define ECOD_FILESEND		-36
+
+#define IMSG_FILECACHED		"File loaded into cache"
+#define IMSG_FILECHANGED	"File changed, removed from cache"
 
 /* ********** request.c ********** */
 #define EMSG_READSOCKET		"Error reading data from socket"
@@ -56,6 +63,12 @@
 #define ECOD_BADFORMREQ		-42
 #define EMSG_NOSOCKINFO		"Cannot get socket info"
 #define ECOD_NOSOCKINFO		-43
+#define EMSG_REQTOOLONG		"Request too long"
+#define ECOD_REQTOOLONG		-44
+#define EMSG_HEADERTIMEOUT	"Timeout reading request headers"
+#define ECOD_HEADERTIMEOUT	-45
+#define EMSG_CONNIDLE		"Idle connection closed"
+#define ECOD_CONNIDLE		-46
 
 #define IMSG_VALIDPARAM		"Valid parameters received"
 #define IMSG_PARSING		"Parsing new request"
@@ -87,8 +100,13 @@
 #define ECOD_NOSTREAM		-68
 #define EMSG_NODATAFILE		"This data file does not exist"
 #define ECOD_NODATAFILE		-69
+#define EMSG_POPULARITY		"Cannot save the video popularity list"
+#define ECOD_POPULARITY		-190
+#define EMSG_POPULARITYTHREAD	"Cannot start the popularity list thread"
+#define ECOD_POPULARITYTHREAD	-191
 
 #define IMSG_INVALTIMEOUT       "Timeout too short, using default"
+#define IMSG_INVALPACE		"Pacing rate below the bitrate, using the bitrate"
 #define IMSG_NOVIDEO		"This path has no video files"
 #define IMSG_VIDEOSTOP		"Video stopped before ending"
 #define IMSG_CLIENTMSG		"Message received from client"
@@ -97,6 +115,12 @@
 #define IMSG_BITRATEHIGH	"Bitrate raised"
 #define IMSG_QUALITYSEL		"Quality selected by URL"
 #define	IMSG_POSITIONSEL	"Position selected by URL"
+#define IMSG_RANGESEL		"Byte range requested"
+#define IMSG_RANGEIGNORED	"Invalid byte range, sending the whole stream"
+#define IMSG_RANGENOTSAT	"Byte range not satisfiable"
+#define IMSG_PACINGENABLED	"Pacing enabled"
+#define IMSG_USERPACING		"Kernel pacing not available, pacing in user space"
+#define IMSG_WARMUPDONE		"Videos warmed up"
 
 /* ********** conn.c ********** */
 #define EMSG_SOCKET		"Failed to create a socket"
@@ -155,5 +179,64 @@
 #define ECOD_INVALIDLEVEL       -101
 #define EMSG_INVALIDDEV         "Invalid logging device"
 #define ECOD_INVALIDDEV         -102
+#define EMSG_LOGTHREAD          "Cannot start the logging thread"
+#define ECOD_LOGTHREAD          -103
+
+#define IMSG_LOGDROPPED         "Log messages dropped, log ring full"
+#define IMSG_LOGSUPPRESSED      "Similar log messages suppressed"
+
+/* ********** reply.c ********** */
+#define EMSG_SPLITHEADER	"Cannot find the date field in a header"
+#define ECOD_SPLITHEADER	-110
+
+/* ********** metrics.c ********** */
+#define EMSG_METRICSPORT	"Cannot open the metrics port"
+#define ECOD_METRICSPORT	-130
+#define EMSG_METRICSTHREAD	"Cannot start the metrics thread"
+#define ECOD_METRICSTHREAD	-131
+
+#define IMSG_METRICSENABLED	"Metrics enabled"
+
+/* ********** timer.c ********** */
+#define EMSG_TIMERTHREAD	"Cannot start the timer thread"
+#define ECOD_TIMERTHREAD	-140
+
+#define IMSG_TIMEREXPIRED	"Connection timed out"
+
+/* ********** control.c ********** */
+#define EMSG_CONTROLTHREAD	"Cannot start the control thread"
+#define ECOD_CONTROLTHREAD	-150
+#define EMSG_CONTROLTOOLONG	"Control message too long, discarded"
+#define ECOD_CONTROLTOOLONG	-151
+
+/* ********** session.c ********** */
+#define EMSG_SESSIONRANDOM	"Cannot open the random device for session ids"
+#define ECOD_SESSIONRANDOM	-160
+#define EMSG_SESSIONFULL	"Session table full, stream sent without session"
+#define ECOD_SESSIONFULL	-161
+
+#define IMSG_SESSIONRESUMED	"Session resumed"
+
+/* ********** mp4.c ********** */
+#define EMSG_MP4INDEX		"Invalid MP4 sample table"
+#define ECOD_MP4INDEX		-170
+#define EMSG_MP4REWRITE		"Cannot rewrite the MP4 header"
+#define ECOD_MP4REWRITE		-171
+
+#define IMSG_MP4REWRITTEN	"MP4 header rewritten"
+
+/* ********** cmaf.c ********** */
+#define EMSG_CMAFINDEX		"Cannot cut the rendition in CMAF segments"
+#define ECOD_CMAFINDEX		-180
+#define EMSG_NOSEGMENT		"CMAF segment not found"
+#define ECOD_NOSEGMENT		-181
+#define EMSG_SEGMENTSEND	"Cannot send the CMAF segment"
+#define ECOD_SEGMENTSEND	-182
+
+#define IMSG_SEGMENTBUILT	"CMAF segment built"
+
+/* ********** arena.c ********** */
+#define EMSG_ARENAALLOC		"Cannot allocate memory for an arena"
+#define ECOD_ARENAALLOC		-120
 
 #endif
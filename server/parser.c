@@ -0,0 +1,349 @@
+/* Parser module.
+ * File: parser.c
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Single pass, in place HTTP request tokenizer.
+ * The whole request is scanned once, from left to right, and every
+ * token is saved as an (offset, length) pair into the input buffer.
+ * Nothing is allocated, and nothing is copied. Delimiters are searched
+ * 16 or 32 bytes at a time when SSE2 or AVX2 are available.
+ * */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <strings.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "common.h"
+#include "parser.h"
+
+/* ********** Constant definitions ********** */
+#define MIN_REQUEST_LEN		14
+
+/* ********** Private functions ********** */
+
+/* find_delim()
+ *
+ * Return a pointer to the first 'fst' or 'snd' character between 'str'
+ * and 'end', or 'end' if there is none. It never reads beyond 'end'.
+ * */
+static inline
+const char *
+find_delim			(const char * str, const char * end, char fst, char snd)
+{
+#if defined(__AVX2__)
+    const __m256i fst_256 = _mm256_set1_epi8(fst);
+    const __m256i snd_256 = _mm256_set1_epi8(snd);
+    __m256i block_256;
+    unsigned int mask_256;
+#endif
+#if defined(__SSE2__)
+    const __m128i fst_128 = _mm_set1_epi8(fst);
+    const __m128i snd_128 = _mm_set1_epi8(snd);
+    __m128i block_128;
+    unsigned int mask_128;
+#endif
+
+#if defined(__AVX2__)
+    while ((end - str) >= 32)
+    {
+	block_256 = _mm256_loadu_si256((const __m256i *)str);
+	mask_256 = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(block_256, fst_256),
+							 _mm256_cmpeq_epi8(block_256, snd_256)));
+	if (mask_256 != 0)
+	{
+	    return (str + __builtin_ctz(mask_256));
+	}
+	str += 32;
+    }
+#endif
+
+#if defined(__SSE2__)
+    while ((end - str) >= 16)
+    {
+	block_128 = _mm_loadu_si128((const __m128i *)str);
+	mask_128 = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block_128, fst_128),
+						  _mm_cmpeq_epi8(block_128, snd_128)));
+	if (mask_128 != 0)
+	{
+	    return (str + __builtin_ctz(mask_128));
+	}
+	str += 16;
+    }
+#endif
+
+    while ((str < end) && (*str != fst) && (*str != snd))
+    {
+	str++;
+    }
+
+    return (str);
+}
+
+/* is_valid_value_char()
+ *
+ * Only alphanumeric characters are allowed in parameter values.
+ * */
+static inline
+Boolean
+is_valid_value_char		(char c)
+{
+    return (((unsigned char)((c | 0x20) - 'a') < 26) ||
+	    ((unsigned char)(c - '0') < 10));
+}
+
+/* set_slice()
+ *
+ * */
+static inline
+void
+set_slice			(Slice * slice, const char * buf, const char * head, const char * tail)
+{
+    slice->offset = head - buf;
+    slice->len = tail - head;
+}
+
+/* ********** Public functions ********** */
+
+/* parse_http_request()
+ *
+ * Tokenize the request line and every header in 'buf'.
+ * Returns the length of the request, PARSE_INCOMPLETE if the request
+ * needs more data to be parsed, or ECOD_BADFORMREQ if it is not well
+ * formed.
+ * Only requests like "GET /path?query HTTP/x.y" are accepted.
+ * */
+int
+parse_http_request		(const char * buf, size_t len, HttpRequest * req)
+{
+    const char * cur, * head, * tail, * end;
+
+    req->header_num = 0;
+    req->query.offset = 0;
+    req->query.len = 0;
+    end = buf + len;
+
+    /* Request line: method. */
+    head = buf;
+    if ((cur = find_delim(head, end, ' ', '\r')) >= end)
+    {
+	return ((len < MIN_REQUEST_LEN) ? PARSE_INCOMPLETE : ECOD_BADFORMREQ);
+    }
+
+    if ((*cur != ' ') || (cur == head))
+    {
+	return (ECOD_BADFORMREQ);
+    }
+    set_slice(&req->method, buf, head, cur);
+
+    /* Request line: path and query. */
+    head = ++cur;
+    if ((head >= end) || (*head != '/'))
+    {
+	return ((head >= end) ? PARSE_INCOMPLETE : ECOD_BADFORMREQ);
+    }
+
+    head++;
+    if ((cur = find_delim(head, end, ' ', '\r')) >= end)
+    {
+	return (PARSE_INCOMPLETE);
+    }
+
+    /* The request line ends before the protocol version. */
+    if (*cur != ' ')
+    {
+	return (ECOD_BADFORMREQ);
+    }
+
+    if ((tail = memchr(head, '?', cur - head)) != NULL)
+    {
+	set_slice(&req->path, buf, head, tail);
+	set_slice(&req->query, buf, tail + 1, cur);
+    }
+    else
+    {
+	set_slice(&req->path, buf, head, cur);
+    }
+
+    /* Request line: protocol version. */
+    head = ++cur;
+    if ((cur = find_delim(head, end, '\r', ' ')) >= end)
+    {
+	return (PARSE_INCOMPLETE);
+    }
+
+    if ((*cur != '\r') || ((cur - head) < 8) || (strncmp(head, "HTTP/", 5) != 0))
+    {
+	return (ECOD_BADFORMREQ);
+    }
+    set_slice(&req->version, buf, head, cur);
+
+    /* Headers, one per line, until an empty one is found. */
+    while (TRUE)
+    {
+	if ((cur + 1) >= end)
+	{
+	    return (PARSE_INCOMPLETE);
+	}
+
+	if (cur[1] != '\n')
+	{
+	    return (ECOD_BADFORMREQ);
+	}
+
+	head = cur + 2;
+	if ((head + 1) >= end)
+	{
+	    return (PARSE_INCOMPLETE);
+	}
+
+	/* Empty line: end of request. */
+	if (head[0] == '\r')
+	{
+	    if (head[1] != '\n')
+	    {
+		return (ECOD_BADFORMREQ);
+	    }
+
+	    req->len = head + 2 - buf;
+	    return (req->len);
+	}
+
+	/* Header name. */
+	if ((cur = find_delim(head, end, ':', '\r')) >= end)
+	{
+	    return (PARSE_INCOMPLETE);
+	}
+
+	if ((*cur != ':') || (cur == head))
+	{
+	    return (ECOD_BADFORMREQ);
+	}
+
+	if (req->header_num < MAX_HEADERS)
+	{
+	    set_slice(&req->header_names[req->header_num], buf, head, cur);
+	}
+
+	/* Header value, without surrounding blanks. */
+	for (head = cur + 1; (head < end) && ((*head == ' ') || (*head == '\t')); head++);
+
+	if ((cur = find_delim(head, end, '\r', '\n')) >= end)
+	{
+	    return (PARSE_INCOMPLETE);
+	}
+
+	if (*cur != '\r')
+	{
+	    return (ECOD_BADFORMREQ);
+	}
+
+	for (tail = cur; (tail > head) && ((tail[-1] == ' ') || (tail[-1] == '\t')); tail--);
+
+	if (req->header_num < MAX_HEADERS)
+	{
+	    set_slice(&req->header_values[req->header_num], buf, head, tail);
+	    req->header_num++;
+	}
+    }
+}
+
+/* find_header()
+ *
+ * Return the position of the header 'name' into the 'req' header
+ * arrays, or -1 if it was not sent. Header names are not case
+ * sensitive.
+ * */
+int
+find_header			(const char * buf, const HttpRequest * req, const char * name)
+{
+    int i;
+    size_t name_len;
+
+    name_len = strlen(name);
+
+    for (i = 0; i < req->header_num; i++)
+    {
+	if ((req->header_names[i].len == name_len) &&
+	    (strncasecmp(buf + req->header_names[i].offset, name, name_len) == 0))
+	{
+	    return (i);
+	}
+    }
+
+    return (-1);
+}
+
+/* parse_query()
+ *
+ * Parse the key-value pairs in the 'query' slice of 'buf', in place.
+ * Each value found for a key in 'keys' is terminated with '\0' into the
+ * buffer, and a pointer to it is saved in the same position of 'values';
+ * any other value is set to NULL. Values are truncated on the first non
+ * alphanumeric character, or when they are 'max_len' - 1 bytes long.
+ * If a key is repeated, only the first value is taken.
+ * Returns the number of values found.
+ * */
+int
+parse_query			(char * buf, Slice query, const char ** keys, int len, char ** values, int max_len)
+{
+    char * head, * cur, * end, * value, * value_end, * next;
+    int i, found;
+    size_t key_len;
+
+    for (i = 0; i < len; i++)
+    {
+	values[i] = NULL;
+    }
+
+    found = 0;
+    head = buf + query.offset;
+    end = head + query.len;
+
+    while (head < end)
+    {
+	next = (char *)find_delim(head, end, '&', '&');
+	cur = (char *)find_delim(head, next, '=', '=');
+
+	if (cur < next)
+	{
+	    key_len = cur - head;
+
+	    for (i = 0; (i < len) && !((strlen(keys[i]) == key_len) && (memcmp(keys[i], head, key_len) == 0)); i++);
+
+	    if ((i < len) && (values[i] == NULL))
+	    {
+		value = cur + 1;
+		for (value_end = value; (value_end < next) && ((value_end - value) < (max_len - 1)) && is_valid_value_char(*value_end); value_end++);
+
+		/* Every byte after the value is a delimiter or a character
+		 * already discarded, so it can be safely overwritten.
+		 * */
+		*value_end = '\0';
+		values[i] = value;
+		found++;
+	    }
+	}
+
+	head = next + 1;
+    }
+
+    return (found);
+}
+
+/* slice_equals()
+ *
+ * Check if a slice has exactly the same contents as 'str'.
+ * */
+Boolean
+slice_equals			(const char * buf, Slice slice, const char * str)
+{
+    return ((strlen(str) == slice.len) && (memcmp(buf + slice.offset, str, slice.len) == 0));
+}
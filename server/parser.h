@@ -0,0 +1,71 @@
+/* Parser module.
+ * File: parser.h
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Single pass, in place HTTP request tokenizer.
+ * */
+
+#ifndef PARSER_H
+#define PARSER_H
+
+/* ********** Constant definitions ********** */
+
+/* Maximum number of headers kept per request. Any header beyond this
+ * limit is checked for syntax, but not recorded.
+ * */
+#define MAX_HEADERS		24
+
+/* parse_http_request() returns this value when the buffer does not
+ * contain a whole request yet.
+ * */
+#define PARSE_INCOMPLETE	0
+
+/* ********** Type definitions ********** */
+
+/* A 'Slice' points to a substring of the input buffer, so nothing is
+ * ever copied while parsing.
+ * */
+typedef
+struct _slice
+{
+    unsigned short offset;
+    unsigned short len;
+}
+Slice;
+
+/* Every field of a request, as slices of the input buffer.
+ *  - 'path' does not contain neither the leading '/' nor the query.
+ *  - 'query' is everything between '?' and the protocol version.
+ *  - 'len' is the request length, including the last empty line.
+ * */
+typedef
+struct _http_request
+{
+    Slice method;
+    Slice path;
+    Slice query;
+    Slice version;
+
+    Slice header_names[MAX_HEADERS];
+    Slice header_values[MAX_HEADERS];
+    int header_num;
+
+    unsigned short len;
+}
+HttpRequest;
+
+/* ********** Public functions ********** */
+int
+parse_http_request		(const char * buf, size_t len, HttpRequest * req);
+
+int
+find_header			(const char * buf, const HttpRequest * req, const char * name);
+
+int
+parse_query			(char * buf, Slice query, const char ** keys, int len, char ** values, int max_len);
+
+Boolean
+slice_equals			(const char * buf, Slice slice, const char * str);
+
+#endif
@@ -14,6 +14,7 @@
 #include "common.h"
 #include "msg.h"
 #include "logging.h"
+#include "request.h"
 #include "reply.h"
 
 /* ********** Constant definitions ********** */
@@ -23,7 +24,9 @@
 #define VERSION_LEN		     5
 
 #define DATE_FMT		     "%a, %d %b %Y %H:%M:%S GMT"
-#define DATE_LEN		     30
+#define FIELD_LEN		     64
+#define DATE_FIELD		     "\r\nDate: "
+#define DATE_FIELD_LEN		     8
 
 #define DEFAULT_HTTP_COMMAND	     ""
 #define DEFAULT_HTTP_COMMAND_LEN     0
@@ -74,11 +77,25 @@ char http_template [] = "HTTP/1.1 %s\r\n"
 			"%s\r\n"
 			"Connection: %s\r\n"
 			"Cache-Control: %s\r\n"
-			"Expires: %s\r\n\r\n";
+			"Expires: %s\r\n"
+			"%s\r\n";
 				  
 const
 size_t http_template_len = 91;
 
+/* Current date, as written in the 'Date' field, and the time it was
+ * last formatted. Each thread keeps its own copy, that changes only once
+ * per second.
+ * */
+__thread
+char cur_date [DATE_LEN];
+
+__thread
+unsigned int cur_date_len = 0;
+
+__thread
+time_t cur_date_time = 0;
+
 /* HTML Template.
  * */
 const
@@ -89,6 +106,9 @@ char html_template [] = "<HTML><HEAD><meta http-equiv=\"content-type\" content=\
 const
 size_t html_template_len = 110;
 
+/* Maximum size of a whole HTML page. */
+#define HTML_LEN			512
+
 /* ********** Public functions ********** */
 
 /* Specific replies.
@@ -101,36 +121,31 @@ size_t html_template_len = 110;
  * 
  * */
 char *
-ok_reply			()
+ok_reply			(Arena * arena, char * connection)
 {
     ReplyParams params;
-    char * res, * contents;
+    char contents [HTML_LEN];
+    char * res;
     unsigned int contents_len, reply_size;
 	
     /* Initialize reply parameters. */
     params.http_command = NULL;
     params.http_code = HTTP_OK_CODE;
     params.content_type = HTML_TYPE;
-    params.connection = CONN_CLOSE;
+    params.connection = connection;
     params.transfer_encoding = NULL;
     params.cache_control = NO_CACHE;
     params.expiration = NO_EXPIRE;
+    params.extra_headers = NULL;
 	
-    if ((contents_len = asprintf(&contents, html_template,
-				 HTTP_OK_CODE, HTTP_OK_MSG)) == -1)
+    if ((contents_len = snprintf(contents, HTML_LEN, html_template,
+				 HTTP_OK_CODE, HTTP_OK_MSG)) >= HTML_LEN)
     {
-	if (contents)
-	{
-	    free(contents);
-	}
-		
-	log_message(WARNING, EMSG_COMPNOTFOUND, NULL);
+	LOG(WARNING, EMSG_COMPNOTFOUND, NULL);
 	return (NULL);
     }
 	
-    res = compose_reply(params, (uint8_t *)contents, contents_len, &reply_size);
-
-    free(contents);
+    res = compose_reply(arena, params, (uint8_t *)contents, contents_len, &reply_size);
     return (res);
 }
 
@@ -138,36 +153,31 @@ ok_reply			()
  * 
  * */
 char *
-serv_unavail_reply			()
+serv_unavail_reply			(Arena * arena, char * connection)
 {
     ReplyParams params;
-    char * res, * contents;
+    char contents [HTML_LEN];
+    char * res;
     unsigned int contents_len, reply_size;
 	
     /* Initialize reply parameters. */
     params.http_command = NULL;
     params.http_code = HTTP_SERVICE_UNAVAIL_CODE;
     params.content_type = HTML_TYPE;
-    params.connection = CONN_CLOSE;
+    params.connection = connection;
     params.transfer_encoding = NULL;
     params.cache_control = NO_CACHE;
     params.expiration = NO_EXPIRE;
+    params.extra_headers = NULL;
 	
-    if ((contents_len = asprintf(&contents, html_template,
-				 HTTP_SERVICE_UNAVAIL_CODE, HTTP_SERVICE_UNAVAIL_MSG)) == -1)
+    if ((contents_len = snprintf(contents, HTML_LEN, html_template,
+				 HTTP_SERVICE_UNAVAIL_CODE, HTTP_SERVICE_UNAVAIL_MSG)) >= HTML_LEN)
     {
-	if (contents)
-	{
-	    free(contents);
-	}
-		
-	log_message(WARNING, EMSG_COMPNOTFOUND, NULL);
+	LOG(WARNING, EMSG_COMPNOTFOUND, NULL);
 	return (NULL);
     }
 	
-    res = compose_reply(params, (uint8_t *)contents, contents_len, &reply_size);
-
-    free(contents);
+    res = compose_reply(arena, params, (uint8_t *)contents, contents_len, &reply_size);
     return (res);
 }
 
@@ -175,58 +185,88 @@ serv_unavail_reply			()
  * 
  * */
 char *
-not_found_reply				()
+not_found_reply				(Arena * arena, char * connection)
 {
     ReplyParams params;
-    char * res, * contents;
+    char contents [HTML_LEN];
+    char * res;
     unsigned int contents_len, reply_size;
 	
     /* Initialize reply parameters. */
     params.http_command = NULL;
     params.http_code = HTTP_NOT_FOUND_CODE;
     params.content_type = HTML_TYPE;
-    params.connection = CONN_CLOSE;
+    params.connection = connection;
     params.transfer_encoding = NULL;
     params.cache_control = NO_CACHE;
     params.expiration = NO_EXPIRE;
+    params.extra_headers = NULL;
 	
-    if ((contents_len = asprintf(&contents, html_template,
-				 HTTP_NOT_FOUND_CODE, HTTP_NOT_FOUND_MSG)) == -1)
+    if ((contents_len = snprintf(contents, HTML_LEN, html_template,
+				 HTTP_NOT_FOUND_CODE, HTTP_NOT_FOUND_MSG)) >= HTML_LEN)
     {
-	if (contents)
-	{
-	    free(contents);
-	}
-		
-	log_message(WARNING, EMSG_COMPNOTFOUND, NULL);
+	LOG(WARNING, EMSG_COMPNOTFOUND, NULL);
 	return (NULL);
     }
 	
-    res = compose_reply(params, (uint8_t *)contents, contents_len, &reply_size);
+    res = compose_reply(arena, params, (uint8_t *)contents, contents_len, &reply_size);
+    return (res);
+}
 
-    free(contents);
+/* too_long_reply()
+ * 
+ * */
+char *
+too_long_reply				(Arena * arena, char * connection)
+{
+    ReplyParams params;
+    char contents [HTML_LEN];
+    char * res;
+    unsigned int contents_len, reply_size;
+	
+    /* Initialize reply parameters. */
+    params.http_command = NULL;
+    params.http_code = HTTP_TOO_LONG_CODE;
+    params.content_type = HTML_TYPE;
+    params.connection = connection;
+    params.transfer_encoding = NULL;
+    params.cache_control = NO_CACHE;
+    params.expiration = NO_EXPIRE;
+    params.extra_headers = NULL;
+	
+    if ((contents_len = snprintf(contents, HTML_LEN, html_template,
+				 HTTP_TOO_LONG_CODE, HTTP_TOO_LONG_MSG)) >= HTML_LEN)
+    {
+	LOG(WARNING, EMSG_COMPNOTFOUND, NULL);
+	return (NULL);
+    }
+	
+    res = compose_reply(arena, params, (uint8_t *)contents, contents_len, &reply_size);
     return (res);
 }
 
 /* General purpose functions.
  * */
 
-/* compose_reply()
+/* compose_header()
  * 
- * Compose a reply using a set of parameters and a string with the desired
- * contents.
- * The returned value should be freed after its use with free().
- * Use 'uint8_t' for contents, as it can be fairly used with binary data.
- * 'reply_size' has the returned string length.
+ * Compose only the header of a reply, for a body 'content_len' bytes
+ * long. It allows the body to be sent straight from wherever it is
+ * stored, without copying it.
+ * The returned value is allocated from 'arena', or should be freed after
+ * its use with free() if 'arena' is NULL.
+ * 'header_size' has the returned string length.
  * */
 char *
-compose_reply			(ReplyParams params, uint8_t * content, int content_len, unsigned int * reply_size)
+compose_header			(Arena * arena, ReplyParams params, int64_t content_len, unsigned int * header_size)
 {
 	/* Here, 'var_field' is a field that should contain either a
 	 * 'Transfer-encoding: chunked' or a 'Content-length: x' string.
+	 * Every field is short, so they are composed on the stack.
 	 * */
-	char * fst_field, * expiration, * server, * date_time, * res, * var_field;
-	int size, expiration_len, var_field_len;
+	char expiration [FIELD_LEN], server [FIELD_LEN], date_time [DATE_LEN], var_field [FIELD_LEN];
+	char * fst_field, * res;
+	int size;
 	
 	const time_t current_time = time(NULL);
 	
@@ -284,58 +324,245 @@ compose_reply			(ReplyParams params, uint8_t * content, int content_len, unsigne
 		params.cache_control = DEFAULT_CACHE_CONTROL;
 		size += DEFAULT_CACHE_CONTROL_LEN;
 	}
-	
-	if (((expiration_len = asprintf(&expiration, "%d", params.expiration)) > 0) &&
-		(expiration != NULL))
+
+	/* Any other header, already formatted. */
+	if (params.extra_headers != NULL)
 	{
-		size += expiration_len;
+		size += strlen(params.extra_headers);
 	}
 	else
 	{
-		expiration = DEFAULT_EXPIRATION_TIME;
-		size += DEFAULT_EXPIRATION_TIME_LEN;
+		params.extra_headers = "";
 	}
 	
+	size += snprintf(expiration, FIELD_LEN, "%d", params.expiration);
+	
 	/* Compose a chunked transfer header. */
 	if (params.transfer_encoding != NULL)
 	{
-		var_field_len = asprintf(&var_field, "%s%s", transfer_enc_header, params.transfer_encoding); 
-		size += var_field_len;
+		size += snprintf(var_field, FIELD_LEN, "%s%s", transfer_enc_header, params.transfer_encoding); 
 	}
 	else
 	{
 		/* Compose a regular header with 'Content-length' field, so
 		 * calculate total reply_size.
-		 * Note that the method used is not as good as it should be.
 		 * */
-		size += asprintf(&var_field, "%s%d", content_len_header, content_len);
+		size += snprintf(var_field, FIELD_LEN, "%s%lld", content_len_header, (long long)content_len);
 	}
 	
 	/* Constant fields: 'Server' and 'Date' */
-	size += asprintf(&server, "%s/%s", SERVER, VERSION);
-	date_time = malloc(DATE_LEN * sizeof(char));
-	size += strftime(date_time, DATE_LEN, DATE_FMT, localtime(&current_time));
+	size += snprintf(server, FIELD_LEN, "%s/%s", SERVER, VERSION);
+	size += format_date(current_time, date_time);
 	
-	/* Finally, compose the reply. */
-	res = malloc(size + content_len + 1);
-	memset(res, '\0', size + content_len + 1);
+	/* Finally, compose the header. */
+	if ((res = arena_alloc(arena, size + 1)) == NULL)
+	{
+		return (NULL);
+	}
 	
 	sprintf(res, http_template, fst_field, server, date_time, params.content_type, var_field,
-								params.connection, params.cache_control, expiration);
-	memcpy(res + size, content, content_len);
+		params.connection, params.cache_control, expiration, params.extra_headers);
+
+	if (header_size != NULL)
+	{
+		*header_size = size;
+	}
 	
-	free(date_time);
-	free(var_field);
+	return (res);
+}
+
+/* compose_reply()
+ * 
+ * Compose a reply using a set of parameters and a string with the desired
+ * contents.
+ * The returned value is allocated from 'arena', or should be freed after
+ * its use with free() if 'arena' is NULL.
+ * Use 'uint8_t' for contents, as it can be fairly used with binary data.
+ * 'reply_size' has the returned string length.
+ * */
+char *
+compose_reply			(Arena * arena, ReplyParams params, uint8_t * content, int content_len, unsigned int * reply_size)
+{
+	char * header, * res;
+	unsigned int header_size;
+
+	if ((header = compose_header(arena, params, content_len, &header_size)) == NULL)
+	{
+		return (NULL);
+	}
 	
-	if (expiration)
+	if ((res = arena_alloc(arena, header_size + content_len + 1)) != NULL)
+	{
+		memcpy(res, header, header_size);
+		memcpy(res + header_size, content, content_len);
+		res[header_size + content_len] = '\0';
+	}
+
+	if (arena == NULL)
 	{
-		free(expiration);
+		free(header);
 	}
 
 	if (reply_size != NULL)
 	{
-		*reply_size = size + content_len;
+		*reply_size = header_size + content_len;
 	}
 	
 	return (res);
 }
+
+/* get_date()
+ * 
+ * Returns the current date, formatted to be used in a 'Date' field, and
+ * its length in 'date_len'. The returned string belongs to the calling
+ * thread, and must not be freed.
+ * */
+char *
+get_date			(unsigned int * date_len)
+{
+	const time_t current_time = time(NULL);
+
+	if (current_time != cur_date_time)
+	{
+		cur_date_len = format_date(current_time, cur_date);
+		cur_date_time = current_time;
+	}
+
+	*date_len = cur_date_len;
+	return (cur_date);
+}
+
+/* split_header_date()
+ * 
+ * Find the value of the 'Date' field in a header made by compose_header(),
+ * so the header can be kept and sent many times, replacing its date with
+ * get_date().
+ * 'date_pos' is the offset of the date into the header, and 'tail' points
+ * to the first byte after it, being 'tail_len' bytes long.
+ * */
+int
+split_header_date		(char * header, unsigned int header_size, unsigned int * date_pos, char ** tail, unsigned int * tail_len)
+{
+	char * date;
+
+	if (((date = strstr(header, DATE_FIELD)) == NULL) ||
+		((*tail = strstr(date + DATE_FIELD_LEN, CRLF)) == NULL))
+	{
+		return (ECOD_SPLITHEADER);
+	}
+
+	*date_pos = date + DATE_FIELD_LEN - header;
+	*tail_len = header_size - (*tail - header);
+
+	return (EXIT_SUCCESS);
+}
+
+/* format_date()
+ * 
+ * Write 'date_time' into 'buf', that must be at least DATE_LEN bytes
+ * long, as an HTTP date. Returns the length of the date.
+ * */
+unsigned int
+format_date			(time_t date_time, char * buf)
+{
+	struct tm date_tm;
+
+	return (strftime(buf, DATE_LEN, DATE_FMT, gmtime_r(&date_time, &date_tm)));
+}
+
+/* parse_date()
+ * 
+ * Returns the time written in an HTTP date, or -1 if it is not valid.
+ * */
+time_t
+parse_date			(const char * date)
+{
+	struct tm date_tm;
+	char * end;
+
+	memset(&date_tm, 0, sizeof(struct tm));
+
+	if (((end = strptime(date, DATE_FMT, &date_tm)) == NULL) || (*end != '\0'))
+	{
+		return (-1);
+	}
+
+	return (timegm(&date_tm));
+}
+
+/* match_etag()
+ * 
+ * Check if 'etag' is in 'etag_list', the value of an 'If-None-Match' or
+ * 'If-Range' header. Weak comparison ignores the 'W/' prefix, while
+ * strong comparison never matches weak tags.
+ * */
+Boolean
+match_etag			(const char * etag_list, const char * etag, Boolean weak)
+{
+	const char * cur;
+	size_t etag_len;
+	Boolean is_weak;
+
+	etag_len = strlen(etag);
+	cur = etag_list;
+
+	while (*cur != '\0')
+	{
+		for (; (*cur == ' ') || (*cur == '\t') || (*cur == ','); cur++);
+
+		if (*cur == '*')
+		{
+			return (TRUE);
+		}
+
+		if ((is_weak = (strncmp(cur, "W/", 2) == 0)))
+		{
+			cur += 2;
+		}
+
+		if ((!is_weak || weak) &&
+			(strncmp(cur, etag, etag_len) == 0) &&
+			((cur[etag_len] == '\0') || (cur[etag_len] == ',') ||
+			 (cur[etag_len] == ' ') || (cur[etag_len] == '\t')))
+		{
+			return (TRUE);
+		}
+
+		/* Skip this tag. Quoted tags may contain commas. */
+		if (*cur == '"')
+		{
+			for (cur++; (*cur != '\0') && (*cur != '"'); cur++);
+		}
+
+		for (; (*cur != '\0') && (*cur != ','); cur++);
+	}
+
+	return (FALSE);
+}
+
+/* is_not_modified()
+ * 
+ * Evaluate the conditional headers of a request against the validators
+ * of the entity to be sent, that is, its 'etag' and its modification
+ * time, or -1 if it is unknown.
+ * Returns TRUE if a "304 Not Modified" reply should be sent instead.
+ * */
+Boolean
+is_not_modified			(const RequestHeaders * headers, const char * etag, time_t mtime)
+{
+	time_t since;
+
+	/* 'If-Modified-Since' is ignored if there is an 'If-None-Match'. */
+	if (headers->if_none_match != NULL)
+	{
+		return ((etag != NULL) && match_etag(headers->if_none_match, etag, TRUE));
+	}
+
+	if ((headers->if_modified_since != NULL) && (mtime >= 0) &&
+		((since = parse_date(headers->if_modified_since)) >= 0))
+	{
+		return (mtime <= since);
+	}
+
+	return (FALSE);
+}
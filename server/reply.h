@@ -22,10 +22,13 @@
  * */
 #define HTTP_OK_CODE			"200 OK"
 #define HTTP_ACCEPTED_CODE		"202 Accepted"
+#define HTTP_PARTIAL_CODE		"206 Partial Content"
+#define HTTP_NOT_MODIFIED_CODE		"304 Not Modified"
 #define HTTP_BAD_REQUEST_CODE		"400 Bad Request"
 #define HTTP_FORBIDDEN_CODE		"403 Forbidden"	
 #define HTTP_NOT_FOUND_CODE		"404 Not Found"
 #define HTTP_TOO_LONG_CODE		"414 Request-URI Too Long"
+#define HTTP_NOT_SATISFIABLE_CODE	"416 Requested Range Not Satisfiable"
 #define HTTP_SERVER_ERROR_CODE		"500 Internal Server Error"
 #define HTTP_SERVICE_UNAVAIL_CODE	"503 Service Unavailable"
 
@@ -38,10 +41,17 @@
 #define HTTP_SERVER_ERROR_MSG		"<h1>Internal error, please come back later</h1>"
 #define HTTP_SERVICE_UNAVAIL_MSG	"<h1>Service temporarily unavailable</h1>"
 
+/* HTTP dates, including the trailing '\0'. */
+#define DATE_LEN			30
+
 /* Connection types. */
 #define CONN_CLOSE			"close"
 #define CONN_KEEP			"Keep-Alive"
 
+/* Byte ranges. */
+#define ACCEPT_RANGES			"Accept-Ranges: bytes\r\n"
+#define BYTERANGES_TYPE			"multipart/byteranges; boundary="
+
 /* Transfer encoding. */
 #define CHUNKED				"chunked"
 
@@ -51,6 +61,7 @@
 /* Cache control. */
 #define NO_CACHE			"no-cache"
 #define MAX_AGE				"max-age="
+#define IMMUTABLE			"public, max-age=31536000, immutable"
 
 /* Supported content types. */
 #define XML_TYPE			"application/xml"
@@ -59,6 +70,8 @@
 #define PLAIN_TYPE			"text/plain"
 #define FLV_TYPE			"video/x-flv"
 #define MP4_TYPE			"video/mp4"
+#define M3U8_TYPE			"application/vnd.apple.mpegurl"
+#define MPD_TYPE			"application/dash+xml"
 
 /* ********** Type definitions ********** */
 struct _reply_params
@@ -70,6 +83,9 @@ struct _reply_params
     char * transfer_encoding;
     char * cache_control;
     int expiration;
+
+    /* Any other header lines, each one ending with CRLF. */
+    char * extra_headers;
 };
 
 /* Only a small note here: Hungarian notation is only used with type
@@ -81,18 +97,42 @@ typedef struct _reply_params ReplyParams;
 /* Specific replies.
  * */
 char *
-ok_reply			();
+ok_reply			(Arena * arena, char * connection);
 
 char *
-serv_unavail_reply		();
+serv_unavail_reply		(Arena * arena, char * connection);
 
 char *
-not_found_reply			();
+not_found_reply			(Arena * arena, char * connection);
+
+char *
+too_long_reply			(Arena * arena, char * connection);
 
 /* General purpose functions.
  * */
 
 char *
-compose_reply			(ReplyParams params, uint8_t * content, int content_len, unsigned int * reply_size);
+compose_header			(Arena * arena, ReplyParams params, int64_t content_len, unsigned int * header_size);
+
+char *
+compose_reply			(Arena * arena, ReplyParams params, uint8_t * content, int content_len, unsigned int * reply_size);
+
+char *
+get_date			(unsigned int * date_len);
+
+int
+split_header_date		(char * header, unsigned int header_size, unsigned int * date_pos, char ** tail, unsigned int * tail_len);
+
+unsigned int
+format_date			(time_t date_time, char * buf);
+
+time_t
+parse_date			(const char * date);
+
+Boolean
+match_etag			(const char * etag_list, const char * etag, Boolean weak);
+
+Boolean
+is_not_modified			(const RequestHeaders * headers, const char * etag, time_t mtime);
 
 #endif
@@ -13,17 +13,21 @@
 #define _GNU_SOURCE
 
 #include <string.h>
+#include <strings.h>
+#include <errno.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 
 #include "common.h"
 #include "conn.h"
+#include "parser.h"
+#include "request.h"
 #include "file.h"
 #include "stream.h"
 #include "reply.h"
 #include "stat.h"
 #include "security.h"
-#include "request.h"
+#include "metrics.h"
 
 /* ********** Constant definitions ********** */
 
@@ -35,6 +39,7 @@
 #define ROBOTS_REQUEST_CODE             4
 #define ADJS_REQUEST_CODE		5
 #define STREAM_REQUEST_CODE		6
+#define CMAF_REQUEST_CODE		7
 #define EMPTY_REQUEST_CODE		99
 
 #define CROSSDOMAIN_REQUEST_NAME	"crossdomain.xml"
@@ -44,14 +49,19 @@
 #define ROBOTS_REQUEST_NAME             "robots.txt"
 #define ADJS_REQUEST_NAME		"sfMovie.js"
 #define STREAM_REQUEST_NAME		"stream"
+#define CMAF_REQUEST_NAME		"cmaf"
 #define EMPTY_REQUEST_NAME		""
 
-#define BUFFER_SIZE			1024
 #define LOG_SIZE			250
-#define GET_COMMAND			"GET /"
-#define GET_COMMAND_LEN			5
-#define AGENT_HEADER			"User-Agent:"
-#define AGENT_HEADER_LEN		12
+#define AGENT_HEADER			"User-Agent"
+#define CONNECTION_HEADER		"Connection"
+#define RANGE_HEADER			"Range"
+#define ENCODING_HEADER			"Accept-Encoding"
+#define IF_NONE_MATCH_HEADER		"If-None-Match"
+#define IF_MODIFIED_HEADER		"If-Modified-Since"
+#define IF_RANGE_HEADER			"If-Range"
+#define CONN_KEEP_LEN			10
+#define HTTP_1_1			"HTTP/1.1"
 
 /* ********** Type definitions ********** */
 typedef
@@ -60,11 +70,15 @@ struct _request
 	unsigned long ip_num;
 	int type;
 	int video_id;
-	char ** params;
+	HttpRequest http;
+	char * params[REQ_PARAM_NUM];
 	char * user_agent;
+	RequestHeaders headers;
+	Arena * arena;
+	Boolean keep_alive;
 	
-	char input[BUFFER_SIZE];
-	unsigned short input_len;
+	char * input;
+	int input_len;
 }
 Request;
 
@@ -73,181 +87,359 @@ const
 char * request_names [] = {CROSSDOMAIN_REQUEST_NAME, DATA_REQUEST_NAME,
 			   INTRO_REQUEST_NAME, PLAYER_REQUEST_NAME,
 			   ROBOTS_REQUEST_NAME, ADJS_REQUEST_NAME,
-			   STREAM_REQUEST_NAME};
+			   STREAM_REQUEST_NAME, CMAF_REQUEST_NAME};
 
 const
-size_t request_vlen = 7;
+size_t request_vlen = 8;
 
 const
 char * req_param_names [] = {VIDEOID_PARAM_NAME, SETID_PARAM_NAME,
 				CLIENTID_PARAM_NAME, DATA_PARAM_NAME,
 				INTRO_PARAM_NAME, SIGN_PARAM_NAME,
 				QUALITY_PARAM_NAME, POS_PARAM_NAME,
-				CACHE_PARAM_NAME};
+				CACHE_PARAM_NAME, SESSION_PARAM_NAME,
+				FORMAT_PARAM_NAME, SEGMENT_PARAM_NAME};
 						 
 const
-int req_param_vlen = 9;
+int req_param_vlen = REQ_PARAM_NUM;
+
+/* Headers that may change the reply, in the same order as the fields of
+ * 'RequestHeaders'.
+ * */
+const
+char * reply_header_names [] = {RANGE_HEADER, ENCODING_HEADER,
+				IF_NONE_MATCH_HEADER, IF_MODIFIED_HEADER,
+				IF_RANGE_HEADER};
+
+const
+int reply_header_vlen = 5;
 
 /* ********** Private functions ********** */
 
-/* parse_request()
+/* read_request()
  * 
- * Parse the request analyzing the received message.
+ * Read data from the client until a whole request is available in
+ * 'conn->input'.
+ * The first request on a connection must be received in HEADER_TIMEOUT
+ * seconds. Any later request must start in 'conn->idle_timeout' seconds,
+ * and then it has HEADER_TIMEOUT seconds to be completed. Both
+ * deadlines are kept by the connection timer, which shuts the socket
+ * down once they pass, so recv() may simply block.
+ * Requests may arrive split in several segments, so the buffer grows
+ * as needed up to REQUEST_MAX_SIZE bytes. Any byte received after the
+ * request is left in the buffer for the next one.
+ * Returns the length of the request, or an error code.
  * */
 int
-parse_request		(Request * client_req)
+read_request		(ClientConn * conn, HttpRequest * http)
 {
-    char * path, * add_info, * type, * saveptr, * params;
-    char * http_header, * agent_ptr;
-    unsigned short path_len, type_len, params_len, agent_len;
-	
-    /* Show the URL that will be parsed. */
-    add_info = wipe_special_chars(client_req->input, LOG_SIZE);
-    log_message(MESSAGE, IMSG_PARSING, add_info);
-    free(add_info);
-
-    /* Check if the first line of the request is well formed.
-     * - Length is at least 14 bytes, to contain a GET command, a path
-     *   and a protocol (HTTP 1.1 in this case).
-     * - The first bytes contain "GET /", to avoid malformed requests.
-     * - There is not only a GET and HTTP version in the request, but
-     *   also a set of other data (actually the referrer data).
-     * */
-    if ((client_req->input_len >= 14) &&
-	(strstr(client_req->input, GET_COMMAND) == client_req->input) &&
-	(http_header = strchr(client_req->input, '\r')) &&
-	(*(http_header + 1) != '\0'))
+    InputBuffer * input;
+    char * end, * data;
+    size_t scan_from, size;
+    ssize_t bytes_read;
+    int res;
+    Boolean idle;
+
+    input = &conn->input;
+    idle = (conn->requests > 0) && (input->len == 0);
+    scan_from = 0;
+
+    if (idle)
+    {
+	set_timer(&conn->timer, TIMER_IDLE, conn->idle_timeout, 0);
+    }
+    else
     {
-	/* Check which is the type requested. */
-	path = client_req->input + GET_COMMAND_LEN;
-	path_len = strchr(path, ' ') - path;
+	set_timer(&conn->timer, TIMER_HEADER, HEADER_TIMEOUT, 0);
+    }
+
+    while (TRUE)
+    {
+	/* Look for the empty line ending the request, only among the
+	 * bytes not scanned yet.
+	 * */
+	if ((input->len >= 4) &&
+	    ((end = memmem(input->data + scan_from, input->len - scan_from, CRLF CRLF, 4)) != NULL))
+	{
+	    /* The whole request is here: it cannot be incomplete. */
+	    res = parse_http_request(input->data, end + 4 - input->data, http);
+	    return ((res > 0) ? res : ECOD_BADFORMREQ);
+	}
 
-	/* Manage empty requests to provide clean replies. */
-	if (path_len < 1)
+	scan_from = (input->len > 3) ? (input->len - 3) : 0;
+
+	/* Enlarge the buffer if it is full. */
+	if (input->len >= input->size)
 	{
-	    client_req->type = EMPTY_REQUEST_CODE;
-	    client_req->params = NULL;
+	    if (input->size >= REQUEST_MAX_SIZE)
+	    {
+		/* Tell bad formed requests from long ones. */
+		if (parse_http_request(input->data, input->len, http) < 0)
+		{
+		    return (ECOD_BADFORMREQ);
+		}
+
+		LOG_RATELIMITED(WARNING, EMSG_REQTOOLONG, NULL);
+		return (ECOD_REQTOOLONG);
+	    }
+
+	    size = (input->size * 2 < REQUEST_MAX_SIZE) ? input->size * 2 : REQUEST_MAX_SIZE;
+
+	    if ((data = realloc(input->data, size + 1)) == NULL)
+	    {
+		return (ECOD_REQTOOLONG);
+	    }
+
+	    input->data = data;
+	    input->size = size;
 	}
-	else
+
+	if ((bytes_read = recv(conn->sd, input->data + input->len, input->size - input->len, 0)) <= 0)
 	{
-	    /* Find the request type code. */
-	    asprintf(&type, "%s", path);
-	    type = strtok_r(type, "? ", &saveptr);
+	    if ((bytes_read < 0) && (errno == EINTR))
+	    {
+		continue;
+	    }
 
-	    /* Find the request type code. */
-	    if ((client_req->type = find_vector_first(type, request_names, request_vlen)) < 0)
+	    /* Tell timeouts from connections closed by the client. */
+	    switch (get_timer_reason(&conn->timer))
 	    {
-		add_info = wipe_special_chars(client_req->input, LOG_SIZE);
-		log_message(WARNING, EMSG_TYPEUNKNOWN, add_info);
-		free(add_info);
-		free(type);
-		return (ECOD_TYPEUNKNOWN);
+		case (TIMER_IDLE):
+		    LOG(MESSAGE, EMSG_CONNIDLE, NULL);
+		    return (ECOD_CONNIDLE);
+		case (TIMER_HEADER):
+		    LOG_RATELIMITED(WARNING, EMSG_HEADERTIMEOUT, NULL);
+		    return (ECOD_HEADERTIMEOUT);
+		default:
+		    break;
 	    }
-			
-	    /* Get the URL parameter list. */
-	    free(type);
-	    type_len = strlen(request_names[client_req->type]);
-	    params_len = path_len - (type_len + 1);
-	    params = malloc((params_len + 1) * sizeof(char));
-	    snprintf(params, params_len + 1, "%s", path + type_len + 1);
-	    client_req->params = parse_key_value(params, req_param_names, req_param_vlen, "=&", PARAM_MAX_LEN);
-	    free(params);
+
+	    if (bytes_read < 0)
+	    {
+		LOG_RATELIMITED(WARNING, EMSG_READSOCKET, NULL);
+	    }
+	    return (ECOD_READSOCKET);
 	}
-		
-	/* Get the user agent, if available. */
-	if ((agent_ptr = strstr(http_header, AGENT_HEADER)) != NULL)
+
+	/* A new request has started on an idle connection. */
+	if (idle)
 	{
-	    agent_ptr += AGENT_HEADER_LEN;
-	    agent_len = strchr(agent_ptr, '\r') - agent_ptr + 1;
-	    client_req->user_agent = malloc(agent_len * sizeof(char));
-	    snprintf(client_req->user_agent, agent_len, "%s", agent_ptr);
+	    idle = FALSE;
+	    set_timer(&conn->timer, TIMER_HEADER, HEADER_TIMEOUT, 0);
 	}
+
+	input->len += bytes_read;
+	input->data[input->len] = '\0';
+    }
+}
+
+/* consume_request()
+ * 
+ * Remove the first 'len' bytes from 'input', moving any remaining data
+ * to the beginning of the buffer.
+ * */
+void
+consume_request		(InputBuffer * input, size_t len)
+{
+    if (len >= input->len)
+    {
+	input->len = 0;
     }
     else
     {
-	add_info = wipe_special_chars(client_req->input, LOG_SIZE);
-	log_message(WARNING, EMSG_BADFORMREQ, add_info);
-	free(add_info);
+	memmove(input->data, input->data + len, input->len - len);
+	input->len -= len;
+    }
+
+    input->data[input->len] = '\0';
+}
+
+/* parse_request()
+ * 
+ * Parse the request analyzing the received message, already tokenized
+ * by read_request().
+ * The input buffer is modified in place, so 'params' and every header value
+ * point into it and must not be freed.
+ * */
+int
+parse_request		(Request * client_req)
+{
+    char ** header_values [] = {&client_req->headers.range, &client_req->headers.accept_encoding,
+				&client_req->headers.if_none_match, &client_req->headers.if_modified_since,
+				&client_req->headers.if_range};
+    int i, j;
+	
+    /* Show the URL that will be parsed. */
+    LOG(MESSAGE, IMSG_PARSING, wipe_special_chars(client_req->arena, client_req->input, LOG_SIZE));
+
+    /* The request is well formed, so only check if the method is
+     * "GET", to avoid unsupported requests.
+     * */
+    if (!slice_equals(client_req->input, client_req->http.method, HTTP_GET_COMMAND))
+    {
+	LOG_RATELIMITED(WARNING, EMSG_BADFORMREQ, wipe_special_chars(client_req->arena, client_req->input, LOG_SIZE));
 	return (ECOD_BADFORMREQ);
     }
+
+    /* Manage empty requests to provide clean replies. */
+    if (client_req->http.path.len < 1)
+    {
+	client_req->type = EMPTY_REQUEST_CODE;
+    }
+    else
+    {
+	/* Find the request type code. */
+	for (i = 0; (i < request_vlen) && !slice_equals(client_req->input, client_req->http.path, request_names[i]); i++);
+
+	if (i >= request_vlen)
+	{
+	    LOG_RATELIMITED(WARNING, EMSG_TYPEUNKNOWN, wipe_special_chars(client_req->arena, client_req->input, LOG_SIZE));
+	    return (ECOD_TYPEUNKNOWN);
+	}
+
+	/* Get the URL parameter list. */
+	client_req->type = i;
+	parse_query(client_req->input, client_req->http.query, req_param_names,
+		    req_param_vlen, client_req->params, PARAM_MAX_LEN);
+    }
+		
+    /* HTTP/1.1 connections are persistent unless the client closes
+     * them, and HTTP/1.0 ones only if the client asks for it.
+     * */
+    if ((i = find_header(client_req->input, &client_req->http, CONNECTION_HEADER)) >= 0)
+    {
+	client_req->keep_alive = (client_req->http.header_values[i].len == CONN_KEEP_LEN) &&
+	    (strncasecmp(client_req->input + client_req->http.header_values[i].offset, CONN_KEEP, CONN_KEEP_LEN) == 0);
+    }
+    else
+    {
+	client_req->keep_alive = slice_equals(client_req->input, client_req->http.version, HTTP_1_1);
+    }
+
+    /* Get the user agent, if available. */
+    if ((i = find_header(client_req->input, &client_req->http, AGENT_HEADER)) >= 0)
+    {
+	client_req->user_agent = client_req->input + client_req->http.header_values[i].offset;
+	client_req->user_agent[client_req->http.header_values[i].len] = '\0';
+    }
+
+    /* Get every header that may change the reply. */
+    for (j = 0; j < reply_header_vlen; j++)
+    {
+	if ((i = find_header(client_req->input, &client_req->http, reply_header_names[j])) >= 0)
+	{
+	    *header_values[j] = client_req->input + client_req->http.header_values[i].offset;
+	    (*header_values[j])[client_req->http.header_values[i].len] = '\0';
+	}
+    }
 	
     return (EXIT_SUCCESS);
 }
 
-/* ********** Public functions ********** */
-
-/* manage_request()
+/* serve_request()
  * 
- * Main HTTP IO function.
- * Here the application will read a client request, classify it and send
- * a response. 
- * Also, it will act as a hub for all the tasks involving HTTP headers,
- * referrers and so on.
- * Remember that this function is called in a multithreaded environment!
- * Every piece of shared memory must be locked with lock_mutex() before
- * writing on it, and unlocked with unlock_mutex() after.
+ * Read, parse and reply a single request. Every allocation is taken from
+ * the connection arena.
  * */
 int
-manage_request			(int client_sd)
+serve_request			(ClientConn * conn)
 {
     Request client_req;
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len;
-    char * output_buf;
+    struct timespec parse_start;
+    char * output_buf, * connection;
     int bytes_sent, res, stat_req_id, i;
 	
-    client_req.ip_num = 0;
-    memset(client_req.input, '\0', BUFFER_SIZE);
+    client_req.ip_num = conn->ip_num;
+    client_req.arena = &conn->arena;
+    client_req.input = NULL;
     client_req.input_len = 0;
-    client_addr_len = sizeof(struct sockaddr_in);
     client_req.user_agent = NULL;
-	
-    /* Get client ip number in network order. */
-    if (getpeername(client_sd, (struct sockaddr *)&client_addr, &client_addr_len) != 0)
+    memset(&client_req.headers, 0, sizeof(RequestHeaders));
+    memset(&client_req.http, 0, sizeof(HttpRequest));
+    client_req.keep_alive = FALSE;
+    conn->keep_alive = FALSE;
+
+    for (i = 0; i < req_param_vlen; i++)
     {
-	log_message(WARNING, EMSG_NOSOCKINFO, NULL);
+	client_req.params[i] = NULL;
     }
-    else
+	
+    /* Start reading some data, until a whole request is received. */
+    if ((res = read_request(conn, &client_req.http)) < 0)
     {
-	client_req.ip_num = client_addr.sin_addr.s_addr;
+	switch (res)
+	{
+	    case (ECOD_REQTOOLONG):
+		output_buf = too_long_reply(&conn->arena, CONN_CLOSE);
+		break;
+	    case (ECOD_BADFORMREQ):
+		output_buf = not_found_reply(&conn->arena, CONN_CLOSE);
+		break;
+	    default:
+		output_buf = NULL;
+		break;
+	}
+
+	if (output_buf != NULL)
+	{
+	    bytes_sent = send(conn->sd, output_buf, strlen(output_buf), MSG_NOSIGNAL);
+	}
+
+	/* Nothing else can be read from this connection. */
+	conn->input.len = 0;
+	return (res);
     }
-	
+
+    conn->requests++;
+    metrics_add(M_REQUESTS, 1);
+
+    /* The request is complete: from now on, only watch the reply. */
+    set_timer(&conn->timer, TIMER_REPLY, 0, REPLY_TIMEOUT);
+    client_req.input = conn->input.data;
+    client_req.input_len = res;
+    conn->input.request_len = res;
+
     /* Before processing the request, check if it comes from a
      * blacklisted client.
      * */
     if ((res = check_client(client_req.ip_num)) != EXIT_SUCCESS)
     {
-	output_buf = serv_unavail_reply();
-	bytes_sent = send(client_sd, output_buf, strlen(output_buf), MSG_NOSIGNAL);
-	free(output_buf);
+	metrics_add(M_SECURITY_REJECTS, 1);
+	output_buf = serv_unavail_reply(&conn->arena, CONN_CLOSE);
+	bytes_sent = send(conn->sd, output_buf, strlen(output_buf), MSG_NOSIGNAL);
 	return (res);
     }
-	
-    /* Start reading some data.
-     * Read the request in one go.
-     * */
-    if ((client_req.input_len = recv(client_sd, client_req.input, BUFFER_SIZE, 0)) < 0)
-    {
-	log_message(WARNING, EMSG_READSOCKET, NULL);
-	return (ECOD_READSOCKET);
-    }
 
     /* It is time to analyze received data.
      * The application only takes care of "GET" commands, why more?
      * */
-    if ((res = parse_request(&client_req)) < 0)
+    clock_gettime(CLOCK_MONOTONIC, &parse_start);
+    res = parse_request(&client_req);
+    metrics_record(H_PARSE, metrics_elapsed(&parse_start));
+
+    if (res < 0)
     {
-	output_buf = not_found_reply();
-	bytes_sent = send(client_sd, output_buf, strlen(output_buf), MSG_NOSIGNAL);
-	free(output_buf);
+	output_buf = not_found_reply(&conn->arena, CONN_CLOSE);
+	bytes_sent = send(conn->sd, output_buf, strlen(output_buf), MSG_NOSIGNAL);
+	consume_request(&conn->input, client_req.input_len);
 	return (res);
     }
+
+    /* Keep the connection open only if the client wants to, the request
+     * limit has not been reached, and this is not a stream: streams
+     * read control messages from the socket, so they must be the last
+     * request on a connection.
+     * */
+    conn->keep_alive = client_req.keep_alive &&
+	(conn->requests < conn->max_requests) &&
+	(client_req.type != STREAM_REQUEST_CODE);
+    connection = (conn->keep_alive) ? CONN_KEEP : CONN_CLOSE;
 	
     /* Log received message, for the extremely paranoid, and save a 'request'
      * statistic.
      * */
-    log_message(MESSAGE, IMSG_VALIDPARAM, NULL);
-    stat_req_id = new_request_stat(client_req.ip_num, request_names[client_req.type], client_req.user_agent);
+    LOG(MESSAGE, IMSG_VALIDPARAM, NULL);
+    stat_req_id = new_request_stat(client_req.ip_num, (client_req.type == EMPTY_REQUEST_CODE) ? EMPTY_REQUEST_NAME : request_names[client_req.type], client_req.user_agent);
 	
     /* If there is a video petition, redirect socket to send_video()
      * In other case, use get_ad_file_by_id() from ads.c to get the
@@ -256,67 +448,120 @@ manage_request			(int client_sd)
     switch (client_req.type)
     {
 	case (STREAM_REQUEST_CODE):
-	    /* Send video. */
-	    if ((bytes_sent = send_video(client_sd, client_req.params)) < 0)
+	    /* Send video, saving its stats. */
+	    if ((bytes_sent = send_video(conn, client_req.params, &client_req.headers, stat_req_id)) < 0)
 	    {
 		/* Stream not found or failed streaming, send a "not found" page. */
-		output_buf = not_found_reply();
-		bytes_sent = send(client_sd, output_buf, strlen(output_buf), MSG_NOSIGNAL);
-		free(output_buf);
+		output_buf = not_found_reply(&conn->arena, connection);
+		bytes_sent = send(conn->sd, output_buf, strlen(output_buf), MSG_NOSIGNAL);
 	    }
-	    else
+	    break;
+
+	case (CMAF_REQUEST_CODE):
+	    /* Send a segment or a manifest, which may be cached. */
+	    if (((bytes_sent = send_segment(conn, client_req.params, &client_req.headers, connection)) < 0) &&
+		(bytes_sent != ECOD_SEGMENTSEND))
 	    {
-		/* Save stream stats. */
-		if (stat_req_id >= 0)
-		{
-		    new_stream_stat(stat_req_id, atoi(client_req.params[VIDEOID_PARAM_CODE]), bytes_sent);
-		}
+		output_buf = not_found_reply(&conn->arena, connection);
+		bytes_sent = send(conn->sd, output_buf, strlen(output_buf), MSG_NOSIGNAL);
 	    }
 	    break;
 			
 	case (EMPTY_REQUEST_CODE):
 	    /* Empty request. Reply with a "200 OK" code. */
-	    output_buf = ok_reply();
-	    bytes_sent = send(client_sd, output_buf, strlen(output_buf), MSG_NOSIGNAL);
-	    free(output_buf);
+	    output_buf = ok_reply(&conn->arena, connection);
+	    bytes_sent = send(conn->sd, output_buf, strlen(output_buf), MSG_NOSIGNAL);
 	    break;
 			
 	default:
 		
 	    /* Assume there is a identified request type and it is a non video file. */
-	    if ((output_buf = get_file_by_id((char *)request_names[client_req.type], client_req.params)) != NULL)
-	    {
-		bytes_sent = send(client_sd, output_buf, strlen(output_buf), MSG_NOSIGNAL);
-	    }
-	    else
+	    if (((bytes_sent = send_file_by_id(&conn->arena, conn->sd, (char *)request_names[client_req.type], client_req.params, connection,
+					      &client_req.headers)) < 0) &&
+		(bytes_sent != ECOD_FILESEND))
 	    {
 		/* Ad not found, so send a "not found" page. */
-		output_buf = not_found_reply();
-		bytes_sent = send(client_sd, output_buf, strlen(output_buf), MSG_NOSIGNAL);
+		output_buf = not_found_reply(&conn->arena, connection);
+		bytes_sent = send(conn->sd, output_buf, strlen(output_buf), MSG_NOSIGNAL);
 	    }
-			
-	    free(output_buf);
-		
+
 	    break;
     }
-	
-    /* Free memory, if allocated. */
-    if (client_req.params != NULL)
+
+    if (bytes_sent < 0)
     {
-	for (i = 0; i < req_param_vlen; i++)
-	{
-	    if (client_req.params[i] != NULL)
-	    {
-		free(client_req.params[i]);
-	    }
-	}
-	free(client_req.params);
+	conn->keep_alive = FALSE;
     }
 	
-    if (client_req.user_agent != NULL)
+    /* Leave pipelined data, if any, for the next request. */
+    consume_request(&conn->input, client_req.input_len);
+    return (EXIT_SUCCESS);
+}
+
+/* ********** Public functions ********** */
+
+/* init_input_buffer()
+ * 
+ * Allocate a request buffer. It is meant to be reused by every
+ * connection a child manages, so it is allocated only once.
+ * */
+int
+init_input_buffer		(InputBuffer * input)
+{
+    input->len = 0;
+    input->size = REQUEST_INIT_SIZE;
+
+    /* Keep room for a trailing '\0'. */
+    if ((input->data = malloc(input->size + 1)) == NULL)
     {
-	free(client_req.user_agent);
+	input->size = 0;
+	return (ECOD_REQTOOLONG);
     }
-	
+
+    input->data[0] = '\0';
     return (EXIT_SUCCESS);
 }
+
+/* free_input_buffer()
+ * 
+ * */
+void
+free_input_buffer		(InputBuffer * input)
+{
+    free(input->data);
+    input->data = NULL;
+    input->len = 0;
+    input->size = 0;
+}
+
+/* manage_request()
+ * 
+ * Main HTTP IO function.
+ * Here the application will read a client request, classify it and send
+ * a response. 
+ * Also, it will act as a hub for all the tasks involving HTTP headers,
+ * referrers and so on.
+ * It manages only one request, so it is called once for each request
+ * received through a persistent connection. 'conn->keep_alive' tells the
+ * caller if the connection should remain open afterwards.
+ * Memory allocated from 'conn->arena' while serving the request is
+ * released at once before returning.
+ * Remember that this function is called in a multithreaded environment!
+ * Every piece of shared memory must be locked with lock_mutex() before
+ * writing on it, and unlocked with unlock_mutex() after.
+ * */
+int
+manage_request			(ClientConn * conn)
+{
+    int res;
+
+    res = serve_request(conn);
+    reset_arena(&conn->arena);
+
+    /* Streams take note as soon as they start sending; any other reply
+     * has just been sent.
+     * */
+    metrics_first_byte();
+
+    return (res);
+}
@@ -25,6 +25,11 @@
 #define QUALITY_PARAM_CODE			6
 #define POS_PARAM_CODE				7
 #define CACHE_PARAM_CODE			8
+#define SESSION_PARAM_CODE			9
+#define FORMAT_PARAM_CODE			10
+#define SEGMENT_PARAM_CODE			11
+
+#define REQ_PARAM_NUM				12
 
 #define VIDEOID_PARAM_NAME			"video_id"
 #define SETID_PARAM_NAME		        "setid"
@@ -35,9 +40,92 @@
 #define QUALITY_PARAM_NAME			"quality"
 #define POS_PARAM_NAME				"pos"
 #define CACHE_PARAM_NAME			"cache"
+#define SESSION_PARAM_NAME			"session"
+#define FORMAT_PARAM_NAME			"format"
+#define SEGMENT_PARAM_NAME			"segment"
+
+/* Request buffer sizes, in bytes. */
+#define REQUEST_INIT_SIZE			1024
+#define REQUEST_MAX_SIZE			8192
+
+/* Maximum time (in seconds) to receive a whole request. */
+#define HEADER_TIMEOUT				10
+
+/* Maximum time (in seconds) a reply may go without sending anything.
+ * Streams use their own timeout instead.
+ * */
+#define REPLY_TIMEOUT				60
+
+/* ********** Type definitions ********** */
+
+/* Buffer holding the data read from a client.
+ * 'len' is the number of bytes received but not yet processed, and
+ * 'size' is the allocated size, not counting a trailing '\0'.
+ * 'request_len' is the length of the request being served: any byte
+ * after it was sent along with it.
+ * */
+typedef
+struct _input_buffer
+{
+    char * data;
+    size_t len;
+    size_t size;
+    size_t request_len;
+}
+InputBuffer;
+
+/* Request headers that change the reply, or NULL if they were not
+ * sent. Values point into the input buffer.
+ * */
+typedef
+struct _request_headers
+{
+    char * range;
+    char * accept_encoding;
+    char * if_none_match;
+    char * if_modified_since;
+    char * if_range;
+}
+RequestHeaders;
+
+/* Per connection data.
+ * Each child keeps one of these and reuses it, along with its input
+ * buffer and its arena, for every connection it accepts.
+ *  - 'arena' holds every allocation made while serving a request, and
+ *    it is reset when the request is done.
+ *  - 'requests' is the number of requests received on this connection.
+ *  - 'max_requests' is the maximum number of requests allowed on it.
+ *  - 'idle_timeout' is the time (in seconds) to wait for a new request.
+ *  - 'keep_alive' is set by manage_request() if the connection should
+ *    be kept open.
+ *  - 'timer' closes the connection once any of its deadlines passes.
+ *  - 'control' reads the control messages sent during a stream.
+ * */
+typedef
+struct _client_conn
+{
+    int sd;
+    unsigned long ip_num;
+    InputBuffer input;
+    Arena arena;
+
+    int requests;
+    int max_requests;
+    int idle_timeout;
+    Boolean keep_alive;
+    Timer timer;
+    Control control;
+}
+ClientConn;
 
 /* ********** Public functions ********** */
 int
-manage_request			(int client_fd);
+init_input_buffer		(InputBuffer * input);
+
+void
+free_input_buffer		(InputBuffer * input);
+
+int
+manage_request			(ClientConn * conn);
 
 #endif
@@ -113,9 +113,12 @@ init_security			(int req_limit, int time_limit, int len)
     max_request = req_limit;
     max_time = (int64_t)time_limit * NANOSEC_IN_SEC;
 	
-    asprintf(&add_info, "Request limit: %d; Time limit: %d; Queue len: %d\n", req_limit, time_limit, len);
-    log_message(MESSAGE, IMSG_SECENABLED, add_info);
-    free(add_info);
+    if (LOG_ENABLED(MESSAGE))
+    {
+	asprintf(&add_info, "Request limit: %d; Time limit: %d; Queue len: %d\n", req_limit, time_limit, len);
+	log_message(MESSAGE, IMSG_SECENABLED, add_info);
+	free(add_info);
+    }
     sec_enabled = 1;
     return (EXIT_SUCCESS);
 }
@@ -162,7 +165,7 @@ check_client			(unsigned long ip_num)
 	    pthread_mutex_unlock(&sec_lock);
 			
 	    asprintf(&ip, "IP: %lu", ip_num);
-	    log_message(ERROR, EMSG_BLACKLISTED, ip);
+	    LOG_RATELIMITED(ERROR, EMSG_BLACKLISTED, ip);
 	    free(tmp_entry);
 	    free(ip);
 			
@@ -188,7 +191,7 @@ check_client			(unsigned long ip_num)
 			
 	    /* ... And return. */
 	    asprintf(&ip, "IP: %lu", ip_num);
-	    log_message(ERROR, EMSG_ADDBLACKLIST, ip);
+	    LOG_RATELIMITED(ERROR, EMSG_ADDBLACKLIST, ip);
 	    free(tmp_entry);
 	    free(ip);
 			
@@ -0,0 +1,256 @@
+/* Session module.
+ * File: session.c
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Stream sessions, so clients may resume a stream after reconnecting.
+ * Every adaptive stream gets a random session id, sent in its reply
+ * headers. A later request with that id resumes the stream at the same
+ * video, quality and position, with the adaptive algorithm already warm.
+ * Sessions are kept in a hash table, with a lock for every group of
+ * buckets, and expire SESSION_TTL seconds after their last stream ends.
+ * Expired sessions are freed when their bucket is walked, or all at
+ * once if the table is full.
+ * */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "session.h"
+
+/* ********** Constant definitions ********** */
+
+/* Both must be powers of 2. */
+#define SESSION_BUCKETS		4096
+#define SESSION_LOCKS		64
+
+#define SESSION_KEY_LEN		16
+#define HEX_CHARS		"0123456789abcdef"
+#define RANDOM_DEVICE		"/dev/urandom"
+
+/* ********** Global variables ********** */
+Session * session_table[SESSION_BUCKETS];
+pthread_mutex_t session_locks[SESSION_LOCKS];
+int session_count = 0;
+
+int random_fd = -1;
+
+/* ********** Private functions ********** */
+
+/* get_bucket_lock()
+ *
+ * */
+static
+pthread_mutex_t *
+get_bucket_lock			(int bucket)
+{
+    return (&session_locks[bucket & (SESSION_LOCKS - 1)]);
+}
+
+/* purge_bucket()
+ *
+ * Free every expired session in a bucket.
+ * Must be called with the bucket lock held.
+ * */
+static
+void
+purge_bucket			(int bucket, time_t now)
+{
+    Session ** cur, * session;
+
+    for (cur = &session_table[bucket]; (session = *cur) != NULL;)
+    {
+	if ((session->refs == 0) && (session->expires <= now))
+	{
+	    *cur = session->next;
+	    free(session);
+	    __sync_fetch_and_sub(&session_count, 1);
+	}
+	else
+	{
+	    cur = &session->next;
+	}
+    }
+}
+
+/* purge_sessions()
+ *
+ * Free every expired session in the table.
+ * */
+static
+void
+purge_sessions			(time_t now)
+{
+    int i;
+
+    for (i = 0; i < SESSION_BUCKETS; i++)
+    {
+	pthread_mutex_lock(get_bucket_lock(i));
+	purge_bucket(i, now);
+	pthread_mutex_unlock(get_bucket_lock(i));
+    }
+}
+
+/* ********** Public functions ********** */
+
+/* init_sessions()
+ *
+ * */
+int
+init_sessions			()
+{
+    int i;
+
+    if ((random_fd = open(RANDOM_DEVICE, O_RDONLY | O_CLOEXEC)) < 0)
+    {
+	LOG(CRITICAL, EMSG_SESSIONRANDOM, RANDOM_DEVICE);
+	return (ECOD_SESSIONRANDOM);
+    }
+
+    memset(session_table, 0, sizeof(session_table));
+
+    for (i = 0; i < SESSION_LOCKS; i++)
+    {
+	pthread_mutex_init(&session_locks[i], NULL);
+    }
+
+    return (EXIT_SUCCESS);
+}
+
+/* open_session()
+ *
+ * Find the session 'id', which must not have expired, and take a
+ * reference to it. If 'video_id' is not negative, the session must be
+ * for that video.
+ * Returns NULL if it is not found, or if a stream is using it already:
+ * a session is resumed by one stream at a time.
+ * */
+Session *
+open_session			(const char * id, int video_id)
+{
+    Session * session;
+    char key[SESSION_KEY_LEN + 1];
+    time_t now;
+    int bucket;
+
+    if ((random_fd < 0) || (strlen(id) != SESSION_ID_LEN) ||
+	(get_valid_substr_len(id, HEX_CHARS) != SESSION_ID_LEN))
+    {
+	return (NULL);
+    }
+
+    memcpy(key, id, SESSION_KEY_LEN);
+    key[SESSION_KEY_LEN] = '\0';
+    bucket = strtoull(key, NULL, 16) & (SESSION_BUCKETS - 1);
+    now = time(NULL);
+
+    pthread_mutex_lock(get_bucket_lock(bucket));
+    purge_bucket(bucket, now);
+
+    for (session = session_table[bucket];
+	 (session != NULL) && (strcmp(session->id, id) != 0);
+	 session = session->next);
+
+    if ((session != NULL) && (session->refs == 0) && ((video_id < 0) || (session->video_id == video_id)))
+    {
+	session->refs++;
+    }
+    else
+    {
+	session = NULL;
+    }
+
+    pthread_mutex_unlock(get_bucket_lock(bucket));
+    return (session);
+}
+
+/* new_session()
+ *
+ * Create a session for a video, with a reference taken.
+ * Returns NULL if it cannot be created.
+ * */
+Session *
+new_session			(int video_id, const char * sign)
+{
+    Session * session;
+    unsigned char random[SESSION_ID_LEN / 2];
+    int bucket, i;
+
+    if (random_fd < 0)
+    {
+	return (NULL);
+    }
+
+    if (session_count >= MAX_SESSIONS)
+    {
+	purge_sessions(time(NULL));
+
+	if (session_count >= MAX_SESSIONS)
+	{
+	    LOG_RATELIMITED(WARNING, EMSG_SESSIONFULL, NULL);
+	    return (NULL);
+	}
+    }
+
+    if ((read(random_fd, random, sizeof(random)) != sizeof(random)) ||
+	((session = calloc(1, sizeof(Session))) == NULL))
+    {
+	return (NULL);
+    }
+
+    for (i = 0; i < (SESSION_ID_LEN / 2); i++)
+    {
+	sprintf(session->id + (i * 2), "%02x", random[i]);
+    }
+
+    for (i = 0; i < (SESSION_KEY_LEN / 2); i++)
+    {
+	session->key = (session->key << 8) | random[i];
+    }
+
+    session->video_id = video_id;
+    strncpy(session->sign, (sign != NULL) ? sign : "", SIGN_LEN);
+    session->refs = 1;
+
+    bucket = session->key & (SESSION_BUCKETS - 1);
+
+    pthread_mutex_lock(get_bucket_lock(bucket));
+    session->next = session_table[bucket];
+    session_table[bucket] = session;
+    pthread_mutex_unlock(get_bucket_lock(bucket));
+
+    __sync_fetch_and_add(&session_count, 1);
+    return (session);
+}
+
+/* close_session()
+ *
+ * Add a stream, 'bytes' long and lasting 'duration' nanoseconds, to a
+ * session, and release the reference taken to it. The session expires
+ * SESSION_TTL seconds after its last stream.
+ * */
+void
+close_session			(Session * session, int64_t bytes, int64_t duration)
+{
+    int bucket;
+
+    session->bytes += bytes;
+    session->duration += duration;
+
+    if (duration > 0)
+    {
+	session->throughput = (int64_t)(((double)bytes * 1000000000) / duration);
+    }
+
+    bucket = session->key & (SESSION_BUCKETS - 1);
+
+    pthread_mutex_lock(get_bucket_lock(bucket));
+    session->refs--;
+    session->expires = time(NULL) + SESSION_TTL;
+    pthread_mutex_unlock(get_bucket_lock(bucket));
+}
@@ -0,0 +1,72 @@
+/* Session module.
+ * File: session.h
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Stream sessions, so clients may resume a stream after reconnecting.
+ * */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <time.h>
+
+/* ********** Constant definitions ********** */
+
+/* Session ids are 128 random bits, in hexadecimal. */
+#define SESSION_ID_LEN		32
+
+/* Reply header carrying the session id. */
+#define SESSION_HEADER		"X-Session-Id"
+
+/* Time (in seconds) a session is kept after its last stream ends. */
+#define SESSION_TTL		300
+
+/* Highest number of sessions kept at once. */
+#define MAX_SESSIONS		65536
+
+/* ********** Type definitions ********** */
+
+/* State of a stream session.
+ * Fields below 'stream_pos' are only written by the stream using the
+ * session, which holds the only reference to it, so they need no lock.
+ *  - 'stream_pos' and 'iframe' are the quality and position being sent.
+ *  - 'cached_time' is the state of the adaptive algorithm.
+ *  - 'throughput' is the last estimate, in bytes per second.
+ *  - 'bytes' and 'duration' (in nanoseconds) add up every stream.
+ * */
+typedef
+struct _session
+{
+    char id[SESSION_ID_LEN + 1];
+    uint64_t key;
+    int video_id;
+    char sign[SIGN_LEN + 1];
+
+    int stream_pos;
+    int iframe;
+    int cached_time;
+    int64_t throughput;
+    int64_t bytes;
+    int64_t duration;
+
+    int refs;
+    time_t expires;
+    struct _session * next;
+}
+Session;
+
+/* ********** Public functions ********** */
+int
+init_sessions			();
+
+Session *
+open_session			(const char * id, int video_id);
+
+Session *
+new_session			(int video_id, const char * sign);
+
+void
+close_session			(Session * session, int64_t bytes, int64_t duration);
+
+#endif
@@ -36,16 +36,16 @@ default_handler			(int signum)
     switch(signum)
     {
 	case (SIGSEGV):
-	    log_message(CRITICAL, EMSG_SIGSEGV, NULL);
+	    LOG(CRITICAL, EMSG_SIGSEGV, NULL);
 	    break;
 	case (SIGTERM):
-	    log_message(MESSAGE, IMSG_SIGTERM, NULL);
+	    LOG(MESSAGE, IMSG_SIGTERM, NULL);
 	    break;
 	case (SIGINT):
-	    log_message(MESSAGE, IMSG_SIGINT, NULL);
+	    LOG(MESSAGE, IMSG_SIGINT, NULL);
 	    break;
 	default:
-	    log_message(MESSAGE, IMSG_SIGDEFAULT, NULL);
+	    LOG(MESSAGE, IMSG_SIGDEFAULT, NULL);
 	    break;
     }
 
@@ -54,9 +54,10 @@ default_handler			(int signum)
 
     if (setrlimit(RLIMIT_CORE, &core_limit) != 0)
     {
-	log_message(WARNING, EMSG_RULIMIT, NULL);
+	LOG(WARNING, EMSG_RULIMIT, NULL);
     }	
 
+    try_flush_log();
     printf("\n\nClosing process...\n");
     signal(signum, SIG_DFL);
     kill(getpid(), signum);
@@ -16,12 +16,13 @@
 #include "common.h"
 #include "conn.h"
 #include "stat.h"
+#include "metrics.h"
  
 /* ********** Constant definitions ********** */
 #define DEFAULT_PATH	    "/etc/ichoppedthatvideo/passwd"
 #define DATABASE	    "ichoppedthatvideo"
 #define REQUEST_FIELDS	    "client_id, server_id, child_id, type, browser, opsys, city, country, cur_timestamp"
-#define STREAM_FIELDS	    "request_id, video_id, seconds"
+#define STREAM_FIELDS	    "request_id, video_id, session, seconds, bytes"
 #define UNKNOWN_FIELD	    "unknown"
 
 /* ********** Global variables ********** */
@@ -30,6 +31,31 @@ pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
 MYSQL * db_conn           = NULL;
 GeoIP * gi_db             = NULL;
 
+/* ********** Private functions ********** */
+
+/* lock_stats()
+ * 
+ * Take the database connection, counting every thread waiting for it.
+ * */
+static
+void
+lock_stats				()
+{
+    metrics_add(M_STATS_QUEUE, 1);
+    pthread_mutex_lock(&stat_lock);
+}
+
+/* unlock_stats()
+ * 
+ * */
+static
+void
+unlock_stats				()
+{
+    pthread_mutex_unlock(&stat_lock);
+    metrics_add(M_STATS_QUEUE, -1);
+}
+
 /* ********** Public functions ********** */
 
 /* init_stat()
@@ -46,7 +72,7 @@ init_stat				(char * host, char * path)
 	
     if (host == NULL)
     {
-	log_message(ERROR, EMSG_DBHOST, NULL);
+	LOG(ERROR, EMSG_DBHOST, NULL);
 	return (ECOD_DBHOST);
     }
 	
@@ -68,7 +94,7 @@ init_stat				(char * host, char * path)
     if ((user = get_first_substr(entry, ',')) == NULL)
     {
 	free(contents);
-	log_message(ERROR, EMSG_STATDBUSER, NULL);
+	LOG(ERROR, EMSG_STATDBUSER, NULL);
 	return (ECOD_STATDBUSER);
     }
 	
@@ -76,7 +102,7 @@ init_stat				(char * host, char * path)
     {
 	free(user);
 	free(contents);
-	log_message(ERROR, EMSG_STATDBPASS, NULL);
+	LOG(ERROR, EMSG_STATDBPASS, NULL);
 	return (ECOD_STATDBPASS);
     }
     free(contents);
@@ -88,7 +114,7 @@ init_stat				(char * host, char * path)
 	free(user);
 	free(passwd);
 	mysql_close(db_conn);
-	log_message(ERROR, EMSG_DBSTATCONN, NULL);
+	LOG(ERROR, EMSG_DBSTATCONN, NULL);
 	return (ECOD_DBSTATCONN);
     }
 	
@@ -101,13 +127,16 @@ init_stat				(char * host, char * path)
      * */
     if ((gi_db = GeoIP_open("/usr/share/GeoIP/GeoLiteCity.dat", GEOIP_STANDARD)) == NULL)
     {
-	log_message(ERROR, EMSG_GISTATINIT, NULL);
+	LOG(ERROR, EMSG_GISTATINIT, NULL);
 	return (ECOD_GISTATINIT);
     }
 	
-    asprintf(&add_info, "Server: %s\n", host);
-    log_message(MESSAGE, IMSG_STATSENABLED, add_info);
-    free(add_info);
+    if (LOG_ENABLED(MESSAGE))
+    {
+	asprintf(&add_info, "Server: %s\n", host);
+	log_message(MESSAGE, IMSG_STATSENABLED, add_info);
+	free(add_info);
+    }
     stats_enabled = 1;
     return (EXIT_SUCCESS);
 }
@@ -174,47 +203,50 @@ new_request_stat			(unsigned long ip_num, const char * type, char * user_agent)
      * */
 	
     /* Insert data and get the last autoincremented value. */
-    pthread_mutex_lock(&stat_lock);
+    lock_stats();
     if (mysql_query(db_conn, query) != 0)
     {
-	pthread_mutex_unlock(&stat_lock);
-	log_message(ERROR, EMSG_INSERT, query);
+	unlock_stats();
+	LOG_RATELIMITED(ERROR, EMSG_INSERT, query);
 	free(client_id);
 	free(server_id);
 	free(query);
 	return (ECOD_INSERT);
     }
 
-    pthread_mutex_unlock(&stat_lock);
+    unlock_stats();
     free(client_id);
     free(query);
     asprintf(&query, "SELECT MAX(id) FROM requests WHERE server_id = '%s' AND child_id = %d", server_id, child_id);
     free(server_id);
 	
-    pthread_mutex_lock(&stat_lock);
+    lock_stats();
     if (mysql_query(db_conn, query) != 0)
     {
-	pthread_mutex_unlock(&stat_lock);
-	log_message(ERROR, EMSG_SELECT, query);
+	unlock_stats();
+	LOG_RATELIMITED(ERROR, EMSG_SELECT, query);
 	free(query);
 	return (ECOD_SELECT);
     }
 	
     if ((result = mysql_store_result(db_conn)) != NULL)
     {
-	pthread_mutex_unlock(&stat_lock);
+	unlock_stats();
 	free(query);
 	row = mysql_fetch_row(result);
 	auto_id = atoi(row[0]);
 	mysql_free_result(result);
-	asprintf(&add_info, "Request ID: %d\n", auto_id);
-	log_message(MESSAGE, IMSG_NEWREQSTAT, add_info);
-	free(add_info);
+	if (LOG_ENABLED(MESSAGE))
+	{
+	    asprintf(&add_info, "Request ID: %d\n", auto_id);
+	    log_message(MESSAGE, IMSG_NEWREQSTAT, add_info);
+	    free(add_info);
+	}
     }
     else
     {
-	pthread_mutex_unlock(&stat_lock);
-	log_message(ERROR, EMSG_SELECT, query);
+	unlock_stats();
+	LOG_RATELIMITED(ERROR, EMSG_SELECT, query);
 	free(query);
 	return (ECOD_SELECT);
     }
@@ -225,9 +257,12 @@ new_request_stat			(unsigned long ip_num, const char * type, char * user_agent)
 /* new_stream_stat()
  * 
  * Register statistics about streams and its duration.
+ * 'seconds' and 'bytes' add up every stream of 'session' so far, so the
+ * last row of a session holds its totals. Streams without a session
+ * have an empty one.
  * */
 int
-new_stream_stat			(int request_id, int video_id, int bytes)
+new_stream_stat			(int request_id, int video_id, const char * session, int seconds, int64_t bytes)
 {
     char * query, * add_info;
 	
@@ -237,23 +272,26 @@ new_stream_stat			(int request_id, int video_id, int bytes)
 	return (EXIT_SUCCESS);
     }
 	
-    asprintf(&query, "INSERT INTO streams (%s) VALUES (%d, %d, %d)",
-	     STREAM_FIELDS, request_id, video_id, bytes);
+    asprintf(&query, "INSERT INTO streams (%s) VALUES (%d, %d, '%s', %d, %lld)",
+	     STREAM_FIELDS, request_id, video_id, (session != NULL) ? session : "", seconds, (long long)bytes);
 	
-    pthread_mutex_lock(&stat_lock);		 
+    lock_stats();		 
     if (mysql_query(db_conn, query) != 0)
     {
-	pthread_mutex_unlock(&stat_lock);
-	log_message(ERROR, EMSG_INSERT, query);
+	unlock_stats();
+	LOG_RATELIMITED(ERROR, EMSG_INSERT, query);
 	free(query);
 	return (ECOD_INSERT);
     }		 
 
-    pthread_mutex_unlock(&stat_lock);
+    unlock_stats();
     free(query);
-    asprintf(&add_info, "Request ID: %d\n", request_id);
-    log_message(MESSAGE, IMSG_NEWSTRMSTAT, add_info);
-    free(add_info);
+    if (LOG_ENABLED(MESSAGE))
+    {
+	asprintf(&add_info, "Request ID: %d\n", request_id);
+	log_message(MESSAGE, IMSG_NEWSTRMSTAT, add_info);
+	free(add_info);
+    }
     return (EXIT_SUCCESS);
 }
 
@@ -272,6 +310,6 @@ close_stat				()
     mysql_close(db_conn);
     GeoIP_delete(gi_db);
 	
-    log_message(MESSAGE, IMSG_STATCLOSED, NULL);
+    LOG(MESSAGE, IMSG_STATCLOSED, NULL);
     return (EXIT_SUCCESS);
 }
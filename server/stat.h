@@ -17,6 +17,6 @@ int
 new_request_stat		(unsigned long ip_num, const char * type, char * user_agent);
 
 int
-new_stream_stat			(int request_id, int video_id, int bytes);
+new_stream_stat			(int request_id, int video_id, const char * session, int seconds, int64_t bytes);
 
 #endif
@@ -9,12 +9,15 @@
 #define _GNU_SOURCE
 
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <limits.h>
 #include <math.h>
 #include <unistd.h>
 #include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <dirent.h>
@@ -28,9 +31,16 @@
 
 #include "common.h"
 #include "conn.h"
-#include "reply.h"
+#include "parser.h"
 #include "request.h"
+#include "reply.h"
+#include "file.h"
 #include "stream.h"
+#include "metrics.h"
+#include "mp4.h"
+#include "cmaf.h"
+#include "session.h"
+#include "stat.h"
 
 /* ********** Constant definitions ********** */
 /* Maximum memory percentage available. */
@@ -45,13 +55,89 @@
 /* Time buffer below which the algorithm lowers stream quality. */
 #define LOWER_LIMIT_TIME	1500000000
 
+/* send() calls blocked for longer than this, in nanoseconds, are
+ * counted as stalls.
+ * */
+#define SEND_STALL_TIME		100000000
+
+/* Streams are closed once they last longer than the send timeout plus
+ * this many times the length of the video.
+ * */
+#define STREAM_DURATION_FACTOR	3
+
+/* Number of 'Video' headers allocated at once. */
+#define VIDEO_SLAB_SIZE		64
+
+/* Buckets of the table of shared stream files, a power of two. They are
+ * chosen by the first hex digits of the file hash.
+ * */
+#define STREAM_DATA_BUCKETS	1024
+#define STREAM_DATA_DIGITS	"%4x"
+
+/* Popularity list: one line per video, with its id and the number of
+ * times it was requested, most requested first. It is saved every
+ * 'POPULARITY_SAVE_TIME' seconds, so it survives restarts.
+ * */
+#define POPULARITY_BUCKETS	1024
+#define POPULARITY_SAVE_TIME	300
+#define POPULARITY_TMP_EXT	".tmp"
+
+/* Highest number of videos loaded at once while warming up, and room
+ * for their ids.
+ * */
+#define MAX_WARMUP_THREADS	16
+#define VIDEO_ID_LEN		16
+
+/* Reasons to load a video. Only streams are counted in the popularity
+ * list, and videos warmed up are not checked against their sign.
+ * */
+#define LOAD_STREAM		0
+#define LOAD_SEGMENT		1
+#define LOAD_WARMUP		2
+
+/* Videos kept in memory after a CMAF segment or manifest is built, so
+ * their indexes are not cut again for the next ones. The least recently
+ * used is dropped first.
+ * */
+#define CMAF_VIDEOS		64
+
 /* Chunk size for chunked transfers. */
 #define CHUNK_SIZE		1024
 #define CHUNK_END		0
 
+/* Room for a chunk size line, such as "\r\nffffffff\r\n". */
+#define CHUNK_PREFIX_LEN	16
+
+/* Byte ranges.
+ * Requests with more than 'MAX_RANGES' ranges are served whole.
+ * */
+#define RANGE_UNIT		"bytes="
+#define RANGE_UNIT_LEN		6
+#define MAX_RANGES		8
+#define RANGE_BOUNDARY		"ICHOPPEDTHATVIDEO_BYTERANGES"
+
 /* File containing information about streams. */
 #define	FILE_INFO		"data.txt"
 
+/* Stream attributes, written on their own lines after the iframe
+ * offsets. They locate the file header and the codec configuration,
+ * which are sent again when a stream does not start on its first byte.
+ * */
+#define ATTR_MARK		'/'
+#define HEADER_ATTR		"/header "
+#define CONFIG_ATTR		"/config "
+#define TIMES_ATTR		"/times "
+#define HASH_ATTR		"/hash "
+#define MAX_CONFIG_RANGES	4
+
+/* Iframes of two streams at most this many milliseconds apart are taken
+ * as the same one when switching streams.
+ * */
+#define ALIGN_TOLERANCE		50
+
+/* Room for the ranges sent before a stream: header and configuration. */
+#define MAX_PREFIX_RANGES	(MAX_CONFIG_RANGES + 1)
+
 /* Allowed video file extensions. */
 #define FLV_EXT			"flv"
 #define MP4_EXT			"mp4"
@@ -61,6 +147,7 @@
  * */ 
 #define RNEW_QUALITY_PARAM_CODE	0
 #define RNEW_POS_PARAM_CODE	1
+#define RNEW_PARAMS		2
 
 #define RNEW_QUALITY_PARAM_NAME	"quality"
 #define RNEW_POS_PARAM_NAME	"pos"
@@ -81,10 +168,37 @@ const
 char * renew_param_names [] = {RNEW_QUALITY_PARAM_NAME, RNEW_POS_PARAM_NAME};
 
 const
-int renew_param_vlen = 2;
+int renew_param_vlen = RNEW_PARAMS;
 
 /* ********** Type definitions ********** */
 
+/* A byte range into a stream file. */
+typedef
+struct _data_range
+{
+    int64_t offset;
+    int64_t len;
+}
+DataRange;
+
+/* The contents of a stream file, and its sample table if it is an MP4
+ * file. Files with a content hash in the info file are shared by every
+ * video listing them, as bumpers and intros are, and are freed along
+ * with their last reference. Files without one are never shared.
+ * */
+typedef
+struct _stream_data
+{
+    char hash[SIGN_LEN + 1];
+    uint8_t * data;
+    int64_t data_size;
+    Mp4Index * mp4;
+
+    int refs;
+    struct _stream_data * next;
+}
+StreamData;
+
 /* The 'Stream' structure holds all the data about each video file, and
  * each 'Video' structure has at least one 'Stream'.
  * */
@@ -93,6 +207,8 @@ struct _stream
 {	
     ushort type;
 		
+    /* File contents, taken from 'shared'. */
+    StreamData * shared;
     uint8_t * data;
     int64_t data_size;
 	
@@ -102,6 +218,22 @@ struct _stream
     /* Array with all the iframe offsets in the file. */
     int64_t * iframe_offset;
     ushort iframe_num;
+
+    /* Time of every iframe, in milliseconds, if the info file has them.
+     * Streams are switched between iframes shown at the same time.
+     * */
+    int64_t * iframe_time;
+
+    /* File header and codec configuration, if the info file has them. */
+    DataRange header;
+    DataRange config[MAX_CONFIG_RANGES];
+    ushort config_num;
+
+    /* Sample table of MP4 streams, if chopper saved it. */
+    Mp4Index * mp4;
+
+    /* CMAF segments of the stream, once one of them is requested. */
+    CmafIndex * cmaf;
 }
 Stream;
 
@@ -109,6 +241,9 @@ Stream;
  * stream set containing several versions, each one with different
  * quality settings.
  * The 'Stream' array is ordered by stream size, from higher to lower.
+ * It is allocated in a single block along with every iframe offset and
+ * time, and the video path and sign, so switching streams does not chase
+ * pointers and the whole layout is freed at once.
  * */
 typedef
 struct _video
@@ -123,12 +258,67 @@ struct _video
     char * sign;
     int counter;
 
-    Stream ** streams;
+    Stream * streams;
     int stream_num;
+
+    /* Memory taken by its layout and the indexes of its streams.
+     * Stream files are accounted for apart, as videos may share them.
+     * */
     int64_t size;
+
+    /* Next free header, only while this one is not in use. */
+    struct _video * next_free;
 }
 Video;
 
+/* 'Video' headers are taken from slabs, and only returned to the
+ * system when the module is closed.
+ * */
+typedef
+struct _video_slab
+{
+    struct _video_slab * next;
+    Video videos[VIDEO_SLAB_SIZE];
+}
+VideoSlab;
+
+/* The number of times a video was requested, since the popularity list
+ * was first saved.
+ * */
+typedef
+struct _popularity
+{
+    int video_id;
+    int64_t requests;
+    struct _popularity * next;
+}
+Popularity;
+
+/* Videos being warmed up, in order, and the next one to load. */
+typedef
+struct _warmup
+{
+    Popularity * list;
+    int list_num;
+    int next;
+    int loaded;
+    pthread_mutex_t lock;
+}
+Warmup;
+
+/* A byte range, relative to the first byte sent.
+ * 'open' is set for ranges without last byte ("bytes=x-"), as sent by
+ * players when seeking.
+ * */
+typedef
+struct _byte_range
+{
+    int64_t first;
+    int64_t last;
+    Boolean open;
+}
+ByteRange;
+
 /* ********** Global variables ********** */
 
 /* Default reply parameters for sending streams.
@@ -140,22 +330,43 @@ Video;
  *  - cache_control: no cache.
  *  - pragma: no cache.
  *  - expiration: no expiration.
+ *  - extra_headers: none.
  * */
 ReplyParams default_params = {NULL, HTTP_OK_CODE, NULL, CONN_CLOSE, NULL,
-			      NO_CACHE, NO_EXPIRE};
+			      NO_CACHE, NO_EXPIRE, NULL};
 
 /* Video related variables. */
 char * video_path    = NULL;
 Video ** videos      = NULL;
 int videos_num       = 0;
+VideoSlab * video_slabs = NULL;
+Video * free_videos  = NULL;
 int signed_auth      = 0;
 
+/* Stream files in memory, by content hash. */
+StreamData * stream_data[STREAM_DATA_BUCKETS];
+
+/* Requests of every video, by id, and the file they are saved to. */
+Popularity * popularity[POPULARITY_BUCKETS];
+int popularity_num   = 0;
+char * popularity_file = NULL;
+
+/* Videos kept for CMAF requests, from the least recently used. */
+Video * cmaf_videos[CMAF_VIDEOS];
+int cmaf_videos_num  = 0;
+
 /* Thread related variables. */
 pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Connection timeouts. */
 int timeout_sec  = 0;
 
+/* Pacing, as a percentage of the stream bitrate, and seconds of video
+ * sent before pacing.
+ * */
+int pace_percent     = 0;
+int pace_burst       = 0;
+
 /* Buffer and data sizes to ensure stable transmissions. */
 int send_buffer      = 0;
 int chunk_size       = 0;
@@ -186,6 +397,54 @@ get_next_offset				(const Stream * cur_stream, const ushort first_offset, ushort
     return (next_offset);
 }
 
+/* get_aligned_iframe()
+ * 
+ * Takes an iframe of stream 'from' and returns the first iframe of
+ * stream 'to' shown no earlier than it, so switching streams neither
+ * repeats nor skips video. Streams without iframe times are taken as
+ * aligned by position.
+ * Returns 'to->iframe_num' if 'iframe' is past the end of 'from' or
+ * 'to' has no such iframe.
+ * */
+static
+ushort
+get_aligned_iframe			(const Stream * from, const Stream * to, ushort iframe)
+{
+    int64_t time;
+    int first, last, middle;
+
+    if (iframe >= from->iframe_num)
+    {
+	return (to->iframe_num);
+    }
+
+    if ((from == to) || (from->iframe_time == NULL) || (to->iframe_time == NULL))
+    {
+	return ((iframe < to->iframe_num) ? iframe : to->iframe_num);
+    }
+
+    /* Iframe times grow along the stream. */
+    time = from->iframe_time[iframe] - ALIGN_TOLERANCE;
+    first = 0;
+    last = to->iframe_num;
+
+    while (first < last)
+    {
+	middle = (first + last) / 2;
+
+	if (to->iframe_time[middle] < time)
+	{
+	    first = middle + 1;
+	}
+	else
+	{
+	    last = middle;
+	}
+    }
+
+    return (first);
+}
+
 /* compare_video_id()
  * 
  * Function to be used with bsearch() to search for a video.
@@ -219,253 +478,1619 @@ inline
 int
 compare_stream_size			(const void * fst, const void * snd)
 {
-    Stream ** fst_stream = (Stream **) fst;
-    Stream ** snd_stream = (Stream **) snd;
+    const Stream * fst_stream = (const Stream *) fst;
+    const Stream * snd_stream = (const Stream *) snd;
 
-    return ((*fst_stream)->data_size - (*snd_stream)->data_size);
+    return ((fst_stream->data_size > snd_stream->data_size) - (fst_stream->data_size < snd_stream->data_size));
 }
 
-/* load_video()
+/* alloc_video()
  * 
- * Localize all video files under a specific directory and load them
- * to feed a request.
- * Returns a 'Video' pointer that should be freed after use, only if it
- * is found. Returns NULL otherwise.
- * This function is thread safe.
+ * Take a 'Video' header from the slabs, allocating a new slab if every
+ * header is in use. The header returned is zeroed.
+ * Must be called with 'stream_lock' held.
  * */
+static
 Video *
-load_video				(char * id, char * sign)
+alloc_video				()
 {
-    Video * cur_video, * search_video, ** found_video;
-    Stream * stream;
-    char * filename, * file_data, * offset, * ext, * field, * next_valid;
-    int i, j;
-	
-    /* Check if this directory is supported. */
-    if (check_supported_dir(video_path, id) == 0)
+    VideoSlab * slab;
+    Video * video;
+    int i;
+
+    if (free_videos == NULL)
     {
-	log_message(ERROR, EMSG_STREAMIDUNK, id);
-	return (NULL);
+	if ((slab = malloc(sizeof(VideoSlab))) == NULL)
+	{
+	    return (NULL);
+	}
+
+	slab->next = video_slabs;
+	video_slabs = slab;
+
+	for (i = 0; i < VIDEO_SLAB_SIZE; i++)
+	{
+	    slab->videos[i].next_free = free_videos;
+	    free_videos = &slab->videos[i];
+	}
     }
-	
-    /* Is this video already in memory? If so, use that. If not, get it
-     * from hard disk.
-     * */
-    search_video = malloc(sizeof(Video));
-    search_video->id = atoi(id);	
-    pthread_mutex_lock(&stream_lock);
 
-    /* Search in video cache.
-     *  - There is at least one video in memory.
-     *  - Video ID is found in cache.
-     *  - Video sign matches with the requested one.
-     * */ 
-    if ((videos_num > 0) &&
-	((found_video = bsearch(&search_video, videos, videos_num, sizeof(Video *), compare_video_id)) != NULL) &&
-	(!signed_auth || (strcmp((*found_video)->sign, sign) == 0)))
+    video = free_videos;
+    free_videos = video->next_free;
+    memset(video, 0, sizeof(Video));
+
+    return (video);
+}
+
+/* release_video()
+ * 
+ * Free the stream layout of a video, and return its header to the slabs.
+ * Stream data must be freed before.
+ * Must be called with 'stream_lock' held.
+ * */
+static
+void
+release_video				(Video * video)
+{
+    free(video->streams);
+    video->streams = NULL;
+    video->next_free = free_videos;
+    free_videos = video;
+}
+
+/* get_data_bucket()
+ * 
+ * Returns the bucket of the stream file with content hash 'hash'.
+ * */
+static
+unsigned int
+get_data_bucket				(const char * hash)
+{
+    unsigned int bucket;
+
+    bucket = 0;
+    sscanf(hash, STREAM_DATA_DIGITS, &bucket);
+
+    return (bucket & (STREAM_DATA_BUCKETS - 1));
+}
+
+/* get_stream_data()
+ * 
+ * Find a stream file in memory by its content hash, 'hash', or load it
+ * from 'filename' if it is not there or has no hash.
+ * Returns it with a new reference, which should be dropped with
+ * release_stream_data(), or NULL if it cannot be loaded.
+ * Must be called with 'stream_lock' held.
+ * */
+static
+StreamData *
+get_stream_data				(const char * hash, char * filename)
+{
+    StreamData * shared;
+
+    if (hash != NULL)
     {
-	cur_video = *found_video;
-	cur_video->counter++;
-	pthread_mutex_unlock(&stream_lock);
-	free(search_video);
-	return (cur_video);
+	for (shared = stream_data[get_data_bucket(hash)];
+	     (shared != NULL) && (strncmp(shared->hash, hash, SIGN_LEN) != 0);
+	     shared = shared->next);
+
+	if (shared != NULL)
+	{
+	    shared->refs++;
+	    metrics_add(M_SHARED_STREAMS, 1);
+	    return (shared);
+	}
     }
-	
-    free(search_video);
-	
-    /* Load the info file. */
-    asprintf(&filename, "%s/%s/%s", video_path, id, FILE_INFO);
 
-    if (!(get_file_size(filename) > 0) ||
-	(file_data = (char*)get_file_contents(filename)) == NULL)
+    if ((shared = malloc(sizeof(StreamData))) == NULL)
     {
-	free(filename);
-	pthread_mutex_unlock(&stream_lock);
-	log_message(ERROR, EMSG_NODATAFILE, filename);
 	return (NULL);
     }
 
-    free(filename);
-    cur_video = malloc(sizeof(Video));
-	
-    /* Check video sign. */
-    cur_video->id = atoi(id);
-    cur_video->path = get_first_substr(file_data, '\n');
-    cur_video->sign = get_first_substr(strchr(file_data, '\n') + 1, '\n');
-    cur_video->counter = 1;
-
-    if ((signed_auth) &&
-	((strlen(sign) != SIGN_LEN) || (strncmp(cur_video->sign, sign, SIGN_LEN) != 0)))
+    if ((shared->data = get_file_contents(filename)) == NULL)
     {
-	pthread_mutex_unlock(&stream_lock);
-	log_message(WARNING, EMSG_INVALSIGN, cur_video->path);
-
-	free(file_data);
-	free(cur_video->sign);
-	free(cur_video->path);
-	free(cur_video);
+	free(shared);
 	return (NULL);
     }
 
-    offset = strchr(strchr(file_data, '\n') + 1, '\n');
+    shared->data_size = get_file_size(filename);
+    shared->mp4 = NULL;
+    shared->refs = 1;
+    shared->next = NULL;
+    shared->hash[0] = '\0';
+    mem_used += shared->data_size;
 
-    /* Read the number of available streams. */
-    cur_video->stream_num = strtod(offset + 1, &offset);
-    cur_video->streams = malloc(cur_video->stream_num * sizeof(Stream *));
-	
-    /* Load each video file found. */
-    i = 0;
-    while (i < cur_video->stream_num)
+    if (hash != NULL)
     {
-	/* Read the name of the first video file. */
-	field = get_between_delim(offset, '\n', '\n');
-	asprintf(&filename, "%s/%s", cur_video->path, field);
-	free(field);
-		
-	stream = malloc(sizeof(Stream));
-		
-	if ((stream->data = get_file_contents(filename)) == NULL)
-	{
-	    /* This stream does not exist. */
-	    free(stream);
-	    cur_video->stream_num--;
-	    cur_video->streams = realloc(cur_video->streams, cur_video->stream_num * sizeof(Stream *));
-	    log_message(WARNING, EMSG_NOSTREAM, filename);
-	    free(filename);
-	}
-	else
-	{
-	    stream->data_size = get_file_size(filename);
-
-	    /* Find the stream type. 
-	     * In the type check, into 'send_video', the switch() checks if
-	     * this type is one of the allowed or has an undefined value
-	     * (a value bigger than 'allowed_vlen'.
-	     * */
-	    ext = get_last_substr(filename, '.');
-	    for (j = 0; ((j < allowed_vlen) && (strstr(ext, allowed_ext[j]) == NULL)); j++);
-	    stream->type = j;
-	    free(filename);
-	    free(ext);
-			
-	    /* Read the number of iframes. */
-	    offset = strchr(offset + 2, '\n');
-	    stream->iframe_num = strtod(offset + 1, &offset);
-	    stream->avg_size = stream->data_size / stream->iframe_num;
-			
-	    /* Allocate memory for the offsets. */
-	    stream->iframe_offset = malloc(stream->iframe_num * sizeof(int64_t));
-			
-	    /* Read each iframe offset. */
-	    for (j = 0; j < stream->iframe_num; j++)
-	    {
-		stream->iframe_offset[j] = strtoll(offset, &next_valid, 10);
-		offset = next_valid;
-	    }
-			
-	    /* Check if the current stream iframe offsets are well formed,
-	     * i.e., there is no iframe offsets beyond the last byte.
-	     * */
-	    if (stream->iframe_offset[stream->iframe_num - 1] < stream->data_size)
-	    {
-		cur_video->streams[i] = stream;
-		cur_video->size += stream->data_size;
-		i++;
-	    }
-	    else
-	    {
-		free(stream->iframe_offset);
-		free(stream);
-		cur_video->stream_num--;
-		cur_video->streams = realloc(cur_video->streams, cur_video->stream_num * sizeof(Stream *));
-		log_message(WARNING, EMSG_INVALOFFSET, filename);
-	    }
-	}
+	memcpy(shared->hash, hash, SIGN_LEN);
+	shared->hash[SIGN_LEN] = '\0';
+	shared->next = stream_data[get_data_bucket(hash)];
+	stream_data[get_data_bucket(hash)] = shared;
     }
 
-    mem_used += cur_video->size;
-    free(file_data);
+    return (shared);
+}
 
-    if (cur_video->stream_num > 0)
+/* release_stream_data()
+ * 
+ * Drop a reference to a stream file, and free it if it was the last
+ * one.
+ * Must be called with 'stream_lock' held.
+ * */
+static
+void
+release_stream_data			(StreamData * shared)
+{
+    StreamData ** link;
+
+    if (--shared->refs > 0)
     {
-	/* Sort streams array. */
-	qsort(cur_video->streams, cur_video->stream_num, sizeof(Stream *), compare_stream_size);
+	return;
     }
-    else
+
+    if (shared->hash[0] != '\0')
     {
-	/* Return an error and free allocated memory. */
-	pthread_mutex_unlock(&stream_lock);
-	log_message(ERROR, EMSG_NOSTREAMAVAIL, cur_video->path);
-		
-	free(cur_video->sign);
-	free(cur_video->path);
-	free(cur_video);
-	return (NULL);
+	for (link = &stream_data[get_data_bucket(shared->hash)]; *link != shared; link = &(*link)->next);
+	*link = shared->next;
     }
-	
-    /* Add this video to the list and sort it if necessary.
-     * This is controlled by the application-wide mutex.
-     * */
-    videos_num++;
-    videos = realloc(videos, videos_num * sizeof(Video *));
-    videos[videos_num - 1] = cur_video;
-	
-    if (videos_num > 1)
+
+    if (shared->mp4 != NULL)
     {
-	qsort(videos, videos_num, sizeof(Video *), compare_video_id);
+	mem_used -= shared->mp4->size;
+	free_mp4_index(shared->mp4);
     }
 
-    pthread_mutex_unlock(&stream_lock);
-    return (cur_video);
+    mem_used -= shared->data_size;
+    free(shared->data);
+    free(shared);
 }
 
-/* unload_video()
+/* count_requests()
  * 
- * Free memory allocated for a video.
- * This process is here because of the huge amount of code in
- * send_video().
- * This function is thread safe.
+ * Add 'requests' to the number of times a video was requested.
+ * Must be called with 'stream_lock' held.
  * */
-int
-unload_video			(Video * video)
+static
+void
+count_requests				(int video_id, int64_t requests)
 {
-    int i, counter;
+    Popularity * entry;
+    int bucket;
 
-    pthread_mutex_lock(&stream_lock);
-	
-    /* Delete video from memory if counter reaches 0 and video time alive
-     * in memory reaches MAX_TIME_ALIVE.
-     * */
-    if ((counter = --video->counter) <= 0)
+    bucket = (unsigned int)video_id & (POPULARITY_BUCKETS - 1);
+
+    for (entry = popularity[bucket]; (entry != NULL) && (entry->video_id != video_id); entry = entry->next);
+
+    if (entry == NULL)
     {
-	/* Free allocated streams. */
-	for (i = 0; i < video->stream_num; i++)
+	if ((entry = malloc(sizeof(Popularity))) == NULL)
 	{
-	    free(video->streams[i]->data);
-	    free(video->streams[i]->iframe_offset);
-	    free(video->streams[i]);
+	    return;
 	}
 
-	free(video->streams);
-	free(video->path);
-	free(video->sign);
-	mem_used -= video->size;
-	video->id = INT_MAX;
-	qsort(videos, videos_num, sizeof(Video *), compare_video_id);
-	free(video);
-	videos_num--;
-		
-	/* Reallocating this vector might fail. If so, initialize
-	 * 'videos_num' to 0
-	 * */
-	if ((videos = realloc(videos, videos_num * sizeof(Video *))) == NULL)
+	entry->video_id = video_id;
+	entry->requests = 0;
+	entry->next = popularity[bucket];
+	popularity[bucket] = entry;
+	popularity_num++;
+    }
+
+    entry->requests += requests;
+}
+
+/* compare_requests()
+ * 
+ * Function to be used with qsort() to sort videos by requests, from
+ * the most requested.
+ * */
+static
+int
+compare_requests			(const void * fst, const void * snd)
+{
+    const Popularity * fst_entry = (const Popularity *)fst;
+    const Popularity * snd_entry = (const Popularity *)snd;
+
+    return ((fst_entry->requests < snd_entry->requests) - (fst_entry->requests > snd_entry->requests));
+}
+
+/* get_popular_videos()
+ * 
+ * Returns a copy of the requests of every video, from the most
+ * requested, in an array that should be freed after use, and saves its
+ * length in 'list_num'.
+ * This function is thread safe.
+ * */
+static
+Popularity *
+get_popular_videos			(int * list_num)
+{
+    Popularity * list, * entry;
+    int i;
+
+    *list_num = 0;
+    pthread_mutex_lock(&stream_lock);
+
+    if ((popularity_num == 0) ||
+	((list = malloc(popularity_num * sizeof(Popularity))) == NULL))
+    {
+	pthread_mutex_unlock(&stream_lock);
+	return (NULL);
+    }
+
+    for (i = 0; i < POPULARITY_BUCKETS; i++)
+    {
+	for (entry = popularity[i]; entry != NULL; entry = entry->next)
+	{
+	    list[(*list_num)++] = *entry;
+	}
+    }
+
+    pthread_mutex_unlock(&stream_lock);
+    qsort(list, *list_num, sizeof(Popularity), compare_requests);
+    return (list);
+}
+
+/* parse_stream_info()
+ * 
+ * Parse the description of a single stream into the info file, starting
+ * at 'info': its file name, the number of iframes and their offsets.
+ * The file name is saved into 'name', and should be freed after use, the
+ * offsets into 'iframe_offset', and the first attribute line into
+ * 'attrs', or NULL if there is none; each of them is skipped if NULL.
+ * Returns a pointer to the end of the description, or NULL if it is not
+ * well formed.
+ * */
+char *
+parse_stream_info			(char * info, char ** name, ushort * iframe_num, int64_t * iframe_offset, char ** attrs)
+{
+    char * head, * next_valid;
+    int64_t value;
+    int i;
+
+    if (((head = strchr(info, '\n')) == NULL) ||
+	((info = strchr(head + 1, '\n')) == NULL))
+    {
+	return (NULL);
+    }
+
+    if (name != NULL)
+    {
+	*name = get_between_delim(head, '\n', '\n');
+    }
+
+    *iframe_num = strtol(info + 1, &info, 10);
+
+    for (i = 0; i < *iframe_num; i++)
+    {
+	value = strtoll(info, &next_valid, 10);
+
+	if (next_valid == info)
+	{
+	    if (name != NULL)
+	    {
+		free(*name);
+	    }
+
+	    return (NULL);
+	}
+
+	if (iframe_offset != NULL)
+	{
+	    iframe_offset[i] = value;
+	}
+
+	info = next_valid;
+    }
+
+    /* Skip the attribute lines, if any. */
+    if (attrs != NULL)
+    {
+	*attrs = NULL;
+    }
+
+    while (((next_valid = strchr(info, '\n')) != NULL) && (*(next_valid + 1) == ATTR_MARK))
+    {
+	info = next_valid + 1;
+
+	if ((attrs != NULL) && (*attrs == NULL))
+	{
+	    *attrs = info;
+	}
+    }
+
+    return (info);
+}
+
+/* parse_data_range()
+ * 
+ * Parse a range written as its offset and length, and check that it
+ * fits in 'data_size' bytes.
+ * */
+static
+Boolean
+parse_data_range			(char * value, int64_t data_size, DataRange * range)
+{
+    char * next_valid;
+
+    range->offset = strtoll(value, &next_valid, 10);
+
+    if (next_valid == value)
+    {
+	return (FALSE);
+    }
+
+    value = next_valid;
+    range->len = strtoll(value, &next_valid, 10);
+
+    return ((next_valid != value) && (range->offset >= 0) && (range->len > 0) &&
+	    (range->offset + range->len <= data_size));
+}
+
+/* parse_iframe_times()
+ * 
+ * Parse the time of every iframe of a stream into 'iframe_time'. There
+ * must be one for each iframe, and they must not decrease.
+ * */
+static
+Boolean
+parse_iframe_times			(char * value, ushort iframe_num, int64_t * iframe_time)
+{
+    char * next_valid;
+    int i;
+
+    for (i = 0; i < iframe_num; i++)
+    {
+	iframe_time[i] = strtoll(value, &next_valid, 10);
+
+	if ((next_valid == value) || ((i > 0) && (iframe_time[i] < iframe_time[i - 1])))
+	{
+	    return (FALSE);
+	}
+
+	value = next_valid;
+    }
+
+    return (iframe_num > 0);
+}
+
+/* get_stream_hash()
+ * 
+ * Find the content hash of a stream among its attribute lines, starting
+ * at 'attrs'.
+ * Returns a pointer to it, SIGN_LEN characters long, or NULL if there
+ * is none or it is malformed.
+ * */
+static
+char *
+get_stream_hash				(char * attrs)
+{
+    char * hash;
+
+    while ((attrs != NULL) && (*attrs == ATTR_MARK))
+    {
+	if (strncmp(attrs, HASH_ATTR, strlen(HASH_ATTR)) == 0)
+	{
+	    hash = attrs + strlen(HASH_ATTR);
+
+	    return (((strspn(hash, "0123456789abcdef") == SIGN_LEN) &&
+		     ((hash[SIGN_LEN] == '\n') || (hash[SIGN_LEN] == '\0'))) ? hash : NULL);
+	}
+
+	if ((attrs = strchr(attrs, '\n')) != NULL)
+	{
+	    attrs++;
+	}
+    }
+
+    return (NULL);
+}
+
+/* parse_stream_attrs()
+ * 
+ * Parse the attribute lines of a stream, starting at 'attrs'. Iframe
+ * times are saved into 'iframe_time'. Unknown and malformed attributes
+ * are skipped, so players only miss the ranges they describe, and
+ * streams without times are switched by iframe position.
+ * */
+static
+void
+parse_stream_attrs			(char * attrs, Stream * stream, int64_t * iframe_time)
+{
+    stream->header.len = 0;
+    stream->config_num = 0;
+    stream->iframe_time = NULL;
+
+    while ((attrs != NULL) && (*attrs == ATTR_MARK))
+    {
+	if (strncmp(attrs, HEADER_ATTR, strlen(HEADER_ATTR)) == 0)
+	{
+	    if (!parse_data_range(attrs + strlen(HEADER_ATTR), stream->data_size, &stream->header))
+	    {
+		stream->header.len = 0;
+	    }
+	}
+	else if ((strncmp(attrs, CONFIG_ATTR, strlen(CONFIG_ATTR)) == 0) && (stream->config_num < MAX_CONFIG_RANGES))
+	{
+	    if (parse_data_range(attrs + strlen(CONFIG_ATTR), stream->data_size, &stream->config[stream->config_num]))
+	    {
+		stream->config_num++;
+	    }
+	}
+	else if (strncmp(attrs, TIMES_ATTR, strlen(TIMES_ATTR)) == 0)
+	{
+	    if (parse_iframe_times(attrs + strlen(TIMES_ATTR), stream->iframe_num, iframe_time))
+	    {
+		stream->iframe_time = iframe_time;
+	    }
+	}
+
+	if ((attrs = strchr(attrs, '\n')) != NULL)
+	{
+	    attrs++;
+	}
+    }
+}
+
+/* load_video()
+ * 
+ * Localize all video files under a specific directory and load them
+ * to feed a request.
+ * The info file is read twice: first to count the iframes, so the
+ * 'Stream' array, every offset and time, and the video path and sign fit in a
+ * single allocation, and then to fill it.
+ * The 'reason' to load it is one of LOAD_STREAM, LOAD_SEGMENT or
+ * LOAD_WARMUP: only streams are counted as requested, and videos
+ * warmed up are not checked against 'sign'.
+ * Returns a 'Video' pointer that should be freed after use, only if it
+ * is found. Returns NULL otherwise.
+ * This function is thread safe.
+ * */
+Video *
+load_video				(char * id, char * sign, int reason)
+{
+    Video search_video, * cur_video, * search_video_ptr, ** found_video;
+    Stream * stream;
+    struct timespec load_start;
+    int64_t * iframe_offset, * iframe_time;
+    char * filename, * file_data, * offset, * cursor, * ext, * field, * path_end, * sign_end, * attrs;
+    size_t path_len, sign_len, layout_size;
+    ushort iframe_num;
+    int i, j, stream_num, iframe_total;
+	
+    /* Check if this directory is supported. */
+    if (check_supported_dir(video_path, id) == 0)
+    {
+	LOG_RATELIMITED(ERROR, EMSG_STREAMIDUNK, id);
+	return (NULL);
+    }
+	
+    /* Is this video already in memory? If so, use that. If not, get it
+     * from hard disk.
+     * */
+    search_video.id = atoi(id);	
+    search_video_ptr = &search_video;
+    pthread_mutex_lock(&stream_lock);
+
+    /* Search in video cache.
+     *  - There is at least one video in memory.
+     *  - Video ID is found in cache.
+     *  - Video sign matches with the requested one.
+     * */ 
+    if ((videos_num > 0) &&
+	((found_video = bsearch(&search_video_ptr, videos, videos_num, sizeof(Video *), compare_video_id)) != NULL) &&
+	(!signed_auth || (reason == LOAD_WARMUP) || (strcmp((*found_video)->sign, sign) == 0)))
+    {
+	cur_video = *found_video;
+	cur_video->counter++;
+
+	if (reason == LOAD_STREAM)
+	{
+	    count_requests(cur_video->id, 1);
+	}
+
+	pthread_mutex_unlock(&stream_lock);
+	metrics_add(M_VIDEO_HITS, 1);
+	return (cur_video);
+    }
+	
+    metrics_add(M_VIDEO_MISSES, 1);
+    clock_gettime(CLOCK_MONOTONIC, &load_start);
+
+    /* Load the info file. */
+    asprintf(&filename, "%s/%s/%s", video_path, id, FILE_INFO);
+
+    if (!(get_file_size(filename) > 0) ||
+	(file_data = (char*)get_file_contents(filename)) == NULL)
+    {
+	pthread_mutex_unlock(&stream_lock);
+	LOG_RATELIMITED(ERROR, EMSG_NODATAFILE, filename);
+	free(filename);
+	return (NULL);
+    }
+
+    /* Count every stream and iframe. */
+    cur_video = NULL;
+    cursor = NULL;
+    stream_num = 0;
+    iframe_total = 0;
+
+    if (((path_end = strchr(file_data, '\n')) != NULL) &&
+	((sign_end = strchr(path_end + 1, '\n')) != NULL))
+    {
+	stream_num = strtol(sign_end + 1, &offset, 10);
+
+	for (i = 0, cursor = offset; (i < stream_num) && (cursor != NULL); i++)
+	{
+	    if ((cursor = parse_stream_info(cursor, NULL, &iframe_num, NULL, NULL)) != NULL)
+	    {
+		iframe_total += iframe_num;
+	    }
+	}
+    }
+
+    layout_size = (stream_num * sizeof(Stream)) + (2 * iframe_total * sizeof(int64_t)) + (sign_end - file_data) + 1;
+
+    if ((stream_num <= 0) || (cursor == NULL) ||
+	((cur_video = alloc_video()) == NULL) ||
+	((cur_video->streams = malloc(layout_size)) == NULL))
+    {
+	if (cur_video != NULL)
+	{
+	    release_video(cur_video);
+	}
+
+	pthread_mutex_unlock(&stream_lock);
+	LOG_RATELIMITED(ERROR, EMSG_NODATAFILE, filename);
+	free(filename);
+	free(file_data);
+	return (NULL);
+    }
+
+    free(filename);
+
+    /* Layout: streams, iframe offsets, iframe times, path and sign. */
+    iframe_offset = (int64_t *)(cur_video->streams + stream_num);
+    iframe_time = iframe_offset + iframe_total;
+    path_len = path_end - file_data;
+    sign_len = sign_end - (path_end + 1);
+    cur_video->path = (char *)(iframe_time + iframe_total);
+    cur_video->sign = cur_video->path + path_len + 1;
+    memcpy(cur_video->path, file_data, path_len);
+    cur_video->path[path_len] = '\0';
+    memcpy(cur_video->sign, path_end + 1, sign_len);
+    cur_video->sign[sign_len] = '\0';
+	
+    /* Check video sign. */
+    cur_video->id = atoi(id);
+    cur_video->counter = 1;
+
+    if ((signed_auth) && (reason != LOAD_WARMUP) &&
+	((strlen(sign) != SIGN_LEN) || (strncmp(cur_video->sign, sign, SIGN_LEN) != 0)))
+    {
+	LOG_RATELIMITED(WARNING, EMSG_INVALSIGN, cur_video->path);
+	release_video(cur_video);
+	pthread_mutex_unlock(&stream_lock);
+
+	free(file_data);
+	return (NULL);
+    }
+
+    /* Load each video file found. Missing or malformed streams are
+     * skipped, and their room is used by the next one.
+     * */
+    for (i = 0; i < stream_num; i++)
+    {
+	stream = &cur_video->streams[cur_video->stream_num];
+	offset = parse_stream_info(offset, &field, &stream->iframe_num, iframe_offset, &attrs);
+	asprintf(&filename, "%s/%s", cur_video->path, field);
+	free(field);
+		
+	/* Stream files are loaded once, even if other videos list them. */
+	if ((stream->shared = get_stream_data(get_stream_hash(attrs), filename)) == NULL)
+	{
+	    /* This stream does not exist. */
+	    LOG(WARNING, EMSG_NOSTREAM, filename);
+	}
+	else
+	{
+	    stream->data = stream->shared->data;
+	    stream->data_size = stream->shared->data_size;
+	    stream->iframe_offset = iframe_offset;
+	    stream->mp4 = NULL;
+	    stream->cmaf = NULL;
+	    parse_stream_attrs(attrs, stream, iframe_time);
+
+	    /* Find the stream type. 
+	     * In the type check, into 'send_video', the switch() checks if
+	     * this type is one of the allowed or has an undefined value
+	     * (a value bigger than 'allowed_vlen'.
+	     * */
+	    ext = get_last_substr(filename, '.');
+	    for (j = 0; ((j < allowed_vlen) && (strstr(ext, allowed_ext[j]) == NULL)); j++);
+	    stream->type = j;
+	    free(ext);
+			
+	    /* Check if the current stream iframe offsets are well formed,
+	     * i.e., there is no iframe offsets beyond the last byte.
+	     * */
+	    if ((stream->iframe_num > 0) &&
+		(stream->iframe_offset[stream->iframe_num - 1] < stream->data_size))
+	    {
+		stream->avg_size = stream->data_size / stream->iframe_num;
+		iframe_offset += stream->iframe_num;
+		iframe_time += stream->iframe_num;
+		cur_video->stream_num++;
+
+		/* MP4 streams may start on any iframe only with their
+		 * sample table, which is shared along with the file.
+		 * */
+		if ((stream->type == MP4_EXT_CODE) && (stream->shared->mp4 == NULL) &&
+		    ((stream->shared->mp4 = load_mp4_index(filename, stream->data_size)) != NULL))
+		{
+		    mem_used += stream->shared->mp4->size;
+		}
+
+		stream->mp4 = (stream->type == MP4_EXT_CODE) ? stream->shared->mp4 : NULL;
+	    }
+	    else
+	    {
+		release_stream_data(stream->shared);
+		LOG(WARNING, EMSG_INVALOFFSET, filename);
+	    }
+	}
+
+	free(filename);
+    }
+
+    free(file_data);
+
+    if (cur_video->stream_num > 0)
+    {
+	/* Sort streams array. */
+	qsort(cur_video->streams, cur_video->stream_num, sizeof(Stream), compare_stream_size);
+    }
+    else
+    {
+	/* Return an error and free allocated memory. */
+	LOG(ERROR, EMSG_NOSTREAMAVAIL, cur_video->path);
+	release_video(cur_video);
+	pthread_mutex_unlock(&stream_lock);
+	return (NULL);
+    }
+	
+    /* The layout is freed along with the video. */
+    cur_video->size += layout_size;
+    mem_used += layout_size;
+
+    /* Add this video to the list and sort it if necessary.
+     * This is controlled by the application-wide mutex.
+     * */
+    videos_num++;
+    videos = realloc(videos, videos_num * sizeof(Video *));
+    videos[videos_num - 1] = cur_video;
+	
+    if (videos_num > 1)
+    {
+	qsort(videos, videos_num, sizeof(Video *), compare_video_id);
+    }
+
+    if (reason == LOAD_STREAM)
+    {
+	count_requests(cur_video->id, 1);
+    }
+
+    pthread_mutex_unlock(&stream_lock);
+    metrics_record(H_VIDEO_LOAD, metrics_elapsed(&load_start));
+    return (cur_video);
+}
+
+/* unload_video()
+ * 
+ * Free memory allocated for a video.
+ * This process is here because of the huge amount of code in
+ * send_video().
+ * This function is thread safe.
+ * */
+int
+unload_video			(Video * video)
+{
+    int i, counter;
+
+    pthread_mutex_lock(&stream_lock);
+	
+    /* Delete video from memory if counter reaches 0 and video time alive
+     * in memory reaches MAX_TIME_ALIVE.
+     * */
+    if ((counter = --video->counter) <= 0)
+    {
+	/* Free stream data, and then the whole layout at once. */
+	for (i = 0; i < video->stream_num; i++)
+	{
+	    release_stream_data(video->streams[i].shared);
+
+	    if (video->streams[i].cmaf != NULL)
+	    {
+		free_cmaf_index(video->streams[i].cmaf);
+	    }
+	}
+
+	mem_used -= video->size;
+	video->id = INT_MAX;
+	qsort(videos, videos_num, sizeof(Video *), compare_video_id);
+	release_video(video);
+	videos_num--;
+		
+	/* Reallocating this vector might fail. If so, initialize
+	 * 'videos_num' to 0
+	 * */
+	if ((videos = realloc(videos, videos_num * sizeof(Video *))) == NULL)
+	{
+	    videos_num = 0;
+	}
+    }
+
+    pthread_mutex_unlock(&stream_lock);
+    return (counter);	
+}
+
+/* prefetch_video()
+ * 
+ * Read every stream file of a video into the page cache, without
+ * holding 'stream_lock', so videos loaded at once are read from disk
+ * in parallel and load_video() finds them in memory.
+ * */
+static
+void
+prefetch_video				(char * id)
+{
+    char * filename, * file_data, * cursor, * field, * path_end, * sign_end;
+    ushort iframe_num;
+    int fd, i, stream_num;
+
+    asprintf(&filename, "%s/%s/%s", video_path, id, FILE_INFO);
+    file_data = (get_file_size(filename) > 0) ? (char *)get_file_contents(filename) : NULL;
+    free(filename);
+
+    if ((file_data == NULL) ||
+	((path_end = strchr(file_data, '\n')) == NULL) || ((sign_end = strchr(path_end + 1, '\n')) == NULL))
+    {
+	free(file_data);
+	return;
+    }
+
+    stream_num = strtol(sign_end + 1, &cursor, 10);
+
+    for (i = 0; (i < stream_num) && ((cursor = parse_stream_info(cursor, &field, &iframe_num, NULL, NULL)) != NULL); i++)
+    {
+	asprintf(&filename, "%.*s/%s", (int)(path_end - file_data), file_data, field);
+
+	if ((fd = open(filename, O_RDONLY)) >= 0)
+	{
+	    readahead(fd, 0, get_file_size(filename));
+	    close(fd);
+	}
+
+	free(filename);
+	free(field);
+    }
+
+    free(file_data);
+}
+
+/* warm_videos()
+ * 
+ * Thread that loads videos from a warm-up list, in order, until every
+ * one is loaded or the memory available is used up. Videos loaded are
+ * kept in memory, as their reference is never dropped.
+ * */
+static
+void *
+warm_videos				(void * arg)
+{
+    Warmup * warmup;
+    char id[VIDEO_ID_LEN];
+    int next;
+    Boolean full;
+
+    warmup = (Warmup *)arg;
+
+    while (TRUE)
+    {
+	pthread_mutex_lock(&warmup->lock);
+	next = warmup->next++;
+	pthread_mutex_unlock(&warmup->lock);
+
+	pthread_mutex_lock(&stream_lock);
+	full = (mem_used >= mem_avail);
+	pthread_mutex_unlock(&stream_lock);
+
+	if ((next >= warmup->list_num) || full)
+	{
+	    break;
+	}
+
+	snprintf(id, VIDEO_ID_LEN, "%d", warmup->list[next].video_id);
+	prefetch_video(id);
+
+	if (load_video(id, NULL, LOAD_WARMUP) != NULL)
+	{
+	    pthread_mutex_lock(&warmup->lock);
+	    warmup->loaded++;
+	    pthread_mutex_unlock(&warmup->lock);
+	}
+    }
+
+    return (NULL);
+}
+
+/* save_popularity()
+ * 
+ * Save the requests of every video to the popularity list. It is
+ * written aside and then renamed, so it is never found half written.
+ * */
+static
+Boolean
+save_popularity				()
+{
+    Popularity * list;
+    FILE * file;
+    char * tmp_name;
+    int list_num, i;
+
+    list = get_popular_videos(&list_num);
+    asprintf(&tmp_name, "%s%s", popularity_file, POPULARITY_TMP_EXT);
+
+    if ((file = fopen(tmp_name, "w")) != NULL)
+    {
+	for (i = 0; i < list_num; i++)
+	{
+	    fprintf(file, "%d %lld\n", list[i].video_id, (long long)list[i].requests);
+	}
+
+	if ((fclose(file) != 0) || (rename(tmp_name, popularity_file) != 0))
+	{
+	    unlink(tmp_name);
+	    file = NULL;
+	}
+    }
+
+    free(tmp_name);
+    free(list);
+    return (file != NULL);
+}
+
+/* keep_popularity()
+ * 
+ * Thread that saves the popularity list periodically.
+ * */
+static
+void *
+keep_popularity				(void * arg)
+{
+    while (TRUE)
+    {
+	sleep(POPULARITY_SAVE_TIME);
+
+	if (!save_popularity())
+	{
+	    LOG(WARNING, EMSG_POPULARITY, popularity_file);
+	}
+    }
+
+    return (NULL);
+}
+
+/* load_popularity()
+ * 
+ * Read the requests of every video from a popularity list, as saved by
+ * save_popularity() or exported from the statistics database. Lines
+ * that are not well formed are skipped.
+ * */
+static
+void
+load_popularity				(char * filename)
+{
+    char * file_data, * line, * line_end;
+    long long requests;
+    int video_id;
+
+    if (!(get_file_size(filename) > 0) ||
+	((file_data = (char *)get_file_contents(filename)) == NULL))
+    {
+	return;
+    }
+
+    pthread_mutex_lock(&stream_lock);
+
+    for (line = file_data; line != NULL; line = (line_end != NULL) ? line_end + 1 : NULL)
+    {
+	if ((line_end = strchr(line, '\n')) != NULL)
+	{
+	    *line_end = '\0';
+	}
+
+	if ((sscanf(line, "%d %lld", &video_id, &requests) == 2) && (video_id >= 0) && (requests > 0))
+	{
+	    count_requests(video_id, requests);
+	}
+    }
+
+    pthread_mutex_unlock(&stream_lock);
+    free(file_data);
+}
+
+/* parse_range()
+ * 
+ * Parse the value of a 'Range' header for an entity 'size' bytes long.
+ * Returns the number of satisfiable ranges saved in 'ranges', 0 if none
+ * of them can be satisfied, or -1 if the header is not valid or has too
+ * many ranges, so it should be ignored.
+ * */
+int
+parse_range				(const char * value, int64_t size, ByteRange * ranges)
+{
+    const char * cur;
+    char * next;
+    int64_t first, last;
+    Boolean open;
+    int num;
+
+    if (strncasecmp(value, RANGE_UNIT, RANGE_UNIT_LEN) != 0)
+    {
+	return (-1);
+    }
+
+    cur = value + RANGE_UNIT_LEN;
+    num = 0;
+
+    while (TRUE)
+    {
+	while ((*cur == ' ') || (*cur == '\t'))
+	{
+	    cur++;
+	}
+
+	open = FALSE;
+	
+	if (*cur == '-')
+	{
+	    /* Suffix range: last 'n' bytes of the entity. */
+	    if (!isdigit(cur[1]))
+	    {
+		return (-1);
+	    }
+
+	    last = strtoll(cur + 1, &next, 10);
+	    first = (last < size) ? (size - last) : 0;
+	    last = (last > 0) ? (size - 1) : -1;
+	}
+	else
+	{
+	    if (!isdigit(*cur))
+	    {
+		return (-1);
+	    }
+
+	    first = strtoll(cur, &next, 10);
+
+	    if (*next != '-')
+	    {
+		return (-1);
+	    }
+
+	    cur = next + 1;
+
+	    if (isdigit(*cur))
+	    {
+		if ((last = strtoll(cur, &next, 10)) < first)
+		{
+		    return (-1);
+		}
+	    }
+	    else
+	    {
+		last = size - 1;
+		open = TRUE;
+		next = (char *)cur;
+	    }
+	}
+
+	if (last >= size)
+	{
+	    last = size - 1;
+	}
+
+	/* Unsatisfiable ranges are silently discarded. */
+	if ((first <= last) && (first < size))
+	{
+	    if (num >= MAX_RANGES)
+	    {
+		return (-1);
+	    }
+
+	    ranges[num].first = first;
+	    ranges[num].last = last;
+	    ranges[num].open = open;
+	    num++;
+	}
+
+	for (cur = next; (*cur == ' ') || (*cur == '\t'); cur++);
+
+	if (*cur == '\0')
+	{
+	    break;
+	}
+
+	if (*cur != ',')
+	{
+	    return (-1);
+	}
+	
+	cur++;
+    }
+
+    return (num);
+}
+
+/* snap_to_iframe()
+ * 
+ * Returns the offset of the last iframe placed before 'offset', searching
+ * from 'first_iframe' onwards.
+ * */
+int64_t
+snap_to_iframe				(const Stream * cur_stream, ushort first_iframe, int64_t offset)
+{
+    int low, high, mid;
+
+    low = first_iframe;
+    high = cur_stream->iframe_num - 1;
+
+    while (low < high)
+    {
+	mid = (low + high + 1) / 2;
+
+	if (cur_stream->iframe_offset[mid] <= offset)
+	{
+	    low = mid;
+	}
+	else
+	{
+	    high = mid - 1;
+	}
+    }
+
+    return (cur_stream->iframe_offset[low]);
+}
+
+/* get_stream_prefix()
+ * 
+ * Fill 'iov' with the ranges players need before the data of a stream
+ * sent from 'first_iframe': nothing if it is sent from its first byte,
+ * or else its header and codec configuration, or only the latter when
+ * 'switching' from another stream in the middle of a reply.
+ * Returns the number of ranges, and their total length in 'prefix_len'.
+ * */
+static
+int
+get_stream_prefix			(Stream * cur_stream, ushort first_iframe, Boolean switching, struct iovec * iov, int64_t * prefix_len)
+{
+    int iov_num, i;
+
+    iov_num = 0;
+    *prefix_len = 0;
+
+    if (cur_stream->iframe_offset[first_iframe] == 0)
+    {
+	return (0);
+    }
+
+    if (!switching && (cur_stream->header.len > 0))
+    {
+	iov[iov_num].iov_base = cur_stream->data + cur_stream->header.offset;
+	iov[iov_num].iov_len = cur_stream->header.len;
+	*prefix_len += cur_stream->header.len;
+	iov_num++;
+    }
+
+    for (i = 0; i < cur_stream->config_num; i++)
+    {
+	iov[iov_num].iov_base = cur_stream->data + cur_stream->config[i].offset;
+	iov[iov_num].iov_len = cur_stream->config[i].len;
+	*prefix_len += cur_stream->config[i].len;
+	iov_num++;
+    }
+
+    return (iov_num);
+}
+
+/* check_stall()
+ * 
+ * Count a send() call as stalled if it took longer than SEND_STALL_TIME.
+ * */
+static
+void
+check_stall				(const struct timespec * start_time, const struct timespec * stop_time)
+{
+    if ((((int64_t)(stop_time->tv_sec - start_time->tv_sec) * NANOSEC_IN_SEC) + (stop_time->tv_nsec - start_time->tv_nsec)) > SEND_STALL_TIME)
+    {
+	metrics_add(M_SEND_STALLS, 1);
+    }
+}
+
+/* set_pacing_rate()
+ * 
+ * Ask the kernel to pace this socket at 'rate' bytes per second, either
+ * through the fq queue discipline or TCP internal pacing.
+ * Returns FALSE if it is not available.
+ * */
+static
+Boolean
+set_pacing_rate				(int client_sd, int64_t rate)
+{
+#ifdef SO_MAX_PACING_RATE
+    unsigned int pacing_rate;
+
+    pacing_rate = (rate < UINT_MAX) ? (unsigned int)rate : UINT_MAX;
+    return (setsockopt(client_sd, SOL_SOCKET, SO_MAX_PACING_RATE, &pacing_rate, sizeof(unsigned int)) == 0);
+#else
+    return (FALSE);
+#endif
+}
+
+/* wait_release()
+ * 
+ * Pace data in user space: wait until 'release_time', if it has not
+ * passed yet, and then schedule the next release once 'len' bytes are
+ * sent at 'rate' bytes per second.
+ * Clients late on schedule are not allowed to catch up with a burst.
+ * */
+static
+void
+wait_release				(struct timespec * release_time, int64_t len, int64_t rate)
+{
+    struct timespec now;
+    int64_t interval;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if ((release_time->tv_sec > now.tv_sec) ||
+	((release_time->tv_sec == now.tv_sec) && (release_time->tv_nsec > now.tv_nsec)))
+    {
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, release_time, NULL) == EINTR);
+    }
+    else
+    {
+	*release_time = now;
+    }
+
+    interval = (len * NANOSEC_IN_SEC) / rate;
+    release_time->tv_sec += (release_time->tv_nsec + interval) / NANOSEC_IN_SEC;
+    release_time->tv_nsec = (release_time->tv_nsec + interval) % NANOSEC_IN_SEC;
+}
+
+/* send_data()
+ * 
+ * Send 'len' bytes from 'buf' in 'CHUNK_SIZE' pieces, telling the
+ * connection timer after each one.
+ * Returns -1 if the data could not be sent, or 'len' otherwise.
+ * */
+int64_t
+send_data				(int client_sd, const uint8_t * buf, int64_t len, int * total_bytes_sent)
+{
+    struct timespec start_time, stop_time;
+    int64_t data_sent;
+    int bytes_sent;
+
+    data_sent = 0;
+
+    while (data_sent < len)
+    {
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+	if ((bytes_sent = send(client_sd, buf + data_sent,
+			       ((len - data_sent) < CHUNK_SIZE) ? (len - data_sent) : CHUNK_SIZE,
+			       MSG_NOSIGNAL)) <= 0)
+	{
+	    clock_gettime(CLOCK_MONOTONIC, &stop_time);
+	    check_stall(&start_time, &stop_time);
+	    return (-1);
+	}
+
+	data_sent += bytes_sent;
+	*total_bytes_sent += bytes_sent;
+	metrics_first_byte();
+	timer_progress();
+
+	clock_gettime(CLOCK_MONOTONIC, &stop_time);
+	check_stall(&start_time, &stop_time);
+    }
+
+    return (len);
+}
+
+/* send_entity()
+ * 
+ * Send 'len' bytes from byte 'first' of an entity made of several
+ * buffers, straight from wherever each one is stored.
+ * Returns -1 if the data could not be sent, or 'len' otherwise.
+ * */
+static
+int64_t
+send_entity				(int client_sd, const struct iovec * entity, int entity_num, int64_t first, int64_t len,
+					 int * total_bytes_sent)
+{
+    int64_t part_len, left;
+    int i;
+
+    for (i = 0, left = len; (i < entity_num) && (left > 0); i++)
+    {
+	if (first >= (int64_t)entity[i].iov_len)
+	{
+	    first -= entity[i].iov_len;
+	    continue;
+	}
+
+	part_len = ((entity[i].iov_len - first) < left) ? (entity[i].iov_len - first) : left;
+
+	if (send_data(client_sd, (uint8_t *)entity[i].iov_base + first, part_len, total_bytes_sent) < 0)
+	{
+	    return (-1);
+	}
+
+	left -= part_len;
+	first = 0;
+    }
+
+    return (len);
+}
+
+/* send_stream()
+ * 
+ * Send a single stream, from 'first_iframe' to the end, honouring the
+ * byte ranges and the conditions requested by the client, if any.
+ * 'etag' identifies the data sent, so it may be revalidated by clients.
+ * Streams sent from the middle of the file start with its header and
+ * codec configuration, or with a rewritten header on MP4 streams, which
+ * are part of the entity sent.
+ * Ranges are relative to the first byte sent. Open ranges ("bytes=x-")
+ * on FLV streams start on the previous iframe, as playback cannot start
+ * elsewhere; every other range is served exactly. 'Content-Range' always
+ * shows the bytes actually sent.
+ * Headers are allocated from 'arena'.
+ * Returns the amount of data written.
+ * */
+int
+send_stream				(Arena * arena, int client_sd, Video * cur_video, Stream * cur_stream, ushort first_iframe,
+					 ReplyParams send_params, RequestHeaders * headers, char * etag)
+{
+    ByteRange ranges[MAX_RANGES];
+    char * part_headers[MAX_RANGES];
+    int part_header_len[MAX_RANGES];
+    struct iovec entity[MAX_PREFIX_RANGES + 1];
+    Mp4Header * moov;
+    char * header, * closing, * range;
+    int64_t data_size, prefix_len, content_len;
+    unsigned int header_len;
+    int closing_len;
+    int entity_num, range_num, total_bytes_sent, i;
+    Boolean failed;
+
+    moov = NULL;
+
+    /* MP4 streams starting on a later iframe are sent with a header of
+     * their own, and then the samples from that iframe onwards.
+     * */
+    if ((cur_stream->mp4 != NULL) && (first_iframe > 0) &&
+	((moov = get_mp4_header(cur_stream->mp4, cur_stream->data, first_iframe)) != NULL))
+    {
+	entity[0].iov_base = moov->data;
+	entity[0].iov_len = moov->len;
+	entity[1].iov_base = cur_stream->data + moov->tail_offset;
+	entity[1].iov_len = moov->tail_len;
+	entity_num = 2;
+	prefix_len = moov->len;
+    }
+    else
+    {
+	entity_num = get_stream_prefix(cur_stream, first_iframe, FALSE, entity, &prefix_len);
+	entity[entity_num].iov_base = cur_stream->data + cur_stream->iframe_offset[first_iframe];
+	entity[entity_num].iov_len = cur_stream->data_size - cur_stream->iframe_offset[first_iframe];
+	entity_num++;
+    }
+
+    data_size = prefix_len + entity[entity_num - 1].iov_len;
+    range_num = -1;
+    total_bytes_sent = 0;
+
+    /* The client has this very data already. */
+    if (is_not_modified(headers, etag, -1))
+    {
+	send_params.http_code = HTTP_NOT_MODIFIED_CODE;
+	send_params.extra_headers = arena_printf(arena, NULL, "ETag: %s\r\n", etag);
+	header = compose_header(arena, send_params, data_size, &header_len);
+
+	send_data(client_sd, (uint8_t *)header, header_len, &total_bytes_sent);
+
+	if (moov != NULL)
+	{
+	    release_mp4_header(cur_stream->mp4, moov);
+	}
+
+	return (total_bytes_sent);
+    }
+
+    /* Ranges are only valid for the same data the client already has. */
+    range = headers->range;
+
+    if ((range != NULL) && (headers->if_range != NULL) && !match_etag(headers->if_range, etag, FALSE))
+    {
+	range = NULL;
+    }
+
+    if (range != NULL)
+    {
+	if ((range_num = parse_range(range, data_size, ranges)) < 0)
+	{
+	    LOG(MESSAGE, IMSG_RANGEIGNORED, range);
+	}
+	else
+	{
+	    LOG(MESSAGE, IMSG_RANGESEL, range);
+	}
+    }
+
+    if (cur_stream->type == FLV_EXT_CODE)
+    {
+	for (i = 0; i < range_num; i++)
+	{
+	    if (ranges[i].open && (ranges[i].first >= prefix_len))
+	    {
+		ranges[i].first = snap_to_iframe(cur_stream, first_iframe,
+						 cur_stream->iframe_offset[first_iframe] + ranges[i].first - prefix_len) -
+		    cur_stream->iframe_offset[first_iframe] + prefix_len;
+	    }
+	}
+    }
+
+    /* Compose the header according to the ranges found:
+     *  - None or invalid: the whole entity.
+     *  - None satisfiable: nothing at all.
+     *  - Only one: that range.
+     *  - Several: a multipart reply, with a header for each part.
+     * */
+    content_len = 0;
+    closing = NULL;
+    closing_len = 0;
+    
+    switch (range_num)
+    {
+	case (-1):
+	    send_params.extra_headers = arena_printf(arena, NULL, "ETag: %s\r\n%s", etag, ACCEPT_RANGES);
+	    content_len = data_size;
+	    break;
+	case (0):
+	    LOG(MESSAGE, IMSG_RANGENOTSAT, range);
+	    send_params.http_code = HTTP_NOT_SATISFIABLE_CODE;
+	    send_params.extra_headers = arena_printf(arena, NULL, "Content-Range: bytes */%lld\r\n", (long long)data_size);
+	    break;
+	case (1):
+	    send_params.http_code = HTTP_PARTIAL_CODE;
+	    send_params.extra_headers = arena_printf(arena, NULL, "Content-Range: bytes %lld-%lld/%lld\r\nETag: %s\r\n%s",
+						     (long long)ranges[0].first, (long long)ranges[0].last, (long long)data_size, etag, ACCEPT_RANGES);
+	    content_len = ranges[0].last - ranges[0].first + 1;
+	    break;
+	default:
+	    for (i = 0; i < range_num; i++)
+	    {
+		part_headers[i] = arena_printf(arena, &part_header_len[i], "%s--%s%sContent-Type: %s%sContent-Range: bytes %lld-%lld/%lld%s%s",
+					       CRLF, RANGE_BOUNDARY, CRLF, send_params.content_type, CRLF,
+					       (long long)ranges[i].first, (long long)ranges[i].last, (long long)data_size, CRLF, CRLF);
+		content_len += part_header_len[i] + ranges[i].last - ranges[i].first + 1;
+	    }
+
+	    closing = arena_printf(arena, &closing_len, "%s--%s--%s", CRLF, RANGE_BOUNDARY, CRLF);
+	    content_len += closing_len;
+	    send_params.http_code = HTTP_PARTIAL_CODE;
+	    send_params.content_type = BYTERANGES_TYPE RANGE_BOUNDARY;
+	    send_params.extra_headers = arena_printf(arena, NULL, "ETag: %s\r\n%s", etag, ACCEPT_RANGES);
+	    break;
+    }
+
+    header = compose_header(arena, send_params, content_len, &header_len);
+
+    /* Send the header and every range. */
+    failed = (send_data(client_sd, (uint8_t *)header, header_len, &total_bytes_sent) < 0);
+
+    switch (range_num)
+    {
+	case (-1):
+	    failed = failed || (send_entity(client_sd, entity, entity_num, 0, data_size, &total_bytes_sent) < 0);
+	    break;
+	case (0):
+	    break;
+	case (1):
+	    failed = failed || (send_entity(client_sd, entity, entity_num, ranges[0].first, content_len, &total_bytes_sent) < 0);
+	    break;
+	default:
+	    for (i = 0; i < range_num; i++)
+	    {
+		failed = failed || (send_data(client_sd, (uint8_t *)part_headers[i], part_header_len[i], &total_bytes_sent) < 0) ||
+		    (send_entity(client_sd, entity, entity_num, ranges[i].first, ranges[i].last - ranges[i].first + 1,
+				 &total_bytes_sent) < 0);
+	    }
+
+	    failed = failed || (send_data(client_sd, (uint8_t *)closing, closing_len, &total_bytes_sent) < 0);
+	    break;
+    }
+
+    if (failed)
+    {
+	LOG_RATELIMITED(MESSAGE, IMSG_VIDEOSTOP, cur_video->path);
+    }
+
+    if (moov != NULL)
+    {
+	release_mp4_header(cur_stream->mp4, moov);
+    }
+
+    return (total_bytes_sent);
+}
+
+/* get_cmaf_index()
+ *
+ * Cut a stream in CMAF segments, the first time one of them is
+ * requested. Its segments, as long as its video is in memory, are
+ * counted in its size.
+ * Returns NULL if the stream cannot be cut.
+ * This function is thread safe.
+ * */
+static
+CmafIndex *
+get_cmaf_index				(Video * video, Stream * stream)
+{
+    CmafIndex * index;
+
+    pthread_mutex_lock(&stream_lock);
+
+    if ((stream->cmaf == NULL) &&
+	((stream->type == FLV_EXT_CODE) || (stream->mp4 != NULL)) &&
+	((stream->cmaf = load_cmaf_index(stream->data, stream->data_size, stream->iframe_offset, stream->iframe_num,
+					 stream->mp4)) != NULL))
+    {
+	video->size += stream->cmaf->size;
+	mem_used += stream->cmaf->size;
+    }
+
+    index = stream->cmaf;
+    pthread_mutex_unlock(&stream_lock);
+
+    return (index);
+}
+
+/* keep_cmaf_video()
+ *
+ * Keep a video, loaded for a CMAF request, in memory along with its
+ * indexes, taking over the reference the caller has to it.
+ * Returns the video whose reference should be dropped after all: the
+ * same one, if it was kept already, or the least recently used one, if
+ * there is no room for more; NULL if there is none.
+ * This function is thread safe.
+ * */
+static
+Video *
+keep_cmaf_video				(Video * video)
+{
+    Video * released;
+    int i;
+
+    pthread_mutex_lock(&stream_lock);
+
+    for (i = 0; (i < cmaf_videos_num) && (cmaf_videos[i] != video); i++);
+
+    if (i < cmaf_videos_num)
+    {
+	released = video;
+	cmaf_videos_num--;
+    }
+    else if (cmaf_videos_num >= CMAF_VIDEOS)
+    {
+	released = cmaf_videos[0];
+	i = 0;
+	cmaf_videos_num--;
+    }
+    else
+    {
+	released = NULL;
+	i = cmaf_videos_num;
+    }
+
+    /* The video is now the most recently used. */
+    memmove(&cmaf_videos[i], &cmaf_videos[i + 1], (cmaf_videos_num - i) * sizeof(Video *));
+    cmaf_videos[cmaf_videos_num++] = video;
+
+    pthread_mutex_unlock(&stream_lock);
+    return (released);
+}
+
+/* build_cmaf_object()
+ *
+ * Compose a segment or a manifest of a video, as selected by 'quality'
+ * and 'number', and add it to the segment cache under 'key_sign'.
+ * Manifests cover every stream of the video, which must all be cut in
+ * segments, and every URL in them carries 'url_sign', if it is not
+ * NULL.
+ * Returns the object, which should be released after use, or NULL if
+ * it cannot be composed.
+ * */
+static
+CmafObject *
+build_cmaf_object			(Arena * arena, char * video_id, char * sign, const char * key_sign, const char * url_sign,
+					 int quality, int number)
+{
+    Video * cur_video;
+    CmafIndex ** indexes;
+    CmafObject * object;
+    uint8_t * data;
+    char * etag;
+    int64_t len;
+    int i;
+
+    if ((cur_video = load_video(video_id, sign, LOAD_SEGMENT)) == NULL)
+    {
+	LOG_RATELIMITED(WARNING, EMSG_NOVIDEO, video_id);
+	return (NULL);
+    }
+
+    data = NULL;
+
+    if ((quality < cur_video->stream_num) &&
+	((indexes = arena_alloc(arena, cur_video->stream_num * sizeof(CmafIndex *))) != NULL))
+    {
+	for (i = 0; (i < cur_video->stream_num) &&
+		 (((quality >= 0) && (i != quality)) ||
+		  ((indexes[i] = get_cmaf_index(cur_video, &cur_video->streams[i])) != NULL));
+	     i++);
+
+	if (i >= cur_video->stream_num)
 	{
-	    videos_num = 0;
+	    switch (number)
+	    {
+		case (CMAF_HLS_MASTER):
+		    data = (uint8_t *)compose_hls_master(indexes, cur_video->stream_num, cur_video->id, url_sign, &len);
+		    break;
+		case (CMAF_DASH_MANIFEST):
+		    data = (uint8_t *)compose_dash_manifest(indexes, cur_video->stream_num, cur_video->id, url_sign, &len);
+		    break;
+		case (CMAF_HLS_PLAYLIST):
+		    data = (uint8_t *)compose_hls_playlist(indexes[quality], quality, cur_video->id, url_sign, &len);
+		    break;
+		default:
+		    data = build_cmaf_segment(indexes[quality], cur_video->streams[quality].data, number, &len);
+		    break;
+	    }
 	}
     }
 
-    pthread_mutex_unlock(&stream_lock);
-    return (counter);	
+    /* The video sign identifies its contents. */
+    object = NULL;
+
+    if (data == NULL)
+    {
+	LOG_RATELIMITED(WARNING, EMSG_NOSEGMENT, cur_video->path);
+    }
+    else
+    {
+	etag = arena_printf(arena, NULL, "\"%s-cmaf-%d-%d\"", cur_video->sign, quality, number);
+	object = add_cmaf_object(cur_video->id, key_sign, quality, number, data, len, etag);
+	LOG(MESSAGE, IMSG_SEGMENTBUILT, etag);
+    }
+
+    if ((cur_video = keep_cmaf_video(cur_video)) != NULL)
+    {
+	unload_video(cur_video);
+    }
+
+    return (object);
 }
 
 /* ********** Public functions ********** */
@@ -475,16 +2100,17 @@ unload_video			(Video * video)
  * Initialize streaming and load a default video.
  * */
 int
-init_videos			(char * path, int auth, int timeout)
+init_videos			(char * path, int auth, int timeout, int pace, int burst)
 {
     struct sysinfo info;
+    char * add_info;
 	
     /* Determine the amount of memory available. This is not used right
      * now, but might be an interesting option in the future.
      * */
     if (sysinfo(&info) != 0)
     {
-	log_message(CRITICAL, EMSG_FREEMEM, NULL);
+	LOG(CRITICAL, EMSG_FREEMEM, NULL);
 	return (ECOD_FREEMEM);
     }
 	
@@ -493,14 +2119,14 @@ init_videos			(char * path, int auth, int timeout)
     if (!check_file_exists(path) ||
 	(asprintf(&video_path, "%s", path) <= 0))
     {
-	log_message(CRITICAL, EMSG_VIDEOPATH, NULL);
+	LOG(CRITICAL, EMSG_VIDEOPATH, NULL);
 	return (ECOD_VIDEOPATH);
     }
 
     /* Enable signed video requests. */
     signed_auth = auth;
 
-    /* Timeout for send(). */
+    /* Time a stream may go without sending anything. */
     if (timeout > MIN_TIMEOUT)
     {
 	timeout_sec = timeout;
@@ -508,26 +2134,168 @@ init_videos			(char * path, int auth, int timeout)
     else
     {
 	timeout_sec = MIN_TIMEOUT;
-	log_message(MESSAGE, IMSG_INVALTIMEOUT, NULL);
+	LOG(MESSAGE, IMSG_INVALTIMEOUT, NULL);
+    }
+
+    /* Pacing. */
+    pace_percent = (pace > 0) ? pace : 0;
+
+    if ((pace_percent > 0) && (pace_percent < MIN_PACE))
+    {
+	pace_percent = MIN_PACE;
+	LOG(MESSAGE, IMSG_INVALPACE, NULL);
+    }
+
+    pace_burst = (burst > 0) ? burst : 0;
+
+    if ((pace_percent > 0) && LOG_ENABLED(MESSAGE))
+    {
+	asprintf(&add_info, "Rate: %d%% of bitrate; Burst: %d seconds\n", pace_percent, pace_burst);
+	log_message(MESSAGE, IMSG_PACINGENABLED, add_info);
+	free(add_info);
+    }
+
+    return (EXIT_SUCCESS);
+}
+
+/* init_warmup()
+ * 
+ * Load the 'top' most requested videos of the popularity list 'list',
+ * several at once, until the memory available is used up, and keep
+ * them in memory, so the first viewers of each one do not wait for it.
+ * The list is then saved periodically from the requests served.
+ * */
+int
+init_warmup			(char * list, int top)
+{
+    pthread_t threads[MAX_WARMUP_THREADS], save_thread;
+    Warmup warmup;
+    char * add_info;
+    int thread_num, i;
+
+    if (asprintf(&popularity_file, "%s", list) <= 0)
+    {
+	popularity_file = NULL;
+	LOG(WARNING, EMSG_POPULARITY, list);
+	return (EXIT_SUCCESS);
+    }
+
+    load_popularity(popularity_file);
+
+    warmup.list = get_popular_videos(&warmup.list_num);
+    warmup.list_num = ((top >= 0) && (top < warmup.list_num)) ? top : warmup.list_num;
+    warmup.next = 0;
+    warmup.loaded = 0;
+    pthread_mutex_init(&warmup.lock, NULL);
+
+    /* One thread for every processor. If none can be started, videos
+     * are loaded from this one.
+     * */
+    thread_num = (get_nprocs() < MAX_WARMUP_THREADS) ? get_nprocs() : MAX_WARMUP_THREADS;
+    thread_num = (thread_num < warmup.list_num) ? thread_num : warmup.list_num;
+
+    for (i = 0; (i < thread_num) && (pthread_create(&threads[i], NULL, &warm_videos, &warmup) == 0); i++);
+
+    if (i == 0)
+    {
+	warm_videos(&warmup);
+    }
+
+    for (thread_num = i, i = 0; i < thread_num; i++)
+    {
+	pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&warmup.lock);
+    free(warmup.list);
+
+    if (LOG_ENABLED(MESSAGE))
+    {
+	asprintf(&add_info, "%d videos; %lld bytes", warmup.loaded, (long long)mem_used);
+	log_message(MESSAGE, IMSG_WARMUPDONE, add_info);
+	free(add_info);
+    }
+
+    if (pthread_create(&save_thread, NULL, &keep_popularity, NULL) != 0)
+    {
+	LOG(WARNING, EMSG_POPULARITYTHREAD, NULL);
+    }
+    else
+    {
+	pthread_detach(save_thread);
     }
 
     return (EXIT_SUCCESS);
 }
 
+/* end_stream()
+ * 
+ * Save the statistics of a stream 'bytes' long, started at 'start_time',
+ * and release its video and its session, if any.
+ * Returns 'bytes'.
+ * */
+static
+int
+end_stream				(Video * video, Session * session, int stat_req_id, const struct timespec * start_time, int bytes)
+{
+    int64_t duration, total_duration, total_bytes;
+
+    duration = metrics_elapsed(start_time);
+    total_duration = duration;
+    total_bytes = bytes;
+
+    if (session != NULL)
+    {
+	total_duration += session->duration;
+	total_bytes += session->bytes;
+    }
+
+    if (stat_req_id >= 0)
+    {
+	new_stream_stat(stat_req_id, video->id, (session != NULL) ? session->id : NULL,
+			(int)(total_duration / NANOSEC_IN_SEC), total_bytes);
+    }
+
+    if (session != NULL)
+    {
+	close_session(session, bytes, duration);
+    }
+
+    unload_video(video);
+    return (bytes);
+}
+
 /* send_video()
  *
- * The function receives a socket descriptor and the request parameters,
- * and returns the amount of data written.
+ * The function receives the client connection, the request parameters
+ * and the request headers that may change the reply, and returns the
+ * amount of data written. Its statistics are saved under the request
+ * 'stat_req_id'.
+ * A 'session' parameter resumes a previous stream, from the quality and
+ * position it was sent at, unless the request selects other ones; every
+ * adaptive stream is given a session otherwise.
+ * Every buffer is allocated once from the connection arena, and reused
+ * while the stream is being sent.
  * */
 int
-send_video			(int client_sd, char ** params)
+send_video			(ClientConn * conn, char ** params, RequestHeaders * headers, int stat_req_id)
 {
+    Arena * arena;
+    int client_sd;
+    struct timespec stream_start;
+
+    /* Session, and the video it asks for. */
+    Session * session;
+    char * video_id, * sign;
+
     /* Reply parameters. */
     ReplyParams send_params;
+    char * etag;
 	
     /* Needed to change sending options on the fly. */
-    char ** renew_params;
-    const int renew_params_buf_len = 512 * sizeof(char);
+    char * renew_params[RNEW_PARAMS];
+    char * control_msg;
+    Slice renew_query;
 
     /* Sending data. */
     struct timespec start_time, stop_time;
@@ -535,22 +2303,41 @@ send_video			(int client_sd, char ** params)
     ushort cur_stream_pos, first_iframe, next_iframe, temp_iframe;
     int total_bytes_sent, bytes_sent, chunks_sent, chunks_to_send;
 	
-    /* Video structures. */
+    /* Video structures.
+     * 'sent_stream' is the stream whose codec configuration the client
+     * has, so it is sent again once the stream changes.
+     * */
     Video * cur_video;
-    Stream * cur_stream;
+    Stream * cur_stream, * sent_stream;
 
-    /* 'output_buf' is the buffer used to send data over the net.
-     * 'data_buf' is used to concatenate stream data.
-     * 'output_buf_len_str' contains the length of the 'output_buf' in char * format.
-     * 'data_buf_len_str' is the same as above for 'data_buf'.
+    /* 'output_buf' is the buffer used to send data over the net, with
+     * room for a single chunk.
+     * 'data_buf' points to the stream data between two iframes.
      * 'output_buf_len' and 'data_buf_len' are the length of the previous buffers.
-     * 'output_buf_len_len' and 'data_buf_len_len' are the length of the strings
-     * containing the length of the buffers (little messy).
+     * 'prefix_len' is the length of the chunk size line.
      * 'chunk_len' is the size of the data chunk actually sent.
+     * 'iov' holds the reply header, a chunk size line and the ranges
+     * spliced from the stream data, and 'splice_len' their length.
      * */
-    char * output_buf, * output_buf_len_str, * data_buf_len_str;
+    char * output_buf, * header;
     uint8_t * data_buf;
-    unsigned int output_buf_len, data_buf_len, output_buf_len_len, data_buf_len_len, chunk_len;
+    unsigned int output_buf_len, data_buf_len, chunk_len, header_len;
+    int prefix_len;
+    struct iovec iov[MAX_PREFIX_RANGES + 3];
+    int64_t splice_len;
+    int iov_num;
+
+    /* Pacing.
+     * 'intervals_sent' counts the iframe intervals sent, about a second
+     * of video each.
+     * 'kernel_rate' is the pacing rate set on the socket, if any.
+     * 'user_pacing' is set if the kernel cannot pace this socket, and
+     * then 'release_time' is the time the next interval is due.
+     * */
+    struct timespec release_time;
+    int64_t pace_rate, kernel_rate;
+    Boolean user_pacing;
+    int intervals_sent;
 	
     /* Socket parameters. 
      * 'send_buffer', is a memory segment assigned to this socket to perform better sending
@@ -559,65 +2346,102 @@ send_video			(int client_sd, char ** params)
      * 'keepalive_time', time (in seconds) between the last data packet sent and the first keepalive probe.
      * 'keepalive_intvl', time (in seconds) between probes.
      * 'keepalive_probes', number of probes.
-     * 'send_timeout', is a timeout (in seconds) for send()
      */
     const int send_buffer = 524288;
     const int keepalive = 1;                    /* TODO: This four variables may be global. */
     const int keepalive_probes = 10;
     const int keepalive_intvl = 5;
     const int keepalive_time = timeout_sec - (keepalive_probes * keepalive_intvl);
-    struct timeval send_timeout;
 
     /* Initialization.
      * */
-    if ((params[VIDEOID_PARAM_CODE] != NULL) &&
-	(!signed_auth || (params[SIGN_PARAM_CODE] != NULL)))
+    arena = &conn->arena;
+    client_sd = conn->sd;
+    clock_gettime(CLOCK_MONOTONIC, &stream_start);
+
+    session = NULL;
+    video_id = params[VIDEOID_PARAM_CODE];
+    sign = params[SIGN_PARAM_CODE];
+
+    /* A session already holds its video id and sign, which were checked
+     * when it was created.
+     * */
+    if ((params[SESSION_PARAM_CODE] != NULL) &&
+	((session = open_session(params[SESSION_PARAM_CODE], (video_id != NULL) ? atoi(video_id) : -1)) != NULL))
+    {
+	video_id = arena_printf(arena, NULL, "%d", session->video_id);
+	sign = session->sign;
+
+	if (LOG_ENABLED(MESSAGE))
+	{
+	    log_message(MESSAGE, IMSG_SESSIONRESUMED,
+			arena_printf(arena, NULL, "%s: quality %d, iframe %d, %lld bytes/s", session->id,
+				     session->stream_pos, session->iframe, (long long)session->throughput));
+	}
+    }
+
+    if ((video_id != NULL) &&
+	(!signed_auth || (sign != NULL)))
     {
 	/* Load the video selected.
 	 * It checks if the provided video id is available, and if the
 	 * video sign is valid.
 	 * */
-	if ((cur_video = load_video(params[VIDEOID_PARAM_CODE], params[SIGN_PARAM_CODE])) == NULL)
+	if ((cur_video = load_video(video_id, sign, LOAD_STREAM)) == NULL)
 	{
-	    log_message(WARNING, EMSG_NOVIDEO, params[VIDEOID_PARAM_CODE]);
+	    if (session != NULL)
+	    {
+		close_session(session, 0, 0);
+	    }
+
+	    LOG_RATELIMITED(WARNING, EMSG_NOVIDEO, video_id);
 	    return (ECOD_NOVIDEO);
 	}
     }
     else
     {
 	/* There is no video id or sign. */
-	log_message(WARNING, EMSG_INVALVIDEO, params[VIDEOID_PARAM_CODE]);
+	LOG_RATELIMITED(WARNING, EMSG_INVALVIDEO, video_id);
 	return (ECOD_INVALVIDEO);
     }
 	
-    /* Select the quality specified on URL parameters, if there is one.
+    /* Select the quality specified on URL parameters, if there is one,
+     * or the one of the session resumed.
      * Check also if the quality code is between limits.
      * (Warren 2003, pg. 51)
      * */
     if (!(params[QUALITY_PARAM_CODE] &&
 	  ((cur_stream_pos = (ushort)atoi(params[QUALITY_PARAM_CODE])) <= (cur_video->stream_num - 1))))
     {
-	cur_stream_pos = (ushort)floor(cur_video->stream_num / 2);
+	if ((session != NULL) && (session->stream_pos < cur_video->stream_num))
+	{
+	    cur_stream_pos = (ushort)session->stream_pos;
+	}
+	else
+	{
+	    cur_stream_pos = (ushort)floor(cur_video->stream_num / 2);
+	}
     }
     else
     {
-	log_message(MESSAGE, IMSG_QUALITYSEL, params[QUALITY_PARAM_CODE]);
+	LOG(MESSAGE, IMSG_QUALITYSEL, params[QUALITY_PARAM_CODE]);
     }
 	
-    cur_stream = cur_video->streams[cur_stream_pos];
+    cur_stream = &cur_video->streams[cur_stream_pos];
 
-    /* First iframe could be either defined on URL, or '0' if the stream
-     * should be played from the start. If the iframe specified is beyond
-     * limits (higher than 'iframe_num' or lower than '0'), set it to '0'.
+    /* First iframe could be either defined on URL, taken from the
+     * session resumed, or '0' if the stream should be played from the
+     * start. If the iframe specified is beyond limits (higher than
+     * 'iframe_num' or lower than '0'), set it to '0'.
      * */
     if (!(params[POS_PARAM_CODE] &&
 	  ((first_iframe = (ushort)atoi(params[POS_PARAM_CODE])) <= (cur_stream->iframe_num - 1))))
     {
-	first_iframe = 0;
+	first_iframe = ((session != NULL) && (session->iframe < cur_stream->iframe_num)) ? (ushort)session->iframe : 0;
     }
     else
     {
-	log_message(MESSAGE, IMSG_POSITIONSEL, params[POS_PARAM_CODE]);
+	LOG(MESSAGE, IMSG_POSITIONSEL, params[POS_PARAM_CODE]);
     }
 
     /* Compose a reply according to the file type. */
@@ -626,7 +2450,7 @@ send_video			(int client_sd, char ** params)
     /* Cache control. */
     if (params[CACHE_PARAM_CODE] != NULL)
     {
-	asprintf(&send_params.cache_control, "%s%s", MAX_AGE, params[CACHE_PARAM_CODE]);
+	send_params.cache_control = arena_printf(arena, NULL, "%s%s", MAX_AGE, params[CACHE_PARAM_CODE]);
     }
 
     switch (cur_stream->type)
@@ -653,78 +2477,35 @@ send_video			(int client_sd, char ** params)
     setsockopt(client_sd, SOL_TCP, TCP_KEEPCNT, &keepalive_probes, sizeof(int));
     setsockopt(client_sd, SOL_TCP, TCP_KEEPIDLE, &keepalive_time, sizeof(int)); */
 
-    /* Set a default send() timeout at first. 
-     * This can be DANGEROUS, and in a near future should be removed.
+    /* The stream is closed if the client stops reading for
+     * 'timeout_sec' seconds, or if it takes much longer than the video
+     * itself, assuming an iframe per second.
      * */
-    send_timeout.tv_sec = DEFAULT_TIMEOUT + timeout_sec;
-    send_timeout.tv_usec = 0;
-    setsockopt(client_sd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(struct timeval));
+    set_timer(&conn->timer, TIMER_DURATION, timeout_sec + (cur_stream->iframe_num * STREAM_DURATION_FACTOR), timeout_sec);
 
     spent_time = 0;
     total_bytes_sent = 0;
     chunk_len = CHUNK_SIZE;
 
     /* Program must select between two different behaviours:
-     *  - Send a whole file if there is only one video in the directory or
-     *    a precise video quality is selected.
+     *  - Send a whole file if there is only one video in the directory,
+     *    a precise video quality is selected, the client asks for byte
+     *    ranges, or the stream is a MP4 file, which cannot be switched
+     *    to another one once started.
      *  - Use an adaptative algorithm to switch between video streams on
      *    the fly.
      * First approach should perform better, as it is simpler and delivers
      * the entire stream at once, allowing the kernel take care of it.
      * */
-    if ((cur_video->stream_num == 1) || (params[QUALITY_PARAM_CODE]))
+    if ((cur_video->stream_num == 1) || (params[QUALITY_PARAM_CODE]) || (headers->range != NULL) ||
+	(cur_stream->type == MP4_EXT_CODE))
     {
-	/* There are some code duplication. Do not blame on me, as it is
-	 * not my idea.
-	 * */
-	data_buf_len = cur_stream->data_size - cur_stream->iframe_offset[first_iframe];
-	data_buf = cur_stream->data + cur_stream->iframe_offset[first_iframe];
-	output_buf = compose_reply(send_params, data_buf, data_buf_len, &output_buf_len);
-
-	if (params[CACHE_PARAM_CODE] != NULL)
-	{
-	    free(send_params.cache_control);
-	}
-
-	chunks_to_send = (int)ceil((double)output_buf_len / chunk_len);
-	chunks_sent = 0;
-		
-	do
-	{
-	    clock_gettime(CLOCK_REALTIME, &start_time);	
-
-	    if ((bytes_sent = send(client_sd,
-				   output_buf + (chunks_sent * chunk_len),
-				   chunk_len - ((chunks_sent + 1) == chunks_to_send) * ((chunks_to_send * chunk_len) - output_buf_len),
-				   MSG_NOSIGNAL)) > 0)
-	    {
-		total_bytes_sent += bytes_sent;
-		chunks_sent++;
-	    }
-
-	    clock_gettime(CLOCK_REALTIME, &stop_time);
-	    spent_time += (int)ceil((double)(((stop_time.tv_sec * NANOSEC_IN_SEC) + stop_time.tv_nsec) - 
-					     ((start_time.tv_sec * NANOSEC_IN_SEC) + start_time.tv_nsec)) / NANOSEC_IN_SEC);
-
-
-	    /* Set a send() timeout. 
-	     * This can be DANGEROUS, and in a near future should be removed.
-	     * */
-	    send_timeout.tv_sec = ceil((spent_time / total_bytes_sent) * chunk_len) + timeout_sec;
-	    send_timeout.tv_usec = 0;
-	    setsockopt(client_sd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(struct timeval));
-	}
-	while ((chunks_sent < chunks_to_send) && (bytes_sent > 0));
-
-	if (bytes_sent < 0)
-	{
-	    log_message(MESSAGE, IMSG_VIDEOSTOP, cur_video->path);
-	}
-		
-	free(output_buf);
-	unload_video(cur_video);
+	/* The video sign identifies its contents. */
+	etag = arena_printf(arena, NULL, "\"%s-%d-%d\"", cur_video->sign, cur_stream_pos, first_iframe);
+	total_bytes_sent = send_stream(arena, client_sd, cur_video, cur_stream, first_iframe, send_params, headers, etag);
+	metrics_bytes(cur_stream_pos, total_bytes_sent);
 
-	return (total_bytes_sent);
+	return (end_stream(cur_video, session, stat_req_id, &stream_start, total_bytes_sent));
     }
     else
     {
@@ -733,40 +2514,62 @@ send_video			(int client_sd, char ** params)
 	next_iframe = get_next_offset(cur_stream, first_iframe, NEXT_IFRAME);
 	data_buf_len = cur_stream->iframe_offset[next_iframe] - cur_stream->iframe_offset[first_iframe];
 	next_iframe = get_next_offset(cur_stream, next_iframe, 1);
-		
-	data_buf_len_len = asprintf(&data_buf_len_str, "%x%s", data_buf_len, CRLF);
-	data_buf = malloc(data_buf_len + data_buf_len_len);
-	memcpy(data_buf, data_buf_len_str, data_buf_len_len);
-	memcpy(data_buf + data_buf_len_len, cur_stream->data + cur_stream->iframe_offset[first_iframe], data_buf_len);
-		
-	output_buf = compose_reply(send_params, data_buf, data_buf_len + data_buf_len_len, &output_buf_len);
-	free(data_buf);
-	free(data_buf_len_str);
 
-	if (params[CACHE_PARAM_CODE] != NULL)
+	/* Allocate every buffer needed before sending anything. */
+	if ((output_buf = arena_alloc(arena, chunk_len + CHUNK_PREFIX_LEN)) == NULL)
 	{
-	    free(send_params.cache_control);
+	    return (end_stream(cur_video, session, stat_req_id, &stream_start, total_bytes_sent));
 	}
 
-	if ((bytes_sent = send(client_sd, output_buf, output_buf_len, MSG_NOSIGNAL)) < 0)
+	/* Tell the client its session, so it may resume the stream. */
+	if ((session != NULL) || ((session = new_session(cur_video->id, cur_video->sign)) != NULL))
 	{
-	    log_message(MESSAGE, IMSG_VIDEOSTOP, cur_video->path);
-	    free(output_buf);
-	    unload_video(cur_video);
-			
-	    return (total_bytes_sent);
+	    send_params.extra_headers = arena_printf(arena, NULL, "%s: %s\r\n", SESSION_HEADER, session->id);
+	}
+
+	if ((header = compose_header(arena, send_params, 0, &header_len)) == NULL)
+	{
+	    return (end_stream(cur_video, session, stat_req_id, &stream_start, total_bytes_sent));
+	}
+
+	/* The first chunk is the header and codec configuration, if the
+	 * stream does not start on its first byte, and the first interval,
+	 * all of them sent straight from the stream data.
+	 * */
+	iov_num = get_stream_prefix(cur_stream, first_iframe, FALSE, iov + 2, &splice_len) + 2;
+	iov[iov_num].iov_base = cur_stream->data + cur_stream->iframe_offset[first_iframe];
+	iov[iov_num].iov_len = data_buf_len;
+	iov_num++;
+
+	prefix_len = snprintf(output_buf, CHUNK_PREFIX_LEN, "%x%s", (unsigned int)(splice_len + data_buf_len), CRLF);
+	iov[0].iov_base = header;
+	iov[0].iov_len = header_len;
+	iov[1].iov_base = output_buf;
+	iov[1].iov_len = prefix_len;
+
+	if ((bytes_sent = send_iovec(client_sd, iov, iov_num)) < 0)
+	{
+	    LOG_RATELIMITED(MESSAGE, IMSG_VIDEOSTOP, cur_video->path);
+	    return (end_stream(cur_video, session, stat_req_id, &stream_start, total_bytes_sent));
 	}
 
-	free(output_buf);
-	cached_time = 0;
+	/* A resumed session keeps the adaptive algorithm warm. */
+	cached_time = (session != NULL) ? session->cached_time : 0;
+	sent_stream = cur_stream;
+	intervals_sent = NEXT_IFRAME;
+	kernel_rate = 0;
+	user_pacing = FALSE;
 	total_bytes_sent += bytes_sent;
+	metrics_first_byte();
+	metrics_bytes(cur_stream_pos, bytes_sent);
+	timer_progress();
 
-        /* Recalculate send() timeout using SO_SNDTIMEO.
-	 * This can be DANGEROUS, and in a near future should be removed.
+	/* From now on, the client may send control messages. The first
+	 * ones may have been read along with the request.
 	 * */
-	send_timeout.tv_sec = ceil((spent_time / total_bytes_sent) * chunk_len) + timeout_sec;
-	send_timeout.tv_usec = 0;
-	setsockopt(client_sd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(struct timeval));
+	watch_control(&conn->control, client_sd, conn->input.data + conn->input.request_len,
+		      conn->input.len - conn->input.request_len);
+	conn->input.len = conn->input.request_len;
     }
 
     /* Function did not returned, so there is data left to send.
@@ -778,10 +2581,73 @@ send_video			(int client_sd, char ** params)
 	/* Read data between the next two iframes. */
 	data_buf_len = (next_iframe == cur_stream->iframe_num) ? 
 	    (cur_stream->data_size - cur_stream->iframe_offset[next_iframe - 1]) : cur_stream->iframe_offset[next_iframe] - cur_stream->iframe_offset[next_iframe - 1];
-	data_buf = malloc(data_buf_len);
-	memcpy(data_buf,  cur_stream->data + cur_stream->iframe_offset[next_iframe - 1], data_buf_len);
+	data_buf = cur_stream->data + cur_stream->iframe_offset[next_iframe - 1];
 	chunks_to_send = (int)ceil((double)data_buf_len / chunk_len);
 	chunks_sent = 0;
+
+	/* Save where the stream is, in case the client reconnects. */
+	if (session != NULL)
+	{
+	    session->stream_pos = cur_stream_pos;
+	    session->iframe = next_iframe - 1;
+	    session->cached_time = cached_time;
+	}
+
+	/* Once the burst is sent, pace the stream. The rate follows the
+	 * bitrate of the current stream, assuming an iframe per second as
+	 * the adaptive algorithm does, so it changes along with quality.
+	 * */
+	if ((pace_percent > 0) && (intervals_sent >= pace_burst))
+	{
+	    pace_rate = (((int64_t)cur_stream->avg_size * pace_percent) + 99) / 100;
+
+	    if (!user_pacing && (pace_rate != kernel_rate))
+	    {
+		if (set_pacing_rate(client_sd, pace_rate))
+		{
+		    kernel_rate = pace_rate;
+		}
+		else
+		{
+		    user_pacing = TRUE;
+		    clock_gettime(CLOCK_MONOTONIC, &release_time);
+		    LOG_RATELIMITED(MESSAGE, IMSG_USERPACING, cur_video->path);
+		}
+	    }
+
+	    if (user_pacing)
+	    {
+		wait_release(&release_time, data_buf_len, pace_rate);
+	    }
+	}
+
+	intervals_sent++;
+
+	/* A new stream is preceded by its codec configuration, in a chunk
+	 * of its own.
+	 * */
+	if (cur_stream != sent_stream)
+	{
+	    if ((iov_num = get_stream_prefix(cur_stream, next_iframe - 1, TRUE, iov + 1, &splice_len)) > 0)
+	    {
+		prefix_len = snprintf(output_buf, CHUNK_PREFIX_LEN, "%s%x%s", CRLF, (unsigned int)splice_len, CRLF);
+		iov[0].iov_base = output_buf;
+		iov[0].iov_len = prefix_len;
+
+		if ((bytes_sent = send_iovec(client_sd, iov, iov_num + 1)) < 0)
+		{
+		    LOG_RATELIMITED(MESSAGE, IMSG_VIDEOSTOP, cur_video->path);
+		    unwatch_control(&conn->control);
+		    return (end_stream(cur_video, session, stat_req_id, &stream_start, total_bytes_sent));
+		}
+
+		total_bytes_sent += bytes_sent;
+		metrics_bytes(cur_stream_pos, bytes_sent);
+		timer_progress();
+	    }
+
+	    sent_stream = cur_stream;
+	}
 		
 	/* Send data in chunks. */
 	while (chunks_sent < chunks_to_send)
@@ -790,47 +2656,34 @@ send_video			(int client_sd, char ** params)
 	     * CHUNK_SIZE bytes
 	     * */
 	    output_buf_len = (chunks_sent != (chunks_to_send - 1)) ? chunk_len : (data_buf_len - (chunks_to_send - 1) * chunk_len);
-	    output_buf_len_len = asprintf(&output_buf_len_str, "%s%x%s", CRLF, output_buf_len, CRLF);
-	    output_buf = malloc((output_buf_len + output_buf_len_len) * sizeof(char));
-
-	    memcpy(output_buf, output_buf_len_str, output_buf_len_len);
-	    memcpy(output_buf + output_buf_len_len, data_buf + (chunks_sent) * chunk_len, output_buf_len);
-	    output_buf_len += output_buf_len_len;
+	    prefix_len = snprintf(output_buf, CHUNK_PREFIX_LEN, "%s%x%s", CRLF, output_buf_len, CRLF);
+	    memcpy(output_buf + prefix_len, data_buf + (chunks_sent) * chunk_len, output_buf_len);
+	    output_buf_len += prefix_len;
 	    
             /* Start counting time... */
-	    clock_gettime(CLOCK_REALTIME, &start_time);
+	    clock_gettime(CLOCK_MONOTONIC, &start_time);
 
 	    /* Send a chunk and check if the operation is done. */
 	    if ((bytes_sent = send(client_sd, output_buf, output_buf_len, MSG_NOSIGNAL)) < 0)
 	    {
-		log_message(MESSAGE, IMSG_VIDEOSTOP, cur_video->path);
-		free(data_buf);
-		free(output_buf);
-		free(output_buf_len_str);
-		unload_video(cur_video);
-	
-		return (total_bytes_sent);
+		clock_gettime(CLOCK_MONOTONIC, &stop_time);
+		check_stall(&start_time, &stop_time);
+		LOG_RATELIMITED(MESSAGE, IMSG_VIDEOSTOP, cur_video->path);
+		unwatch_control(&conn->control);
+		return (end_stream(cur_video, session, stat_req_id, &stream_start, total_bytes_sent));
 	    }
 
 	    /* Calculate time spent sending the buffer. */
-	    clock_gettime(CLOCK_REALTIME, &stop_time);
+	    clock_gettime(CLOCK_MONOTONIC, &stop_time);
 	    spent_time += (int)ceil((double)(((stop_time.tv_sec * NANOSEC_IN_SEC) + stop_time.tv_nsec) - 
 					 ((start_time.tv_sec * NANOSEC_IN_SEC) + start_time.tv_nsec)) / NANOSEC_IN_SEC);
+	    check_stall(&start_time, &stop_time);
 	    
-	    free(output_buf);
-	    free(output_buf_len_str);
 	    total_bytes_sent += bytes_sent;
+	    metrics_bytes(cur_stream_pos, bytes_sent);
+	    timer_progress();
 	    chunks_sent++;
-
-	    /* Recalculate send() timeout using SO_SNDTIMEO.
-	     * This can be DANGEROUS, and in a near future should be removed.
-	     * */
-	    send_timeout.tv_sec = ceil((spent_time / total_bytes_sent) * chunk_len) + timeout_sec;
-	    send_timeout.tv_usec = 0;
-	    setsockopt(client_sd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(struct timeval));
 	}
-		
-	free(data_buf);
 
 	/* TODO: Change this!
 	 * Assuming that it sends ALWAYS 1 second of video.
@@ -844,14 +2697,17 @@ send_video			(int client_sd, char ** params)
 	 * 
 	 * If 'cached_time' is lower than 'MIN_SEND_TIME', change stream
 	 * to a higher resolution.
+	 * The new stream goes on from the iframe shown at the same time.
 	 * */
 	if (next_iframe <= cur_stream->iframe_num)
 	{
 	    if ((cached_time > UPPER_LIMIT_TIME) && (cur_stream_pos < (cur_video->stream_num - 1)))
 	    {
 		cur_stream_pos++;
-		cur_stream = cur_video->streams[cur_stream_pos];
-		log_message(MESSAGE, IMSG_BITRATEHIGH, cur_video->path);
+		next_iframe = get_aligned_iframe(cur_stream, &cur_video->streams[cur_stream_pos], next_iframe);
+		cur_stream = &cur_video->streams[cur_stream_pos];
+		metrics_add(M_ABR_SWITCHES, 1);
+		LOG(MESSAGE, IMSG_BITRATEHIGH, cur_video->path);
 	    }
 	    else
 	    {
@@ -861,30 +2717,33 @@ send_video			(int client_sd, char ** params)
 		if ((cached_time < LOWER_LIMIT_TIME) && (cur_stream_pos > 0))
 		{
 		    cur_stream_pos--;
-		    cur_stream = cur_video->streams[cur_stream_pos];
-		    log_message(MESSAGE, IMSG_BITRATELOW, cur_video->path);
+		    next_iframe = get_aligned_iframe(cur_stream, &cur_video->streams[cur_stream_pos], next_iframe);
+		    cur_stream = &cur_video->streams[cur_stream_pos];
+		    metrics_add(M_ABR_SWITCHES, 1);
+		    LOG(MESSAGE, IMSG_BITRATELOW, cur_video->path);
 		}
 	    }
 	}
 		
 	next_iframe = get_next_offset(cur_stream, next_iframe, 1);
 		
-	/* Read status data from client. Do not wait if there is no data
-	 * available.
-	 * TODO
+	/* Apply the control messages received from the client, if any.
+	 * They take effect on the next iframe, as streams may only be
+	 * switched there.
 	 * */
-	data_buf = malloc(renew_params_buf_len);
-		
-	if (recv(client_sd, data_buf, renew_params_buf_len, MSG_DONTWAIT) > 0)
+	while ((control_msg = read_control(&conn->control)) != NULL)
 	{
-	    log_message(MESSAGE, IMSG_CLIENTMSG, (char *)data_buf);			
-	    renew_params = parse_key_value((char * )data_buf, renew_param_names, renew_param_vlen, "=&", PARAM_MAX_LEN);
+	    LOG_RATELIMITED(MESSAGE, IMSG_CLIENTMSG, control_msg);
+
+	    /* The message is parsed in place, as a query string. */
+	    renew_query.offset = 0;
+	    renew_query.len = strlen(control_msg);
+	    parse_query(control_msg, renew_query, renew_param_names, renew_param_vlen, renew_params, PARAM_MAX_LEN);
 			
 	    /* Select stream quality. */
 	    if (renew_params[RNEW_QUALITY_PARAM_CODE])
 	    {
 		cur_stream_pos = atoi(renew_params[RNEW_QUALITY_PARAM_CODE]);
-		free(renew_params[RNEW_QUALITY_PARAM_CODE]);
 				
 		if (cur_stream_pos >= cur_video->stream_num)
 		{
@@ -897,13 +2756,16 @@ send_video			(int client_sd, char ** params)
 			cur_stream_pos = 0;
 		    }
 		}
+
+		/* 'next_iframe' is already past the iframe sent next. */
+		next_iframe = get_aligned_iframe(cur_stream, &cur_video->streams[cur_stream_pos], next_iframe - 1) + 1;
+		cur_stream = &cur_video->streams[cur_stream_pos];
 	    }
 			
 	    /* Select position into stream. */
 	    if (renew_params[RNEW_POS_PARAM_CODE])
 	    {
 		temp_iframe = atoi(renew_params[RNEW_POS_PARAM_CODE]);
-		free(renew_params[RNEW_POS_PARAM_CODE]);
 				
 		if ((temp_iframe < cur_stream->iframe_num) &&
 		    (temp_iframe > 0))
@@ -911,33 +2773,186 @@ send_video			(int client_sd, char ** params)
 		    next_iframe = temp_iframe;
 		}
 	    }
-			
-	    if (renew_params)
-	    {
-		free(renew_params);
-	    }
 	}
-		
-	free(data_buf);
     }
+
+    unwatch_control(&conn->control);
 	
     /* Send ending chunk. */
-    output_buf_len = asprintf(&output_buf, "%s%x%s%s", CRLF, CHUNK_END, CRLF, CRLF);
+    output_buf_len = snprintf(output_buf, CHUNK_PREFIX_LEN, "%s%x%s%s", CRLF, CHUNK_END, CRLF, CRLF);
 
     if ((bytes_sent = send(client_sd, output_buf, output_buf_len, MSG_NOSIGNAL)) < 0)
     {
-	log_message(MESSAGE, IMSG_VIDEOSTOP, cur_video->path);
-	free(output_buf);
-	unload_video(cur_video);
-		
-	return (total_bytes_sent);
+	LOG_RATELIMITED(MESSAGE, IMSG_VIDEOSTOP, cur_video->path);
+	return (end_stream(cur_video, session, stat_req_id, &stream_start, total_bytes_sent));
     }
 	
-    free(output_buf);
     total_bytes_sent += bytes_sent;
-    unload_video(cur_video);
 	
-    return (total_bytes_sent);
+    return (end_stream(cur_video, session, stat_req_id, &stream_start, total_bytes_sent));
+}
+
+/* send_segment()
+ *
+ * Send a CMAF segment or manifest of a video, as selected by the
+ * request parameters:
+ *  - 'segment': the initialization segment, if it is "init", or a media
+ *    segment, of the stream selected by 'quality'.
+ *  - 'format': the DASH manifest, if it is "mpd".
+ *  - 'quality': the HLS media playlist of that stream.
+ *  - Otherwise, the HLS master playlist.
+ * Every object is sent whole, and taken from the segment cache if it is
+ * there. They never change, so clients may cache them for as long as
+ * they want, unless the request has a 'cache' parameter.
+ * Returns the amount of data written.
+ * */
+int
+send_segment			(ClientConn * conn, char ** params, RequestHeaders * headers, char * connection)
+{
+    Arena * arena;
+    CmafObject * object;
+    ReplyParams send_params;
+    struct iovec iov[2];
+    struct stat info_stat;
+    char * video_id, * sign, * key_sign, * header, * end, * filename;
+    unsigned int header_len;
+    long long_number;
+    int quality, number, iov_num, bytes_sent;
+
+    arena = &conn->arena;
+    video_id = params[VIDEOID_PARAM_CODE];
+    sign = params[SIGN_PARAM_CODE];
+    quality = (params[QUALITY_PARAM_CODE] != NULL) ? atoi(params[QUALITY_PARAM_CODE]) : -1;
+
+    if ((video_id == NULL) || (signed_auth && (sign == NULL)) ||
+	((params[SEGMENT_PARAM_CODE] != NULL) && (quality < 0)))
+    {
+	LOG_RATELIMITED(WARNING, EMSG_INVALVIDEO, video_id);
+	return (ECOD_INVALVIDEO);
+    }
+
+    if (params[SEGMENT_PARAM_CODE] != NULL)
+    {
+	if (strcmp(params[SEGMENT_PARAM_CODE], "init") == 0)
+	{
+	    number = CMAF_INIT;
+	}
+	else if (isdigit(params[SEGMENT_PARAM_CODE][0]))
+	{
+	    /* Numbers out of range must not wrap into another object. */
+	    errno = 0;
+	    long_number = strtol(params[SEGMENT_PARAM_CODE], &end, 10);
+
+	    if ((errno != 0) || (*end != '\0') || (long_number > INT_MAX))
+	    {
+		LOG_RATELIMITED(WARNING, EMSG_NOSEGMENT, params[SEGMENT_PARAM_CODE]);
+		return (ECOD_NOSEGMENT);
+	    }
+
+	    number = (int)long_number;
+	}
+	else
+	{
+	    number = CMAF_HLS_PLAYLIST;
+	}
+    }
+    else if ((params[FORMAT_PARAM_CODE] != NULL) && (strcmp(params[FORMAT_PARAM_CODE], "mpd") == 0))
+    {
+	number = CMAF_DASH_MANIFEST;
+	quality = -1;
+    }
+    else
+    {
+	number = (quality >= 0) ? CMAF_HLS_PLAYLIST : CMAF_HLS_MASTER;
+    }
+
+    /* Signs are only part of the objects when they are checked. Otherwise,
+     * the info file tells a video apart from an older copy chopped again,
+     * as objects are cached for good.
+     * */
+    if (signed_auth)
+    {
+	key_sign = sign;
+    }
+    else
+    {
+	filename = arena_printf(arena, NULL, "%s/%s/%s", video_path, video_id, FILE_INFO);
+
+	if ((filename == NULL) || (stat(filename, &info_stat) != 0))
+	{
+	    LOG_RATELIMITED(WARNING, EMSG_NODATAFILE, filename);
+	    return (ECOD_NOSEGMENT);
+	}
+
+	if ((key_sign = arena_printf(arena, NULL, "%lx-%lx", (unsigned long)info_stat.st_mtime,
+				     (unsigned long)info_stat.st_size)) == NULL)
+	{
+	    return (ECOD_NOSEGMENT);
+	}
+    }
+
+    if ((object = find_cmaf_object(atoi(video_id), key_sign, quality, number)) != NULL)
+    {
+	metrics_add(M_SEGMENT_HITS, 1);
+    }
+    else
+    {
+	metrics_add(M_SEGMENT_MISSES, 1);
+
+	if ((object = build_cmaf_object(arena, video_id, sign, key_sign, signed_auth ? sign : NULL, quality, number)) == NULL)
+	{
+	    return (ECOD_NOSEGMENT);
+	}
+    }
+
+    send_params = default_params;
+    send_params.connection = connection;
+    send_params.cache_control = (params[CACHE_PARAM_CODE] != NULL) ?
+	arena_printf(arena, NULL, "%s%s", MAX_AGE, params[CACHE_PARAM_CODE]) : IMMUTABLE;
+    send_params.extra_headers = arena_printf(arena, NULL, "ETag: %s\r\n", object->etag);
+
+    switch (number)
+    {
+	case (CMAF_HLS_MASTER):
+	case (CMAF_HLS_PLAYLIST):
+	    send_params.content_type = M3U8_TYPE;
+	    break;
+	case (CMAF_DASH_MANIFEST):
+	    send_params.content_type = MPD_TYPE;
+	    break;
+	default:
+	    send_params.content_type = MP4_TYPE;
+	    break;
+    }
+
+    /* "304 Not Modified" replies have no body. */
+    iov_num = 1;
+
+    if (is_not_modified(headers, object->etag, -1))
+    {
+	send_params.http_code = HTTP_NOT_MODIFIED_CODE;
+    }
+    else
+    {
+	iov[1].iov_base = object->data;
+	iov[1].iov_len = object->len;
+	iov_num++;
+    }
+
+    header = compose_header(arena, send_params, object->len, &header_len);
+    iov[0].iov_base = header;
+    iov[0].iov_len = header_len;
+
+    bytes_sent = send_iovec(conn->sd, iov, iov_num);
+    release_cmaf_object(object);
+
+    if (bytes_sent < 0)
+    {
+	LOG_RATELIMITED(MESSAGE, EMSG_SEGMENTSEND, video_id);
+	return (ECOD_SEGMENTSEND);
+    }
+
+    return (bytes_sent);
 }
 
 /* close_videos()
@@ -947,6 +2962,7 @@ send_video			(int client_sd, char ** params)
 int
 close_videos				()
 {
+    VideoSlab * slab;
     int i;
 
     if (videos_num > 0)
@@ -962,6 +2978,16 @@ close_videos				()
 		
 	free(videos);
     }
+
+    while (video_slabs != NULL)
+    {
+	slab = video_slabs->next;
+	free(video_slabs);
+	video_slabs = slab;
+    }
+
+    free_videos = NULL;
+    cmaf_videos_num = 0;
 	
     return (EXIT_SUCCESS);
 }
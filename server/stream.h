@@ -15,13 +15,30 @@
 #define DEFAULT_TIMEOUT 300
 #define MIN_TIMEOUT     60
 
+/* Pacing: once the first 'DEFAULT_PACE_BURST' seconds of video are
+ * sent, adaptive streams are sent at a percentage of the stream bitrate,
+ * 0 to send them as fast as possible. Below 'MIN_PACE', players would
+ * run out of video.
+ * */
+#define DEFAULT_PACE		0
+#define MIN_PACE		100
+#define DEFAULT_PACE_BURST	10
+
+/* Videos loaded at startup from the popularity list, if there is one. */
+#define DEFAULT_WARMUP_TOP	100
 
 /* ********** Public functions ********** */
 int
-init_videos		(char * path, int auth, int timeout);
+init_videos		(char * path, int auth, int timeout, int pace, int pace_burst);
+
+int
+init_warmup		(char * list, int top);
+
+int
+send_video		(ClientConn * conn, char ** params, RequestHeaders * headers, int stat_req_id);
 
 int
-send_video		(int client_sd, char ** params);
+send_segment		(ClientConn * conn, char ** params, RequestHeaders * headers, char * connection);
 
 int
 close_videos		();
@@ -0,0 +1,379 @@
+/* Timer module.
+ * File: timer.c
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Connection deadlines: request headers, idle keep-alive connections,
+ * stalled replies and streams lasting too long.
+ * Timers live in a hierarchical wheel, as in the Linux kernel: the
+ * first level has a slot per tick, and every other level has a slot
+ * per whole turn of the previous one. Timers are moved down a level
+ * each time the previous level turns, so arming or stopping a timer
+ * costs the same whatever its timeout is.
+ * A single thread advances the wheel, and shuts down the socket of
+ * every connection whose deadline has passed.
+ * */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "metrics.h"
+#include "timer.h"
+
+/* ********** Constant definitions ********** */
+
+/* Wheel resolution, in nanoseconds. */
+#define TIMER_TICK		100000000
+
+/* 4 levels of 64 slots cover 2^24 ticks, about 19 days. Later timers
+ * are kept in the last slot, and checked again when they are due.
+ * */
+#define WHEEL_BITS		6
+#define WHEEL_SIZE		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS		4
+#define WHEEL_MAX_TICKS		((1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+#define NANOSEC_IN_SEC		1000000000
+
+/* ********** Global variables ********** */
+const
+char * timer_reason_names [] = {"none", "header", "idle", "reply", "duration", "stall"};
+
+Timer * wheel[WHEEL_LEVELS][WHEEL_SIZE];
+
+/* Next tick to be run. */
+int64_t wheel_tick = 0;
+
+pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_t wheel_thread;
+
+/* Timer of the connection served by the current thread. */
+__thread Timer * own_timer = NULL;
+
+/* ********** Private functions ********** */
+
+/* get_monotonic_time()
+ *
+ * */
+static
+int64_t
+get_monotonic_time		()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (((int64_t)now.tv_sec * NANOSEC_IN_SEC) + now.tv_nsec);
+}
+
+/* get_expiry()
+ *
+ * Earliest time 'timer' may expire, or 0 if it has no deadline.
+ * */
+static
+int64_t
+get_expiry			(Timer * timer)
+{
+    int64_t expiry;
+
+    expiry = timer->deadline;
+
+    if ((timer->stall > 0) &&
+	((expiry == 0) || ((timer->progress + timer->stall) < expiry)))
+    {
+	expiry = timer->progress + timer->stall;
+    }
+
+    return (expiry);
+}
+
+/* unlink_timer()
+ *
+ * Remove a timer from its slot, if it is in one.
+ * */
+static
+void
+unlink_timer			(Timer * timer)
+{
+    if (timer->pprev != NULL)
+    {
+	if ((*timer->pprev = timer->next) != NULL)
+	{
+	    timer->next->pprev = timer->pprev;
+	}
+
+	timer->next = NULL;
+	timer->pprev = NULL;
+    }
+}
+
+/* link_timer()
+ *
+ * Put a timer in the slot of the level matching its distance to the
+ * current tick. Timers already due are run on the next tick.
+ * */
+static
+void
+link_timer			(Timer * timer)
+{
+    Timer ** slot;
+    int64_t tick, delta;
+    int level;
+
+    tick = (timer->expires + TIMER_TICK - 1) / TIMER_TICK;
+
+    if ((delta = tick - wheel_tick) < 0)
+    {
+	tick = wheel_tick;
+	delta = 0;
+    }
+    else if (delta > WHEEL_MAX_TICKS)
+    {
+	tick = wheel_tick + WHEEL_MAX_TICKS;
+	delta = WHEEL_MAX_TICKS;
+    }
+
+    for (level = 0; (level < (WHEEL_LEVELS - 1)) && (delta >= (1 << (WHEEL_BITS * (level + 1)))); level++);
+
+    slot = &wheel[level][(tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+    if ((timer->next = *slot) != NULL)
+    {
+	timer->next->pprev = &timer->next;
+    }
+
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+/* cascade()
+ *
+ * Move every timer in a slot of an upper level down to the levels
+ * below. Returns the index of the slot.
+ * */
+static
+int
+cascade				(int level)
+{
+    Timer * timer, * next;
+    int index;
+
+    index = (wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    timer = wheel[level][index];
+    wheel[level][index] = NULL;
+
+    for (; timer != NULL; timer = next)
+    {
+	next = timer->next;
+	timer->pprev = NULL;
+	link_timer(timer);
+    }
+
+    return (index);
+}
+
+/* expire_timer()
+ *
+ * Check a timer whose slot is due. If it has made progress since it
+ * was linked, it is linked again; otherwise its socket is shut down.
+ * */
+static
+void
+expire_timer			(Timer * timer, int64_t now)
+{
+    int64_t expiry;
+
+    if (((expiry = get_expiry(timer)) == 0) || (expiry > now))
+    {
+	timer->expires = expiry;
+
+	if (expiry > 0)
+	{
+	    link_timer(timer);
+	}
+	return;
+    }
+
+    timer->fired = ((timer->deadline > 0) && (timer->deadline <= now)) ? timer->reason : TIMER_STALL;
+    shutdown(timer->sd, SHUT_RDWR);
+    metrics_add(M_TIMEOUTS, 1);
+    LOG_RATELIMITED(MESSAGE, IMSG_TIMEREXPIRED, (char *)timer_reason_names[timer->fired]);
+}
+
+/* run_tick()
+ *
+ * Advance the wheel a tick, and check every timer due.
+ * */
+static
+void
+run_tick			(int64_t now)
+{
+    Timer * timer, * next;
+    int index, level;
+
+    index = wheel_tick & WHEEL_MASK;
+
+    /* Refill the first level each time it turns. */
+    for (level = 1; (index == 0) && (level < WHEEL_LEVELS) && (cascade(level) == 0); level++);
+
+    timer = wheel[0][index];
+    wheel[0][index] = NULL;
+    wheel_tick++;
+
+    for (; timer != NULL; timer = next)
+    {
+	next = timer->next;
+	timer->next = NULL;
+	timer->pprev = NULL;
+	expire_timer(timer, now);
+    }
+}
+
+/* run_wheel()
+ *
+ * Main function of the timer thread. Ticks missed while sleeping are
+ * run at once.
+ * */
+static
+void *
+run_wheel			(void * arg)
+{
+    struct timespec next_tick;
+    int64_t now, tick;
+
+    while (TRUE)
+    {
+	now = get_monotonic_time();
+
+	pthread_mutex_lock(&wheel_lock);
+
+	for (; wheel_tick <= (now / TIMER_TICK); run_tick(now));
+
+	tick = wheel_tick * TIMER_TICK;
+	pthread_mutex_unlock(&wheel_lock);
+
+	next_tick.tv_sec = tick / NANOSEC_IN_SEC;
+	next_tick.tv_nsec = tick % NANOSEC_IN_SEC;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_tick, NULL) == EINTR);
+    }
+
+    return (NULL);
+}
+
+/* ********** Public functions ********** */
+
+/* init_timers()
+ *
+ * Start the timer thread.
+ * */
+int
+init_timers			()
+{
+    memset(wheel, 0, sizeof(wheel));
+    wheel_tick = get_monotonic_time() / TIMER_TICK;
+
+    if (pthread_create(&wheel_thread, NULL, &run_wheel, NULL) != 0)
+    {
+	LOG(CRITICAL, EMSG_TIMERTHREAD, NULL);
+	return (ECOD_TIMERTHREAD);
+    }
+
+    pthread_detach(wheel_thread);
+    return (EXIT_SUCCESS);
+}
+
+/* start_timer()
+ *
+ * Prepare the timer of a new connection on socket 'sd', owned by the
+ * calling thread. It has no deadline yet.
+ * */
+void
+start_timer			(Timer * timer, int sd)
+{
+    memset(timer, 0, sizeof(Timer));
+    timer->sd = sd;
+    own_timer = timer;
+}
+
+/* set_timer()
+ *
+ * Replace the deadlines watched by a timer: the connection is closed
+ * in 'timeout' seconds, or once 'stall' seconds pass without progress.
+ * Either may be 0 to be left unset.
+ * */
+void
+set_timer			(Timer * timer, int reason, int timeout, int stall)
+{
+    int64_t now;
+
+    now = get_monotonic_time();
+
+    pthread_mutex_lock(&wheel_lock);
+
+    unlink_timer(timer);
+    timer->reason = reason;
+    timer->deadline = (timeout > 0) ? (now + ((int64_t)timeout * NANOSEC_IN_SEC)) : 0;
+    timer->stall = (stall > 0) ? ((int64_t)stall * NANOSEC_IN_SEC) : 0;
+    timer->progress = now;
+
+    if ((timer->fired == TIMER_NONE) && ((timer->expires = get_expiry(timer)) > 0))
+    {
+	link_timer(timer);
+    }
+
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+/* stop_timer()
+ *
+ * Remove a timer from the wheel. It must be called before closing its
+ * socket, so a descriptor reused by another connection is never shut
+ * down.
+ * */
+void
+stop_timer			(Timer * timer)
+{
+    pthread_mutex_lock(&wheel_lock);
+    unlink_timer(timer);
+    pthread_mutex_unlock(&wheel_lock);
+
+    if (own_timer == timer)
+    {
+	own_timer = NULL;
+    }
+}
+
+/* timer_progress()
+ *
+ * Tell the timer of the current thread that data was just sent, so
+ * its stall deadline moves forward. No lock is taken: the timer thread
+ * only reads the new time once the old deadline is due.
+ * */
+void
+timer_progress			()
+{
+    Timer * timer;
+
+    if ((timer = own_timer) != NULL)
+    {
+	timer->progress = get_monotonic_time();
+    }
+}
+
+/* get_timer_reason()
+ *
+ * Reason a timer expired for, or TIMER_NONE if it did not.
+ * */
+int
+get_timer_reason		(Timer * timer)
+{
+    return (timer->fired);
+}
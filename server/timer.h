@@ -0,0 +1,72 @@
+/* Timer module.
+ * File: timer.h
+ * Author: mabeledo (m.a.abeledo.garcia@members.fsf)
+ * License: GPLv3
+ *
+ * Connection deadlines, kept in a hierarchical timer wheel.
+ * */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/* ********** Constant definitions ********** */
+
+/* Reasons for a timer to expire. */
+#define TIMER_NONE		0
+#define TIMER_HEADER		1
+#define TIMER_IDLE		2
+#define TIMER_REPLY		3
+#define TIMER_DURATION		4
+#define TIMER_STALL		5
+
+/* ********** Type definitions ********** */
+
+/* Every connection owns a timer, which watches two deadlines:
+ *  - 'deadline' is a fixed time, such as the end of the time allowed
+ *    to read a request. 'reason' tells what it is for.
+ *  - 'stall' is the time allowed without sending anything. The owner
+ *    only saves the time of its last progress, and the timer thread
+ *    checks it once the stall might have expired.
+ * Once expired, the socket is shut down, so any blocked call on it
+ * returns, and 'fired' is set to the reason.
+ * Times are in nanoseconds, from CLOCK_MONOTONIC, and 0 means unset.
+ * Only 'progress' may be changed without holding the wheel lock.
+ * */
+typedef
+struct _timer
+{
+    struct _timer * next;
+    struct _timer ** pprev;
+    int64_t expires;
+
+    int sd;
+    int reason;
+    volatile int fired;
+    int64_t deadline;
+    int64_t stall;
+    volatile int64_t progress;
+}
+Timer;
+
+/* ********** Public functions ********** */
+int
+init_timers			();
+
+void
+start_timer			(Timer * timer, int sd);
+
+void
+set_timer			(Timer * timer, int reason, int timeout, int stall);
+
+void
+stop_timer			(Timer * timer);
+
+void
+timer_progress			();
+
+int
+get_timer_reason		(Timer * timer);
+
+#endif
@@ -29,7 +29,7 @@ def main ():
 	""")
 
 	cursor.execute("""
-		create table streams (id bigint(20) unsigned not null auto_increment, request_id bigint(20) unsigned not null, video_id int(10) unsigned not null, seconds int(10) 			unsigned not null, primary key (id));
+		create table streams (id bigint(20) unsigned not null auto_increment, request_id bigint(20) unsigned not null, video_id int(10) unsigned not null, session char(32) not null default '', seconds int(10) 			unsigned not null, bytes bigint(20) unsigned not null, primary key (id));
 	""")
 
 